@@ -0,0 +1,234 @@
+/**
+ * @file bench_compare.c
+ * @brief Compare two benchmark result files and flag regressions
+ *
+ * Usage: bench_compare [--metric NAME] [--threshold PCT] baseline.json current.json
+ * Both files hold one JSON object per line, as printed by micro_bench,
+ * report_bench or ipc_bench. Lines are matched by their "bench", "driver"
+ * or "path" name. A change counts only when it exceeds the threshold and,
+ * when the results carry a standard deviation, also twice the combined
+ * noise of both runs. Metrics ending in "_per_sec" are better when higher,
+ * all others when lower. Exits 1 if anything regressed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_RESULTS     64
+#define MAX_RESULT_LINE 4096
+#define MAX_NAME        128
+
+/* Default metric and the change below which results count as noise */
+#define DEFAULT_METRIC    "median_ns"
+#define DEFAULT_THRESHOLD 5.0
+
+/* Keys naming a result, in the order they are tried */
+static const char *const name_keys[] = { "bench", "driver", "path" };
+
+/**
+ * Structure for one benchmark result
+ */
+typedef struct {
+    char name[MAX_NAME];  /* Benchmark, driver or path name */
+    double value;         /* The compared metric */
+    double stddev;        /* Standard deviation per call, 0 if not reported */
+    double mean;          /* Mean per call, 0 if not reported */
+} BenchLine;
+
+/**
+ * Find the value of a key in a flat JSON object
+ * @param line JSON text
+ * @param key Key to look for
+ * @return Start of the value, NULL if the key is absent
+ */
+static const char *find_value(const char *line, const char *key)
+{
+    char pattern[MAX_NAME + 4];
+    const char *found;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    found = strstr(line, pattern);
+    return (found != NULL) ? found + strlen(pattern) : NULL;
+}
+
+/**
+ * Read a string value of a flat JSON object
+ * @return 0 on success, -1 if absent
+ */
+static int json_string(const char *line, const char *key, char *out, size_t size)
+{
+    const char *value = find_value(line, key);
+    size_t length = 0;
+
+    if (value == NULL || *value != '"')
+    {
+        return -1;
+    }
+    value++;
+    while (value[length] != '\0' && value[length] != '"' && length + 1 < size)
+    {
+        out[length] = value[length];
+        length++;
+    }
+    out[length] = '\0';
+    return 0;
+}
+
+/**
+ * Read a numeric value of a flat JSON object
+ * @return 0 on success, -1 if absent or not a number
+ */
+static int json_number(const char *line, const char *key, double *out)
+{
+    const char *value = find_value(line, key);
+    char *end;
+
+    if (value == NULL)
+    {
+        return -1;
+    }
+    *out = strtod(value, &end);
+    return (end == value) ? -1 : 0;
+}
+
+/**
+ * Load the results of one run
+ * @param path Result file
+ * @param metric Metric to read
+ * @param lines Receives the results
+ * @return Number of results, or -1 on error
+ */
+static int load_results(const char *path, const char *metric, BenchLine *lines)
+{
+    char text[MAX_RESULT_LINE];
+    int count = 0;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    while (count < MAX_RESULTS && fgets(text, sizeof(text), file) != NULL)
+    {
+        BenchLine *line = &lines[count];
+        size_t k;
+
+        memset(line, 0, sizeof(*line));
+        for (k = 0; k < sizeof(name_keys) / sizeof(name_keys[0]); k++)
+        {
+            if (json_string(text, name_keys[k], line->name, sizeof(line->name)) == 0)
+            {
+                break;
+            }
+        }
+        if (line->name[0] == '\0' || json_number(text, metric, &line->value) != 0)
+        {
+            continue;
+        }
+        /* Relative noise is the same whichever metric is compared */
+        if (json_number(text, "stddev_ns", &line->stddev) != 0 || json_number(text, "mean_ns", &line->mean) != 0)
+        {
+            line->stddev = 0.0;
+            line->mean = 0.0;
+        }
+        count++;
+    }
+
+    fclose(file);
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    static BenchLine baseline[MAX_RESULTS];
+    static BenchLine current[MAX_RESULTS];
+    const char *metric = DEFAULT_METRIC;
+    double threshold = DEFAULT_THRESHOLD;
+    int higher_is_better;
+    int baseline_count, current_count;
+    int regressions = 0;
+    int i, j;
+
+    for (i = 1; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2)
+    {
+        if (strcmp(argv[i], "--metric") == 0)
+        {
+            metric = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--threshold") == 0)
+        {
+            threshold = atof(argv[i + 1]);
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (argc - i != 2 || threshold < 0.0)
+    {
+        fprintf(stderr, "Usage: %s [--metric NAME] [--threshold PCT] baseline.json current.json\n"
+                        "  Default metric %s, threshold %.1f%%\n",
+                argv[0], DEFAULT_METRIC, DEFAULT_THRESHOLD);
+        return 2;
+    }
+
+    baseline_count = load_results(argv[i], metric, baseline);
+    current_count = load_results(argv[i + 1], metric, current);
+    if (baseline_count < 0 || current_count < 0)
+    {
+        return 2;
+    }
+    higher_is_better = (strlen(metric) > 8 && strcmp(metric + strlen(metric) - 8, "_per_sec") == 0);
+
+    printf("%-36s %14s %14s %9s  %s\n", "benchmark", "baseline", "current", "change", metric);
+    for (j = 0; j < current_count; j++)
+    {
+        const BenchLine *now = &current[j];
+        const BenchLine *base = NULL;
+        const char *verdict;
+        double change, noise;
+
+        for (i = 0; i < baseline_count && base == NULL; i++)
+        {
+            if (strcmp(baseline[i].name, now->name) == 0)
+            {
+                base = &baseline[i];
+            }
+        }
+        if (base == NULL || base->value == 0.0)
+        {
+            printf("%-36s %14s %14.1f %9s  new\n", now->name, "-", now->value, "-");
+            continue;
+        }
+
+        change = 100.0 * (now->value - base->value) / base->value;
+
+        /* Twice the combined relative standard deviation of both runs */
+        noise = 0.0;
+        if (base->mean > 0.0 && now->mean > 0.0)
+        {
+            noise = 200.0 * sqrt(pow(base->stddev / base->mean, 2) + pow(now->stddev / now->mean, 2));
+        }
+
+        if (fabs(change) <= threshold || fabs(change) <= noise)
+        {
+            verdict = "same";
+        }
+        else if ((change > 0.0) == higher_is_better)
+        {
+            verdict = "faster";
+        }
+        else
+        {
+            verdict = "REGRESSION";
+            regressions++;
+        }
+        printf("%-36s %14.1f %14.1f %+8.1f%%  %s\n", now->name, base->value, now->value, change, verdict);
+    }
+
+    return (regressions > 0) ? 1 : 0;
+}
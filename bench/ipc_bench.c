@@ -0,0 +1,263 @@
+/**
+ * @file ipc_bench.c
+ * @brief Worker-to-daemon notification throughput and latency: the
+ * shared event ring against framed messages over the FIFO
+ *
+ * Usage: ipc_bench [producers] [messages per producer] [interval us]
+ * With an interval, producers pause between messages so latency is
+ * measured without the queueing of a flood. Prints one JSON object per path.
+ */
+
+#define _GNU_SOURCE
+
+#include "event_ring.h"
+#include "protocol.h"
+#include "ipc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define DEFAULT_PRODUCERS 4
+#define DEFAULT_MESSAGES  100000
+
+/* Pause between messages of one producer, 0 = flood */
+static long interval_us = 0;
+
+/**
+ * Order latencies ascending
+ */
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Print the results of one path as JSON
+ */
+static void report(const char *path, int producers, long total, uint64_t elapsed_ns,
+                   uint64_t *latencies, long received, unsigned long long retries)
+{
+    qsort(latencies, received, sizeof(uint64_t), compare_u64);
+    printf("{\"path\":\"%s\",\"producers\":%d,\"messages\":%ld,\"received\":%ld,"
+           "\"seconds\":%.3f,\"msgs_per_sec\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+           "\"max_us\":%.1f,\"interval_us\":%ld,\"ring_full\":%llu}\n",
+           path, producers, total, received, elapsed_ns / 1e9,
+           received / (elapsed_ns / 1e9),
+           latencies[(long)(0.50 * (received - 1))] / 1e3,
+           latencies[(long)(0.99 * (received - 1))] / 1e3,
+           latencies[received - 1] / 1e3, interval_us, retries);
+}
+
+/**
+ * Wait for every producer; returns FAILURE if any of them failed
+ */
+static int reap(int producers)
+{
+    int status, result = SUCCESS;
+
+    while (producers-- > 0)
+    {
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            result = FAILURE;
+        }
+    }
+    return result;
+}
+
+/**
+ * Ring path: producers publish, the consumer drains in batches and only
+ * sleeps on the doorbell when the ring is empty
+ */
+static int bench_ring(int producers, long messages)
+{
+    long total = producers * messages;
+    uint64_t *latencies = (uint64_t *)malloc(total * sizeof(uint64_t));
+    unsigned long long retries;
+    RingEvent events[EVENT_BATCH];
+    uint64_t start;
+    long received = 0;
+    int i;
+
+    if (latencies == NULL || event_ring_init() != SUCCESS)
+    {
+        fprintf(stderr, "ring setup failed\n");
+        return FAILURE;
+    }
+
+    start = event_ring_now_ns();
+    for (i = 0; i < producers; i++)
+    {
+        if (fork() == 0)
+        {
+            long n;
+
+            for (n = 0; n < messages; n++)
+            {
+                /* A full ring means the consumer is behind; give it the CPU */
+                while (event_ring_publish(MSG_FILE_TRANSFERRED, SUCCESS, "Sales_2026-10-18.xml") != SUCCESS)
+                {
+                    sched_yield();
+                }
+                if (interval_us > 0)
+                {
+                    usleep(interval_us);
+                }
+            }
+            _exit(0);
+        }
+    }
+
+    while (received < total)
+    {
+        int count = event_ring_drain(events, EVENT_BATCH);
+        uint64_t now = event_ring_now_ns();
+        int k;
+
+        for (k = 0; k < count; k++)
+        {
+            latencies[received++] = now - events[k].sent_ns;
+        }
+
+        if (count == 0 && !event_ring_prepare_wait())
+        {
+            struct pollfd pfd = { event_ring_fd(), POLLIN, 0 };
+
+            poll(&pfd, 1, 100);
+            event_ring_ack_doorbell();
+        }
+    }
+
+    retries = event_ring_overflows();
+    report("ring", producers, total, event_ring_now_ns() - start, latencies, received, retries);
+    free(latencies);
+    return reap(producers);
+}
+
+/**
+ * FIFO path: producers write one frame per message, the consumer reads
+ * them back one at a time like the daemon's receive_ipc_message()
+ */
+static int bench_fifo(int producers, long messages)
+{
+    long total = producers * messages;
+    uint64_t *latencies = (uint64_t *)malloc(total * sizeof(uint64_t));
+    char dir[] = "/tmp/ipc_bench.XXXXXX";
+    char fifo_path[64];
+    FrameReader reader;
+    uint64_t start;
+    long received = 0;
+    int fd, i;
+
+    if (latencies == NULL || mkdtemp(dir) == NULL)
+    {
+        fprintf(stderr, "fifo setup failed: %s\n", strerror(errno));
+        return FAILURE;
+    }
+
+    snprintf(fifo_path, sizeof(fifo_path), "%s/pipe", dir);
+    if (mkfifo(fifo_path, 0600) != 0 || (fd = open(fifo_path, O_RDWR | O_NONBLOCK)) == -1)
+    {
+        fprintf(stderr, "fifo setup failed: %s\n", strerror(errno));
+        rmdir(dir);
+        return FAILURE;
+    }
+
+    start = event_ring_now_ns();
+    for (i = 0; i < producers; i++)
+    {
+        if (fork() == 0)
+        {
+            int out = open(fifo_path, O_WRONLY);
+            long n;
+
+            for (n = 0; out != -1 && n < messages; n++)
+            {
+                Frame frame;
+                int sent;
+
+                if (frame_init(&frame, MSG_FILE_TRANSFERRED, 0) != SUCCESS)
+                {
+                    _exit(1);
+                }
+                frame_add_i32(&frame, FIELD_PID, getpid());
+                frame_add_i32(&frame, FIELD_STATUS, SUCCESS);
+                frame_add_string(&frame, FIELD_TEXT, "Sales_2026-10-18.xml");
+                frame_add_u64(&frame, FIELD_TIMESTAMP, event_ring_now_ns());
+                sent = frame_send(out, &frame, FALSE);
+                frame_free(&frame);
+                if (sent != SUCCESS)
+                {
+                    _exit(1);
+                }
+                if (interval_us > 0)
+                {
+                    usleep(interval_us);
+                }
+            }
+            _exit(out == -1);
+        }
+    }
+
+    frame_reader_init(&reader);
+    while (received < total)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        Frame frame;
+
+        poll(&pfd, 1, 100);
+        while (frame_reader_read(&reader, fd, FALSE, &frame) == SUCCESS)
+        {
+            uint64_t sent_ns = 0;
+
+            frame_get_u64(&frame, FIELD_TIMESTAMP, &sent_ns);
+            latencies[received++] = event_ring_now_ns() - sent_ns;
+            frame_free(&frame);
+        }
+        if (errno != EAGAIN)
+        {
+            fprintf(stderr, "fifo read failed: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+    if (received > 0)
+    {
+        report("fifo", producers, total, event_ring_now_ns() - start, latencies, received, 0);
+    }
+
+    frame_reader_free(&reader);
+    close(fd);
+    unlink(fifo_path);
+    rmdir(dir);
+    free(latencies);
+    return (reap(producers) == SUCCESS && received == total) ? SUCCESS : FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+    int producers = (argc > 1) ? atoi(argv[1]) : DEFAULT_PRODUCERS;
+    long messages = (argc > 2) ? atol(argv[2]) : DEFAULT_MESSAGES;
+
+    interval_us = (argc > 3) ? atol(argv[3]) : 0;
+    if (producers <= 0 || messages <= 0 || interval_us < 0)
+    {
+        fprintf(stderr, "Usage: %s [producers] [messages per producer] [interval us]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (bench_ring(producers, messages) != SUCCESS || bench_fifo(producers, messages) != SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,411 @@
+/**
+ * @file micro_bench.c
+ * @brief Microbenchmarks of the helpers every transfer, backup and scan
+ * calls once per file
+ *
+ * Usage: micro_bench --root DIR [options] [benchmark ...]
+ * Each benchmark is warmed up, then timed over a number of samples of
+ * many calls each on one pinned CPU. Prints one JSON object per benchmark
+ * with per-call statistics over the samples; bench_compare diffs two such
+ * outputs. Like report_bench, it works under a scratch root prefix (--root).
+ */
+
+#define _GNU_SOURCE
+
+#include "backup.h"
+#include "file_operations.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DEFAULT_SAMPLES 30
+#define DEFAULT_WARMUP  3
+
+/* Size of the report the file benchmarks read and copy; small enough
+ * that is_valid_xml_report() finds the closing tag in its 4 KB window */
+#define DEFAULT_REPORT_KB 3
+
+/* Results are accumulated here so the compiler cannot drop the calls */
+static volatile unsigned long sink;
+
+static char report_path[MAX_PATH_LENGTH];
+static char copy_path[MAX_PATH_LENGTH];
+
+/**
+ * Structure describing one benchmark
+ */
+typedef struct {
+    const char *name;            /* Name on the command line and in the output */
+    long iterations;             /* Calls per sample at --scale 1 */
+    void (*run)(long iterations);
+} MicroBench;
+
+/**
+ * Get a monotonic clock reading in nanoseconds
+ */
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Validate one report per call, as the transfer does
+ */
+static void bench_valid_xml(long iterations)
+{
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        sink += is_valid_xml_report(report_path);
+    }
+}
+
+/**
+ * Parse the department out of a report name
+ */
+static void bench_extract_department(long iterations)
+{
+    static const char *const names[] = {
+        "Warehouse_2026-10-18.xml", "Manufacturing_2026-10-18_r01.xml",
+        "Sales_weekly.xml", "Distribution_2026-10-18_late.xml"
+    };
+    char department[MAX_USER_LENGTH];
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        sink += (extract_department_from_filename(names[i & 3], department, sizeof(department)) != NULL);
+    }
+}
+
+/**
+ * Look up the owner of a report, as the scan and transfer do
+ */
+static void bench_file_owner(long iterations)
+{
+    char owner[MAX_USER_LENGTH];
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        sink += get_file_owner(report_path, owner, sizeof(owner));
+    }
+}
+
+/**
+ * Format a timestamp for the change log
+ */
+static void bench_timestamp_string(long iterations)
+{
+    char buffer[64];
+    time_t now = time(NULL);
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        sink += get_timestamp_string(now + i, buffer, sizeof(buffer))[0];
+    }
+}
+
+/**
+ * Log from one call site per file, as the transfer loop does
+ */
+static void bench_log_operation(long iterations)
+{
+    long i;
+
+    /* Past its burst the site is rate limited, so this is mostly that path */
+    for (i = 0; i < iterations; i++)
+    {
+        log_operation("Moving file: %s to %s", "Sales_2026-10-18.xml", DASHBOARD_DIR);
+    }
+}
+
+/**
+ * Call log_debug() below the current log level
+ */
+static void bench_log_filtered(long iterations)
+{
+    long i;
+
+    /* Below the default level: measures the cost of a disabled call site */
+    for (i = 0; i < iterations; i++)
+    {
+        log_debug("Scanned file: %s", "Sales_2026-10-18.xml");
+    }
+}
+
+/**
+ * Copy one report, as a backup does
+ */
+static void bench_copy_file(long iterations)
+{
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        sink += copy_file(report_path, copy_path);
+    }
+}
+
+static const MicroBench benchmarks[] = {
+    { "is_valid_xml_report", 20000, bench_valid_xml },
+    { "extract_department_from_filename", 1000000, bench_extract_department },
+    { "get_file_owner", 20000, bench_file_owner },
+    { "get_timestamp_string", 200000, bench_timestamp_string },
+    { "log_operation", 200000, bench_log_operation },
+    { "log_debug_filtered", 1000000, bench_log_filtered },
+    { "copy_file", 500, bench_copy_file }
+};
+
+#define BENCHMARK_COUNT ((int)(sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+/**
+ * Order per-call times ascending
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Write the report the file benchmarks work on
+ * @param size_kb Report size
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int prepare_files(long size_kb)
+{
+    FILE *file;
+    long written = 0;
+    long n = 0;
+
+    if (create_path_roots() != SUCCESS)
+    {
+        fprintf(stderr, "Cannot create the scratch tree: %s\n", strerror(errno));
+        return FAILURE;
+    }
+    create_directory_if_not_exists(UPLOAD_DIR);
+    create_directory_if_not_exists(DASHBOARD_DIR);
+    snprintf(report_path, sizeof(report_path), "%s/Sales_2026-10-18.xml", UPLOAD_DIR);
+    snprintf(copy_path, sizeof(copy_path), "%s/Sales_2026-10-18.xml", DASHBOARD_DIR);
+
+    file = fopen(report_path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Cannot write %s: %s\n", report_path, strerror(errno));
+        return FAILURE;
+    }
+    written += fprintf(file, "<?xml version=\"1.0\"?>\n<report>\n");
+    while (written < size_kb * 1024 - 10)
+    {
+        written += fprintf(file, "<row id=\"%ld\" value=\"%ld\"/>\n", n, (n * 104729) % 100000);
+        n++;
+    }
+    fprintf(file, "</report>\n");
+    return (fclose(file) == 0) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Keep the benchmark on one CPU so migrations do not add noise
+ * @param cpu CPU number, -1 to leave scheduling alone
+ */
+static void pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+    {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        fprintf(stderr, "Cannot pin to CPU %d: %s\n", cpu, strerror(errno));
+    }
+}
+
+/**
+ * Run one benchmark and print its statistics
+ */
+static void run_benchmark(const MicroBench *bench, double scale, int warmup, int samples, int cpu)
+{
+    long iterations = (long)(bench->iterations * scale);
+    double *per_call = (double *)malloc(samples * sizeof(double));
+    double sum = 0.0;
+    double variance = 0.0;
+    double mean, stddev;
+    int i;
+
+    if (per_call == NULL)
+    {
+        return;
+    }
+    if (iterations < 1)
+    {
+        iterations = 1;
+    }
+
+    for (i = 0; i < warmup; i++)
+    {
+        bench->run(iterations);
+    }
+    for (i = 0; i < samples; i++)
+    {
+        double started = now_ns();
+
+        bench->run(iterations);
+        per_call[i] = (now_ns() - started) / iterations;
+        sum += per_call[i];
+    }
+
+    mean = sum / samples;
+    for (i = 0; i < samples; i++)
+    {
+        variance += (per_call[i] - mean) * (per_call[i] - mean);
+    }
+    stddev = (samples > 1) ? sqrt(variance / (samples - 1)) : 0.0;
+    qsort(per_call, samples, sizeof(double), compare_double);
+
+    printf("{\"bench\":\"%s\",\"iterations\":%ld,\"samples\":%d,\"cpu\":%d,"
+           "\"mean_ns\":%.1f,\"median_ns\":%.1f,\"stddev_ns\":%.1f,\"cv_pct\":%.2f,"
+           "\"min_ns\":%.1f,\"p90_ns\":%.1f,\"max_ns\":%.1f,\"calls_per_sec\":%.0f}\n",
+           bench->name, iterations, samples, cpu, mean, per_call[samples / 2], stddev,
+           (mean > 0.0) ? 100.0 * stddev / mean : 0.0, per_call[0],
+           per_call[(int)(0.9 * (samples - 1))], per_call[samples - 1],
+           (mean > 0.0) ? 1e9 / mean : 0.0);
+    fflush(stdout);
+    free(per_call);
+}
+
+/**
+ * Print usage
+ */
+static void usage(const char *program)
+{
+    int i;
+
+    fprintf(stderr,
+            "Usage: %s --root DIR [options] [benchmark ...]\n"
+            "  --root DIR      scratch root prefix every path is put under\n"
+            "  --samples N     timed samples per benchmark (default %d)\n"
+            "  --warmup N      untimed samples first (default %d)\n"
+            "  --scale F       multiply the calls per sample (default 1)\n"
+            "  --cpu N         CPU to pin to, -1 for none (default 0)\n"
+            "  --size-kb K     size of the report read and copied (default %d)\n"
+            "Benchmarks:",
+            program, DEFAULT_SAMPLES, DEFAULT_WARMUP, DEFAULT_REPORT_KB);
+    for (i = 0; i < BENCHMARK_COUNT; i++)
+    {
+        fprintf(stderr, " %s", benchmarks[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int samples = DEFAULT_SAMPLES;
+    int warmup = DEFAULT_WARMUP;
+    double scale = 1.0;
+    int cpu = 0;
+    long size_kb = DEFAULT_REPORT_KB;
+    int selected[BENCHMARK_COUNT];
+    const char *root = NULL;
+    int any = FALSE;
+    int i, j;
+
+    memset(selected, 0, sizeof(selected));
+    for (i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--", 2) == 0 && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+
+            if (strcmp(argv[i - 1], "--root") == 0)
+            {
+                root = value;
+            }
+            else if (strcmp(argv[i - 1], "--samples") == 0)
+            {
+                samples = atoi(value);
+            }
+            else if (strcmp(argv[i - 1], "--warmup") == 0)
+            {
+                warmup = atoi(value);
+            }
+            else if (strcmp(argv[i - 1], "--scale") == 0)
+            {
+                scale = atof(value);
+            }
+            else if (strcmp(argv[i - 1], "--cpu") == 0)
+            {
+                cpu = atoi(value);
+            }
+            else if (strcmp(argv[i - 1], "--size-kb") == 0)
+            {
+                size_kb = atol(value);
+            }
+            else
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+
+        for (j = 0; j < BENCHMARK_COUNT && strcmp(argv[i], benchmarks[j].name) != 0; j++)
+        {
+        }
+        if (j == BENCHMARK_COUNT)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        selected[j] = TRUE;
+        any = TRUE;
+    }
+
+    /* Never point the benchmarks at a live installation */
+    if (root == NULL || strcmp(root, "/") == 0 || init_paths(root, NULL) != SUCCESS)
+    {
+        fprintf(stderr, "%s needs a scratch --root\n", argv[0]);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (samples < 1 || warmup < 0 || scale <= 0.0 || size_kb < 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (prepare_files(size_kb) != SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    pin_cpu(cpu);
+
+    for (i = 0; i < BENCHMARK_COUNT; i++)
+    {
+        if (!any || selected[i])
+        {
+            run_benchmark(&benchmarks[i], scale, warmup, samples, cpu);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1072 @@
+/**
+ * @file report_bench.c
+ * @brief End-to-end benchmarks of the daemon's file paths: a synthetic
+ * upload generator plus drivers for the transfer, the backup, the change
+ * monitor's directory scan and the control socket
+ *
+ * Usage: report_bench --root DIR [options] [generate | transfer | backup | scan | ipc ...]
+ * Without drivers, all four run. "generate" only writes one upload set.
+ *
+ * Every path is put under a scratch root prefix (--root, see paths.h),
+ * so the drivers exercise the daemon's real code against their own tree
+ * and need no privileges. Prints one JSON object per driver.
+ */
+
+#define _GNU_SOURCE
+
+#include "daemon.h"
+#include "backup.h"
+#include "file_operations.h"
+#include "utils.h"
+#include "ipc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <ftw.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* Size distributions of generated reports */
+#define SIZE_FIXED     0
+#define SIZE_UNIFORM   1
+#define SIZE_LOGNORMAL 2
+
+/* Spread of the lognormal distribution; about 1 in 20 reports is over 5x the mean */
+#define LOGNORMAL_SIGMA 1.0
+
+/* Smallest report generated, enough for the XML envelope */
+#define MIN_REPORT_SIZE 64
+
+/* Departments beyond the four real ones get synthetic names */
+static const char *const department_names[] = {
+    DEPT_WAREHOUSE, DEPT_MANUFACTURING, DEPT_SALES, DEPT_DISTRIBUTION
+};
+
+/**
+ * Structure holding the benchmark settings
+ */
+typedef struct {
+    int departments;        /* Departments uploading */
+    int reports;            /* Reports per department */
+    long size_kb;           /* Mean report size */
+    int size_dist;          /* SIZE_* distribution */
+    double invalid_pct;     /* Share of reports that fail XML validation */
+    double late_pct;        /* Share stamped after the upload deadline */
+    double churn_pct;       /* Share rewritten between backup and scan rounds */
+    int rounds;             /* Timed repetitions of the transfer and backup */
+    int scans;              /* Timed calls of the change monitor */
+    long ipc_messages;      /* Control socket round trips */
+    size_t ipc_payload;     /* Content bytes per control socket request */
+    unsigned int seed;      /* Generator seed */
+} BenchConfig;
+
+/**
+ * Structure describing a generated upload set
+ */
+typedef struct {
+    long files;             /* Reports written */
+    long long bytes;        /* Their total size */
+    long invalid;           /* Reports that fail validation */
+    long late;              /* Reports stamped late */
+} GeneratedSet;
+
+/**
+ * Read and write counters from /proc/self/io
+ */
+typedef struct {
+    long long syscr;        /* read-type system calls */
+    long long syscw;        /* write-type system calls */
+    long long read_bytes;   /* Bytes fetched from storage */
+    long long write_bytes;  /* Bytes sent to storage */
+} IoCounters;
+
+/**
+ * Structure collecting the timings of one driver
+ */
+typedef struct {
+    double* samples_ms;     /* One latency per round, call or message */
+    long count;             /* Samples taken */
+    long capacity;          /* Samples allocated */
+    long offered;           /* Files (or messages) handed to the driver */
+    long files;             /* Files (or messages) processed */
+    long long bytes;        /* Bytes processed */
+    double seconds;         /* Time spent in the measured calls */
+    IoCounters io;          /* I/O of the measured calls */
+    IoCounters mark_io;     /* Counters when the current sample started */
+    double mark_ms;         /* Clock when the current sample started */
+} BenchResult;
+
+static BenchConfig config = {
+    4, 250, 64, SIZE_LOGNORMAL, 5.0, 5.0, 10.0, 5, 20, 20000, 256, 1
+};
+
+/* What reading the counters twice costs, subtracted from every sample */
+static IoCounters io_overhead;
+
+/**
+ * Get a monotonic clock reading in milliseconds
+ */
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Read this process's I/O counters; all -1 when the kernel lacks them
+ */
+static IoCounters read_io_counters(void)
+{
+    IoCounters io = { -1, -1, -1, -1 };
+    char name[32];
+    long long value;
+    FILE *file = fopen("/proc/self/io", "r");
+
+    if (file == NULL)
+    {
+        return io;
+    }
+    while (fscanf(file, "%31[^:]: %lld\n", name, &value) == 2)
+    {
+        if (strcmp(name, "syscr") == 0)
+        {
+            io.syscr = value;
+        }
+        else if (strcmp(name, "syscw") == 0)
+        {
+            io.syscw = value;
+        }
+        else if (strcmp(name, "read_bytes") == 0)
+        {
+            io.read_bytes = value;
+        }
+        else if (strcmp(name, "write_bytes") == 0)
+        {
+            io.write_bytes = value;
+        }
+    }
+    fclose(file);
+    return io;
+}
+
+/**
+ * Record one latency sample
+ */
+static void add_sample(BenchResult *result, double ms)
+{
+    if (result->count == result->capacity)
+    {
+        long capacity = (result->capacity > 0) ? result->capacity * 2 : 64;
+        double *grown = (double *)realloc(result->samples_ms, capacity * sizeof(double));
+
+        if (grown == NULL)
+        {
+            return;
+        }
+        result->samples_ms = grown;
+        result->capacity = capacity;
+    }
+    result->samples_ms[result->count++] = ms;
+    result->seconds += ms / 1000.0;
+}
+
+/**
+ * Add the difference of two counters, -1 once either is unavailable
+ */
+static void add_io(long long *total, long long start, long long end, long long overhead)
+{
+    if (*total < 0 || start < 0 || end < 0)
+    {
+        *total = -1;
+        return;
+    }
+    *total += (end - start > overhead) ? end - start - overhead : 0;
+}
+
+/**
+ * Start timing one measured call
+ */
+static void start_sample(BenchResult *result)
+{
+    result->mark_io = read_io_counters();
+    result->mark_ms = now_ms();
+}
+
+/**
+ * Finish timing one measured call, adding its latency and I/O
+ */
+static void stop_sample(BenchResult *result)
+{
+    double ms = now_ms() - result->mark_ms;
+    IoCounters io = read_io_counters();
+
+    add_sample(result, ms);
+    add_io(&result->io.syscr, result->mark_io.syscr, io.syscr, io_overhead.syscr);
+    add_io(&result->io.syscw, result->mark_io.syscw, io.syscw, io_overhead.syscw);
+    add_io(&result->io.read_bytes, result->mark_io.read_bytes, io.read_bytes, 0);
+    add_io(&result->io.write_bytes, result->mark_io.write_bytes, io.write_bytes, 0);
+}
+
+/**
+ * Measure what an empty sample costs in read and write calls
+ */
+static void calibrate_io(void)
+{
+    BenchResult result;
+
+    memset(&result, 0, sizeof(result));
+    start_sample(&result);
+    stop_sample(&result);
+    io_overhead = result.io;
+    free(result.samples_ms);
+}
+
+/**
+ * Order latencies ascending
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Get the median of sorted samples
+ */
+static double median(const BenchResult *result)
+{
+    if (result->count == 0)
+    {
+        return 0.0;
+    }
+    if (result->count % 2 == 0)
+    {
+        return (result->samples_ms[result->count / 2 - 1] + result->samples_ms[result->count / 2]) / 2.0;
+    }
+    return result->samples_ms[result->count / 2];
+}
+
+/**
+ * Format a nearest-rank percentile of sorted samples, or null when there
+ * are too few samples for it to differ from the maximum (fewer than 10
+ * for p90, 100 for p99)
+ * @param buffer Receives the JSON value
+ * @param size Size of buffer
+ * @param result Sorted timings
+ * @param p Percentile as a fraction, below 1
+ */
+static void format_percentile(char *buffer, size_t size, const BenchResult *result, double p)
+{
+    long needed = (long)(1.0 / (1.0 - p) + 0.5);
+    long rank = (long)ceil(p * result->count);
+
+    if (result->count == 0 || result->count < needed)
+    {
+        snprintf(buffer, size, "null");
+        return;
+    }
+    snprintf(buffer, size, "%.3f", result->samples_ms[(rank > 0 ? rank : 1) - 1]);
+}
+
+/**
+ * Get the driver process's peak RSS since reset_peak_rss()
+ * @return Kilobytes, or -1 if /proc does not say
+ */
+static long peak_rss_kb(void)
+{
+    char line[256];
+    long kb = -1;
+    FILE *status = fopen("/proc/self/status", "r");
+
+    if (status == NULL)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(status);
+    return kb;
+}
+
+/**
+ * Reset the peak RSS, so a forked driver does not report the high-water
+ * mark it inherited from its parent
+ */
+static void reset_peak_rss(void)
+{
+    FILE *clear = fopen("/proc/self/clear_refs", "w");
+
+    if (clear != NULL)
+    {
+        fputs("5", clear);
+        fclose(clear);
+    }
+}
+
+/**
+ * Print one driver's results as JSON
+ * @param driver Driver name
+ * @param sample What one latency sample covers
+ * @param result Timings
+ */
+static void report(const char *driver, const char *sample, BenchResult *result)
+{
+    struct rusage usage;
+    double seconds = (result->seconds > 0.0) ? result->seconds : 1e-9;
+    char p90[32], p99[32];
+
+    getrusage(RUSAGE_SELF, &usage);
+    qsort(result->samples_ms, result->count, sizeof(double), compare_double);
+    format_percentile(p90, sizeof(p90), result, 0.90);
+    format_percentile(p99, sizeof(p99), result, 0.99);
+
+    printf("{\"driver\":\"%s\",\"departments\":%d,\"reports_per_department\":%d,\"size_kb\":%ld,"
+           "\"size_dist\":\"%s\",\"invalid_pct\":%.1f,\"late_pct\":%.1f,"
+           "\"offered\":%ld,\"files\":%ld,\"bytes\":%lld,\"seconds\":%.3f,\"files_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+           "\"read_syscalls\":%lld,\"write_syscalls\":%lld,\"disk_read_bytes\":%lld,\"disk_write_bytes\":%lld,"
+           "\"voluntary_switches\":%ld,\"peak_rss_kb\":%ld,"
+           "\"sample\":\"%s\",\"samples\":%ld,\"median_ms\":%.3f,\"p90_ms\":%s,\"p99_ms\":%s,\"max_ms\":%.3f}\n",
+           driver, config.departments, config.reports, config.size_kb,
+           config.size_dist == SIZE_FIXED ? "fixed" : config.size_dist == SIZE_UNIFORM ? "uniform" : "lognormal",
+           config.invalid_pct, config.late_pct,
+           result->offered, result->files, result->bytes, result->seconds, result->files / seconds,
+           result->bytes / (1024.0 * 1024.0) / seconds,
+           result->io.syscr, result->io.syscw, result->io.read_bytes, result->io.write_bytes,
+           usage.ru_nvcsw, peak_rss_kb(),
+           sample, result->count, median(result), p90, p99,
+           (result->count > 0) ? result->samples_ms[result->count - 1] : 0.0);
+    fflush(stdout);
+    free(result->samples_ms);
+}
+
+/**
+ * Pick the size of the next report
+ */
+static size_t next_report_size(unsigned int *seed)
+{
+    double mean = config.size_kb * 1024.0;
+    double size = mean;
+
+    if (config.size_dist == SIZE_UNIFORM)
+    {
+        size = mean * (0.5 + (double)rand_r(seed) / RAND_MAX);
+    }
+    else if (config.size_dist == SIZE_LOGNORMAL)
+    {
+        /* Box-Muller, scaled so the mean stays at size_kb */
+        double u1 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+        double u2 = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+        double z = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+
+        size = mean * exp(LOGNORMAL_SIGMA * z - LOGNORMAL_SIGMA * LOGNORMAL_SIGMA / 2.0);
+    }
+
+    return (size < MIN_REPORT_SIZE) ? MIN_REPORT_SIZE : (size_t)size;
+}
+
+/**
+ * Write one synthetic report
+ * @param path File to create
+ * @param size Bytes to write
+ * @param valid Whether it should pass XML validation
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int write_report(const char *path, size_t size, int valid)
+{
+    static const char header[] = "<?xml version=\"1.0\"?>\n<report>\n";
+    static const char footer[] = "</report>\n";
+    char row[128];
+    size_t written = 0;
+    long n = 0;
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL)
+    {
+        return FAILURE;
+    }
+
+    /* Invalid reports lack the XML declaration, like a truncated or misnamed upload */
+    written += fwrite(valid ? header : header + 22, 1, valid ? sizeof(header) - 1 : sizeof(header) - 23, file);
+    while (written + sizeof(footer) - 1 < size)
+    {
+        int length = snprintf(row, sizeof(row), "<row id=\"%ld\" units=\"%ld\" value=\"%ld.%02ld\"/>\n",
+                              n, (n * 7919) % 1000, (n * 104729) % 100000, n % 100);
+        size_t take = size - written - (sizeof(footer) - 1);
+
+        if ((size_t)length < take)
+        {
+            take = (size_t)length;
+        }
+        written += fwrite(row, 1, take, file);
+        n++;
+    }
+    written += fwrite(footer, 1, sizeof(footer) - 1, file);
+
+    return (fclose(file) == 0 && written >= size) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Generate N departments x M reports into a directory
+ * @param dir Directory to fill
+ * @param round Distinguishes the file names of successive sets
+ * @param set Receives what was written
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int generate_reports(const char *dir, int round, GeneratedSet *set)
+{
+    unsigned int seed = config.seed + (unsigned int)round;
+    char department[32];
+    char path[MAX_PATH_LENGTH];
+    time_t now = time(NULL);
+    struct tm late_tm;
+    struct timespec late_times[2];
+    int d, r;
+
+    memset(set, 0, sizeof(*set));
+
+    /* Late uploads are stamped after today's deadline */
+    localtime_r(&now, &late_tm);
+    late_tm.tm_hour = UPLOAD_DEADLINE_HOUR;
+    late_tm.tm_min = UPLOAD_DEADLINE_MINUTE + 15;
+    late_tm.tm_sec = 0;
+    late_times[0].tv_sec = late_times[1].tv_sec = mktime(&late_tm);
+    late_times[0].tv_nsec = late_times[1].tv_nsec = 0;
+
+    for (d = 0; d < config.departments; d++)
+    {
+        if (d < 4)
+        {
+            snprintf(department, sizeof(department), "%s", department_names[d]);
+        }
+        else
+        {
+            snprintf(department, sizeof(department), "Dept%03d", d + 1);
+        }
+
+        for (r = 0; r < config.reports; r++)
+        {
+            size_t size = next_report_size(&seed);
+            int valid = (rand_r(&seed) % 10000) >= config.invalid_pct * 100.0;
+            int late = (rand_r(&seed) % 10000) < config.late_pct * 100.0;
+
+            snprintf(path, sizeof(path), "%s/%s_2026-10-18_r%02d_%05d%s",
+                     dir, department, round, r, REPORT_EXTENSION);
+            if (write_report(path, size, valid) != SUCCESS ||
+                (late && utimensat(AT_FDCWD, path, late_times, 0) != 0))
+            {
+                fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+                return FAILURE;
+            }
+
+            set->files++;
+            set->bytes += (long long)size;
+            set->invalid += !valid;
+            set->late += late;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Remove one entry of a tree being emptied
+ */
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+
+    /* Keep the top directory itself */
+    if (ftw->level > 0 && remove(path) != 0)
+    {
+        fprintf(stderr, "Cannot remove %s: %s\n", path, strerror(errno));
+    }
+    return 0;
+}
+
+/**
+ * Empty a directory, creating it if needed
+ */
+static void empty_directory(const char *dir)
+{
+    create_directory_if_not_exists(dir);
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Create a clean scratch tree
+ */
+static void reset_tree(void)
+{
+    create_path_roots();
+    empty_directory(UPLOAD_DIR);
+    empty_directory(DASHBOARD_DIR);
+    empty_directory(BACKUP_DIR);
+    remove_stale_dashboard_views();
+}
+
+/**
+ * Rewrite a share of the reports in a directory
+ * @param dir Directory holding reports
+ * @param seed Generator state
+ * @return Number of reports rewritten
+ */
+static long churn_reports(const char *dir, unsigned int *seed)
+{
+    char path[MAX_PATH_LENGTH];
+    struct dirent *entry;
+    long rewritten = 0;
+    DIR *handle = opendir(dir);
+
+    if (handle == NULL)
+    {
+        return 0;
+    }
+    while ((entry = readdir(handle)) != NULL)
+    {
+        if (entry->d_name[0] == '.' || (rand_r(seed) % 10000) >= config.churn_pct * 100.0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (write_report(path, next_report_size(seed), TRUE) == SUCCESS)
+        {
+            rewritten++;
+        }
+    }
+    closedir(handle);
+    return rewritten;
+}
+
+/**
+ * Sum the regular files in a directory
+ */
+static void count_files(const char *dir, long *files, long long *bytes)
+{
+    char path[MAX_PATH_LENGTH];
+    struct dirent *entry;
+    struct stat st;
+    DIR *handle = opendir(dir);
+
+    *files = 0;
+    *bytes = 0;
+    if (handle == NULL)
+    {
+        return;
+    }
+    while ((entry = readdir(handle)) != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (entry->d_name[0] != '.' && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            (*files)++;
+            *bytes += st.st_size;
+        }
+    }
+    closedir(handle);
+}
+
+/**
+ * Write one upload set and describe it
+ */
+static int run_generate(void)
+{
+    GeneratedSet set;
+
+    reset_tree();
+    if (generate_reports(UPLOAD_DIR, 0, &set) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    printf("{\"driver\":\"generate\",\"directory\":\"%s\",\"files\":%ld,\"bytes\":%lld,"
+           "\"invalid\":%ld,\"late\":%ld}\n",
+           UPLOAD_DIR, set.files, set.bytes, set.invalid, set.late);
+    return SUCCESS;
+}
+
+/**
+ * Transfer driver: each round uploads a fresh set and times transfer_reports()
+ */
+static int run_transfer(void)
+{
+    BenchResult result;
+    int round;
+
+    memset(&result, 0, sizeof(result));
+    reset_tree();
+
+    for (round = 0; round < config.rounds; round++)
+    {
+        GeneratedSet set;
+        long files;
+        long long bytes;
+
+        empty_directory(UPLOAD_DIR);
+        empty_directory(DASHBOARD_DIR);
+        if (generate_reports(UPLOAD_DIR, round, &set) != SUCCESS)
+        {
+            return FAILURE;
+        }
+        sync();
+
+        start_sample(&result);
+        if (transfer_reports() != SUCCESS)
+        {
+            fprintf(stderr, "transfer_reports failed in round %d\n", round);
+        }
+        stop_sample(&result);
+        result.offered += set.files;
+
+        count_files(DASHBOARD_DIR, &files, &bytes);
+        result.files += files;
+        result.bytes += bytes;
+    }
+
+    report("transfer", "round", &result);
+    return SUCCESS;
+}
+
+/**
+ * Backup driver: the first round backs up a full dashboard, later rounds
+ * back it up again after a share of the reports changed
+ */
+static int run_backup(void)
+{
+    BenchResult result;
+    GeneratedSet set;
+    unsigned int seed = config.seed;
+    int round;
+
+    memset(&result, 0, sizeof(result));
+    reset_tree();
+    if (generate_reports(DASHBOARD_DIR, 0, &set) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    for (round = 0; round < config.rounds; round++)
+    {
+        long files;
+        long long bytes;
+        time_t second = time(NULL);
+
+        if (round > 0)
+        {
+            churn_reports(DASHBOARD_DIR, &seed);
+        }
+        sync();
+
+        /* Snapshots are named to the second; never start two in the same one */
+        while (time(NULL) == second)
+        {
+            usleep(10000);
+        }
+
+        count_files(DASHBOARD_DIR, &files, &bytes);
+        start_sample(&result);
+        if (backup_dashboard() != SUCCESS)
+        {
+            fprintf(stderr, "backup_dashboard failed in round %d\n", round);
+        }
+        stop_sample(&result);
+        result.offered += files;
+        result.files += files;
+        result.bytes += bytes;
+    }
+
+    report("backup", "round", &result);
+    return SUCCESS;
+}
+
+/**
+ * Scan driver: times the change monitor's pass over the upload directory,
+ * with a share of the uploads rewritten between passes
+ */
+static int run_scan(void)
+{
+    BenchResult result;
+    GeneratedSet set;
+    unsigned int seed = config.seed;
+    int scan;
+
+    memset(&result, 0, sizeof(result));
+    reset_tree();
+    if (generate_reports(UPLOAD_DIR, 0, &set) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    for (scan = 0; scan < config.scans; scan++)
+    {
+        if (scan > 0)
+        {
+            churn_reports(UPLOAD_DIR, &seed);
+        }
+
+        start_sample(&result);
+        monitor_directory_changes();
+        stop_sample(&result);
+        result.offered += set.files;
+        result.files += set.files;
+    }
+
+    report("scan", "call", &result);
+    return SUCCESS;
+}
+
+/**
+ * Serve control socket requests with the daemon's own IPC code until
+ * the given number has been answered
+ */
+static void serve_ipc(long messages)
+{
+    ControlRequest request;
+    long answered = 0;
+
+    if (setup_ipc() != SUCCESS)
+    {
+        fprintf(stderr, "IPC setup failed\n");
+        _exit(1);
+    }
+    while (answered < messages)
+    {
+        wait_for_ipc(1000);
+        while (receive_control_request(&request) == SUCCESS)
+        {
+            send_control_reply(&request, SUCCESS, "OK");
+            answered++;
+        }
+    }
+    cleanup_ipc();
+    _exit(0);
+}
+
+/**
+ * Wait for the reply to a control request
+ * @return SUCCESS when it arrived, FAILURE on error or timeout
+ */
+static int read_reply(FrameReader *reader, int fd, Frame *reply)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (frame_reader_read(reader, fd, TRUE, reply) != SUCCESS)
+    {
+        if (errno != EAGAIN || poll(&pfd, 1, CONTROL_REPLY_TIMEOUT_MS) != 1)
+        {
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * IPC driver: urgent-change sized requests over the control socket,
+ * one at a time, each timed from send to reply
+ */
+static int run_ipc(void)
+{
+    BenchResult result;
+    struct sockaddr_un addr;
+    FrameReader reader;
+    char *payload;
+    pid_t server;
+    int fd = -1;
+    int attempt;
+    long n;
+    int status;
+
+    memset(&result, 0, sizeof(result));
+    reset_tree();
+
+    /* The server binds the socket; connect once it is there */
+    server = fork();
+    if (server == 0)
+    {
+        serve_ipc(config.ipc_messages);
+    }
+    if (server == -1)
+    {
+        return FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, CONTROL_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    for (attempt = 0; attempt < 100 && fd == -1; attempt++)
+    {
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            close(fd);
+            fd = -1;
+            usleep(10000);
+        }
+    }
+    payload = (char *)malloc(config.ipc_payload + 1);
+    if (fd == -1 || payload == NULL)
+    {
+        fprintf(stderr, "Cannot reach the benchmark server: %s\n", strerror(errno));
+        kill(server, SIGTERM);
+        waitpid(server, &status, 0);
+        free(payload);
+        return FAILURE;
+    }
+    memset(payload, 'x', config.ipc_payload);
+    payload[config.ipc_payload] = '\0';
+
+    frame_reader_init(&reader);
+    for (n = 0; n < config.ipc_messages; n++)
+    {
+        Frame request, reply;
+
+        start_sample(&result);
+        if (frame_init(&request, MSG_URGENT_CHANGE, (uint32_t)n + 1) != SUCCESS ||
+            frame_add_string(&request, FIELD_FILENAME, "Sales_2026-10-18.xml") != SUCCESS ||
+            frame_add_string(&request, FIELD_USERNAME, "bench") != SUCCESS ||
+            frame_add_string(&request, FIELD_CONTENT, payload) != SUCCESS ||
+            frame_send(fd, &request, TRUE) != SUCCESS ||
+            read_reply(&reader, fd, &reply) != SUCCESS)
+        {
+            fprintf(stderr, "Round trip %ld failed: %s\n", n, strerror(errno));
+            frame_free(&request);
+            break;
+        }
+        stop_sample(&result);
+        result.files++;
+        result.bytes += (long long)request.length + (long long)reply.length;
+        frame_free(&request);
+        frame_free(&reply);
+    }
+    result.offered = config.ipc_messages;
+    report("ipc", "message", &result);
+
+    frame_reader_free(&reader);
+    close(fd);
+    free(payload);
+    if (result.files < config.ipc_messages)
+    {
+        kill(server, SIGTERM);
+    }
+    waitpid(server, &status, 0);
+    return (result.files == config.ipc_messages) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Run one driver in its own process, so its peak RSS and I/O counters
+ * are its own; the peak inherited through fork() is reset first
+ */
+static int run_driver(int (*driver)(void))
+{
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+    {
+        int result;
+
+        reset_peak_rss();
+        calibrate_io();
+        result = driver();
+        fflush(stdout);
+        _exit(result == SUCCESS ? 0 : 1);
+    }
+    if (pid == -1 || waitpid(pid, &status, 0) == -1)
+    {
+        return FAILURE;
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Print usage
+ */
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s --root DIR [options] [generate | transfer | backup | scan | ipc ...]\n"
+            "  --root DIR          scratch root prefix every path is put under\n"
+            "  --instance NAME     instance name within it (default none)\n"
+            "  --departments N     departments uploading (default %d)\n"
+            "  --reports M         reports per department (default %d)\n"
+            "  --size-kb K         mean report size (default %ld)\n"
+            "  --size-dist D       fixed, uniform or lognormal (default lognormal)\n"
+            "  --invalid PCT       reports failing XML validation (default %.0f)\n"
+            "  --late PCT          reports uploaded after the deadline (default %.0f)\n"
+            "  --churn PCT         reports rewritten between backup/scan rounds (default %.0f)\n"
+            "  --rounds R          transfer and backup rounds (default %d)\n"
+            "  --scans S           change monitor passes (default %d)\n"
+            "  --ipc-messages N    control socket round trips (default %ld)\n"
+            "  --ipc-payload B     content bytes per request (default %zu)\n"
+            "  --seed S            generator seed (default %u)\n"
+            "  --log-level L       daemon log level while benchmarking\n"
+            "Logs go to DIR%s\n",
+            program, config.departments, config.reports, config.size_kb, config.invalid_pct,
+            config.late_pct, config.churn_pct, config.rounds, config.scans, config.ipc_messages,
+            config.ipc_payload, config.seed, DEFAULT_LOG_ROOT);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *root = NULL;
+    const char *instance = NULL;
+    int ran = 0;
+    int failed = 0;
+    int i;
+
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i += 2)
+    {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (value == NULL)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (strcmp(argv[i], "--root") == 0)
+        {
+            root = value;
+        }
+        else if (strcmp(argv[i], "--instance") == 0)
+        {
+            instance = value;
+        }
+        else if (strcmp(argv[i], "--departments") == 0)
+        {
+            config.departments = atoi(value);
+        }
+        else if (strcmp(argv[i], "--reports") == 0)
+        {
+            config.reports = atoi(value);
+        }
+        else if (strcmp(argv[i], "--size-kb") == 0)
+        {
+            config.size_kb = atol(value);
+        }
+        else if (strcmp(argv[i], "--size-dist") == 0)
+        {
+            config.size_dist = strcmp(value, "fixed") == 0     ? SIZE_FIXED
+                               : strcmp(value, "uniform") == 0 ? SIZE_UNIFORM
+                                                               : SIZE_LOGNORMAL;
+        }
+        else if (strcmp(argv[i], "--invalid") == 0)
+        {
+            config.invalid_pct = atof(value);
+        }
+        else if (strcmp(argv[i], "--late") == 0)
+        {
+            config.late_pct = atof(value);
+        }
+        else if (strcmp(argv[i], "--churn") == 0)
+        {
+            config.churn_pct = atof(value);
+        }
+        else if (strcmp(argv[i], "--rounds") == 0)
+        {
+            config.rounds = atoi(value);
+        }
+        else if (strcmp(argv[i], "--scans") == 0)
+        {
+            config.scans = atoi(value);
+        }
+        else if (strcmp(argv[i], "--ipc-messages") == 0)
+        {
+            config.ipc_messages = atol(value);
+        }
+        else if (strcmp(argv[i], "--ipc-payload") == 0)
+        {
+            config.ipc_payload = (size_t)atol(value);
+        }
+        else if (strcmp(argv[i], "--seed") == 0)
+        {
+            config.seed = (unsigned int)strtoul(value, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && parse_log_level(value) >= 0)
+        {
+            set_log_level(parse_log_level(value));
+        }
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Never point the drivers at a live installation */
+    if (root == NULL || strcmp(root, "/") == 0 || init_paths(root, instance) != SUCCESS)
+    {
+        fprintf(stderr, "%s needs a scratch --root and a valid --instance\n", argv[0]);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (config.departments <= 0 || config.reports <= 0 || config.size_kb <= 0 || config.rounds <= 0 ||
+        config.scans <= 0 || config.ipc_messages <= 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (; i < argc || ran == 0; i++)
+    {
+        const char *driver = (i < argc) ? argv[i] : NULL;
+
+        if (driver == NULL)
+        {
+            /* No drivers named: run them all */
+            failed |= run_driver(run_transfer) | run_driver(run_backup) |
+                      run_driver(run_scan) | run_driver(run_ipc);
+            ran++;
+            break;
+        }
+
+        if (strcmp(driver, "generate") == 0)
+        {
+            failed |= run_driver(run_generate);
+        }
+        else if (strcmp(driver, "transfer") == 0)
+        {
+            failed |= run_driver(run_transfer);
+        }
+        else if (strcmp(driver, "backup") == 0)
+        {
+            failed |= run_driver(run_backup);
+        }
+        else if (strcmp(driver, "scan") == 0)
+        {
+            failed |= run_driver(run_scan);
+        }
+        else if (strcmp(driver, "ipc") == 0)
+        {
+            failed |= run_driver(run_ipc);
+        }
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        ran++;
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
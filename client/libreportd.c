@@ -0,0 +1,599 @@
+/**
+ * @file libreportd.c
+ * @brief Client library for the daemon's control socket, with pipelining
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "libreportd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Structure collecting the reply for reportd_call()
+ */
+typedef struct {
+    int done;          /* Callback ran */
+    int replied;       /* The daemon answered, rather than the connection failing */
+    int status;        /* Its status */
+    char* text;        /* Caller's text buffer, may be NULL */
+    size_t text_size;  /* Size of text */
+} CallResult;
+
+/**
+ * Event names, indexed by the bit's position
+ */
+static const char* const event_names[] = {
+    "create", "modify", "delete", "transfer", "backup", "missing"
+};
+
+/**
+ * Get a monotonic clock reading in milliseconds
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000LL;
+}
+
+/**
+ * Milliseconds left before a deadline, for poll(); -1 means no deadline
+ */
+static int remaining_ms(long long deadline)
+{
+    long long left;
+
+    if (deadline < 0)
+    {
+        return -1;
+    }
+    left = deadline - now_ms();
+    return (left > 0) ? (int)left : 0;
+}
+
+/**
+ * Free the answered requests at the head of the ring
+ */
+static void retire_requests(ReportdClient* client)
+{
+    while (client->count > 0 && client->requests[client->first].answered)
+    {
+        client->first = (client->first + 1) % REPORTD_WINDOW;
+        client->count--;
+    }
+}
+
+/**
+ * Mark a request answered and hand the reply to its callback
+ */
+static void deliver(ReportdClient* client, ReportdRequest* request, int status, const char* text, const Frame* frame)
+{
+    ReportdReply reply;
+    ReportdCallback callback = request->callback;
+    void* context = request->context;
+
+    reply.request_id = request->request_id;
+    reply.type = request->type;
+    reply.status = status;
+    reply.text = text;
+    reply.frame = frame;
+
+    /* The slot is settled before the callback, which may submit more requests */
+    request->answered = TRUE;
+    frame_free(&request->frame);
+    client->outstanding--;
+
+    if (callback != NULL)
+    {
+        callback(&reply, context);
+    }
+}
+
+/**
+ * Answer every outstanding request with FAILURE and close the socket
+ */
+static void fail_requests(ReportdClient* client, const char* reason)
+{
+    int saved_errno = errno;
+    int n;
+
+    if (client->fd != -1)
+    {
+        close(client->fd);
+        client->fd = -1;
+    }
+    frame_reader_free(&client->reader);
+    client->unsent = 0;
+
+    for (n = 0; n < client->count; n++)
+    {
+        ReportdRequest* request = &client->requests[(client->first + n) % REPORTD_WINDOW];
+
+        if (!request->answered)
+        {
+            deliver(client, request, FAILURE, reason, NULL);
+        }
+    }
+    retire_requests(client);
+    errno = saved_errno;
+}
+
+/**
+ * Send queued requests until the socket is full
+ * @return SUCCESS unless the connection failed
+ */
+static int flush_requests(ReportdClient* client)
+{
+    while (client->unsent > 0)
+    {
+        int slot = (client->first + client->count - client->unsent) % REPORTD_WINDOW;
+        ReportdRequest* request = &client->requests[slot];
+
+        if (frame_send_resume(client->fd, &request->frame, TRUE, &request->sent) != SUCCESS)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? SUCCESS : FAILURE;
+        }
+
+        /* Only the ID is needed from here on; drop the buffer and any descriptor */
+        frame_free(&request->frame);
+        client->unsent--;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Hand a pushed event to the event callback
+ */
+static void dispatch_event(ReportdClient* client, const Frame* frame)
+{
+    char filename[MAX_LINE_LENGTH] = "";
+    char user[MAX_LINE_LENGTH] = "";
+    char text[MAX_LINE_LENGTH] = "";
+    int32_t event = 0;
+    int32_t status = SUCCESS;
+    ReportdEvent pushed;
+
+    if (client->event_callback == NULL)
+    {
+        return;
+    }
+
+    frame_get_i32(frame, FIELD_EVENT_TYPE, &event);
+    frame_get_i32(frame, FIELD_STATUS, &status);
+    frame_get_string(frame, FIELD_FILENAME, filename, sizeof(filename));
+    frame_get_string(frame, FIELD_USERNAME, user, sizeof(user));
+    frame_get_string(frame, FIELD_TEXT, text, sizeof(text));
+
+    pushed.event = event;
+    pushed.status = status;
+    pushed.filename = filename;
+    pushed.user = user;
+    pushed.text = text;
+    pushed.time = 0;
+    pushed.dropped = 0;
+    pushed.frame = frame;
+    frame_get_u64(frame, FIELD_EVENT_TIME, &pushed.time);
+    frame_get_u64(frame, FIELD_DROPPED, &pushed.dropped);
+
+    client->event_callback(&pushed, client->event_context);
+}
+
+/**
+ * Match a reply to its request and deliver it
+ */
+static void dispatch_reply(ReportdClient* client, const Frame* frame)
+{
+    char text[MAX_LINE_LENGTH] = "";
+    int32_t status = FAILURE;
+    int n;
+
+    if (frame->type == MSG_EVENT)
+    {
+        dispatch_event(client, frame);
+        return;
+    }
+
+    frame_get_i32(frame, FIELD_STATUS, &status);
+    frame_get_string(frame, FIELD_TEXT, text, sizeof(text));
+
+    for (n = 0; n < client->count - client->unsent; n++)
+    {
+        ReportdRequest* request = &client->requests[(client->first + n) % REPORTD_WINDOW];
+
+        if (!request->answered && request->request_id == frame->request_id)
+        {
+            deliver(client, request, status, text, frame);
+            return;
+        }
+    }
+
+    /* Not ours to answer, e.g. a request abandoned by a reused ID; ignore it */
+}
+
+/**
+ * Connect to the daemon
+ * @param client Connection to set up
+ * @param socket_path Control socket, NULL for REPORTD_SOCKET_PATH
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int reportd_connect(ReportdClient* client, const char* socket_path)
+{
+    struct sockaddr_un addr;
+    int saved_errno;
+
+    memset(client, 0, sizeof(*client));
+    client->next_request_id = 1;
+    frame_reader_init(&client->reader);
+
+    if (socket_path == NULL)
+    {
+        socket_path = REPORTD_SOCKET_PATH;
+    }
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        client->fd = -1;
+        errno = ENAMETOOLONG;
+        return FAILURE;
+    }
+
+    client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->fd == -1)
+    {
+        return FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    /* A local connect completes at once unless the daemon's backlog is full */
+    if (connect(client->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        saved_errno = errno;
+        close(client->fd);
+        client->fd = -1;
+        errno = saved_errno;
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Queue a request and send what the socket takes
+ * @param client Connection
+ * @param request Request frame, taken over by the library
+ * @param callback Called with the reply, may be NULL
+ * @param context Passed to callback
+ * @return SUCCESS if queued, FAILURE on error (errno set)
+ */
+int reportd_submit(ReportdClient* client, Frame* request, ReportdCallback callback, void* context)
+{
+    long long deadline = now_ms() + REPORTD_TIMEOUT_MS;
+    ReportdRequest* slot;
+
+    /* Make room by collecting replies to the oldest requests */
+    while (client->fd != -1 && client->count == REPORTD_WINDOW)
+    {
+        if (reportd_process(client, remaining_ms(deadline)) == FAILURE)
+        {
+            break;
+        }
+        retire_requests(client);
+        if (client->count == REPORTD_WINDOW && remaining_ms(deadline) == 0)
+        {
+            frame_free(request);
+            errno = ETIMEDOUT;
+            return FAILURE;
+        }
+    }
+
+    if (client->fd == -1)
+    {
+        frame_free(request);
+        errno = ENOTCONN;
+        return FAILURE;
+    }
+
+    slot = &client->requests[(client->first + client->count) % REPORTD_WINDOW];
+    memset(slot, 0, sizeof(*slot));
+    slot->request_id = client->next_request_id++;
+    if (client->next_request_id == 0)
+    {
+        client->next_request_id = 1;
+    }
+    slot->type = request->type;
+    slot->callback = callback;
+    slot->context = context;
+
+    frame_set_request_id(request, slot->request_id);
+    memcpy(&slot->frame, request, sizeof(slot->frame));
+    request->buffer = NULL;
+    request->length = 0;
+    request->capacity = 0;
+    request->passed_fd = -1;
+
+    client->count++;
+    client->unsent++;
+    client->outstanding++;
+
+    if (flush_requests(client) != SUCCESS)
+    {
+        fail_requests(client, strerror(errno));
+    }
+    return SUCCESS;
+}
+
+/**
+ * Send pending requests and deliver arrived replies
+ * @param client Connection
+ * @param timeout_ms Milliseconds to wait, 0 to only do what is ready, -1 forever
+ * @return Number of replies delivered, or FAILURE if the connection failed
+ */
+int reportd_process(ReportdClient* client, int timeout_ms)
+{
+    struct pollfd pfd;
+    Frame frame;
+    int delivered = 0;
+
+    if (client->fd == -1)
+    {
+        errno = ENOTCONN;
+        return FAILURE;
+    }
+
+    pfd.fd = client->fd;
+    pfd.events = reportd_events(client);
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR)
+    {
+        fail_requests(client, strerror(errno));
+        return FAILURE;
+    }
+
+    if (flush_requests(client) != SUCCESS)
+    {
+        fail_requests(client, strerror(errno));
+        return FAILURE;
+    }
+
+    for (;;)
+    {
+        if (frame_reader_read(&client->reader, client->fd, TRUE, &frame) != SUCCESS)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            fail_requests(client, errno == ECONNRESET ? "Connection closed by the daemon" : strerror(errno));
+            return FAILURE;
+        }
+
+        dispatch_reply(client, &frame);
+        frame_free(&frame);
+        delivered++;
+
+        /* A callback may have closed the connection */
+        if (client->fd == -1)
+        {
+            break;
+        }
+    }
+
+    retire_requests(client);
+    return delivered;
+}
+
+/**
+ * Process until every outstanding request is answered
+ * @param client Connection
+ * @param timeout_ms Milliseconds to wait in total, -1 forever
+ * @return SUCCESS when all are answered, FAILURE on error or timeout
+ */
+int reportd_wait(ReportdClient* client, int timeout_ms)
+{
+    long long deadline = (timeout_ms < 0) ? -1 : now_ms() + timeout_ms;
+
+    while (client->outstanding > 0)
+    {
+        if (deadline >= 0 && remaining_ms(deadline) == 0)
+        {
+            errno = ETIMEDOUT;
+            return FAILURE;
+        }
+        if (reportd_process(client, remaining_ms(deadline)) == FAILURE)
+        {
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Record the reply for reportd_call()
+ */
+static void call_done(const ReportdReply* reply, void* context)
+{
+    CallResult* result = (CallResult*)context;
+
+    result->done = TRUE;
+    result->replied = (reply->frame != NULL);
+    result->status = reply->status;
+    if (result->text != NULL)
+    {
+        snprintf(result->text, result->text_size, "%s", reply->text);
+    }
+}
+
+/**
+ * Send one request and wait for its reply
+ * @param client Connection
+ * @param request Request frame, taken over by the library
+ * @param status Receives the daemon's status
+ * @param text Receives the reply text (may be NULL)
+ * @param text_size Size of text
+ * @return SUCCESS if a reply arrived, FAILURE on error or timeout
+ */
+int reportd_call(ReportdClient* client, Frame* request, int* status, char* text, size_t text_size)
+{
+    long long deadline = now_ms() + REPORTD_TIMEOUT_MS;
+    CallResult result;
+
+    result.done = FALSE;
+    result.replied = FALSE;
+    result.status = FAILURE;
+    result.text = text;
+    result.text_size = text_size;
+
+    if (reportd_submit(client, request, call_done, &result) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    while (!result.done)
+    {
+        if (remaining_ms(deadline) == 0)
+        {
+            errno = ETIMEDOUT;
+            return FAILURE;
+        }
+        if (reportd_process(client, remaining_ms(deadline)) == FAILURE && !result.done)
+        {
+            return FAILURE;
+        }
+    }
+
+    if (!result.replied)
+    {
+        errno = ECONNRESET;
+        return FAILURE;
+    }
+
+    *status = result.status;
+    return SUCCESS;
+}
+
+/**
+ * Subscribe the connection to pushed events
+ * @param client Connection
+ * @param mask EVENT_* bits, 0 to unsubscribe
+ * @param filter Substring events must contain, NULL or "" for every event
+ * @param on_event Called with each event, may be NULL
+ * @param event_context Passed to on_event
+ * @param callback Called with the reply to the subscription, may be NULL
+ * @param context Passed to callback
+ * @return SUCCESS if queued, FAILURE on error (errno set)
+ */
+int reportd_subscribe(ReportdClient* client, uint32_t mask, const char* filter,
+                      ReportdEventCallback on_event, void* event_context,
+                      ReportdCallback callback, void* context)
+{
+    Frame request;
+
+    if (filter != NULL && strlen(filter) >= MAX_EVENT_FILTER)
+    {
+        errno = ENAMETOOLONG;
+        return FAILURE;
+    }
+
+    if (frame_init(&request, MSG_SUBSCRIBE, 0) != SUCCESS ||
+        frame_add_u64(&request, FIELD_EVENT_MASK, mask) != SUCCESS ||
+        (filter != NULL && filter[0] != '\0' && frame_add_string(&request, FIELD_FILTER, filter) != SUCCESS))
+    {
+        frame_free(&request);
+        return FAILURE;
+    }
+
+    /* Set before sending, so no event can arrive ahead of its handler */
+    client->event_callback = on_event;
+    client->event_context = event_context;
+    return reportd_submit(client, &request, callback, context);
+}
+
+/**
+ * Get the short name of an event type
+ * @param event EVENT_* bit
+ * @return Name, or "unknown"
+ */
+const char* reportd_event_name(int event)
+{
+    size_t n;
+
+    for (n = 0; n < sizeof(event_names) / sizeof(event_names[0]); n++)
+    {
+        if (event == (1 << n))
+        {
+            return event_names[n];
+        }
+    }
+    return "unknown";
+}
+
+/**
+ * Look up an event type by its short name, or "all"
+ * @param name Event name
+ * @return EVENT_* bits, 0 if the name is unknown
+ */
+uint32_t reportd_event_mask(const char* name)
+{
+    size_t n;
+
+    if (strcmp(name, "all") == 0)
+    {
+        return EVENT_ALL;
+    }
+    for (n = 0; n < sizeof(event_names) / sizeof(event_names[0]); n++)
+    {
+        if (strcmp(name, event_names[n]) == 0)
+        {
+            return 1U << n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get the number of requests still waiting for a reply
+ */
+int reportd_outstanding(const ReportdClient* client)
+{
+    return client->outstanding;
+}
+
+/**
+ * Get the connection's descriptor
+ * @return Descriptor, -1 when closed
+ */
+int reportd_fd(const ReportdClient* client)
+{
+    return client->fd;
+}
+
+/**
+ * Get the poll events the connection waits for
+ */
+short reportd_events(const ReportdClient* client)
+{
+    return (client->unsent > 0) ? (POLLIN | POLLOUT) : POLLIN;
+}
+
+/**
+ * Close the connection, answering outstanding requests with FAILURE
+ * @param client Connection
+ */
+void reportd_close(ReportdClient* client)
+{
+    fail_requests(client, "Connection closed");
+}
@@ -0,0 +1,811 @@
+/**
+ * @file reportctl.c
+ * @brief Command-line client for the report daemon, built on libreportd
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "libreportd.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Words in one batch command: enough for the largest urgent batch or patch */
+#define MAX_COMMAND_WORDS (2 + 2 * URGENT_BATCH_MAX_FILES)
+#define MAX_PATCH_WORDS   (5 + URGENT_PATCH_MAX_RANGES)
+
+/**
+ * Structure for one command on the connection
+ */
+typedef struct {
+    int line;                     /* Position in the batch, from 1 */
+    char name[32];                /* Command word */
+    int in_use;                   /* Waiting for its reply */
+} Job;
+
+/* Output options and outcome shared with the callbacks */
+static int json_output = FALSE;
+static int batch_mode = FALSE;
+static int failures = 0;
+
+/**
+ * Print usage
+ */
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [--json] [--instance NAME | --socket PATH] [--deadline MS] COMMAND [ARGS...]\n"
+            "       %s [--json] [--instance NAME | --socket PATH] [--deadline MS] --batch < commands\n"
+            "Commands:\n"
+            "  status\n"
+            "  backup | transfer\n"
+            "  cancel <command-id>\n"
+            "  log-level <error|warn|info|debug>\n"
+            "  io-limit <bytes/s> [ops/s]\n"
+            "  urgent-change <file> <user> <content | @path>\n"
+            "  urgent-batch <user> <file> <content | @path> [<file> <content | @path> ...]\n"
+            "  urgent-patch <file> <user> [--base HASH] <offset>:<delete>:<insert | @path> ...\n"
+            "  watch [--filter TEXT] [create|modify|delete|transfer|backup|missing|all ...]\n"
+            "With --batch, commands are read one per line and pipelined on one connection.\n"
+            "watch prints events as the daemon pushes them until interrupted.\n"
+            "The daemon is found from %s and %s unless --instance or --socket is given.\n",
+            program, program, ROOT_PREFIX_ENV, INSTANCE_ENV);
+}
+
+/**
+ * Parse a rate such as 500, 64K or 20M
+ * @return The rate, or -1 if invalid
+ */
+static long long parse_rate(const char *text)
+{
+    char *end;
+    long long value;
+
+    errno = 0;
+    value = strtoll(text, &end, 10);
+    if (errno != 0 || end == text || value < 0)
+    {
+        return -1;
+    }
+
+    switch (toupper((unsigned char)*end))
+    {
+    case 'K':
+        value *= 1024LL;
+        end++;
+        break;
+    case 'M':
+        value *= 1024LL * 1024LL;
+        end++;
+        break;
+    case 'G':
+        value *= 1024LL * 1024LL * 1024LL;
+        end++;
+        break;
+    default:
+        break;
+    }
+
+    return (*end == '\0') ? value : -1;
+}
+
+/**
+ * Parse a log level name or number
+ * @return LOG_LEVEL_* value, or -1 if invalid
+ */
+static int parse_level(const char *text)
+{
+    static const char *const names[] = {"error", "warn", "info", "debug"};
+    int level;
+
+    for (level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_DEBUG; level++)
+    {
+        if (strcasecmp(text, names[level]) == 0)
+        {
+            return level;
+        }
+    }
+    if (text[0] >= '0' && text[0] <= '3' && text[1] == '\0')
+    {
+        return text[0] - '0';
+    }
+    return -1;
+}
+
+/**
+ * Add a file's content to a request, reading it whole
+ * @param frame Request being built
+ * @param path File to read
+ * @return SUCCESS on success, FAILURE with a message on stderr
+ */
+static int add_file_content(Frame *frame, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    char *content;
+    long size;
+    int result = FAILURE;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return FAILURE;
+    }
+
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        content = malloc(size > 0 ? (size_t)size : 1);
+        if (content != NULL && fread(content, 1, (size_t)size, file) == (size_t)size)
+        {
+            result = frame_add(frame, FIELD_CONTENT, content, (size_t)size);
+        }
+        free(content);
+    }
+    if (result != SUCCESS)
+    {
+        fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+    }
+    fclose(file);
+    return result;
+}
+
+/**
+ * Add one offset:delete:insert range to an urgent patch request
+ * @param frame Request being built
+ * @param range Range as typed
+ * @return SUCCESS on success, FAILURE with a message on stderr
+ */
+static int add_patch_range(Frame *frame, const char *range)
+{
+    unsigned long long offset, delete_length;
+    char *end;
+    const char *insert;
+
+    errno = 0;
+    offset = strtoull(range, &end, 10);
+    if (errno != 0 || end == range || *end != ':')
+    {
+        fprintf(stderr, "Invalid patch range %s; use offset:delete:insert\n", range);
+        return FAILURE;
+    }
+    insert = end + 1;
+    delete_length = strtoull(insert, &end, 10);
+    if (errno != 0 || end == insert || *end != ':')
+    {
+        fprintf(stderr, "Invalid patch range %s; use offset:delete:insert\n", range);
+        return FAILURE;
+    }
+    insert = end + 1;
+
+    if (frame_add_u64(frame, FIELD_PATCH_OFFSET, offset) != SUCCESS ||
+        frame_add_u64(frame, FIELD_PATCH_DELETE, delete_length) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    if (insert[0] == '@')
+    {
+        return add_file_content(frame, insert + 1);
+    }
+    return frame_add_string(frame, FIELD_CONTENT, insert);
+}
+
+/**
+ * Build the request frame for a command
+ * @param words Command and arguments
+ * @param count Number of words
+ * @param deadline_ms Deadline to attach to queued commands, 0 for none
+ * @param frame Receives the request
+ * @return SUCCESS on success, FAILURE with a message on stderr
+ */
+static int build_request(char **words, int count, long deadline_ms, Frame *frame)
+{
+    const char *command = words[0];
+    int result = SUCCESS;
+    int queued = FALSE;
+
+    if (strcmp(command, "status") == 0 && count == 1)
+    {
+        result = frame_init(frame, MSG_STATUS, 0);
+    }
+    else if ((strcmp(command, "backup") == 0 || strcmp(command, "transfer") == 0) && count == 1)
+    {
+        result = frame_init(frame, strcmp(command, "backup") == 0 ? MSG_FORCE_BACKUP : MSG_FORCE_TRANSFER, 0);
+        queued = TRUE;
+    }
+    else if (strcmp(command, "cancel") == 0 && count == 2)
+    {
+        char *end;
+        unsigned long long id = strtoull(words[1], &end, 10);
+
+        if (*end != '\0' || id == 0 || id > UINT32_MAX)
+        {
+            fprintf(stderr, "Invalid command ID: %s\n", words[1]);
+            return FAILURE;
+        }
+        result = frame_init(frame, MSG_CANCEL_COMMAND, 0);
+        if (result == SUCCESS)
+        {
+            result = frame_add_u64(frame, FIELD_COMMAND_ID, id);
+        }
+    }
+    else if (strcmp(command, "log-level") == 0 && count == 2)
+    {
+        int level = parse_level(words[1]);
+
+        if (level < 0)
+        {
+            fprintf(stderr, "Invalid log level: %s\n", words[1]);
+            return FAILURE;
+        }
+        result = frame_init(frame, MSG_SET_LOG_LEVEL, 0);
+        if (result == SUCCESS)
+        {
+            result = frame_add_i32(frame, FIELD_LOG_LEVEL, level);
+        }
+    }
+    else if (strcmp(command, "io-limit") == 0 && (count == 2 || count == 3))
+    {
+        long long bandwidth = parse_rate(words[1]);
+        long long ops = (count == 3) ? parse_rate(words[2]) : 0;
+
+        if (bandwidth < 0 || ops < 0)
+        {
+            fprintf(stderr, "Invalid rate; use e.g. 20M for bytes/s, 0 for unlimited\n");
+            return FAILURE;
+        }
+        result = frame_init(frame, MSG_SET_IO_LIMITS, 0);
+        if (result == SUCCESS &&
+            (frame_add_u64(frame, FIELD_BANDWIDTH, (uint64_t)bandwidth) != SUCCESS ||
+             frame_add_u64(frame, FIELD_OPS, (uint64_t)ops) != SUCCESS))
+        {
+            result = FAILURE;
+        }
+    }
+    else if (strcmp(command, "urgent-change") == 0 && count == 4)
+    {
+        result = frame_init(frame, MSG_URGENT_CHANGE, 0);
+        if (result == SUCCESS &&
+            (frame_add_string(frame, FIELD_FILENAME, words[1]) != SUCCESS ||
+             frame_add_string(frame, FIELD_USERNAME, words[2]) != SUCCESS))
+        {
+            result = FAILURE;
+        }
+
+        /* @path hands the file over as a descriptor; anything else is the content itself */
+        if (result == SUCCESS && words[3][0] == '@')
+        {
+            frame->passed_fd = open(words[3] + 1, O_RDONLY | O_CLOEXEC);
+            if (frame->passed_fd == -1)
+            {
+                fprintf(stderr, "Cannot open %s: %s\n", words[3] + 1, strerror(errno));
+                frame_free(frame);
+                return FAILURE;
+            }
+        }
+        else if (result == SUCCESS)
+        {
+            result = frame_add_string(frame, FIELD_CONTENT, words[3]);
+        }
+        queued = TRUE;
+    }
+    else if (strcmp(command, "urgent-batch") == 0 && count >= 4 && count % 2 == 0 &&
+             (count - 2) / 2 <= URGENT_BATCH_MAX_FILES)
+    {
+        int w;
+
+        result = frame_init(frame, MSG_URGENT_BATCH, 0);
+        if (result == SUCCESS)
+        {
+            result = frame_add_string(frame, FIELD_USERNAME, words[1]);
+        }
+
+        /* Content travels inline here: one frame carries one descriptor at most */
+        for (w = 2; result == SUCCESS && w < count; w += 2)
+        {
+            result = frame_add_string(frame, FIELD_FILENAME, words[w]);
+            if (result == SUCCESS && words[w + 1][0] == '@')
+            {
+                if (add_file_content(frame, words[w + 1] + 1) != SUCCESS)
+                {
+                    frame_free(frame);
+                    return FAILURE;
+                }
+            }
+            else if (result == SUCCESS)
+            {
+                result = frame_add_string(frame, FIELD_CONTENT, words[w + 1]);
+            }
+        }
+        queued = TRUE;
+    }
+    else if (strcmp(command, "urgent-patch") == 0 && count >= 4 && count <= MAX_PATCH_WORDS)
+    {
+        int w = 3;
+
+        result = frame_init(frame, MSG_URGENT_PATCH, 0);
+        if (result == SUCCESS &&
+            (frame_add_string(frame, FIELD_FILENAME, words[1]) != SUCCESS ||
+             frame_add_string(frame, FIELD_USERNAME, words[2]) != SUCCESS))
+        {
+            result = FAILURE;
+        }
+
+        if (result == SUCCESS && strcmp(words[w], "--base") == 0 && w + 1 < count)
+        {
+            char *end;
+            unsigned long long base = strtoull(words[w + 1], &end, 16);
+
+            if (*end != '\0' || end == words[w + 1])
+            {
+                fprintf(stderr, "Invalid base hash: %s\n", words[w + 1]);
+                frame_free(frame);
+                return FAILURE;
+            }
+            result = frame_add_u64(frame, FIELD_BASE_HASH, base);
+            w += 2;
+        }
+        if (result == SUCCESS && w == count)
+        {
+            fprintf(stderr, "urgent-patch needs at least one range\n");
+            frame_free(frame);
+            return FAILURE;
+        }
+
+        for (; result == SUCCESS && w < count; w++)
+        {
+            if (add_patch_range(frame, words[w]) != SUCCESS)
+            {
+                frame_free(frame);
+                return FAILURE;
+            }
+        }
+        queued = TRUE;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown command or wrong arguments: %s\n", command);
+        return FAILURE;
+    }
+
+    if (result == SUCCESS && queued && deadline_ms > 0)
+    {
+        result = frame_add_u64(frame, FIELD_DEADLINE, (uint64_t)deadline_ms);
+    }
+
+    if (result != SUCCESS)
+    {
+        fprintf(stderr, "Failed to build the %s request: %s\n", command, strerror(errno));
+        frame_free(frame);
+    }
+    return result;
+}
+
+/**
+ * Print a string as a JSON string literal
+ */
+static void print_json_string(const char *text, size_t length)
+{
+    size_t i;
+
+    putchar('"');
+    for (i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+
+        if (c == '"' || c == '\\')
+        {
+            printf("\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            printf("\\u%04x", c);
+        }
+        else
+        {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/**
+ * Print the key=value words of a status reply as JSON members
+ */
+static void print_json_fields(const char *text)
+{
+    const char *p = text;
+    int first = TRUE;
+
+    putchar('{');
+    while (*p != '\0')
+    {
+        const char *word, *equals, *end, *value_end;
+        char *number_end;
+
+        while (*p == ' ' || *p == '(' || *p == ')')
+        {
+            p++;
+        }
+        word = p;
+        while (*p != '\0' && *p != ' ' && *p != ')')
+        {
+            p++;
+        }
+        end = p;
+        equals = memchr(word, '=', end - word);
+        if (equals == NULL || equals == word)
+        {
+            continue;
+        }
+
+        if (!first)
+        {
+            putchar(',');
+        }
+        first = FALSE;
+        print_json_string(word, equals - word);
+        putchar(':');
+
+        /* Numbers stay numbers; everything else becomes a string */
+        strtod(equals + 1, &number_end);
+        value_end = end;
+        if (number_end == value_end && value_end > equals + 1 &&
+            (isdigit((unsigned char)equals[1]) || equals[1] == '-'))
+        {
+            fwrite(equals + 1, 1, value_end - equals - 1, stdout);
+        }
+        else
+        {
+            print_json_string(equals + 1, value_end - equals - 1);
+        }
+    }
+    putchar('}');
+}
+
+/**
+ * Print a reply as it arrives
+ */
+static void print_reply(const ReportdReply *reply, void *context)
+{
+    Job *job = (Job *)context;
+    int ok = (reply->status == SUCCESS);
+
+    job->in_use = FALSE;
+    if (!ok)
+    {
+        failures++;
+    }
+
+    if (json_output)
+    {
+        printf("{\"line\":%d,\"command\":", job->line);
+        print_json_string(job->name, strlen(job->name));
+        printf(",\"request_id\":%u,\"ok\":%s,\"replied\":%s,\"status\":%d,\"text\":",
+               reply->request_id, ok ? "true" : "false", reply->frame != NULL ? "true" : "false", reply->status);
+        print_json_string(reply->text, strlen(reply->text));
+        if (ok && reply->type == MSG_STATUS)
+        {
+            printf(",\"fields\":");
+            print_json_fields(reply->text);
+        }
+        printf("}\n");
+    }
+    else if (batch_mode)
+    {
+        printf("[%d] %s: %s%s\n", job->line, job->name, ok ? "" : "FAILED: ", reply->text);
+    }
+    else if (ok)
+    {
+        printf("%s\n", reply->text);
+    }
+    else
+    {
+        fprintf(stderr, "%s failed: %s\n", job->name, reply->text);
+    }
+    fflush(stdout);
+}
+
+/**
+ * Print a pushed event
+ */
+static void print_event(const ReportdEvent *event, void *context)
+{
+    unsigned long long *reported_dropped = (unsigned long long *)context;
+
+    if (json_output)
+    {
+        printf("{\"event\":\"%s\",\"ok\":%s,\"time\":%llu,\"file\":",
+               reportd_event_name(event->event), event->status == SUCCESS ? "true" : "false",
+               (unsigned long long)event->time);
+        print_json_string(event->filename, strlen(event->filename));
+        printf(",\"user\":");
+        print_json_string(event->user, strlen(event->user));
+        printf(",\"text\":");
+        print_json_string(event->text, strlen(event->text));
+        printf(",\"dropped\":%llu}\n", (unsigned long long)event->dropped);
+    }
+    else
+    {
+        char when[32];
+        time_t seconds = (time_t)event->time;
+        struct tm tm_event;
+
+        if (event->dropped > *reported_dropped)
+        {
+            printf("(%llu events dropped: this watcher fell behind)\n",
+                   (unsigned long long)event->dropped - *reported_dropped);
+        }
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm_event));
+        printf("%s %-8s %s%s%s%s%s%s%s\n", when, reportd_event_name(event->event),
+               event->status == SUCCESS ? "" : "FAILED ",
+               event->filename,
+               event->user[0] != '\0' ? " by " : "", event->user,
+               event->filename[0] != '\0' && event->text[0] != '\0' ? " (" : "", event->text,
+               event->filename[0] != '\0' && event->text[0] != '\0' ? ")" : "");
+    }
+    *reported_dropped = event->dropped;
+    fflush(stdout);
+}
+
+/**
+ * Report a refused subscription
+ */
+static void watch_subscribed(const ReportdReply *reply, void *context)
+{
+    (void)context;
+
+    if (reply->status != SUCCESS)
+    {
+        fprintf(stderr, "watch failed: %s\n", reply->text);
+        failures++;
+    }
+}
+
+/**
+ * Subscribe to events and print them until the connection ends
+ * @param words "watch" and its arguments
+ * @param count Number of words
+ * @return SUCCESS if the subscription was made, FAILURE otherwise
+ */
+static int run_watch(ReportdClient *client, char **words, int count)
+{
+    static unsigned long long reported_dropped = 0;
+    const char *filter = NULL;
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 1; i < count; i++)
+    {
+        uint32_t bits;
+
+        if (strcmp(words[i], "--filter") == 0 && i + 1 < count)
+        {
+            filter = words[++i];
+            continue;
+        }
+        bits = reportd_event_mask(words[i]);
+        if (bits == 0)
+        {
+            fprintf(stderr, "Unknown event type: %s\n", words[i]);
+            return FAILURE;
+        }
+        mask |= bits;
+    }
+    if (mask == 0)
+    {
+        mask = EVENT_ALL;
+    }
+
+    if (reportd_subscribe(client, mask, filter, print_event, &reported_dropped,
+                          watch_subscribed, NULL) != SUCCESS)
+    {
+        fprintf(stderr, "Cannot subscribe: %s\n", strerror(errno));
+        return FAILURE;
+    }
+
+    /* The daemon closing the connection is the only way out besides a signal */
+    while (failures == 0 && reportd_process(client, -1) != FAILURE)
+    {
+    }
+    if (failures == 0)
+    {
+        fprintf(stderr, "Connection to the daemon lost: %s\n", strerror(errno));
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Queue one command on the connection
+ * @return SUCCESS if it was sent, FAILURE otherwise
+ */
+static int submit_command(ReportdClient *client, char **words, int count, long deadline_ms, Job *job)
+{
+    Frame request;
+
+    snprintf(job->name, sizeof(job->name), "%s", words[0]);
+    if (build_request(words, count, deadline_ms, &request) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    job->in_use = TRUE;
+    if (reportd_submit(client, &request, print_reply, job) != SUCCESS)
+    {
+        job->in_use = FALSE;
+        fprintf(stderr, "Cannot send %s: %s\n", words[0], strerror(errno));
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Wait for every reply, giving up once none has come for REPORTD_TIMEOUT_MS
+ * @return SUCCESS when all are answered, FAILURE otherwise
+ */
+static int wait_for_replies(ReportdClient *client)
+{
+    time_t last_reply = time(NULL);
+
+    while (reportd_outstanding(client) > 0)
+    {
+        int delivered = reportd_process(client, REPORTD_TIMEOUT_MS);
+
+        if (delivered == FAILURE)
+        {
+            return FAILURE;
+        }
+        if (delivered > 0)
+        {
+            last_reply = time(NULL);
+        }
+        else if (time(NULL) - last_reply >= REPORTD_TIMEOUT_MS / 1000)
+        {
+            fprintf(stderr, "No reply from the daemon for %d ms\n", REPORTD_TIMEOUT_MS);
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Pipeline the commands read from standard input, one per line
+ * @return Number of commands that could not be sent or answered
+ */
+static int run_batch(ReportdClient *client, long deadline_ms)
+{
+    /* One more job than the window, so a free one exists whenever the library takes a request */
+    static Job jobs[REPORTD_WINDOW + 1];
+    char line[MAX_LINE_LENGTH];
+    int line_number = 0;
+    int errors = 0;
+
+    while (fgets(line, sizeof(line), stdin) != NULL)
+    {
+        char *words[MAX_COMMAND_WORDS];
+        char *saveptr;
+        char *word;
+        int count = 0;
+        int j;
+
+        line_number++;
+        for (word = strtok_r(line, " \t\r\n", &saveptr); word != NULL && count < MAX_COMMAND_WORDS;
+             word = strtok_r(NULL, " \t\r\n", &saveptr))
+        {
+            words[count++] = word;
+        }
+        if (count == 0 || words[0][0] == '#')
+        {
+            continue;
+        }
+
+        for (j = 0; jobs[j].in_use; j++)
+        {
+        }
+
+        jobs[j].line = line_number;
+        if (submit_command(client, words, count, deadline_ms, &jobs[j]) != SUCCESS)
+        {
+            errors++;
+            if (reportd_fd(client) == -1)
+            {
+                break;
+            }
+        }
+    }
+
+    if (wait_for_replies(client) != SUCCESS)
+    {
+        errors++;
+    }
+    return errors;
+}
+
+/**
+ * Main entry point
+ */
+int main(int argc, char *argv[])
+{
+    const char *socket_path = NULL;
+    long deadline_ms = 0;
+    ReportdClient client;
+    Job job;
+    int errors = 0;
+    int i = 1;
+
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+        {
+            json_output = TRUE;
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch_mode = TRUE;
+        }
+        else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+        {
+            socket_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--instance") == 0 && i + 1 < argc)
+        {
+            if (init_paths(getenv(ROOT_PREFIX_ENV), argv[++i]) != SUCCESS)
+            {
+                fprintf(stderr, "Invalid instance name: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc)
+        {
+            deadline_ms = atol(argv[++i]);
+        }
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (batch_mode == (i < argc))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (reportd_connect(&client, socket_path) != SUCCESS)
+    {
+        fprintf(stderr, "Cannot reach the daemon at %s: %s\n",
+                socket_path != NULL ? socket_path : REPORTD_SOCKET_PATH, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (batch_mode)
+    {
+        errors = run_batch(&client, deadline_ms);
+    }
+    else if (strcmp(argv[i], "watch") == 0)
+    {
+        if (run_watch(&client, argv + i, argc - i) != SUCCESS)
+        {
+            errors++;
+        }
+    }
+    else
+    {
+        job.line = 1;
+        if (submit_command(&client, argv + i, argc - i, deadline_ms, &job) != SUCCESS ||
+            wait_for_replies(&client) != SUCCESS)
+        {
+            errors++;
+        }
+    }
+
+    reportd_close(&client);
+    return (errors == 0 && failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
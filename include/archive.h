@@ -0,0 +1,92 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Archive layout, written in one sequential pass (each member header is
+ * filled in once its data has been streamed):
+ *
+ *   "RPTARCH1"
+ *   member*    header (ARCHIVE_MEMBER_MAGIC, fields, name) + data
+ *   index      one record per member, same fields plus member offset
+ *   trailer    index offset (8), member count (4), reserved (4), "RPTINDX1"
+ *
+ * All integers are little-endian. The trailing index lets a single member
+ * be extracted with two preads, without reading the rest of the archive.
+ */
+#define ARCHIVE_SUFFIX        ".archive"
+#define ARCHIVE_MAGIC         "RPTARCH1"
+#define ARCHIVE_INDEX_MAGIC   "RPTINDX1"
+#define ARCHIVE_MEMBER_MAGIC  0x424d4552u /* "REMB" */
+#define ARCHIVE_TRAILER_SIZE  24
+#define ARCHIVE_NAME_LENGTH   256
+
+/* Per-member compression */
+#define ARCHIVE_STORED 0  /* Data kept as is (fitted one read and did not shrink) */
+#define ARCHIVE_GZIP   1  /* gzip stream */
+
+/**
+ * Structure describing one archive member, as recorded in the index
+ */
+typedef struct {
+    char name[ARCHIVE_NAME_LENGTH]; /* File name */
+    uint64_t offset;                /* Offset of the member header */
+    uint64_t data_offset;           /* Offset of the member data */
+    uint64_t size;                  /* Uncompressed size */
+    uint64_t compressed_size;       /* Stored size */
+    int64_t mtime;                  /* Source modification time */
+    uint32_t mode;                  /* Source permission bits */
+    uint64_t hash;                  /* XXH64 of the uncompressed data */
+    int compression;                /* ARCHIVE_STORED or ARCHIVE_GZIP */
+} ArchiveEntry;
+
+/**
+ * Structure holding the index of an archive
+ */
+typedef struct {
+    ArchiveEntry* entries; /* Members in archive order */
+    uint32_t count;        /* Number of members */
+} ArchiveIndex;
+
+/**
+ * Write every file in a directory into a new compressed archive
+ * @param source_dir Directory to archive
+ * @param archive_path Path of the archive to create
+ * @return SUCCESS on success, FAILURE on error
+ */
+int archive_backup(const char* source_dir, const char* archive_path);
+
+/**
+ * Read the trailing index of an archive
+ * @param archive_path Path to the archive
+ * @param index Receives the index
+ * @return SUCCESS on success, FAILURE on error
+ */
+int load_archive_index(const char* archive_path, ArchiveIndex* index);
+
+/**
+ * Look up a member by name
+ * @param index Archive index
+ * @param name File name
+ * @return Pointer to the entry or NULL if not present
+ */
+const ArchiveEntry* find_archive_entry(const ArchiveIndex* index, const char* name);
+
+/**
+ * Extract one member into an open file, verifying its hash
+ * @param archive_path Path to the archive
+ * @param entry Member to extract (from the archive's index)
+ * @param out_fd File descriptor to write the data to
+ * @return SUCCESS on success, FAILURE on error
+ */
+int archive_extract_entry(const char* archive_path, const ArchiveEntry* entry, int out_fd);
+
+/**
+ * Free memory held by an archive index
+ * @param index Index to free
+ */
+void free_archive_index(ArchiveIndex* index);
+
+#endif /* ARCHIVE_H */
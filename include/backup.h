@@ -3,13 +3,18 @@
 
 #include <sys/stat.h>
 #include <dirent.h>
+#include "paths.h"
 
 /* Predefined constants from the original header */
-#define BACKUP_DIR     "/var/company/backup"
-#define UPLOAD_DIR     "/var/company/upload"
-#define DASHBOARD_DIR  "/var/company/reporting"
-#define LOG_DIR       "/var/log"
-#define LOCK_FILE      "/var/run/company_daemon.lock"
+#define BACKUP_DIR     (get_daemon_paths()->backup_dir)
+#define UPLOAD_DIR     (get_daemon_paths()->upload_dir)
+#define DASHBOARD_DIR  (get_daemon_paths()->dashboard_dir)
+#define LOG_DIR       LOG_ROOT
+#define LOCK_FILE      (get_daemon_paths()->lock_file)
+
+/* Waiting for the directory lock */
+#define LOCK_WAIT_TIMEOUT_MS   5000  /* create_lock_file() gives up after this */
+#define LOCK_RETRY_INTERVAL_MS 10    /* Pause between attempts */
 
 /* Permission settings */
 #define UPLOAD_PERMISSIONS    0777
@@ -19,6 +24,24 @@
 #define MAX_BACKUP_AGE (7 * 24 * 60 * 60)  /* 7 days in seconds */
 #define MAX_BACKUPS 10 /* Maximum number of backups to keep */
 
+/* Point-in-time views of the dashboard, taken beside it on the same filesystem */
+#define DASHBOARD_VIEW_DIR    COMPANY_ROOT
+#define DASHBOARD_VIEW_PREFIX ".dashboard_view."
+
+/* Snapshot directories are named backup_YYYY-MM-DD_HH-MM-SS */
+#define SNAPSHOT_PREFIX "backup_"
+
+/* Backup backends */
+#define BACKUP_MODE_SNAPSHOT 0  /* Hard-linked snapshot directories */
+#define BACKUP_MODE_CHUNKED  1  /* Deduplicating chunk store + manifests */
+#define BACKUP_MODE_ARCHIVE  2  /* One compressed archive file per backup */
+#define BACKUP_MODE_ENV "COMPANY_DAEMON_BACKUP_MODE" /* Environment override */
+
+/* How lock_directories() keeps transfers consistent */
+#define LOCK_MODE_DIRECTORY 0  /* chmod both directories to LOCKED_PERMISSIONS */
+#define LOCK_MODE_FILE      1  /* Lease each upload while it is validated and renamed */
+#define LOCK_MODE_ENV "COMPANY_DAEMON_LOCK_MODE" /* Environment override */
+
 /* Return codes */
 #define SUCCESS 0
 #define FAILURE -1
@@ -28,13 +51,84 @@
 #define FALSE 0
 
 /**
- * Backup the dashboard directory
+ * Backup the dashboard directory from a point-in-time view of it, so that
+ * transfers running at the same time cannot leave the backup half-updated
  * @return SUCCESS on success, FAILURE on error
  */
 int backup_dashboard(void);
 
 /**
- * Lock directories during backup/transfer operations
+ * Take a point-in-time view of the dashboard: a hidden directory beside it
+ * holding a reflink or hard link of every report
+ * @param path Buffer to receive the view's path
+ * @param path_size Size of the buffer
+ * @return SUCCESS on success, FAILURE on error
+ */
+int create_dashboard_view(char* path, size_t path_size);
+
+/**
+ * Hand a dashboard view to the next backup_dashboard() call, which backs
+ * it up and then deletes it
+ * @param path View created by create_dashboard_view(), or NULL to clear
+ */
+void set_backup_source(const char* path);
+
+/**
+ * Remove dashboard views left behind by a backup that did not finish
+ */
+void remove_stale_dashboard_views(void);
+
+/**
+ * Select the backup backend used by backup_dashboard()
+ * @param mode One of the BACKUP_MODE_* values
+ */
+void set_backup_mode(int mode);
+
+/**
+ * Get the backup backend used by backup_dashboard()
+ * @return Current BACKUP_MODE_* value
+ */
+int get_backup_mode(void);
+
+/**
+ * Parse a backup mode name ("snapshot", "chunked", "archive")
+ * @param name Mode name
+ * @return BACKUP_MODE_* value, or -1 if the name is not recognised
+ */
+int parse_backup_mode(const char* name);
+
+/**
+ * Find the most recent snapshot directory in BACKUP_DIR
+ * @param path Buffer to receive the snapshot path
+ * @param path_size Size of the buffer
+ * @param exclude Snapshot path to ignore (may be NULL)
+ * @return SUCCESS if a snapshot was found, FAILURE otherwise
+ */
+int find_latest_snapshot(char* path, size_t path_size, const char* exclude);
+
+/**
+ * Select how lock_directories() protects transfers
+ * @param mode One of the LOCK_MODE_* values
+ */
+void set_lock_mode(int mode);
+
+/**
+ * Get how lock_directories() protects transfers
+ * @return Current LOCK_MODE_* value
+ */
+int get_lock_mode(void);
+
+/**
+ * Parse a lock mode name ("directory", "file")
+ * @param name Mode name
+ * @return LOCK_MODE_* value, or -1 if the name is not recognised
+ */
+int parse_lock_mode(const char* name);
+
+/**
+ * Lock directories during backup/transfer operations. In LOCK_MODE_FILE
+ * only the lock file is taken; transfer_reports() then leases each upload
+ * it moves, so other uploads and dashboard reads carry on.
  * @return SUCCESS on success, FAILURE on error
  */
 int lock_directories(void);
@@ -74,21 +168,37 @@ int is_directory_empty(const char* path);
 int cleanup_old_backups(void);
 
 /**
- * Create a lock file to prevent race conditions in directory locking
+ * Take the directory lock, waiting up to timeout_ms for the current holder.
+ * The lock is an OFD write lock on LOCK_FILE, so the kernel drops it when
+ * the holder exits or crashes and no stale lock can outlive a process.
+ * @param timeout_ms Milliseconds to keep retrying; 0 tries once
+ * @return SUCCESS on success, FAILURE on error or timeout
+ */
+int try_lock_file(int timeout_ms);
+
+/**
+ * Take the directory lock, waiting up to LOCK_WAIT_TIMEOUT_MS
  * @return SUCCESS on success, FAILURE on error
  */
 int create_lock_file(void);
 
 /**
- * Remove the lock file
+ * Release the directory lock
  * @return SUCCESS on success, FAILURE on error
  */
 int remove_lock_file(void);
 
 /**
- * Check if the directories are locked
+ * Check if the directories are locked, by this or any other process
  * @return TRUE if locked, FALSE if not
  */
 int are_directories_locked(void);
 
+/**
+ * Undo a directory lock whose holder died: if nobody holds the lock but
+ * a directory is still at LOCKED_PERMISSIONS, restore its permissions
+ * @return SUCCESS on success, FAILURE on error
+ */
+int recover_directory_locks(void);
+
 #endif /* BACKUP_H */
\ No newline at end of file
@@ -0,0 +1,114 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "hash.h"
+#include "manifest.h"
+
+/* Chunk store layout: BACKUP_DIR/chunks/<first two hex digits>/<sha256 hex> */
+#define CHUNK_STORE_NAME       "chunks"
+#define CHUNK_MANIFEST_SUFFIX  ".chunks"
+#define CHUNK_MANIFEST_HEADER  "# company_daemon chunk manifest v2"
+#define CHUNK_MANIFEST_HEADER_V1 "# company_daemon chunk manifest v1" /* No file hash or mode */
+
+/* Content-defined chunking parameters */
+#define CHUNK_MIN_SIZE  (2 * 1024)   /* No boundary before this many bytes */
+#define CHUNK_AVG_BITS  13           /* 2^13 = 8 KiB average chunk */
+#define CHUNK_MAX_SIZE  (64 * 1024)  /* Forced boundary */
+
+/* Chunks younger than this are never collected; a backup that
+ * deduplicates against a chunk refreshes its mtime */
+#define CHUNK_GC_GRACE  (60 * 60)
+
+/**
+ * Structure describing one chunk of a file
+ */
+typedef struct {
+    unsigned char digest[SHA256_DIGEST_LENGTH]; /* SHA-256 naming the chunk */
+    size_t length;                              /* Chunk length */
+} ChunkRef;
+
+/**
+ * Structure describing one file recorded in a chunk manifest
+ */
+typedef struct {
+    char name[MANIFEST_NAME_LENGTH]; /* File name */
+    long long size;                  /* Size of the file */
+    long long mtime;                 /* Source modification time */
+    uint64_t hash;                   /* Whole-file content hash (see hash.h) */
+    int has_hash;                    /* FALSE for v1 manifests, which carry none */
+    unsigned int mode;               /* Permission bits, 0 if not recorded */
+    size_t first_chunk;              /* Index of its first chunk in the manifest */
+    int chunk_count;                 /* Number of chunks */
+} ChunkFile;
+
+/**
+ * Structure holding a loaded chunk manifest
+ */
+typedef struct {
+    ChunkFile* files;   /* Files in manifest order */
+    int count;          /* Number of files */
+    ChunkRef* chunks;   /* Chunks of every file, in order */
+    size_t chunk_count; /* Number of chunks */
+    time_t created;     /* Snapshot start time */
+} ChunkManifest;
+
+/**
+ * Back up every file in a directory into the chunk store and write a
+ * snapshot manifest listing each file's chunks
+ * @param source_dir Directory to back up
+ * @param manifest_path Path of the snapshot manifest to create
+ * @param created Snapshot start time
+ * @return SUCCESS on success, FAILURE on error
+ */
+int chunk_store_backup(const char* source_dir, const char* manifest_path, time_t created);
+
+/**
+ * Delete chunks no longer referenced by any snapshot manifest. Skipped
+ * while a chunked backup holds the store.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int chunk_store_gc(void);
+
+/**
+ * Load a chunk manifest
+ * @param manifest_path Path to the manifest
+ * @param manifest Receives the manifest
+ * @return SUCCESS on success, FAILURE if it cannot be read or is malformed
+ */
+int load_chunk_manifest(const char* manifest_path, ChunkManifest* manifest);
+
+/**
+ * Look up a file in a chunk manifest
+ * @param manifest Loaded manifest
+ * @param name File name
+ * @return Pointer to the file or NULL if not present
+ */
+const ChunkFile* find_chunk_file(const ChunkManifest* manifest, const char* name);
+
+/**
+ * Rebuild a file from its chunks into an open file, checking every chunk's
+ * SHA-256 and the whole file's size and hash
+ * @param manifest Manifest the file belongs to
+ * @param file File to rebuild
+ * @param out_fd File descriptor to write the data to
+ * @return SUCCESS on success, FAILURE on error or mismatch
+ */
+int chunk_store_extract(const ChunkManifest* manifest, const ChunkFile* file, int out_fd);
+
+/**
+ * Free memory held by a chunk manifest
+ * @param manifest Manifest to free
+ */
+void free_chunk_manifest(ChunkManifest* manifest);
+
+/**
+ * Write a deduplication report (logical vs stored bytes) for the chunk store
+ * @param out Stream to write the report to
+ * @return SUCCESS on success, FAILURE on error
+ */
+int chunk_store_report(FILE* out);
+
+#endif /* CHUNK_STORE_H */
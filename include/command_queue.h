@@ -0,0 +1,142 @@
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "ipc.h"
+
+/* Command kinds, in priority order: lower values run first */
+#define CMD_URGENT_CHANGE 0
+#define CMD_TRANSFER      1
+#define CMD_BACKUP        2
+#define CMD_HOUSEKEEPING  3
+#define CMD_KINDS         4
+
+/* Commands waiting at once; further requests are refused */
+#define COMMAND_QUEUE_SIZE 64
+
+/* Request bytes waiting commands may hold between them, so 64 urgent
+ * changes cannot each pin a frame of up to MAX_FRAME_SIZE */
+#define COMMAND_QUEUE_MAX_BYTES (64 * 1024 * 1024)
+
+/* Default time a command may wait before it is dropped, 0 = no limit */
+#define URGENT_CHANGE_DEADLINE_MS 60000
+#define TRANSFER_DEADLINE_MS      0
+#define BACKUP_DEADLINE_MS        0
+#define HOUSEKEEPING_DEADLINE_MS  5000
+
+/* Room for a coalescing key, e.g. a dashboard file name */
+#define COMMAND_KEY_LENGTH 256
+
+/**
+ * Structure for a queued command
+ */
+typedef struct {
+    uint32_t id;                     /* Queue-assigned, for cancellation */
+    int kind;                        /* CMD_* kind */
+    char key[COMMAND_KEY_LENGTH];    /* Coalescing key, "" when the kind runs once at a time */
+    double enqueued_ms;              /* Monotonic time the first request arrived */
+    double deadline_ms;              /* Monotonic time it is dropped if not started, 0 = never */
+    int merged;                      /* Later requests folded into this one */
+    int has_request;                 /* TRUE if request is held for a reply */
+    ControlRequest request;          /* Originating request, answered when the command ends */
+} Command;
+
+/**
+ * Structure for queue statistics
+ */
+typedef struct {
+    int depth;                                    /* Commands waiting */
+    int depth_by_kind[CMD_KINDS];                 /* Commands waiting, per kind */
+    int max_depth;                                /* Deepest the queue has been */
+    size_t bytes;                                 /* Request bytes held by waiting commands */
+    double oldest_wait_ms;                        /* Age of the longest waiting command */
+    unsigned long long queued;                    /* Commands accepted */
+    unsigned long long merged;                    /* Requests folded into a pending command */
+    unsigned long long rejected;                  /* Requests refused because the queue was full */
+    unsigned long long expired;                   /* Commands dropped at their deadline */
+    unsigned long long cancelled;                 /* Commands cancelled or superseded */
+    unsigned long long started[CMD_KINDS];        /* Commands started, per kind */
+    double wait_ms_total[CMD_KINDS];              /* Queue wait of started commands, per kind */
+    double wait_ms_max[CMD_KINDS];                /* Longest queue wait, per kind */
+} CommandQueueStats;
+
+/**
+ * Get the name of a command kind
+ * @param kind CMD_* kind
+ * @return Static name string
+ */
+const char* command_kind_name(int kind);
+
+/**
+ * Queue a command. A pending command of the same kind and key absorbs
+ * it: without a request the two simply merge, keeping the more lenient
+ * deadline; with a request the newer one takes over the pending slot
+ * and its place in line, and the request it displaced is handed back
+ * for the caller to answer.
+ * @param kind CMD_* kind
+ * @param key Coalescing key, "" or NULL for none
+ * @param deadline_ms Milliseconds it may wait, 0 for no limit
+ * @param request Request to hold until the command ends, or NULL; the
+ *                queue takes it over on success
+ * @param replaced Receives the displaced command, if any
+ * @param was_replaced Set to TRUE if replaced was filled in
+ * @return Command ID, or 0 when the queue is full or the request would
+ *         take it past COMMAND_QUEUE_MAX_BYTES
+ */
+uint32_t command_queue_push(int kind, const char* key, long deadline_ms, ControlRequest* request,
+                            Command* replaced, int* was_replaced);
+
+/**
+ * Take the highest-priority command whose kind may start, oldest first
+ * within a priority
+ * @param runnable Mask of kinds (1 << CMD_*) that may start now
+ * @param command Receives the command; its request now belongs to the caller
+ * @return SUCCESS if a command was taken, FAILURE if none is runnable
+ */
+int command_queue_pop(unsigned int runnable, Command* command);
+
+/**
+ * Remove one command that has passed its deadline
+ * @param command Receives the expired command for the caller to answer
+ * @return SUCCESS if one was removed, FAILURE if none has expired
+ */
+int command_queue_expire(Command* command);
+
+/**
+ * Cancel a waiting command; one that has started cannot be cancelled
+ * @param id Command ID
+ * @param command Receives the cancelled command for the caller to answer
+ * @return SUCCESS if it was cancelled, FAILURE if it is not waiting
+ */
+int command_queue_cancel(uint32_t id, Command* command);
+
+/**
+ * Drop the waiting commands of a kind that something else has just
+ * satisfied, counting them as merged. Commands holding a request are
+ * left in place.
+ * @param kind CMD_* kind
+ * @return Number of commands dropped
+ */
+int command_queue_absorb(int kind);
+
+/**
+ * Get a snapshot of the queue statistics
+ * @param stats Receives the statistics
+ */
+void command_queue_stats(CommandQueueStats* stats);
+
+/**
+ * Summarize the queue on one line, for status replies
+ * @param buffer Destination
+ * @param size Size of buffer
+ */
+void format_queue_summary(char* buffer, size_t size);
+
+/**
+ * Write the queue statistics in Prometheus text format
+ * @param out Destination stream
+ */
+void write_command_queue_metrics(FILE* out);
+
+#endif /* COMMAND_QUEUE_H */
@@ -0,0 +1,54 @@
+#ifndef COPY_POOL_H
+#define COPY_POOL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "file_operations.h"
+
+/* Worker pool sizing */
+#define COPY_POOL_WORKERS       8   /* Threads copying at once */
+#define COPY_DEVICE_CONCURRENCY 4   /* Copies in flight per backing device */
+#define COPY_POOL_MAX_DEVICES   16  /* Devices tracked; others are unlimited */
+
+/**
+ * Structure describing one file copy handed to the pool
+ */
+typedef struct {
+    char source[MAX_PATH_LENGTH];      /* Source file path */
+    char destination[MAX_PATH_LENGTH]; /* Destination file path */
+    long long size;                    /* Source size, larger files start first */
+    dev_t source_device;               /* st_dev of the source */
+    dev_t destination_device;          /* st_dev of the destination directory */
+    uint64_t hash;                     /* Content hash, set by the worker */
+    int result;                        /* SUCCESS or FAILURE, set by the worker */
+    double latency;                    /* Seconds taken by the copy */
+} CopyJob;
+
+/**
+ * Structure summarising a pool run
+ */
+typedef struct {
+    int files;           /* Jobs run */
+    int failed;          /* Jobs that failed */
+    long long bytes;     /* Bytes copied successfully */
+    double elapsed;      /* Wall clock seconds for the whole run */
+    double mb_per_sec;   /* Achieved throughput */
+    double p50_ms;       /* Per-file latency percentiles in milliseconds */
+    double p90_ms;
+    double p99_ms;
+    double max_ms;
+} CopyPoolStats;
+
+/**
+ * Copy a batch of files with a worker pool, largest files first, keeping
+ * at most per_device_limit copies in flight on any backing device
+ * @param jobs Jobs to run; result, hash and latency are filled in
+ * @param count Number of jobs
+ * @param workers Number of worker threads
+ * @param per_device_limit Maximum concurrent copies per device
+ * @param stats Receives throughput and latency statistics (may be NULL)
+ * @return SUCCESS if every copy succeeded, FAILURE otherwise
+ */
+int run_copy_pool(CopyJob* jobs, int count, int workers, int per_device_limit, CopyPoolStats* stats);
+
+#endif /* COPY_POOL_H */
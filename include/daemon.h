@@ -6,10 +6,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include "paths.h"
 
 /* Path definitions */
-#define PID_FILE       "/var/run/company_daemon.pid"
-#define LOCK_FILE      "/var/run/company_daemon.lock"
+#define PID_FILE       (get_daemon_paths()->pid_file)
+#define LOCK_FILE      (get_daemon_paths()->lock_file)
 
 /* Time settings */
 #define TRANSFER_HOUR   1    /* 1:00 AM */
@@ -0,0 +1,93 @@
+#ifndef EVENT_RING_H
+#define EVENT_RING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Ring geometry; EVENT_RING_SLOTS must be a power of two */
+#define EVENT_RING_SLOTS 4096
+#define EVENT_TEXT_SIZE  200
+#define EVENT_BATCH      64   /* Events the main loop drains per call */
+
+/* A claimed slot left unpublished this long is given up on, even if its
+ * producer cannot be shown to be dead */
+#define EVENT_SLOT_STALE_MS 10000
+
+/**
+ * Structure for one notification from a worker
+ */
+typedef struct {
+    uint32_t type;                  /* MSG_* type */
+    int32_t pid;                    /* Publishing process */
+    int32_t status;                 /* SUCCESS or FAILURE */
+    uint64_t sent_ns;               /* CLOCK_MONOTONIC when published */
+    char text[EVENT_TEXT_SIZE];     /* Message text, truncated to fit */
+} RingEvent;
+
+/**
+ * Create the shared ring and its doorbell. Must run before workers are
+ * forked; without it, publishing fails and workers use the FIFO.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int event_ring_init(void);
+
+/**
+ * Publish an event from any process sharing the ring; no system call
+ * unless the consumer is asleep
+ * @param type MSG_* type
+ * @param status Status code
+ * @param text Message text
+ * @return SUCCESS on success, FAILURE if the ring is full, not set up, or
+ *         the consumer gave up on the claimed slot before it was written
+ */
+int event_ring_publish(int type, int status, const char* text);
+
+/**
+ * Take up to max published events, in order (single consumer only)
+ * @param events Receives the events
+ * @param max Capacity of events
+ * @return Number of events taken
+ */
+int event_ring_drain(RingEvent* events, int max);
+
+/**
+ * Get the doorbell descriptor to poll for readability
+ * @return eventfd descriptor, or -1 if the ring is not set up
+ */
+int event_ring_fd(void);
+
+/**
+ * Announce that the consumer is about to sleep on the doorbell
+ * @return TRUE if events are already waiting and it should not sleep
+ */
+int event_ring_prepare_wait(void);
+
+/**
+ * Reset the doorbell after waking up
+ */
+void event_ring_ack_doorbell(void);
+
+/**
+ * Count events refused because the ring was full
+ * @return Number of refused events
+ */
+uint64_t event_ring_overflows(void);
+
+/**
+ * Count events a producer dropped because its slot was taken back first
+ * @return Number of dropped events
+ */
+uint64_t event_ring_dropped(void);
+
+/**
+ * Count claimed slots the consumer gave up on
+ * @return Number of events dropped because their producer died or stalled
+ */
+uint64_t event_ring_abandoned(void);
+
+/**
+ * Get a CLOCK_MONOTONIC reading in nanoseconds, as used for sent_ns
+ */
+uint64_t event_ring_now_ns(void);
+
+#endif /* EVENT_RING_H */
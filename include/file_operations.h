@@ -5,6 +5,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
+#include "paths.h"
 
 /* Department definitions */
 #define DEPT_WAREHOUSE    "Warehouse"
@@ -18,12 +20,16 @@
 #define REPORT_DATE_FORMAT "%Y-%m-%d"
 
 /* Path definitions */
-#define UPLOAD_DIR      "/var/company/upload"
-#define DASHBOARD_DIR   "/var/company/reporting"
+#define UPLOAD_DIR     (get_daemon_paths()->upload_dir)
+#define DASHBOARD_DIR  (get_daemon_paths()->dashboard_dir)
 
 /* Maximum buffer sizes */
 #define MAX_PATH_LENGTH 1024
 #define MAX_USER_LENGTH 256
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+/* Bytes asked of the kernel per call when copying a file of unknown length */
+#define COPY_CHUNK_SIZE (8 * 1024 * 1024)
 
 /* Return codes */
 #define SUCCESS 0
@@ -51,6 +57,34 @@ typedef struct {
     time_t timestamp;               /* When the change occurred */
 } ChangeRecord;
 
+/* Hidden names an urgent batch leaves in the dashboard while it runs:
+ * ".<report>.undo.<pid>" links to each replaced report, and the marker
+ * ".urgent-batch.<pid>.committed" once nothing needs rolling back */
+#define URGENT_UNDO_INFIX    ".undo."
+#define URGENT_COMMIT_PREFIX ".urgent-batch."
+#define URGENT_COMMIT_SUFFIX ".committed"
+
+/**
+ * Structure for one file of a batched urgent change
+ */
+typedef struct {
+    char filename[MAX_PATH_LENGTH];   /* Report in the dashboard directory */
+    const char* content;              /* New content, any bytes */
+    size_t content_length;            /* Bytes of content */
+    char temp_name[MAX_PATH_LENGTH];  /* Staged content, while the batch runs */
+    char undo_name[MAX_PATH_LENGTH];  /* Link to the old report, while the batch runs */
+} UrgentChange;
+
+/**
+ * Structure for one range of a patch urgent change
+ */
+typedef struct {
+    uint64_t offset;         /* Start of the range in the current report */
+    uint64_t delete_length;  /* Bytes removed there */
+    const char* insert;      /* Bytes put in their place */
+    size_t insert_length;    /* Bytes of insert */
+} UrgentPatch;
+
 /**
  * Transfer reports from upload directory to dashboard directory
  * @return SUCCESS on success, FAILURE on error
@@ -128,6 +162,15 @@ int move_file(const char* source, const char* destination);
  */
 int copy_file(const char* source, const char* destination);
 
+/**
+ * Copy a file from source to destination, hashing the data on the way
+ * @param source Source file path
+ * @param destination Destination file path
+ * @param hash Receives the content hash of the copied data (may be NULL)
+ * @return SUCCESS on success, FAILURE on error
+ */
+int copy_file_hashed(const char* source, const char* destination, uint64_t* hash);
+
 /**
  * Check if a file is a valid XML report
  * @param filepath Path to the file to check
@@ -143,13 +186,71 @@ int is_valid_xml_report(const char* filepath);
 int is_file_uploaded_on_time(const char* filepath);
 
 /**
- * Make an urgent change to a file in the dashboard directory
- * This bypasses the normal permissions to allow emergency updates
+ * Make an urgent change to a file in the dashboard directory. The new
+ * content is staged in a temporary file, synced, and renamed over the
+ * report with its mode and owner kept, so readers see the old or the
+ * new report and never a partial one.
  * @param filename Name of the file to update
  * @param content New content for the file
+ * @param content_length Bytes of content; it may hold any byte, NUL included
+ * @param user_name Name of the user making the change
+ * @return SUCCESS on success, FAILURE on error
+ */
+int make_urgent_change(const char* filename, const char* content, size_t content_length, const char* user_name);
+
+/**
+ * Make an urgent change from a descriptor passed by the client. The
+ * content is copied inside the kernel into a temporary file next to the
+ * report, which then replaces it with a rename. An unsealed file is
+ * copied to its end as it is at the time of the copy.
+ * @param filename Name of the file to update
+ * @param source_fd Readable regular file or memfd; a memfd must be sealed
+ *        against writes and resizing
+ * @param user_name Name of the user making the change
+ * @param content_hash Receives the hash of the content installed
+ * @return SUCCESS on success, FAILURE on error
+ */
+int make_urgent_change_from_fd(const char* filename, int source_fd, const char* user_name, uint64_t* content_hash);
+
+/**
+ * Apply several urgent changes as one. Every file is staged and synced
+ * before any report is replaced; if a step fails, the reports already
+ * replaced are put back, so the batch applies whole or not at all. The
+ * directory lock is held while it runs.
+ * @param changes Files and contents, each to a different report; the
+ *        staging fields are filled in here
+ * @param count Number of changes
+ * @param user_name Name of the user making the changes
+ * @return SUCCESS on success, FAILURE on error (no report changed unless
+ *         a report could not be put back, which is logged)
+ */
+int make_urgent_changes(UrgentChange* changes, int count, const char* user_name);
+
+/**
+ * Finish urgent batches a crash interrupted: roll back those that never
+ * committed from their undo links, and remove leftover staging files.
+ * Meant for daemon start; skipped while the directory lock is held.
+ * @return SUCCESS on success, FAILURE if a report could not be put back
+ */
+int recover_urgent_batches(void);
+
+/**
+ * Patch byte ranges of a report. The report is reflinked (or copied in
+ * the kernel) to a temporary file, the ranges are written there, and the
+ * copy is renamed over the report, so the bytes written scale with the
+ * patch rather than the report.
+ * @param filename Name of the file to update
+ * @param ranges Ranges in ascending, non-overlapping order, with offsets
+ *        into the current report
+ * @param count Number of ranges
+ * @param base_hash Content hash (hash.h) the report must have, or NULL
+ *        to patch whatever is there. Checking it reads the whole report.
+ * @param new_hash Receives the patched report's hash when base_hash is
+ *        given; on a mismatch, receives the report's actual hash
  * @param user_name Name of the user making the change
  * @return SUCCESS on success, FAILURE on error
  */
-int make_urgent_change(const char* filename, const char* content, const char* user_name);
+int make_urgent_patch(const char* filename, const UrgentPatch* ranges, int count,
+                      const uint64_t* base_hash, uint64_t* new_hash, const char* user_name);
 
 #endif /* FILE_OPERATIONS_H */
\ No newline at end of file
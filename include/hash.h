@@ -0,0 +1,70 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default seed for content hashes stored in snapshot manifests */
+#define HASH_SEED 0
+
+/* Strong hash used to address chunks in the deduplicating store */
+#define SHA256_DIGEST_LENGTH 32
+
+/**
+ * Streaming state for the 64-bit content hash (XXH64)
+ */
+typedef struct {
+    uint64_t total_len;      /* Bytes hashed so far */
+    uint64_t acc[4];         /* Lane accumulators */
+    unsigned char mem[32];   /* Buffered partial stripe */
+    size_t mem_size;         /* Bytes held in mem */
+    uint64_t seed;           /* Seed the state was initialised with */
+} HashState;
+
+/**
+ * Initialise a streaming hash state
+ * @param state State to initialise
+ * @param seed Hash seed
+ */
+void hash_init(HashState* state, uint64_t seed);
+
+/**
+ * Feed data into a streaming hash state
+ * @param state State to update
+ * @param data Data to hash
+ * @param len Number of bytes
+ */
+void hash_update(HashState* state, const void* data, size_t len);
+
+/**
+ * Produce the digest of everything fed so far
+ * @param state State to finalise (left unchanged)
+ * @return 64-bit digest
+ */
+uint64_t hash_final(const HashState* state);
+
+/**
+ * Hash a memory buffer in one call
+ * @param data Data to hash
+ * @param len Number of bytes
+ * @return 64-bit digest
+ */
+uint64_t hash_buffer(const void* data, size_t len);
+
+/**
+ * Hash the contents of a file
+ * @param path Path to the file
+ * @param hash Receives the 64-bit digest
+ * @return SUCCESS on success, FAILURE on error
+ */
+int hash_file(const char* path, uint64_t* hash);
+
+/**
+ * Compute the SHA-256 digest of a memory buffer
+ * @param data Data to hash
+ * @param len Number of bytes
+ * @param digest Receives the 32-byte digest
+ */
+void sha256_buffer(const void* data, size_t len, unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+#endif /* HASH_H */
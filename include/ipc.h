@@ -4,9 +4,17 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
+#include "protocol.h"
+#include "paths.h"
 
 /* Path definitions */
-#define FIFO_PATH "/var/run/company_daemon_pipe"
+#define FIFO_PATH (get_daemon_paths()->fifo_path)
+#define CONTROL_SOCKET_PATH (get_daemon_paths()->control_socket_path)
+
+/* Control socket limits */
+#define MAX_CONTROL_CLIENTS 16
+#define CONTROL_REPLY_TIMEOUT_MS 30000
 
 /* IPC message types */
 #define MSG_BACKUP_START     1
@@ -14,7 +22,43 @@
 #define MSG_TRANSFER_START   3
 #define MSG_TRANSFER_COMPLETE 4
 #define MSG_ERROR            5
-#define MSG_URGENT_CHANGE 6
+#define MSG_URGENT_CHANGE 6  /* FIELD_FILENAME, FIELD_USERNAME, and FIELD_CONTENT or a passed descriptor */
+#define MSG_SET_LOG_LEVEL 7  /* FIELD_LOG_LEVEL */
+#define MSG_SET_IO_LIMITS 8  /* FIELD_BANDWIDTH and FIELD_OPS, 0 = unlimited */
+#define MSG_STATUS        9  /* control socket only; reply FIELD_TEXT carries the daemon status */
+#define MSG_FORCE_BACKUP  10 /* same as SIGUSR1 */
+#define MSG_FORCE_TRANSFER 11 /* same as SIGUSR2 */
+#define MSG_FILE_TRANSFERRED 12 /* event ring only; text is the report moved to the dashboard */
+#define MSG_CANCEL_COMMAND 13 /* FIELD_COMMAND_ID of a queued command */
+#define MSG_SUBSCRIBE     14 /* control socket only; FIELD_EVENT_MASK, optional FIELD_FILTER */
+#define MSG_EVENT         15 /* pushed to subscribers, tagged with the MSG_SUBSCRIBE request ID */
+#define MSG_URGENT_BATCH  16 /* FIELD_USERNAME, then FIELD_FILENAME + FIELD_CONTENT per file */
+#define MSG_URGENT_PATCH  17 /* FIELD_FILENAME, FIELD_USERNAME, optional FIELD_BASE_HASH, then
+                                FIELD_PATCH_OFFSET + FIELD_PATCH_DELETE + FIELD_CONTENT per range */
+
+/* Files one MSG_URGENT_BATCH may change; two fields each must fit in MAX_FRAME_FIELDS */
+#define URGENT_BATCH_MAX_FILES 32
+
+/* Ranges one MSG_URGENT_PATCH may change; three fields each */
+#define URGENT_PATCH_MAX_RANGES 20
+
+/* Event stream types, as bits of a subscription mask */
+#define EVENT_FILE_CREATE     0x01  /* Report appeared in the upload directory */
+#define EVENT_FILE_MODIFY     0x02  /* Upload rewritten, or urgent change to a dashboard report */
+#define EVENT_FILE_DELETE     0x04  /* Report left the upload directory */
+#define EVENT_FILE_TRANSFER   0x08  /* Report moved to the dashboard */
+#define EVENT_BACKUP_COMPLETE 0x10  /* Backup finished; FIELD_STATUS tells how */
+#define EVENT_MISSING_REPORT  0x20  /* Department without a report after a transfer */
+#define EVENT_ALL             0x3f
+
+/* Frames waiting for a slow client; events may not take the last few, kept for replies */
+#define CLIENT_QUEUE_FRAMES  256
+#define CLIENT_REPLY_RESERVE 16
+#define MAX_EVENT_FILTER     64
+
+/* Largest request from a caller that is neither root nor the daemon's user;
+ * they may only ask for status or subscribe, which need far less */
+#define UNPRIVILEGED_FRAME_SIZE 4096
 
 /* Maximum buffer sizes */
 #define MAX_LINE_LENGTH 2048
@@ -24,14 +68,15 @@
 #define FAILURE -1
 
 /**
- * Structure for inter-process communication messages
+ * Request received on the control socket
  */
 typedef struct {
-    int type;                        /* Message type */
-    pid_t sender_pid;                /* Sender process ID */
-    int status;                      /* Status code */
-    char message[MAX_LINE_LENGTH];   /* Additional message text */
-} IPCMessage;
+    int client;                      /* Connection the request arrived on, -1 for none */
+    unsigned int generation;         /* Identifies the connection, which may outlive the slot */
+    pid_t peer_pid;                  /* Caller's PID from SO_PEERCRED */
+    uid_t peer_uid;                  /* Caller's UID from SO_PEERCRED */
+    Frame frame;                     /* The request; freed by send_control_reply() */
+} ControlRequest;
 
 /**
  * Setup IPC mechanisms
@@ -46,18 +91,95 @@ int setup_ipc(void);
 int cleanup_ipc(void);
 
 /**
- * Send an IPC message
- * @param msg Pointer to the message to send
+ * Send a worker notice to the daemon over the FIFO. Frames up to PIPE_BUF
+ * bytes are written atomically, so larger ones are refused. The daemon
+ * only accepts notices from its own workers here; clients use the
+ * control socket.
+ * @param frame Frame to send
  * @return SUCCESS on success, FAILURE on error
  */
-int send_ipc_message(IPCMessage* msg);
+int send_ipc_message(const Frame* frame);
+
+/**
+ * Receive a frame from the FIFO (non-blocking)
+ * @param frame Receives the frame; free it with frame_free()
+ * @return SUCCESS on success, FAILURE on error or no complete frame available
+ */
+int receive_ipc_message(Frame* frame);
+
+/**
+ * Wait until IPC traffic arrives or the timeout passes, accepting new
+ * control socket connections
+ * @param timeout_ms Milliseconds to wait at most
+ * @return SUCCESS if something is ready, FAILURE on timeout, signal or error
+ */
+int wait_for_ipc(int timeout_ms);
+
+/**
+ * Check whether a control socket caller may change the daemon's state
+ * @param uid Caller's UID from SO_PEERCRED
+ * @return TRUE for root and the daemon's own user, FALSE otherwise
+ */
+int control_peer_privileged(uid_t uid);
+
+/**
+ * Receive the next control socket request (non-blocking); connected
+ * clients are served round-robin, one request each per turn
+ * @param request Pointer to store the request
+ * @return SUCCESS on success, FAILURE if no complete request is waiting
+ */
+int receive_control_request(ControlRequest* request);
+
+/**
+ * Reply to a control socket request and release it. The reply may be
+ * sent long after the request arrived; if the caller has disconnected
+ * in the meantime, or the request came from the FIFO, it is only released.
+ * @param request The request being answered
+ * @param status Status code for the caller
+ * @param text Reply text
+ * @return SUCCESS on success, FAILURE on error
+ */
+int send_control_reply(ControlRequest* request, int status, const char* text);
+
+/**
+ * Subscribe the caller's connection to pushed events, replacing any
+ * earlier subscription. Events are sent as MSG_EVENT frames carrying the
+ * request's ID; a subscriber that falls behind has events dropped and
+ * counted rather than stalling the daemon.
+ * @param request The MSG_SUBSCRIBE request
+ * @param mask EVENT_* bits, 0 to unsubscribe
+ * @param filter Substring an event's file name (or text, when it has no
+ *               file name) must contain, "" for every event
+ * @return SUCCESS on success, FAILURE if the caller is gone or not on the socket
+ */
+int subscribe_control_client(const ControlRequest* request, uint32_t mask, const char* filter);
+
+/**
+ * Push an event to every subscriber that wants it. Does nothing in
+ * worker processes, which hold no client connections.
+ * @param event EVENT_* bit
+ * @param status Outcome, SUCCESS or FAILURE
+ * @param filename Report file name, or NULL
+ * @param user User responsible, or NULL
+ * @param text Further detail, or NULL
+ */
+void publish_event(int event, int status, const char* filename, const char* user, const char* text);
+
+/**
+ * Get subscription statistics
+ * @param subscribers Receives the number of subscribed connections
+ * @param dropped Receives the events dropped across all subscribers
+ */
+void get_subscription_stats(int* subscribers, unsigned long long* dropped);
 
 /**
- * Receive an IPC message (non-blocking)
- * @param msg Pointer to store the received message
- * @return SUCCESS on success, FAILURE on error or no message available
+ * Send a request to the daemon over the control socket and wait for the
+ * reply. Meant for client processes; reports errors through errno only.
+ * @param request Frame to send; its request ID is assigned here
+ * @param reply Receives the reply; free it with frame_free()
+ * @return SUCCESS if a reply was received, FAILURE on error or timeout
  */
-int receive_ipc_message(IPCMessage* msg);
+int send_control_request(Frame* request, Frame* reply);
 
 /**
  * Create a process that will report back its completion status
@@ -0,0 +1,209 @@
+#ifndef LIBREPORTD_H
+#define LIBREPORTD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+#include "ipc.h"
+
+/*
+ * Client library for the daemon's control socket. Requests are framed
+ * with protocol.h and pipelined on one connection: submit as many as
+ * the window allows, then drive the connection with reportd_process()
+ * (or from your own poll loop via reportd_fd() and reportd_events()).
+ * Each reply is handed to the callback given with its request, in the
+ * order replies arrive, which need not be the order requests were sent.
+ * A connection subscribed with reportd_subscribe() also has pushed events
+ * handed to its event callback as they arrive.
+ * Errors are reported through errno only; the library never logs.
+ */
+
+/* Requests in flight on one connection */
+#define REPORTD_WINDOW 64
+
+/* Default socket, that of the instance named by the environment (paths.h),
+ * and how long a reply may take */
+#define REPORTD_SOCKET_PATH CONTROL_SOCKET_PATH
+#define REPORTD_TIMEOUT_MS  CONTROL_REPLY_TIMEOUT_MS
+
+/**
+ * Structure describing a reply, valid only during the callback
+ */
+typedef struct {
+    uint32_t request_id;   /* ID of the request answered */
+    uint8_t type;          /* MSG_* type of the request */
+    int status;            /* Daemon's status, or FAILURE if no reply came */
+    const char* text;      /* Reply text, or why no reply came */
+    const Frame* frame;    /* Whole reply, NULL if none came */
+} ReportdReply;
+
+/**
+ * Completion callback
+ * @param reply The reply
+ * @param context Pointer given with the request
+ */
+typedef void (*ReportdCallback)(const ReportdReply* reply, void* context);
+
+/**
+ * Structure describing a pushed event, valid only during the callback
+ */
+typedef struct {
+    int event;             /* EVENT_* bit */
+    int status;            /* SUCCESS or FAILURE */
+    const char* filename;  /* Report file name, "" if none */
+    const char* user;      /* User responsible, "" if unknown */
+    const char* text;      /* Further detail, "" if none */
+    uint64_t time;         /* Wall-clock seconds when the daemon saw it */
+    uint64_t dropped;      /* Events this connection lost so far to a full queue */
+    const Frame* frame;    /* The whole event */
+} ReportdEvent;
+
+/**
+ * Event callback
+ * @param event The event
+ * @param context Pointer given to reportd_subscribe()
+ */
+typedef void (*ReportdEventCallback)(const ReportdEvent* event, void* context);
+
+/**
+ * Structure for a request in flight
+ */
+typedef struct {
+    uint32_t request_id;       /* ID the reply will carry */
+    uint8_t type;              /* MSG_* type */
+    Frame frame;               /* Encoded request, owned until fully sent */
+    size_t sent;               /* Bytes of it on the wire */
+    int answered;              /* Reply delivered; slot freed once it is the oldest */
+    ReportdCallback callback;  /* Called with the reply, may be NULL */
+    void* context;             /* Passed to callback */
+} ReportdRequest;
+
+/**
+ * Structure for a connection to the daemon
+ */
+typedef struct {
+    int fd;                                   /* Control socket, -1 when closed */
+    uint32_t next_request_id;                 /* ID for the next request */
+    FrameReader reader;                       /* Partially received reply */
+    ReportdRequest requests[REPORTD_WINDOW];  /* Ring of requests, oldest first */
+    int first;                                /* Oldest slot in the ring */
+    int count;                                /* Slots in use */
+    int unsent;                               /* Requests not fully sent yet, at the ring's tail */
+    int outstanding;                          /* Requests not answered yet */
+    ReportdEventCallback event_callback;      /* Called with pushed events, may be NULL */
+    void* event_context;                      /* Passed to event_callback */
+} ReportdClient;
+
+/**
+ * Connect to the daemon
+ * @param client Connection to set up
+ * @param socket_path Control socket, NULL for REPORTD_SOCKET_PATH
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int reportd_connect(ReportdClient* client, const char* socket_path);
+
+/**
+ * Queue a request and send what the socket takes. When the window is
+ * full, replies are processed first to make room, waiting up to
+ * REPORTD_TIMEOUT_MS.
+ * @param client Connection
+ * @param request Request frame; the library takes it over, including a
+ *                passed descriptor, whether or not the call succeeds
+ * @param callback Called with the reply, may be NULL
+ * @param context Passed to callback
+ * @return SUCCESS if queued, FAILURE on error (errno set). Once queued,
+ *         the callback runs exactly once, with FAILURE if the connection
+ *         is lost first.
+ */
+int reportd_submit(ReportdClient* client, Frame* request, ReportdCallback callback, void* context);
+
+/**
+ * Send pending requests and deliver arrived replies, waiting up to
+ * timeout_ms for the connection to become ready
+ * @param client Connection
+ * @param timeout_ms Milliseconds to wait, 0 to only do what is ready, -1 forever
+ * @return Number of replies and events delivered, or FAILURE if the
+ *         connection failed (outstanding requests are then answered with
+ *         FAILURE)
+ */
+int reportd_process(ReportdClient* client, int timeout_ms);
+
+/**
+ * Process until every outstanding request is answered
+ * @param client Connection
+ * @param timeout_ms Milliseconds to wait in total, -1 forever
+ * @return SUCCESS when all are answered, FAILURE on error or timeout
+ *         (errno ETIMEDOUT)
+ */
+int reportd_wait(ReportdClient* client, int timeout_ms);
+
+/**
+ * Send one request and wait for its reply, for simple callers
+ * @param client Connection
+ * @param request Request frame, taken over as by reportd_submit()
+ * @param status Receives the daemon's status
+ * @param text Receives the reply text (may be NULL)
+ * @param text_size Size of text
+ * @return SUCCESS if a reply arrived, FAILURE on error or timeout
+ */
+int reportd_call(ReportdClient* client, Frame* request, int* status, char* text, size_t text_size);
+
+/**
+ * Subscribe the connection to pushed events, replacing any earlier
+ * subscription. The daemon drops events for a connection that falls
+ * too far behind; ReportdEvent.dropped counts them.
+ * @param client Connection
+ * @param mask EVENT_* bits, 0 to unsubscribe
+ * @param filter Substring an event's file name (or text, when it has no
+ *               file name) must contain, case-insensitively; NULL or ""
+ *               for every event
+ * @param on_event Called with each event, may be NULL
+ * @param event_context Passed to on_event
+ * @param callback Called with the reply to the subscription, may be NULL
+ * @param context Passed to callback
+ * @return SUCCESS if queued, FAILURE on error (errno set)
+ */
+int reportd_subscribe(ReportdClient* client, uint32_t mask, const char* filter,
+                      ReportdEventCallback on_event, void* event_context,
+                      ReportdCallback callback, void* context);
+
+/**
+ * Get the short name of an event type ("create", "modify", "delete",
+ * "transfer", "backup" or "missing")
+ * @param event EVENT_* bit
+ * @return Name, or "unknown"
+ */
+const char* reportd_event_name(int event);
+
+/**
+ * Look up an event type by its short name, or "all"
+ * @param name Name as returned by reportd_event_name()
+ * @return EVENT_* bits, 0 if the name is unknown
+ */
+uint32_t reportd_event_mask(const char* name);
+
+/**
+ * Get the number of requests still waiting for a reply
+ */
+int reportd_outstanding(const ReportdClient* client);
+
+/**
+ * Get the connection's descriptor, for callers with their own poll loop
+ * @return Descriptor, -1 when closed
+ */
+int reportd_fd(const ReportdClient* client);
+
+/**
+ * Get the poll events the connection waits for: POLLIN, plus POLLOUT
+ * while requests are waiting to be sent
+ */
+short reportd_events(const ReportdClient* client);
+
+/**
+ * Close the connection; requests still outstanding are answered with
+ * FAILURE
+ * @param client Connection
+ */
+void reportd_close(ReportdClient* client);
+
+#endif /* LIBREPORTD_H */
@@ -0,0 +1,83 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Manifest file written into every snapshot directory */
+#define SNAPSHOT_MANIFEST  ".manifest"
+#define MANIFEST_HEADER    "# company_daemon manifest v1"
+#define MANIFEST_NAME_LENGTH 256
+
+/**
+ * Structure describing one file recorded in a snapshot
+ */
+typedef struct {
+    char name[MANIFEST_NAME_LENGTH]; /* File name relative to the snapshot */
+    long long size;                  /* Size of the source file in bytes */
+    long long mtime;                 /* Source modification time */
+    uint64_t hash;                   /* Content hash (see hash.h) */
+} ManifestEntry;
+
+/**
+ * Structure holding the manifest of a snapshot
+ */
+typedef struct {
+    ManifestEntry* entries; /* Entries, sorted by name once finished */
+    int count;              /* Number of entries in use */
+    int capacity;           /* Allocated entries */
+    time_t created;         /* When the snapshot was started */
+} SnapshotManifest;
+
+/**
+ * Initialise an empty manifest
+ * @param manifest Manifest to initialise
+ * @param created Snapshot start time
+ */
+void init_snapshot_manifest(SnapshotManifest* manifest, time_t created);
+
+/**
+ * Append an entry to a manifest
+ * @param manifest Manifest to extend
+ * @param entry Entry to copy in
+ * @return SUCCESS on success, FAILURE on error
+ */
+int add_manifest_entry(SnapshotManifest* manifest, const ManifestEntry* entry);
+
+/**
+ * Look up an entry by file name (manifest must be sorted)
+ * @param manifest Manifest to search
+ * @param name File name
+ * @return Pointer to the entry or NULL if not present
+ */
+const ManifestEntry* find_manifest_entry(const SnapshotManifest* manifest, const char* name);
+
+/**
+ * Sort manifest entries by name
+ * @param manifest Manifest to sort
+ */
+void sort_snapshot_manifest(SnapshotManifest* manifest);
+
+/**
+ * Load the manifest of a snapshot directory
+ * @param snapshot_path Path to the snapshot directory
+ * @param manifest Manifest to fill (initialised by this call)
+ * @return SUCCESS on success, FAILURE on error or missing manifest
+ */
+int load_snapshot_manifest(const char* snapshot_path, SnapshotManifest* manifest);
+
+/**
+ * Write the manifest into a snapshot directory (atomically via rename)
+ * @param snapshot_path Path to the snapshot directory
+ * @param manifest Manifest to write, sorted by this call
+ * @return SUCCESS on success, FAILURE on error
+ */
+int write_snapshot_manifest(const char* snapshot_path, SnapshotManifest* manifest);
+
+/**
+ * Free memory held by a manifest
+ * @param manifest Manifest to free
+ */
+void free_snapshot_manifest(SnapshotManifest* manifest);
+
+#endif /* MANIFEST_H */
@@ -0,0 +1,76 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "paths.h"
+
+/* Metrics surface: Prometheus text format, rewritten atomically */
+#define METRICS_FILE     (get_daemon_paths()->metrics_file)
+#define METRICS_INTERVAL 10  /* Seconds between periodic rewrites by the daemon */
+
+/* Lock hold-time alert; overridable through the environment */
+#define LOCK_HOLD_ALERT_MS  60000
+#define LOCK_HOLD_ALERT_ENV "COMPANY_DAEMON_LOCK_ALERT_MS"
+
+/* Upper bounds of the hold-time histogram buckets, in milliseconds */
+#define LOCK_HOLD_BUCKET_BOUNDS {1, 10, 100, 1000, 10000, 60000, 600000}
+#define LOCK_HOLD_BUCKETS 7
+
+/**
+ * Create the shared metrics area. Must run before worker processes are
+ * forked so that locks taken by children are counted too. Without it,
+ * the metrics_* calls do nothing.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int metrics_init(void);
+
+/**
+ * Set the hold time after which the lock raises an alert
+ * @param alert_ms Threshold in milliseconds
+ */
+void set_lock_hold_alert(long alert_ms);
+
+/**
+ * Record a successful directory lock acquisition
+ * @param wait_ms Time spent acquiring it
+ * @param contended TRUE if another holder had to be waited for
+ */
+void metrics_lock_acquired(double wait_ms, int contended);
+
+/**
+ * Record an acquisition that gave up because another process held the lock
+ * @param wait_ms Time spent waiting
+ */
+void metrics_lock_timed_out(double wait_ms);
+
+/**
+ * Record the release of the directory lock, alerting on long holds
+ */
+void metrics_lock_released(void);
+
+/**
+ * Alert once if the lock has been held beyond the threshold and is still held
+ */
+void metrics_check_lock_alert(void);
+
+/**
+ * Format the lock state and counters as one line of key=value pairs
+ * @param buffer Destination buffer
+ * @param size Size of buffer
+ */
+void format_lock_summary(char* buffer, size_t size);
+
+/**
+ * Write all metrics in Prometheus text format
+ * @param out Stream to write to
+ */
+void write_metrics(FILE* out);
+
+/**
+ * Rewrite METRICS_FILE atomically
+ * @return SUCCESS on success, FAILURE on error
+ */
+int write_metrics_file(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,102 @@
+#ifndef PATHS_H
+#define PATHS_H
+
+/*
+ * Every path the daemon uses, derived at runtime from an optional root
+ * prefix and an optional instance name. The prefix is put in front of
+ * the default locations below (COMPANY_DAEMON_ROOT=/srv/unit1 gives
+ * /srv/unit1/var/company/...). An instance gets its own tree under the
+ * company root and its own PID file, lock, FIFO, socket, metrics and logs,
+ * so several daemons can share a host. Without either, the paths are the
+ * historical ones under /var.
+ */
+
+/* Environment overrides, read by init_paths_from_env() */
+#define ROOT_PREFIX_ENV "COMPANY_DAEMON_ROOT"      /* Absolute directory put in front of every path */
+#define INSTANCE_ENV    "COMPANY_DAEMON_INSTANCE"  /* Instance name, empty for the default instance */
+
+/* Default locations, before the prefix */
+#define DEFAULT_COMPANY_ROOT "/var/company"  /* Upload, dashboard and backup trees */
+#define DEFAULT_LOG_ROOT     "/var/log"      /* Operation and change logs */
+#define DEFAULT_RUN_ROOT     "/var/run"      /* PID file, locks, FIFO, socket and metrics */
+
+/* Base name of the run and log files; an instance appends "-<name>" */
+#define DAEMON_FILE_BASE  "company_daemon"
+#define CHANGE_LOG_BASE   "company_changes"
+
+/* Trees under a company root. A named instance's root sits beside the
+ * default instance's trees, so their names cannot be instance names. */
+#define UPLOAD_TREE    "upload"
+#define DASHBOARD_TREE "reporting"
+#define BACKUP_TREE    "backup"
+
+/* Instance names: letters, digits, '-', '_' and '.', not starting with '.'
+ * and not one of the tree names above */
+#define MAX_INSTANCE_LENGTH 32
+
+#define MAX_PATH_LENGTH 1024
+
+/* Resolved paths stay short enough that a file name still fits behind them
+ * in MAX_PATH_LENGTH; the socket must also fit the 108-byte sun_path of a
+ * sockaddr_un, which is filled with strncpy(..., sizeof(sun_path) - 1) */
+#define MAX_ROOT_PATH_LENGTH   256
+#define MAX_SOCKET_PATH_LENGTH 107
+
+/**
+ * Structure holding the resolved paths
+ */
+typedef struct {
+    char prefix[MAX_ROOT_PATH_LENGTH];                /* Root prefix, "" for none */
+    char instance[MAX_INSTANCE_LENGTH + 1];           /* Instance name, "" for the default one */
+    char company_root[MAX_ROOT_PATH_LENGTH];          /* Parent of the upload, dashboard and backup trees */
+    char log_root[MAX_ROOT_PATH_LENGTH];              /* Directory of the logs */
+    char run_root[MAX_ROOT_PATH_LENGTH];              /* Directory of the run files */
+    char upload_dir[MAX_ROOT_PATH_LENGTH];
+    char dashboard_dir[MAX_ROOT_PATH_LENGTH];
+    char backup_dir[MAX_ROOT_PATH_LENGTH];
+    char operation_log[MAX_ROOT_PATH_LENGTH];         /* Also receives errors */
+    char change_log[MAX_ROOT_PATH_LENGTH];
+    char pid_file[MAX_ROOT_PATH_LENGTH];
+    char lock_file[MAX_ROOT_PATH_LENGTH];
+    char fifo_path[MAX_ROOT_PATH_LENGTH];
+    char control_socket_path[MAX_SOCKET_PATH_LENGTH];
+    char metrics_file[MAX_ROOT_PATH_LENGTH];
+} DaemonPaths;
+
+/* Roots of the layout */
+#define COMPANY_ROOT (get_daemon_paths()->company_root)
+#define LOG_ROOT     (get_daemon_paths()->log_root)
+#define RUN_ROOT     (get_daemon_paths()->run_root)
+
+/**
+ * Resolve every path for a root prefix and instance name
+ * @param prefix Absolute directory, NULL, "" or "/" for none
+ * @param instance Instance name, NULL or "" for the default instance
+ * @return SUCCESS on success, FAILURE if either is invalid (a relative
+ *         prefix, or an instance name that is malformed or reserved) or a path
+ *         would be too long (paths are then left unchanged, errno EINVAL
+ *         or ENAMETOOLONG)
+ */
+int init_paths(const char* prefix, const char* instance);
+
+/**
+ * Resolve every path from ROOT_PREFIX_ENV and INSTANCE_ENV
+ * @return SUCCESS on success, FAILURE if either is invalid
+ */
+int init_paths_from_env(void);
+
+/**
+ * Get the resolved paths. Until init_paths() or init_paths_from_env()
+ * succeeds, they come from the environment, falling back to the
+ * defaults if it holds invalid values.
+ * @return The paths, valid for the life of the process
+ */
+const DaemonPaths* get_daemon_paths(void);
+
+/**
+ * Create the company, log and run roots, with any missing parents
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int create_path_roots(void);
+
+#endif /* PATHS_H */
@@ -0,0 +1,235 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frame layout, all integers little-endian:
+ *   header: version u8, type u8, reserved u16 (0), request_id u32, body_length u32
+ *   body:   fields, each tag u16, length u32, then length bytes
+ * On a SEQPACKET socket a frame is sent as records of at most
+ * FRAME_RECORD_SIZE bytes, and may carry one descriptor (SCM_RIGHTS)
+ * with its first record; on a FIFO it is a plain byte stream.
+ */
+#define PROTOCOL_VERSION   1
+#define FRAME_HEADER_SIZE  12
+#define FIELD_HEADER_SIZE  6
+#define MAX_FRAME_SIZE     (64 * 1024 * 1024)
+#define MAX_FRAME_FIELDS   72
+#define FRAME_RECORD_SIZE  (64 * 1024)
+
+/* Field tags */
+#define FIELD_STATUS    1  /* i32 result code */
+#define FIELD_TEXT      2  /* Human-readable text */
+#define FIELD_PID       3  /* i32 sender PID, for FIFO senders */
+#define FIELD_FILENAME  4  /* Report file name */
+#define FIELD_USERNAME  5  /* User responsible for a change */
+#define FIELD_CONTENT   6  /* Raw report bytes, any length or content */
+#define FIELD_LOG_LEVEL 7  /* i32 LOG_LEVEL_* value */
+#define FIELD_BANDWIDTH 8  /* u64 bytes per second, 0 = unlimited */
+#define FIELD_OPS       9  /* u64 operations per second, 0 = unlimited */
+#define FIELD_TIMESTAMP 10 /* u64 CLOCK_MONOTONIC nanoseconds when sent */
+#define FIELD_COMMAND_ID 11 /* u64 queued command ID */
+#define FIELD_DEADLINE  12 /* u64 milliseconds a queued command may wait, 0 = no limit */
+#define FIELD_EVENT_MASK 13 /* u64 EVENT_* bits to subscribe to, 0 = unsubscribe */
+#define FIELD_FILTER    14 /* Case-insensitive substring events must contain */
+#define FIELD_EVENT_TYPE 15 /* i32 EVENT_* bit of a pushed event */
+#define FIELD_DROPPED   16 /* u64 events this subscriber has lost so far */
+#define FIELD_EVENT_TIME 17 /* u64 wall-clock seconds since the epoch */
+#define FIELD_BASE_HASH 18 /* u64 content hash (hash.h) a patch expects the report to have */
+#define FIELD_PATCH_OFFSET 19 /* u64 byte offset of a patch range in the base report */
+#define FIELD_PATCH_DELETE 20 /* u64 bytes the patch range removes there */
+
+/* Return codes */
+#define SUCCESS 0
+#define FAILURE -1
+
+/* Boolean definitions */
+#define TRUE  1
+#define FALSE 0
+
+/**
+ * Structure locating one field inside a frame
+ */
+typedef struct {
+    uint16_t tag;     /* FIELD_* tag */
+    uint32_t length;  /* Payload bytes */
+    size_t offset;    /* Payload position in the frame buffer */
+} FrameField;
+
+/**
+ * Structure for an encoded frame and its field table
+ */
+typedef struct {
+    uint8_t type;                          /* MSG_* type */
+    uint32_t request_id;                   /* Matches replies to requests */
+    int field_count;                       /* Entries in fields */
+    FrameField fields[MAX_FRAME_FIELDS];   /* Fields in wire order */
+    unsigned char* buffer;                 /* Encoded frame, header included */
+    size_t length;                         /* Bytes used in buffer */
+    size_t capacity;                       /* Bytes allocated */
+    int passed_fd;                         /* Descriptor sent along, owned by the frame; -1 if none */
+} Frame;
+
+/**
+ * Structure reassembling frames from a FIFO or socket
+ */
+typedef struct {
+    unsigned char* buffer;  /* Bytes received so far */
+    size_t length;          /* Bytes in buffer */
+    size_t expected;        /* Full frame size once the header is in, else 0 */
+    size_t capacity;        /* Bytes allocated */
+    int passed_fd;          /* Descriptor received with the first record; -1 if none */
+    size_t limit;           /* Largest frame accepted, 0 for MAX_FRAME_SIZE */
+} FrameReader;
+
+/**
+ * Start an empty frame
+ * @param frame Frame to initialize
+ * @param type Message type
+ * @param request_id Request ID, 0 when unused
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_init(Frame* frame, uint8_t type, uint32_t request_id);
+
+/**
+ * Change the request ID of a frame
+ * @param frame Frame to update
+ * @param request_id New request ID
+ */
+void frame_set_request_id(Frame* frame, uint32_t request_id);
+
+/**
+ * Append a field
+ * @param frame Frame to extend
+ * @param tag Field tag
+ * @param data Payload
+ * @param length Payload bytes
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_add(Frame* frame, uint16_t tag, const void* data, size_t length);
+
+/**
+ * Append a string field, without its terminator
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_add_string(Frame* frame, uint16_t tag, const char* value);
+
+/**
+ * Append a 32-bit signed integer field
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_add_i32(Frame* frame, uint16_t tag, int32_t value);
+
+/**
+ * Append a 64-bit unsigned integer field
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_add_u64(Frame* frame, uint16_t tag, uint64_t value);
+
+/**
+ * Find the first field with a tag
+ * @return Field, or NULL if absent
+ */
+const FrameField* frame_find(const Frame* frame, uint16_t tag);
+
+/**
+ * Get the payload of a field
+ * @return Pointer into the frame buffer
+ */
+const unsigned char* frame_field_data(const Frame* frame, const FrameField* field);
+
+/**
+ * Read a 32-bit signed integer field
+ * @return SUCCESS on success, FAILURE if absent or malformed
+ */
+int frame_get_i32(const Frame* frame, uint16_t tag, int32_t* value);
+
+/**
+ * Read a 64-bit unsigned integer field
+ * @return SUCCESS on success, FAILURE if absent or malformed
+ */
+int frame_get_u64(const Frame* frame, uint16_t tag, uint64_t* value);
+
+/**
+ * Read a 64-bit unsigned integer from a given field, for fields that
+ * repeat; walk frame->fields to find them
+ * @param frame Frame the field belongs to
+ * @param field Field to read, may be NULL
+ * @param value Receives the value
+ * @return SUCCESS on success, FAILURE if absent or malformed
+ */
+int frame_field_u64(const Frame* frame, const FrameField* field, uint64_t* value);
+
+/**
+ * Copy a string field into a terminated buffer
+ * @param out Destination buffer
+ * @param size Size of out
+ * @return SUCCESS on success, FAILURE if absent, too long or containing NUL
+ */
+int frame_get_string(const Frame* frame, uint16_t tag, char* out, size_t size);
+
+/**
+ * Release a frame's buffer and close its passed descriptor
+ * @param frame Frame to free
+ */
+void frame_free(Frame* frame);
+
+/**
+ * Send a frame, splitting it into records on packet sockets. A passed
+ * descriptor goes with the first record and stays open on the sender.
+ * @param fd Destination descriptor
+ * @param frame Frame to send
+ * @param packet TRUE for a SEQPACKET socket, FALSE for a byte stream
+ * @return SUCCESS on success, FAILURE on error (errno set; EINVAL when
+ *         a descriptor is passed over a byte stream)
+ */
+int frame_send(int fd, const Frame* frame, int packet);
+
+/**
+ * Send as much of a frame as the descriptor takes, starting at *sent;
+ * for non-blocking senders that must not stall on a full socket
+ * @param fd Destination descriptor
+ * @param frame Frame to send
+ * @param packet TRUE for a SEQPACKET socket, FALSE for a byte stream
+ * @param sent Bytes already sent, 0 at first; advanced past what is sent now
+ * @return SUCCESS once the whole frame is out, FAILURE otherwise (errno
+ *         EAGAIN when the descriptor is full and the call can be repeated)
+ */
+int frame_send_resume(int fd, const Frame* frame, int packet, size_t* sent);
+
+/**
+ * Start an empty reader
+ * @param reader Reader to initialize
+ */
+void frame_reader_init(FrameReader* reader);
+
+/**
+ * Refuse frames larger than a limit before any of their body is buffered;
+ * the limit survives completed frames and frame_reader_free()
+ * @param reader Reader to restrict
+ * @param limit Largest frame in bytes, header included; 0 for MAX_FRAME_SIZE
+ */
+void frame_reader_set_limit(FrameReader* reader, size_t limit);
+
+/**
+ * Read what is available towards the next frame
+ * @param reader Reassembly state for the descriptor
+ * @param fd Source descriptor
+ * @param packet TRUE for a SEQPACKET socket, FALSE for a byte stream
+ * @param frame Receives the frame once it is complete
+ * @return SUCCESS when a frame is complete, FAILURE otherwise with errno
+ *         EAGAIN (incomplete), ECONNRESET (peer closed), EPROTO or
+ *         EMSGSIZE (malformed or over the reader's limit), or the read error
+ */
+int frame_reader_read(FrameReader* reader, int fd, int packet, Frame* frame);
+
+/**
+ * Drop a partially received frame, releasing the reader's buffer and
+ * any descriptor received with it
+ * @param reader Reader to reset
+ */
+void frame_reader_free(FrameReader* reader);
+
+#endif /* PROTOCOL_H */
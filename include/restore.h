@@ -0,0 +1,41 @@
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include <stdio.h>
+
+/**
+ * Verify snapshots against their manifests (directories), indexes
+ * (archives) or chunk manifests (chunked backups, each chunk and the
+ * rebuilt file are checked). Files from every snapshot are checked in parallel.
+ * @param names Snapshot names; NULL or empty to verify every backup
+ * @param count Number of names
+ * @param out Stream receiving one summary line per snapshot
+ * @return SUCCESS if every file verified, FAILURE otherwise
+ */
+int verify_snapshots(char* const* names, int count, FILE* out);
+
+/**
+ * Restore a whole snapshot, or only the reports of some departments, into
+ * DASHBOARD_DIR. A department restore replaces that department's reports
+ * with the snapshot's and keeps everything else. Files are staged next to the dashboard with parallel
+ * workers, checked against their recorded hashes, and the staging
+ * directory is then swapped with the dashboard atomically.
+ * @param snapshot Snapshot name in BACKUP_DIR
+ * @param departments Departments to restore; NULL or empty for everything
+ * @param count Number of departments
+ * @return SUCCESS on success, FAILURE on error
+ */
+int restore_snapshot(const char* snapshot, char* const* departments, int count);
+
+/**
+ * Restore a single report from a backup into the dashboard directory.
+ * The snapshot may be a snapshot directory, an archive or a chunk
+ * manifest, named with or without its suffix; archives are read through
+ * their index and chunked files are rebuilt from the chunk store.
+ * @param snapshot Snapshot name in BACKUP_DIR (e.g. backup_2024-01-31_23-00-00)
+ * @param file Report file name
+ * @return SUCCESS on success, FAILURE on error
+ */
+int restore_snapshot_file(const char* snapshot, const char* file);
+
+#endif /* RESTORE_H */
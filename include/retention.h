@@ -0,0 +1,64 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <time.h>
+#include <sys/types.h>
+
+/* Retention policies */
+#define RETENTION_POLICY_AGE_COUNT 0  /* Keep MAX_BACKUPS no older than MAX_BACKUP_AGE */
+#define RETENTION_POLICY_GFS       1  /* Grandfather-father-son daily/weekly/monthly */
+#define RETENTION_POLICY_ENV "COMPANY_DAEMON_RETENTION" /* Environment override */
+
+/* GFS policy: newest snapshot of each period is kept, for this many periods */
+#define GFS_KEEP_DAILY   7
+#define GFS_KEEP_WEEKLY  4
+#define GFS_KEEP_MONTHLY 12
+
+/* Expired snapshots are renamed here and deleted in the background */
+#define BACKUP_TRASH_NAME ".trash"
+#define PURGE_WORKERS     4
+#define TRASH_NAME_ATTEMPTS 100  /* Unique trash names tried per snapshot */
+
+/**
+ * Select the retention policy
+ * @param policy One of the RETENTION_POLICY_* values
+ */
+void set_retention_policy(int policy);
+
+/**
+ * Get the retention policy
+ * @return Current RETENTION_POLICY_* value
+ */
+int get_retention_policy(void);
+
+/**
+ * Parse a retention policy name ("age", "gfs")
+ * @param name Policy name
+ * @return RETENTION_POLICY_* value, or -1 if the name is not recognised
+ */
+int parse_retention_policy(const char* name);
+
+/**
+ * Apply the retention policy to BACKUP_DIR: expired snapshot directories
+ * are moved to the trash and purged in the background, expired chunk
+ * manifests are removed and their chunks collected
+ * @return SUCCESS on success, FAILURE on error
+ */
+int apply_retention_policy(void);
+
+/**
+ * Delete everything in the backup trash from a background process running
+ * at idle I/O priority
+ * @return PID of the purge process, -1 on error
+ */
+pid_t purge_backup_trash_async(void);
+
+/**
+ * Recursively delete a directory tree with dirfd-relative unlinkat()
+ * @param parent_fd Directory file descriptor containing the tree
+ * @param name Name of the tree within parent_fd
+ * @return SUCCESS on success, FAILURE on error
+ */
+int remove_tree_at(int parent_fd, const char* name);
+
+#endif /* RETENTION_H */
@@ -0,0 +1,62 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+
+/* Environment overrides; rates accept K/M/G suffixes, 0 means unlimited */
+#define IO_BANDWIDTH_ENV "COMPANY_DAEMON_IO_BANDWIDTH" /* Bytes per second */
+#define IO_OPS_ENV       "COMPANY_DAEMON_IO_OPS"       /* Copy operations per second */
+#define IO_IDLE_ENV      "COMPANY_DAEMON_IO_IDLE"      /* "1" puts backup workers in the idle I/O class */
+
+/* A waiting copier re-reads the limits at least this often (seconds) */
+#define THROTTLE_MAX_SLEEP 0.1
+
+/**
+ * Create the shared token bucket. Must run before worker processes are
+ * forked so that they share one bucket with the daemon, which is what
+ * lets limits changed over IPC reach a backup that is already running.
+ * Without it, copies are never throttled.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int throttle_init(void);
+
+/**
+ * Change the I/O limits, taking effect immediately for every process
+ * @param bytes_per_sec Bandwidth limit, 0 for unlimited
+ * @param ops_per_sec Copy operation limit, 0 for unlimited
+ */
+void set_io_limits(long long bytes_per_sec, long long ops_per_sec);
+
+/**
+ * Get the current I/O limits
+ * @param bytes_per_sec Receives the bandwidth limit (may be NULL)
+ * @param ops_per_sec Receives the operation limit (may be NULL)
+ */
+void get_io_limits(long long* bytes_per_sec, long long* ops_per_sec);
+
+/**
+ * Choose whether backup workers run in the idle I/O scheduling class
+ * @param enabled TRUE or FALSE
+ */
+void set_io_idle(int enabled);
+
+/**
+ * Check whether backup workers should run in the idle I/O scheduling class
+ * @return TRUE or FALSE
+ */
+int get_io_idle(void);
+
+/**
+ * Parse a rate such as "20M" or "500"
+ * @param text Rate text
+ * @return Rate, or -1 if the text is not a valid rate
+ */
+long long parse_io_rate(const char* text);
+
+/**
+ * Account for one read/write of a copy, sleeping until the bucket allows it
+ * @param bytes Bytes about to be transferred
+ */
+void throttle_io(size_t bytes);
+
+#endif /* THROTTLE_H */
@@ -7,17 +7,39 @@
 #include <time.h>
 #include <syslog.h>
 #include <errno.h>
+#include "paths.h"
 
 /* Predefined constants from the original header */
 #define MAX_TIME_LENGTH 64
 #define MAX_PATH_LENGTH 1024
-#define ERROR_LOG      "/var/log/company_daemon.log"
-#define OPERATION_LOG  "/var/log/company_daemon.log"
-#define CHANGE_LOG     "/var/log/company_changes.log"
+#define ERROR_LOG      (get_daemon_paths()->operation_log)
+#define OPERATION_LOG  (get_daemon_paths()->operation_log)
+#define CHANGE_LOG     (get_daemon_paths()->change_log)
 
 #define MAX_LOG_SIZE (10 * 1024 * 1024)  /* 10 MB max log size */
 #define MAX_LOG_BACKUPS 5                /* Keep 5 rotated logs */
 
+/* Log levels, most severe first. Messages above the current level are
+ * dropped before any formatting or I/O takes place. */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+#define DEFAULT_LOG_LEVEL LOG_LEVEL_INFO
+#define LOG_LEVEL_ENV "COMPANY_DAEMON_LOG_LEVEL" /* Environment override */
+
+/* Per call site rate limiting (token bucket keyed by format string).
+ * Info and debug sites get a short burst window for per-file loops; error
+ * and warning sites refill over minutes so a failure repeated every few
+ * seconds by the periodic checks is also held back. */
+#define LOG_RATE_BURST      20   /* Info/debug messages a call site may emit at once */
+#define LOG_RATE_REFILL     2    /* Info/debug tokens regained per second */
+#define LOG_ERROR_RATE_BURST  10   /* Errors/warnings a call site may emit at once */
+#define LOG_ERROR_RATE_WINDOW 600  /* Seconds to regain the whole error/warning burst */
+#define LOG_RATE_SLOTS      256  /* Call sites tracked (power of two) */
+#define LOG_REPEAT_FLUSH    30   /* Seconds before a pending repeat summary is written */
+#define MAX_LOG_MESSAGE     2048 /* Longest formatted log message */
+
 /**
  * Log an error message
  * @param format Format string for the message
@@ -32,6 +54,52 @@ void log_error(const char* format, ...);
  */
 void log_operation(const char* format, ...);
 
+/**
+ * Log a warning message
+ * @param format Format string for the message
+ * @param ... Variable arguments
+ */
+void log_warning(const char* format, ...);
+
+/**
+ * Log a debug message
+ * @param format Format string for the message
+ * @param ... Variable arguments
+ */
+void log_debug(const char* format, ...);
+
+/**
+ * Set the runtime log level
+ * @param level One of the LOG_LEVEL_* values
+ */
+void set_log_level(int level);
+
+/**
+ * Get the runtime log level
+ * @return Current LOG_LEVEL_* value
+ */
+int get_log_level(void);
+
+/**
+ * Parse a log level name ("error", "warn", "info", "debug") or number
+ * @param name Level name
+ * @return LOG_LEVEL_* value, or -1 if the name is not recognised
+ */
+int parse_log_level(const char* name);
+
+/**
+ * Write any pending "last message repeated N times" summary that has
+ * been held back for longer than LOG_REPEAT_FLUSH seconds
+ */
+void log_flush_repeats(void);
+
+/**
+ * Move the calling thread to the idle I/O scheduling class, so its disk
+ * I/O only runs when nothing else needs the device
+ * @return SUCCESS on success, FAILURE on error
+ */
+int set_idle_io_priority(void);
+
 /**
  * Get a formatted timestamp string
  * @param timestamp Timestamp to format
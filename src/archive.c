@@ -0,0 +1,743 @@
+/**
+ * @file archive.c
+ * @brief Single-file compressed snapshot archives with a trailing index
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "archive.h"
+#include "hash.h"
+#include "throttle.h"
+#include "utils.h"
+#include "backup.h"
+#include "file_operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define MEMBER_HEADER_SIZE  44  /* Fixed part of a member header */
+#define INDEX_RECORD_SIZE   48  /* Fixed part of an index record */
+#define ARCHIVE_BUFFER_SIZE (64 * 1024)  /* Streaming buffers for member data */
+
+/**
+ * Structure for an archive being written
+ */
+typedef struct {
+    FILE* fp;              /* Archive stream */
+    uint64_t offset;       /* Bytes written so far */
+    ArchiveEntry* entries; /* Members written, for the index */
+    uint32_t count;        /* Members written */
+    uint32_t capacity;     /* Allocated entries */
+    int broken;            /* Stream no longer matches offset, archive must be abandoned */
+} ArchiveWriter;
+
+static void put_u16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        p[i] = (unsigned char)(v >> (i * 8));
+    }
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        p[i] = (unsigned char)(v >> (i * 8));
+    }
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/**
+ * Write bytes to the archive and advance the offset
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int writer_put(ArchiveWriter *writer, const void *data, size_t len)
+{
+    if (len > 0 && fwrite(data, 1, len, writer->fp) != len)
+    {
+        log_error("Failed to write archive: %s", strerror(errno));
+        return FAILURE;
+    }
+    writer->offset += len;
+    return SUCCESS;
+}
+
+/**
+ * Drop everything written from an offset on, so a failed member leaves
+ * no trace in the archive
+ * @return SUCCESS on success, FAILURE on error (the writer is then broken)
+ */
+static int writer_rewind(ArchiveWriter *writer, uint64_t offset)
+{
+    if (fflush(writer->fp) != 0 || ftruncate(fileno(writer->fp), (off_t)offset) != 0 ||
+        fseeko(writer->fp, (off_t)offset, SEEK_SET) != 0)
+    {
+        log_error("Failed to rewind archive: %s", strerror(errno));
+        writer->broken = TRUE;
+        return FAILURE;
+    }
+    writer->offset = offset;
+    return SUCCESS;
+}
+
+/**
+ * Encode a member header
+ * @param header Buffer of MEMBER_HEADER_SIZE bytes
+ * @param entry Member to describe
+ * @param name_len Length of the member name
+ */
+static void encode_member_header(unsigned char *header, const ArchiveEntry *entry, size_t name_len)
+{
+    put_u32(header, ARCHIVE_MEMBER_MAGIC);
+    put_u16(header + 4, (uint16_t)name_len);
+    header[6] = (unsigned char)entry->compression;
+    header[7] = 0;
+    put_u64(header + 8, entry->size);
+    put_u64(header + 16, entry->compressed_size);
+    put_u64(header + 24, (uint64_t)entry->mtime);
+    put_u32(header + 32, entry->mode);
+    put_u64(header + 36, entry->hash);
+}
+
+/**
+ * Stream a file through deflate into the archive
+ * @param writer Archive being written
+ * @param fd File to read until EOF
+ * @param entry Member being written; size, compressed_size and hash are set
+ * @param in_buffer Input buffer of ARCHIVE_BUFFER_SIZE bytes; holds the
+ *        whole file on return when it fitted in one read
+ * @param reads Receives the number of reads that returned data
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int deflate_member(ArchiveWriter *writer, int fd, ArchiveEntry *entry,
+                          unsigned char *in_buffer, int *reads)
+{
+    unsigned char out_buffer[ARCHIVE_BUFFER_SIZE];
+    z_stream stream;
+    HashState state;
+    int flush = Z_NO_FLUSH;
+    int result = SUCCESS;
+
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        log_error("Failed to start compression for %s", entry->name);
+        return FAILURE;
+    }
+    hash_init(&state, HASH_SEED);
+    entry->size = 0;
+    *reads = 0;
+
+    while (result == SUCCESS && flush != Z_FINISH)
+    {
+        ssize_t got = read(fd, in_buffer, ARCHIVE_BUFFER_SIZE);
+
+        if (got < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_error("Failed to read %s for archiving: %s", entry->name, strerror(errno));
+            result = FAILURE;
+            break;
+        }
+        if (got == 0)
+        {
+            flush = Z_FINISH;
+        }
+        else
+        {
+            throttle_io((size_t)got);
+            hash_update(&state, in_buffer, (size_t)got);
+            entry->size += (uint64_t)got;
+            (*reads)++;
+        }
+
+        stream.next_in = in_buffer;
+        stream.avail_in = (uInt)got;
+        do
+        {
+            stream.next_out = out_buffer;
+            stream.avail_out = sizeof(out_buffer);
+            if (deflate(&stream, flush) == Z_STREAM_ERROR ||
+                writer_put(writer, out_buffer, sizeof(out_buffer) - stream.avail_out) != SUCCESS)
+            {
+                result = FAILURE;
+                break;
+            }
+        } while (stream.avail_out == 0);
+    }
+
+    entry->compressed_size = stream.total_out;
+    entry->hash = hash_final(&state);
+    deflateEnd(&stream);
+    return result;
+}
+
+/**
+ * Append one file to the archive. The data is streamed through fixed
+ * buffers and the header, written first as a placeholder, is filled in
+ * afterwards from the bytes actually read.
+ * @param writer Archive being written
+ * @param path Path to the file
+ * @param name Member name
+ * @param st Stat information for the file
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int archive_add_file(ArchiveWriter *writer, const char *path, const char *name, const struct stat *st)
+{
+    unsigned char header[MEMBER_HEADER_SIZE];
+    unsigned char in_buffer[ARCHIVE_BUFFER_SIZE];
+    size_t name_len = strlen(name);
+    ArchiveEntry *entry;
+    int reads = 0;
+    int result;
+    int fd;
+
+    if (name_len >= ARCHIVE_NAME_LENGTH)
+    {
+        log_error("File name too long for archive: %s", name);
+        return FAILURE;
+    }
+
+    if (writer->count >= writer->capacity)
+    {
+        uint32_t new_capacity = (writer->capacity == 0) ? 64 : writer->capacity * 2;
+        ArchiveEntry *grown = (ArchiveEntry *)realloc(writer->entries, new_capacity * sizeof(ArchiveEntry));
+
+        if (grown == NULL)
+        {
+            log_error("Memory allocation failed for archive index");
+            return FAILURE;
+        }
+        writer->entries = grown;
+        writer->capacity = new_capacity;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        log_error("Failed to open %s for archiving: %s", path, strerror(errno));
+        return FAILURE;
+    }
+
+    entry = &writer->entries[writer->count];
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->name, name, name_len + 1);
+    entry->offset = writer->offset;
+    entry->data_offset = writer->offset + MEMBER_HEADER_SIZE + name_len;
+    entry->mtime = (int64_t)st->st_mtime;
+    entry->mode = (uint32_t)(st->st_mode & 07777);
+    entry->compression = ARCHIVE_GZIP;
+    encode_member_header(header, entry, name_len);
+
+    result = writer_put(writer, header, sizeof(header));
+    if (result == SUCCESS)
+    {
+        result = writer_put(writer, name, name_len);
+    }
+    if (result == SUCCESS)
+    {
+        result = deflate_member(writer, fd, entry, in_buffer, &reads);
+    }
+    close(fd);
+
+    /* A file read in one go is kept as is when compression did not shrink it */
+    if (result == SUCCESS && reads <= 1 && entry->compressed_size >= entry->size)
+    {
+        result = writer_rewind(writer, entry->data_offset);
+        if (result == SUCCESS)
+        {
+            result = writer_put(writer, in_buffer, (size_t)entry->size);
+        }
+        entry->compression = ARCHIVE_STORED;
+        entry->compressed_size = entry->size;
+    }
+
+    if (result == SUCCESS && entry->size != (uint64_t)st->st_size)
+    {
+        log_warning("%s changed size while being archived, recorded the %llu bytes read",
+                    name, (unsigned long long)entry->size);
+    }
+
+    /* Fill in the placeholder header now the sizes and hash are known */
+    if (result == SUCCESS)
+    {
+        encode_member_header(header, entry, name_len);
+        if (fflush(writer->fp) != 0 ||
+            pwrite(fileno(writer->fp), header, sizeof(header), (off_t)entry->offset) != (ssize_t)sizeof(header))
+        {
+            log_error("Failed to write archive: %s", strerror(errno));
+            result = FAILURE;
+        }
+    }
+
+    if (result == SUCCESS)
+    {
+        writer->count++;
+    }
+    else if (!writer->broken)
+    {
+        writer_rewind(writer, entry->offset);
+    }
+
+    return result;
+}
+
+/**
+ * Append the index and trailer to the archive
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int archive_write_index(ArchiveWriter *writer)
+{
+    unsigned char trailer[ARCHIVE_TRAILER_SIZE];
+    uint64_t index_offset = writer->offset;
+    uint32_t i;
+
+    for (i = 0; i < writer->count; i++)
+    {
+        const ArchiveEntry *entry = &writer->entries[i];
+        unsigned char record[INDEX_RECORD_SIZE];
+        size_t name_len = strlen(entry->name);
+
+        put_u16(record, (uint16_t)name_len);
+        record[2] = (unsigned char)entry->compression;
+        record[3] = 0;
+        put_u64(record + 4, entry->offset);
+        put_u64(record + 12, entry->size);
+        put_u64(record + 20, entry->compressed_size);
+        put_u64(record + 28, (uint64_t)entry->mtime);
+        put_u32(record + 36, entry->mode);
+        put_u64(record + 40, entry->hash);
+
+        if (writer_put(writer, record, sizeof(record)) != SUCCESS ||
+            writer_put(writer, entry->name, name_len) != SUCCESS)
+        {
+            return FAILURE;
+        }
+    }
+
+    put_u64(trailer, index_offset);
+    put_u32(trailer + 8, writer->count);
+    put_u32(trailer + 12, 0);
+    memcpy(trailer + 16, ARCHIVE_INDEX_MAGIC, 8);
+
+    return writer_put(writer, trailer, sizeof(trailer));
+}
+
+/**
+ * Write every file in a directory into a new compressed archive
+ * @param source_dir Directory to archive
+ * @param archive_path Path of the archive to create
+ * @return SUCCESS on success, FAILURE on error
+ */
+int archive_backup(const char *source_dir, const char *archive_path)
+{
+    ArchiveWriter writer;
+    char temp_path[MAX_PATH_LENGTH];
+    struct dirent *entry;
+    DIR *dir;
+    int file_count = 0;
+    uint64_t logical_bytes = 0;
+    int result = SUCCESS;
+
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", archive_path) >= (int)sizeof(temp_path))
+    {
+        log_error("Archive path too long: %s", archive_path);
+        return FAILURE;
+    }
+
+    dir = opendir(source_dir);
+    if (dir == NULL)
+    {
+        log_error("Failed to open %s for archiving: %s", source_dir, strerror(errno));
+        return FAILURE;
+    }
+
+    memset(&writer, 0, sizeof(writer));
+    writer.fp = fopen(temp_path, "w");
+    if (writer.fp == NULL)
+    {
+        log_error("Failed to create archive %s: %s", temp_path, strerror(errno));
+        closedir(dir);
+        return FAILURE;
+    }
+
+    if (writer_put(&writer, ARCHIVE_MAGIC, 8) != SUCCESS)
+    {
+        result = FAILURE;
+    }
+
+    while (result == SUCCESS && (entry = readdir(dir)) != NULL)
+    {
+        char path[MAX_PATH_LENGTH];
+        struct stat st;
+
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        if (snprintf(path, sizeof(path), "%s/%s", source_dir, entry->d_name) >= (int)sizeof(path) ||
+            stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+
+        file_count++;
+        if (archive_add_file(&writer, path, entry->d_name, &st) == SUCCESS)
+        {
+            logical_bytes += (uint64_t)st.st_size;
+        }
+        else
+        {
+            log_error("Failed to archive file: %s", entry->d_name);
+            /* A failed write leaves the stream in an unknown state */
+            if (writer.broken || ferror(writer.fp))
+            {
+                result = FAILURE;
+            }
+        }
+    }
+
+    closedir(dir);
+
+    if (result == SUCCESS)
+    {
+        result = archive_write_index(&writer);
+    }
+
+    if (result == SUCCESS && (fflush(writer.fp) != 0 || fsync(fileno(writer.fp)) != 0))
+    {
+        log_error("Failed to flush archive %s: %s", temp_path, strerror(errno));
+        result = FAILURE;
+    }
+
+    fclose(writer.fp);
+
+    if (result == SUCCESS && rename(temp_path, archive_path) != 0)
+    {
+        log_error("Failed to install archive %s: %s", archive_path, strerror(errno));
+        result = FAILURE;
+    }
+
+    if (result != SUCCESS)
+    {
+        unlink(temp_path);
+    }
+    else
+    {
+        log_operation("Archive backup: %u/%d files, %llu bytes stored as %llu bytes",
+                      writer.count, file_count, (unsigned long long)logical_bytes,
+                      (unsigned long long)writer.offset);
+        if ((int)writer.count != file_count)
+        {
+            result = (writer.count > 0) ? SUCCESS : FAILURE;
+        }
+    }
+
+    free(writer.entries);
+    return result;
+}
+
+/**
+ * Read the trailing index of an archive
+ * @param archive_path Path to the archive
+ * @param index Receives the index
+ * @return SUCCESS on success, FAILURE on error
+ */
+int load_archive_index(const char *archive_path, ArchiveIndex *index)
+{
+    unsigned char trailer[ARCHIVE_TRAILER_SIZE];
+    unsigned char *records = NULL;
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t index_offset;
+    size_t index_size;
+    struct stat st;
+    uint32_t i;
+    int fd;
+
+    index->entries = NULL;
+    index->count = 0;
+
+    fd = open(archive_path, O_RDONLY);
+    if (fd == -1)
+    {
+        log_error("Failed to open archive %s: %s", archive_path, strerror(errno));
+        return FAILURE;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < 8 + ARCHIVE_TRAILER_SIZE ||
+        pread(fd, trailer, sizeof(trailer), st.st_size - ARCHIVE_TRAILER_SIZE) != (ssize_t)sizeof(trailer) ||
+        memcmp(trailer + 16, ARCHIVE_INDEX_MAGIC, 8) != 0)
+    {
+        log_error("Archive %s has no valid trailer", archive_path);
+        close(fd);
+        return FAILURE;
+    }
+
+    index_offset = get_u64(trailer);
+    if (index_offset < 8 || index_offset > (uint64_t)st.st_size - ARCHIVE_TRAILER_SIZE)
+    {
+        log_error("Archive %s has a corrupt trailer", archive_path);
+        close(fd);
+        return FAILURE;
+    }
+
+    index_size = (size_t)((uint64_t)st.st_size - ARCHIVE_TRAILER_SIZE - index_offset);
+    index->count = get_u32(trailer + 8);
+    records = (unsigned char *)malloc(index_size + 1);
+    index->entries = (ArchiveEntry *)calloc(index->count ? index->count : 1, sizeof(ArchiveEntry));
+    if (records == NULL || index->entries == NULL ||
+        pread(fd, records, index_size, (off_t)index_offset) != (ssize_t)index_size)
+    {
+        log_error("Failed to read index of archive %s", archive_path);
+        close(fd);
+        free(records);
+        free_archive_index(index);
+        return FAILURE;
+    }
+    close(fd);
+
+    p = records;
+    end = records + index_size;
+    for (i = 0; i < index->count; i++)
+    {
+        ArchiveEntry *entry = &index->entries[i];
+        size_t name_len;
+
+        if (p + INDEX_RECORD_SIZE > end)
+        {
+            break;
+        }
+
+        name_len = get_u16(p);
+        if (name_len >= ARCHIVE_NAME_LENGTH || p + INDEX_RECORD_SIZE + name_len > end)
+        {
+            break;
+        }
+
+        entry->compression = p[2];
+        entry->offset = get_u64(p + 4);
+        entry->size = get_u64(p + 12);
+        entry->compressed_size = get_u64(p + 20);
+        entry->mtime = (int64_t)get_u64(p + 28);
+        entry->mode = get_u32(p + 36);
+        entry->hash = get_u64(p + 40);
+        memcpy(entry->name, p + INDEX_RECORD_SIZE, name_len);
+        entry->name[name_len] = '\0';
+        entry->data_offset = entry->offset + MEMBER_HEADER_SIZE + name_len;
+
+        p += INDEX_RECORD_SIZE + name_len;
+    }
+
+    free(records);
+
+    if (i != index->count)
+    {
+        log_error("Archive %s has a truncated index", archive_path);
+        free_archive_index(index);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Look up a member by name
+ * @param index Archive index
+ * @param name File name
+ * @return Pointer to the entry or NULL if not present
+ */
+const ArchiveEntry *find_archive_entry(const ArchiveIndex *index, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < index->count; i++)
+    {
+        if (strcmp(index->entries[i].name, name) == 0)
+        {
+            return &index->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Write a whole buffer to a file descriptor
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int write_all(int fd, const unsigned char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return FAILURE;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Extract one member into an open file, verifying its hash
+ * @param archive_path Path to the archive
+ * @param entry Member to extract (from the archive's index)
+ * @param out_fd File descriptor to write the data to
+ * @return SUCCESS on success, FAILURE on error
+ */
+int archive_extract_entry(const char *archive_path, const ArchiveEntry *entry, int out_fd)
+{
+    unsigned char in_buffer[ARCHIVE_BUFFER_SIZE];
+    unsigned char out_buffer[ARCHIVE_BUFFER_SIZE];
+    uint64_t remaining = entry->compressed_size;
+    off_t offset = (off_t)entry->data_offset;
+    uint64_t produced = 0;
+    HashState state;
+    z_stream stream;
+    int result = SUCCESS;
+    int fd;
+
+    fd = open(archive_path, O_RDONLY);
+    if (fd == -1)
+    {
+        log_error("Failed to open archive %s: %s", archive_path, strerror(errno));
+        return FAILURE;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    if (entry->compression == ARCHIVE_GZIP && inflateInit2(&stream, 15 + 16) != Z_OK)
+    {
+        close(fd);
+        return FAILURE;
+    }
+
+    hash_init(&state, HASH_SEED);
+
+    /* Stream the member through inflate, reading only its own bytes */
+    while (remaining > 0 && result == SUCCESS)
+    {
+        size_t want = remaining < sizeof(in_buffer) ? (size_t)remaining : sizeof(in_buffer);
+        ssize_t got = pread(fd, in_buffer, want, offset);
+
+        if (got <= 0)
+        {
+            log_error("Failed to read member %s from %s", entry->name, archive_path);
+            result = FAILURE;
+            break;
+        }
+        offset += got;
+        remaining -= (uint64_t)got;
+
+        if (entry->compression == ARCHIVE_STORED)
+        {
+            hash_update(&state, in_buffer, (size_t)got);
+            produced += (uint64_t)got;
+            result = write_all(out_fd, in_buffer, (size_t)got);
+            continue;
+        }
+
+        stream.next_in = in_buffer;
+        stream.avail_in = (uInt)got;
+        do
+        {
+            int status;
+            size_t have;
+
+            stream.next_out = out_buffer;
+            stream.avail_out = sizeof(out_buffer);
+            status = inflate(&stream, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END)
+            {
+                log_error("Corrupt compressed data for %s in %s", entry->name, archive_path);
+                result = FAILURE;
+                break;
+            }
+
+            have = sizeof(out_buffer) - stream.avail_out;
+            hash_update(&state, out_buffer, have);
+            produced += have;
+            if (write_all(out_fd, out_buffer, have) != SUCCESS)
+            {
+                result = FAILURE;
+                break;
+            }
+        } while (stream.avail_out == 0);
+    }
+
+    if (entry->compression == ARCHIVE_GZIP)
+    {
+        inflateEnd(&stream);
+    }
+    close(fd);
+
+    if (result == SUCCESS && (produced != entry->size || hash_final(&state) != entry->hash))
+    {
+        log_error("Checksum mismatch extracting %s from %s", entry->name, archive_path);
+        result = FAILURE;
+    }
+
+    return result;
+}
+
+/**
+ * Free memory held by an archive index
+ * @param index Index to free
+ */
+void free_archive_index(ArchiveIndex *index)
+{
+    free(index->entries);
+    index->entries = NULL;
+    index->count = 0;
+}
@@ -1,21 +1,142 @@
-#define _DEFAULT_SOURCE  // For directory entry macros
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE  // For directory entry macros and F_OFD_SETLK
 
 #include "backup.h"
 #include "utils.h"
 #include "file_operations.h"
+#include "manifest.h"
+#include "hash.h"
+#include "chunk_store.h"
+#include "copy_pool.h"
+#include "retention.h"
+#include "archive.h"
+#include "throttle.h"
+#include "metrics.h"
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/* Backend used by backup_dashboard() */
+static int backup_mode = BACKUP_MODE_SNAPSHOT;
+
+/* How lock_directories() protects transfers */
+static int lock_mode = LOCK_MODE_FILE;
+
+/* Descriptor holding the OFD lock on LOCK_FILE, -1 when not locked */
+static int lock_fd = -1;
+
+/* When lock_directories() last succeeded, for blocked-time reporting */
+static struct timespec locked_since;
+
+/* Point-in-time view handed to the next backup_dashboard(), if any */
+static char backup_source[MAX_PATH_LENGTH];
 
 /**
- * Backup the dashboard directory
+ * Copies collected during the directory scan, run later by the copy pool
+ */
+typedef struct {
+    CopyJob *jobs;           /* Jobs for the pool */
+    ManifestEntry *records;  /* Manifest entry for each job */
+    int count;               /* Jobs queued */
+    int capacity;            /* Allocated jobs */
+} CopyQueue;
+
+/**
+ * Queue a file copy for the worker pool
+ * @param queue Queue to extend
+ * @param source Source path
+ * @param destination Destination path
+ * @param st Stat information for the source
+ * @param destination_device Device holding the destination directory
+ * @param record Manifest entry to record once the copy succeeds
  * @return SUCCESS on success, FAILURE on error
  */
-int backup_dashboard(void) {
+static int queue_copy(CopyQueue* queue, const char* source, const char* destination,
+                      const struct stat* st, dev_t destination_device, const ManifestEntry* record) {
+    CopyJob *job;
+    
+    if (queue->count >= queue->capacity) {
+        int new_capacity = (queue->capacity == 0) ? 64 : queue->capacity * 2;
+        CopyJob *new_jobs = (CopyJob *)realloc(queue->jobs, new_capacity * sizeof(CopyJob));
+        ManifestEntry *new_records;
+        
+        if (new_jobs == NULL) {
+            log_error("Memory allocation failed for backup copy queue");
+            return FAILURE;
+        }
+        queue->jobs = new_jobs;
+        
+        new_records = (ManifestEntry *)realloc(queue->records, new_capacity * sizeof(ManifestEntry));
+        if (new_records == NULL) {
+            log_error("Memory allocation failed for backup copy queue");
+            return FAILURE;
+        }
+        queue->records = new_records;
+        queue->capacity = new_capacity;
+    }
+    
+    job = &queue->jobs[queue->count];
+    snprintf(job->source, sizeof(job->source), "%s", source);
+    snprintf(job->destination, sizeof(job->destination), "%s", destination);
+    job->size = (long long)st->st_size;
+    job->source_device = st->st_dev;
+    job->destination_device = destination_device;
+    queue->records[queue->count] = *record;
+    queue->count++;
+    
+    return SUCCESS;
+}
+
+/**
+ * Check whether a dashboard file is unchanged since the previous snapshot
+ * @param previous Manifest of the previous snapshot
+ * @param name File name
+ * @param src_path Path to the dashboard file
+ * @param st Stat information for the dashboard file
+ * @param hash Receives the content hash when the file is unchanged
+ * @return TRUE if size, mtime and hash match the previous snapshot
+ */
+static int file_matches_previous(const SnapshotManifest* previous, const char* name,
+                                 const char* src_path, const struct stat* st, uint64_t* hash) {
+    const ManifestEntry *entry = find_manifest_entry(previous, name);
+
+    if (entry == NULL || entry->size != (long long)st->st_size ||
+        entry->mtime != (long long)st->st_mtime) {
+        return FALSE;
+    }
+
+    /* A file last modified before the previous snapshot started cannot have
+     * changed without moving its mtime, so the recorded hash still holds.
+     * Anything newer may have been rewritten within the same second. */
+    if (st->st_mtime < previous->created) {
+        *hash = entry->hash;
+        return TRUE;
+    }
+
+    if (hash_file(src_path, hash) != SUCCESS) {
+        return FALSE;
+    }
+
+    return *hash == entry->hash;
+}
+
+/**
+ * Back up a directory holding the dashboard's reports
+ * Unchanged files are hard-linked against the previous snapshot so only
+ * changed files are copied (rsync --link-dest style)
+ * @param source_dir Dashboard directory or a point-in-time view of it
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int backup_directory(const char* source_dir) {
     char backup_path[MAX_PATH_LENGTH];
+    char previous_path[MAX_PATH_LENGTH];
     time_t now;
     struct tm *tm_info;
     DIR *dir;
@@ -24,8 +145,14 @@ int backup_dashboard(void) {
     char dest_path[MAX_PATH_LENGTH];
     int success_count = 0;
     int file_count = 0;
-    
-    log_operation("Starting dashboard backup");
+    int linked_count = 0;
+    long long bytes_copied = 0;
+    int have_previous = FALSE;
+    SnapshotManifest previous;
+    SnapshotManifest current;
+    CopyQueue queue = {NULL, NULL, 0, 0};
+    CopyPoolStats stats;
+    struct stat backup_st;
     
     /* Get current time for backup folder name */
     now = time(NULL);
@@ -36,8 +163,8 @@ int backup_dashboard(void) {
     }
     
     /* Safely create backup path with timestamp */
-    int path_len = snprintf(backup_path, sizeof(backup_path), "%s/backup_%04d-%02d-%02d_%02d-%02d-%02d", 
-                 BACKUP_DIR, 
+    int path_len = snprintf(backup_path, sizeof(backup_path), "%s/%s%04d-%02d-%02d_%02d-%02d-%02d", 
+                 BACKUP_DIR, SNAPSHOT_PREFIX,
                  tm_info->tm_year + 1900, tm_info->tm_mon + 1, tm_info->tm_mday,
                  tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec);
     
@@ -47,48 +174,87 @@ int backup_dashboard(void) {
         return FAILURE;
     }
     
+    /* The chunked backend stores a manifest file instead of a directory */
+    if (backup_mode == BACKUP_MODE_CHUNKED) {
+        int result;
+        
+        strncat(backup_path, CHUNK_MANIFEST_SUFFIX, sizeof(backup_path) - strlen(backup_path) - 1);
+        result = chunk_store_backup(source_dir, backup_path, now);
+        cleanup_old_backups();
+        return result;
+    }
+    
+    /* The archive backend writes the whole backup as one file */
+    if (backup_mode == BACKUP_MODE_ARCHIVE) {
+        int result;
+        
+        strncat(backup_path, ARCHIVE_SUFFIX, sizeof(backup_path) - strlen(backup_path) - 1);
+        result = archive_backup(source_dir, backup_path);
+        cleanup_old_backups();
+        return result;
+    }
+    
+    /* Use the previous snapshot as the link target if it has a manifest */
+    if (find_latest_snapshot(previous_path, sizeof(previous_path), backup_path) == SUCCESS &&
+        load_snapshot_manifest(previous_path, &previous) == SUCCESS) {
+        have_previous = TRUE;
+        log_operation("Incremental backup against %s (%d files)", previous_path, previous.count);
+    } else {
+        log_operation("No previous snapshot manifest found, taking a full backup");
+    }
+    
     /* Create backup directory */
     if (mkdir(backup_path, 0755) != 0) {
         log_error("Failed to create backup directory: %s", strerror(errno));
+        if (have_previous) {
+            free_snapshot_manifest(&previous);
+        }
         return FAILURE;
     }
     
-    /* Open dashboard directory */
-    dir = opendir(DASHBOARD_DIR);
+    /* The copies' destination device, for the per-device limits */
+    if (stat(backup_path, &backup_st) != 0) {
+        log_error("Failed to stat backup directory %s: %s", backup_path, strerror(errno));
+        if (have_previous) {
+            free_snapshot_manifest(&previous);
+        }
+        return FAILURE;
+    }
+    
+    /* Open the directory being backed up, the dashboard or a view of it */
+    dir = opendir(source_dir);
     if (dir == NULL) {
-        log_error("Failed to open dashboard directory: %s", strerror(errno));
+        log_error("Failed to open %s for backup: %s", source_dir, strerror(errno));
+        if (have_previous) {
+            free_snapshot_manifest(&previous);
+        }
         return FAILURE;
     }
     
+    init_snapshot_manifest(&current, now);
+    
     /* Process each file in the directory */
     while ((entry = readdir(dir)) != NULL) {
         struct stat st;
-        char full_path[MAX_PATH_LENGTH];
+        ManifestEntry record;
 
         /* Skip special directory entries */
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
             continue;
         }
 
-        /* Construct the full path with careful bounds checking */
-        int full_path_len = snprintf(full_path, sizeof(full_path), "%s/%s", DASHBOARD_DIR, entry->d_name);
-        if (full_path_len < 0 || (size_t)full_path_len >= sizeof(full_path)) {
-            log_error("Path too long for file: %s", entry->d_name);
-            continue;
-        }
-        
-        /* Skip directories */
-        if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode)) {
-            continue;
-        }
-        
         /* Construct source path with careful bounds checking */
-        int src_path_len = snprintf(src_path, sizeof(src_path), "%s/%s", DASHBOARD_DIR, entry->d_name);
+        int src_path_len = snprintf(src_path, sizeof(src_path), "%s/%s", source_dir, entry->d_name);
         if (src_path_len < 0 || (size_t)src_path_len >= sizeof(src_path)) {
             log_error("Source path too long for file: %s", entry->d_name);
             continue;
         }
         
+        /* Skip directories and anything we cannot stat */
+        if (stat(src_path, &st) != 0 || S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        
         /* Construct destination path with careful bounds checking */
         int dest_path_len = snprintf(dest_path, sizeof(dest_path), "%s/%s", backup_path, entry->d_name);
         if (dest_path_len < 0 || (size_t)dest_path_len >= sizeof(dest_path)) {
@@ -96,21 +262,88 @@ int backup_dashboard(void) {
             continue;
         }
         
-        /* Copy the file */
+        if (strlen(entry->d_name) >= MANIFEST_NAME_LENGTH) {
+            log_error("File name too long for manifest: %s", entry->d_name);
+            continue;
+        }
+        strcpy(record.name, entry->d_name);
+        record.size = (long long)st.st_size;
+        record.mtime = (long long)st.st_mtime;
+        
         file_count++;
-        if (copy_file(src_path, dest_path) == SUCCESS) {
-            success_count++;
-        } else {
+        
+        /* Hard-link unchanged files against the previous snapshot */
+        if (have_previous &&
+            file_matches_previous(&previous, entry->d_name, src_path, &st, &record.hash)) {
+            char link_source[MAX_PATH_LENGTH];
+            
+            int link_len = snprintf(link_source, sizeof(link_source), "%s/%s", previous_path, entry->d_name);
+            if (link_len > 0 && (size_t)link_len < sizeof(link_source) &&
+                link(link_source, dest_path) == 0) {
+                linked_count++;
+                success_count++;
+                add_manifest_entry(&current, &record);
+                continue;
+            }
+            
+            /* EMLINK, EXDEV etc. fall through to a full copy */
+            log_error("Failed to link %s from previous snapshot, copying: %s",
+                      entry->d_name, strerror(errno));
+        }
+        
+        /* Queue the file for the parallel copier */
+        if (queue_copy(&queue, src_path, dest_path, &st, backup_st.st_dev, &record) != SUCCESS) {
             log_error("Failed to backup file: %s", entry->d_name);
         }
     }
     
     closedir(dir);
+    
+    /* Copy changed files in parallel, limited per backing device */
+    if (queue.count > 0) {
+        int i;
+        
+        if (run_copy_pool(queue.jobs, queue.count, COPY_POOL_WORKERS, COPY_DEVICE_CONCURRENCY, &stats) != SUCCESS &&
+            stats.files == 0) {
+            log_error("Backup copy pool could not start, %d files not copied", queue.count);
+        }
+        
+        for (i = 0; i < queue.count; i++) {
+            if (queue.jobs[i].result == SUCCESS) {
+                queue.records[i].hash = queue.jobs[i].hash;
+                add_manifest_entry(&current, &queue.records[i]);
+                success_count++;
+                bytes_copied += queue.records[i].size;
+            } else {
+                log_error("Failed to backup file: %s", queue.records[i].name);
+            }
+        }
+        
+        log_operation("Backup copy: %d files, %.1f MB in %.3f s (%.1f MB/s), "
+                      "latency p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms",
+                      stats.files, (double)stats.bytes / (1024.0 * 1024.0), stats.elapsed,
+                      stats.mb_per_sec, stats.p50_ms, stats.p90_ms, stats.p99_ms, stats.max_ms);
+    }
+    
+    free(queue.jobs);
+    free(queue.records);
+    
+    /* Record what the snapshot holds so the next backup can link against it */
+    if (write_snapshot_manifest(backup_path, &current) != SUCCESS) {
+        log_error("Snapshot %s has no manifest, next backup will be a full copy", backup_path);
+    }
+    
+    free_snapshot_manifest(&current);
+    if (have_previous) {
+        free_snapshot_manifest(&previous);
+    }
 
     /* Clean up old backups */
     cleanup_old_backups();
     
     /* Log result */
+    log_operation("Backup summary: %d linked, %d copied (%lld bytes)",
+                  linked_count, success_count - linked_count, bytes_copied);
     if (success_count == file_count) {
         log_operation("Backup completed successfully: %d files", success_count);
         return SUCCESS;
@@ -120,21 +353,332 @@ int backup_dashboard(void) {
     }
 }
 
+/**
+ * Give one file of the dashboard view its own name: a reflink where the
+ * filesystem supports it (later in-place writes cannot leak into the
+ * backup), otherwise a hard link
+ * @param source Dashboard file
+ * @param destination Name in the view
+ * @param use_reflink Cleared when the filesystem cannot reflink
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int clone_into_view(const char* source, const char* destination, int* use_reflink) {
+    if (*use_reflink) {
+        int src_fd = open(source, O_RDONLY);
+        int dest_fd = (src_fd == -1) ? -1 : open(destination, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        int cloned = (dest_fd != -1 && ioctl(dest_fd, FICLONE, src_fd) == 0);
+        int clone_errno = errno;
+        struct stat st;
+        
+        if (cloned && fstat(src_fd, &st) == 0) {
+            fchmod(dest_fd, st.st_mode & 07777);
+            fchown(dest_fd, st.st_uid, st.st_gid);
+            /* Keep the source mtime so incremental backups still see the file as unchanged */
+            struct timespec times[2] = {st.st_atim, st.st_mtim};
+            futimens(dest_fd, times);
+        }
+        if (src_fd != -1) {
+            close(src_fd);
+        }
+        if (dest_fd != -1) {
+            close(dest_fd);
+        }
+        if (cloned) {
+            return SUCCESS;
+        }
+        if (dest_fd != -1) {
+            unlink(destination);
+        }
+        if (clone_errno != EOPNOTSUPP && clone_errno != ENOTTY && clone_errno != EINVAL && clone_errno != EXDEV) {
+            errno = clone_errno;
+            return FAILURE;
+        }
+        *use_reflink = FALSE;
+    }
+    
+    return (link(source, destination) == 0) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Take a point-in-time view of the dashboard: a hidden directory beside it
+ * holding a reflink or hard link of every report. Creating it takes
+ * microseconds per file and copies no data, so the backup can then read
+ * the view at leisure while transfers and readers use the dashboard.
+ * Reports are replaced by rename, so a hard-linked view keeps the
+ * version that was current when the view was taken.
+ * @param path Buffer to receive the view's path
+ * @param path_size Size of the buffer
+ * @return SUCCESS on success, FAILURE on error
+ */
+int create_dashboard_view(char* path, size_t path_size) {
+    struct dirent *entry;
+    int use_reflink = TRUE;
+    int linked = 0;
+    DIR *dir;
+    
+    if (snprintf(path, path_size, "%s/%sXXXXXX", DASHBOARD_VIEW_DIR, DASHBOARD_VIEW_PREFIX) >= (int)path_size ||
+        mkdtemp(path) == NULL) {
+        log_error("Failed to create dashboard view: %s", strerror(errno));
+        return FAILURE;
+    }
+    
+    dir = opendir(DASHBOARD_DIR);
+    if (dir == NULL) {
+        log_error("Failed to open dashboard directory: %s", strerror(errno));
+        rmdir(path);
+        return FAILURE;
+    }
+    
+    while ((entry = readdir(dir)) != NULL) {
+        char source[MAX_PATH_LENGTH];
+        char destination[MAX_PATH_LENGTH];
+        
+        /* Hidden entries are restore and rewrite temporaries */
+        if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) {
+            continue;
+        }
+        
+        if (snprintf(source, sizeof(source), "%s/%s", DASHBOARD_DIR, entry->d_name) >= (int)sizeof(source) ||
+            snprintf(destination, sizeof(destination), "%s/%s", path, entry->d_name) >= (int)sizeof(destination)) {
+            log_error("Path too long for dashboard view: %s", entry->d_name);
+            continue;
+        }
+        
+        if (clone_into_view(source, destination, &use_reflink) != SUCCESS) {
+            /* A report renamed away mid-scan is simply not in this view */
+            if (errno == ENOENT) {
+                continue;
+            }
+            log_error("Failed to add %s to dashboard view: %s", entry->d_name, strerror(errno));
+            closedir(dir);
+            remove_tree_at(AT_FDCWD, path);
+            return FAILURE;
+        }
+        linked++;
+    }
+    
+    closedir(dir);
+    log_operation("Dashboard view %s taken with %d %s", path, linked,
+                  use_reflink ? "reflinks" : "hard links");
+    return SUCCESS;
+}
+
+/**
+ * Remove dashboard views left behind by a backup that did not finish
+ */
+void remove_stale_dashboard_views(void) {
+    struct dirent *entry;
+    DIR *dir;
+    int fd;
+    
+    dir = opendir(DASHBOARD_VIEW_DIR);
+    if (dir == NULL) {
+        return;
+    }
+    
+    fd = dirfd(dir);
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, DASHBOARD_VIEW_PREFIX, strlen(DASHBOARD_VIEW_PREFIX)) == 0) {
+            log_operation("Removing stale dashboard view %s", entry->d_name);
+            remove_tree_at(fd, entry->d_name);
+        }
+    }
+    
+    closedir(dir);
+}
+
+/**
+ * Hand a dashboard view to the next backup_dashboard() call, which backs
+ * it up and then deletes it. Used to take the view in the daemon before
+ * forking the backup process.
+ * @param path View created by create_dashboard_view(), or NULL to clear
+ */
+void set_backup_source(const char* path) {
+    if (path == NULL) {
+        backup_source[0] = '\0';
+    } else {
+        snprintf(backup_source, sizeof(backup_source), "%s", path);
+    }
+}
 
 /**
- * Lock directories during backup/transfer operations
+ * Backup the dashboard directory from a point-in-time view of it, so that
+ * transfers running at the same time cannot leave the backup half-updated
+ * @return SUCCESS on success, FAILURE on error
+ */
+int backup_dashboard(void) {
+    char view[MAX_PATH_LENGTH];
+    int have_view = FALSE;
+    int result;
+    
+    log_operation("Starting dashboard backup");
+    
+    /* Copy pool threads inherit the I/O class of the backup process */
+    if (get_io_idle()) {
+        set_idle_io_priority();
+    }
+    
+    if (backup_source[0] != '\0') {
+        snprintf(view, sizeof(view), "%s", backup_source);
+        backup_source[0] = '\0';
+        have_view = TRUE;
+    } else if (create_dashboard_view(view, sizeof(view)) == SUCCESS) {
+        have_view = TRUE;
+    } else {
+        log_warning("Backing up the live dashboard directory instead of a view");
+    }
+    
+    result = backup_directory(have_view ? view : DASHBOARD_DIR);
+    
+    if (have_view && remove_tree_at(AT_FDCWD, view) != SUCCESS) {
+        log_error("Failed to remove dashboard view %s", view);
+    }
+    
+    return result;
+}
+
+/**
+ * Select the backup backend used by backup_dashboard()
+ * @param mode One of the BACKUP_MODE_* values
+ */
+void set_backup_mode(int mode) {
+    backup_mode = mode;
+}
+
+/**
+ * Get the backup backend used by backup_dashboard()
+ * @return Current BACKUP_MODE_* value
+ */
+int get_backup_mode(void) {
+    return backup_mode;
+}
+
+/**
+ * Parse a backup mode name ("snapshot", "chunked")
+ * @param name Mode name
+ * @return BACKUP_MODE_* value, or -1 if the name is not recognised
+ */
+int parse_backup_mode(const char* name) {
+    if (name == NULL) {
+        return -1;
+    }
+    if (strcmp(name, "snapshot") == 0) {
+        return BACKUP_MODE_SNAPSHOT;
+    }
+    if (strcmp(name, "chunked") == 0) {
+        return BACKUP_MODE_CHUNKED;
+    }
+    if (strcmp(name, "archive") == 0) {
+        return BACKUP_MODE_ARCHIVE;
+    }
+    return -1;
+}
+
+/**
+ * Find the most recent snapshot directory in BACKUP_DIR
+ * Snapshot names embed a zero-padded timestamp, so the greatest name is the newest
+ * @param path Buffer to receive the snapshot path
+ * @param path_size Size of the buffer
+ * @param exclude Snapshot path to ignore (may be NULL)
+ * @return SUCCESS if a snapshot was found, FAILURE otherwise
+ */
+int find_latest_snapshot(char* path, size_t path_size, const char* exclude) {
+    DIR *dir;
+    struct dirent *entry;
+    char latest[MAX_PATH_LENGTH] = "";
+    char candidate[MAX_PATH_LENGTH];
+    struct stat st;
+    
+    dir = opendir(BACKUP_DIR);
+    if (dir == NULL) {
+        log_error("Failed to open backup directory: %s", strerror(errno));
+        return FAILURE;
+    }
+    
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, SNAPSHOT_PREFIX, strlen(SNAPSHOT_PREFIX)) != 0 ||
+            strcmp(entry->d_name, latest) <= 0) {
+            continue;
+        }
+        
+        snprintf(candidate, sizeof(candidate), "%s/%s", BACKUP_DIR, entry->d_name);
+        if ((exclude != NULL && strcmp(candidate, exclude) == 0) ||
+            stat(candidate, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        
+        snprintf(latest, sizeof(latest), "%s", entry->d_name);
+    }
+    
+    closedir(dir);
+    
+    if (latest[0] == '\0') {
+        return FAILURE;
+    }
+    
+    snprintf(path, path_size, "%s/%s", BACKUP_DIR, latest);
+    return SUCCESS;
+}
+
+
+/**
+ * Select how lock_directories() protects transfers
+ * @param mode One of the LOCK_MODE_* values
+ */
+void set_lock_mode(int mode) {
+    lock_mode = mode;
+}
+
+/**
+ * Get how lock_directories() protects transfers
+ * @return Current LOCK_MODE_* value
+ */
+int get_lock_mode(void) {
+    return lock_mode;
+}
+
+/**
+ * Parse a lock mode name ("directory", "file")
+ * @param name Mode name
+ * @return LOCK_MODE_* value, or -1 if the name is not recognised
+ */
+int parse_lock_mode(const char* name) {
+    if (name == NULL) {
+        return -1;
+    }
+    if (strcmp(name, "directory") == 0) {
+        return LOCK_MODE_DIRECTORY;
+    }
+    if (strcmp(name, "file") == 0) {
+        return LOCK_MODE_FILE;
+    }
+    return -1;
+}
+
+/**
+ * Lock directories during backup/transfer operations. In LOCK_MODE_FILE
+ * only the lock file is taken; transfer_reports() then leases each upload
+ * it moves, so other uploads and dashboard reads carry on.
  * @return SUCCESS on success, FAILURE on error
  */
 int lock_directories(void) {
     int result = SUCCESS;
     
-    log_operation("Locking directories for backup/transfer");
+    log_operation("Locking directories for backup/transfer (%s mode)",
+                  lock_mode == LOCK_MODE_FILE ? "file" : "directory");
     
     /* Create lock file to prevent race conditions */
     if (create_lock_file() != SUCCESS) {
         return FAILURE;
     }
     
+    clock_gettime(CLOCK_MONOTONIC, &locked_since);
+    
+    /* Per-file leases are taken by the transfer itself */
+    if (lock_mode == LOCK_MODE_FILE) {
+        return SUCCESS;
+    }
+    
     /* Change permissions to prevent modifications */
     if (set_directory_permissions(UPLOAD_DIR, LOCKED_PERMISSIONS) != SUCCESS) {
         log_error("Failed to lock upload directory");
@@ -164,9 +708,21 @@ int lock_directories(void) {
  */
 int unlock_directories(void) {
     int result = SUCCESS;
+    struct timespec now;
     
     log_operation("Unlocking directories after backup/transfer");
     
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (lock_mode == LOCK_MODE_FILE) {
+        /* Nothing was chmod'ed; the transfer logs its per-file lease times */
+        log_operation("Lock held %.1f ms, directories never blocked",
+                      (now.tv_sec - locked_since.tv_sec) * 1000.0 + (now.tv_nsec - locked_since.tv_nsec) / 1e6);
+        return remove_lock_file();
+    }
+    
+    log_operation("Uploads and dashboard reads were blocked for %.1f ms",
+                  (now.tv_sec - locked_since.tv_sec) * 1000.0 + (now.tv_nsec - locked_since.tv_nsec) / 1e6);
+    
     /* Restore normal permissions */
     if (set_directory_permissions(UPLOAD_DIR, UPLOAD_PERMISSIONS) != SUCCESS) {
         log_error("Failed to unlock upload directory");
@@ -260,122 +816,176 @@ int is_directory_empty(const char* path) {
 
 /**
  * Delete old backups to prevent excessive disk usage
+ * Enforces the configured retention policy (see retention.h)
  * @return SUCCESS on success, FAILURE on error
  */
 int cleanup_old_backups(void) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat st;
-    char path[MAX_PATH_LENGTH];
-    time_t now;
-    time_t cutoff_time;
-    int backup_count = 0;
-    int deleted_count = 0;
-    
     log_operation("Cleaning up old backups");
     
-    /* Get current time */
-    now = time(NULL);
-    cutoff_time = now - MAX_BACKUP_AGE;
+    return apply_retention_policy();
+}
+
+/**
+ * Open (creating if needed) the persistent lock file
+ * @return File descriptor, or -1 on error
+ */
+static int open_lock_file(void) {
+    int fd = open(LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
     
-    /* Open backup directory */
-    dir = opendir(BACKUP_DIR);
-    if (dir == NULL) {
-        log_error("Failed to open backup directory: %s", strerror(errno));
+    if (fd == -1) {
+        log_error("Failed to open lock file %s: %s", LOCK_FILE, strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * Take the directory lock, waiting up to timeout_ms for the current holder.
+ * The lock is an OFD write lock on LOCK_FILE, so the kernel drops it when
+ * the holder exits or crashes and no stale lock can outlive a process.
+ * @param timeout_ms Milliseconds to keep retrying; 0 tries once
+ * @return SUCCESS on success, FAILURE on error or timeout
+ */
+int try_lock_file(int timeout_ms) {
+    struct flock lock;
+    struct timespec start, now, pause = {0, LOCK_RETRY_INTERVAL_MS * 1000000L};
+    char pid_str[16];
+    int pid_len;
+    int contended = FALSE;
+    double waited_ms;
+    int fd;
+    
+    if (lock_fd != -1) {
+        log_error("Directory lock is already held by this process");
         return FAILURE;
     }
     
-    /* Count backup directories */
-    while ((entry = readdir(dir)) != NULL) {
-        /* Skip special directory entries and non-directories */
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        /* Construct full path */
-        snprintf(path, MAX_PATH_LENGTH, "%s/%s", BACKUP_DIR, entry->d_name);
-        
-        /* Get file information */
-        if (stat(path, &st) != 0) {
-            log_error("Failed to get stats for backup %s: %s", path, strerror(errno));
-            continue;
+    fd = open_lock_file();
+    if (fd == -1) {
+        return FAILURE;
+    }
+    
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (fcntl(fd, F_OFD_SETLK, &lock) != 0) {
+        if (errno != EAGAIN && errno != EACCES) {
+            log_error("Failed to lock %s: %s", LOCK_FILE, strerror(errno));
+            close(fd);
+            return FAILURE;
         }
         
-        /* Only count directories starting with 'backup_' */
-        if (S_ISDIR(st.st_mode) && strncmp(entry->d_name, "backup_", 7) == 0) {
-            backup_count++;
-            
-            /* Delete old backups */
-            if (st.st_mtime < cutoff_time) {
-                log_operation("Deleting old backup: %s", entry->d_name);
-                if (rmdir(path) != 0) {
-                    log_error("Failed to delete old backup %s: %s", path, strerror(errno));
-                } else {
-                    deleted_count++;
-                }
-            }
+        contended = TRUE;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited_ms = (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_nsec - start.tv_nsec) / 1e6;
+        if (waited_ms >= timeout_ms) {
+            pid_len = pread(fd, pid_str, sizeof(pid_str) - 1, 0);
+            pid_str[pid_len > 0 ? pid_len : 0] = '\0';
+            log_error("Directory lock still held by PID %d after %d ms", atoi(pid_str), timeout_ms);
+            metrics_lock_timed_out(waited_ms);
+            close(fd);
+            return FAILURE;
         }
+        nanosleep(&pause, NULL);
     }
     
-    closedir(dir);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    waited_ms = (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_nsec - start.tv_nsec) / 1e6;
+    metrics_lock_acquired(waited_ms, contended);
     
-    log_operation("Backup cleanup completed: %d backups found, %d deleted", 
-                 backup_count, deleted_count);
+    /* The PID is informational only; the lock itself is what counts */
+    pid_len = snprintf(pid_str, sizeof(pid_str), "%d\n", getpid());
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, pid_str, pid_len, 0) != pid_len) {
+        log_warning("Failed to record PID in lock file: %s", strerror(errno));
+    }
     
+    lock_fd = fd;
     return SUCCESS;
 }
 
 /**
- * Create a lock file to prevent race conditions in directory locking
+ * Take the directory lock, waiting up to LOCK_WAIT_TIMEOUT_MS
  * @return SUCCESS on success, FAILURE on error
  */
 int create_lock_file(void) {
-    int fd;
-    
-    /* Try to create the lock file exclusively */
-    fd = open(LOCK_FILE, O_WRONLY | O_CREAT | O_EXCL, 0644);
-    
-    if (fd == -1) {
-        if (errno == EEXIST) {
-            log_error("Lock file already exists, another process is locking directories");
-        } else {
-            log_error("Failed to create lock file: %s", strerror(errno));
-        }
-        return FAILURE;
-    }
-    
-    /* Write process ID to the lock file */
-    char pid_str[16];
-    int pid_len = snprintf(pid_str, sizeof(pid_str), "%d\n", getpid());
-    
-    if (write(fd, pid_str, pid_len) != pid_len) {
-        log_error("Failed to write to lock file: %s", strerror(errno));
-        close(fd);
-        unlink(LOCK_FILE);
-        return FAILURE;
-    }
-    
-    close(fd);
-    return SUCCESS;
+    return try_lock_file(LOCK_WAIT_TIMEOUT_MS);
 }
 
 /**
- * Remove the lock file
+ * Release the directory lock. The file itself stays: unlinking it would
+ * let a waiter lock an inode that a new locker can no longer see.
  * @return SUCCESS on success, FAILURE on error
  */
 int remove_lock_file(void) {
-    if (unlink(LOCK_FILE) != 0 && errno != ENOENT) {
-        log_error("Failed to remove lock file: %s", strerror(errno));
-        return FAILURE;
+    if (lock_fd == -1) {
+        return SUCCESS;
+    }
+    
+    if (ftruncate(lock_fd, 0) != 0) {
+        log_warning("Failed to clear lock file: %s", strerror(errno));
     }
     
+    /* Closing the only descriptor releases the OFD lock */
+    close(lock_fd);
+    lock_fd = -1;
+    metrics_lock_released();
     return SUCCESS;
 }
 
 /**
- * Check if the directories are locked
+ * Check if the directories are locked, by this or any other process.
+ * A single F_OFD_GETLK on a cached descriptor; nothing is created or raced.
  * @return TRUE if locked, FALSE if not
  */
 int are_directories_locked(void) {
-    return (access(LOCK_FILE, F_OK) == 0);
-}
\ No newline at end of file
+    static int probe_fd = -1;
+    struct flock lock;
+    
+    if (lock_fd != -1) {
+        return TRUE;
+    }
+    
+    if (probe_fd == -1) {
+        probe_fd = open(LOCK_FILE, O_RDONLY | O_CLOEXEC);
+        if (probe_fd == -1) {
+            /* Nobody has ever locked since the file was last removed */
+            return FALSE;
+        }
+    }
+    
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl(probe_fd, F_OFD_GETLK, &lock) != 0) {
+        return FALSE;
+    }
+    
+    return lock.l_type != F_UNLCK;
+}
+
+/**
+ * Undo a directory lock whose holder died: if nobody holds the lock but
+ * a directory is still at LOCKED_PERMISSIONS, restore its permissions
+ * @return SUCCESS on success, FAILURE on error
+ */
+int recover_directory_locks(void) {
+    struct stat st;
+    int result = SUCCESS;
+    
+    if (are_directories_locked()) {
+        return SUCCESS;
+    }
+    
+    if (stat(UPLOAD_DIR, &st) == 0 && (st.st_mode & 07777) == LOCKED_PERMISSIONS) {
+        log_warning("Upload directory left locked by a crashed process, unlocking");
+        result |= set_directory_permissions(UPLOAD_DIR, UPLOAD_PERMISSIONS);
+    }
+    
+    if (stat(DASHBOARD_DIR, &st) == 0 && (st.st_mode & 07777) == LOCKED_PERMISSIONS) {
+        log_warning("Dashboard directory left locked by a crashed process, unlocking");
+        result |= set_directory_permissions(DASHBOARD_DIR, DASHBOARD_PERMISSIONS);
+    }
+    
+    return (result == SUCCESS) ? SUCCESS : FAILURE;
+}
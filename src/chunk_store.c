@@ -0,0 +1,1159 @@
+/**
+ * @file chunk_store.c
+ * @brief Content-addressed, deduplicating backup store
+ *
+ * Files are split into content-defined chunks with a gear rolling hash,
+ * so an edit only changes the chunks around it. Each chunk is stored once
+ * under its SHA-256 and snapshots are small manifests listing chunks.
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "chunk_store.h"
+#include "hash.h"
+#include "utils.h"
+#include "backup.h"
+#include "file_operations.h"
+#include "throttle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CHUNK_BOUNDARY_SHIFT (64 - CHUNK_AVG_BITS)
+#define DIGEST_HEX_LENGTH    (SHA256_DIGEST_LENGTH * 2)
+
+/* Gear table for the rolling hash, filled on first use */
+static uint64_t gear_table[256];
+static int gear_table_ready = FALSE;
+
+/**
+ * Structure for the state of one chunked backup
+ */
+typedef struct {
+    long long stored_bytes;               /* Bytes of chunks new to the store */
+    unsigned char dirty_buckets[256];     /* Bucket directories that gained a chunk */
+    int new_buckets;                      /* Whether a bucket directory was created */
+} ChunkBackup;
+
+/**
+ * Structure collecting the set of chunks referenced by all manifests
+ */
+typedef struct {
+    unsigned char (*digests)[SHA256_DIGEST_LENGTH]; /* Sorted digests */
+    size_t count;                                   /* Digests in use */
+    size_t capacity;                                /* Allocated digests */
+    long long logical_bytes;                        /* Sum of file sizes */
+} ChunkReferences;
+
+/**
+ * Fill the gear table from a fixed splitmix64 sequence so chunk
+ * boundaries are stable across runs and hosts
+ */
+static void init_gear_table(void)
+{
+    uint64_t state = 0x5EED5EED5EED5EEDULL;
+    int i;
+
+    for (i = 0; i < 256; i++)
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+    gear_table_ready = TRUE;
+}
+
+/**
+ * Find the length of the next chunk
+ * @param data Remaining file data
+ * @param len Bytes remaining
+ * @return Length of the chunk starting at data
+ */
+static size_t find_chunk_boundary(const unsigned char *data, size_t len)
+{
+    size_t limit = (len < CHUNK_MAX_SIZE) ? len : CHUNK_MAX_SIZE;
+    uint64_t fingerprint = 0;
+    size_t i;
+
+    if (len <= CHUNK_MIN_SIZE)
+    {
+        return len;
+    }
+
+    /* The top bits of a gear hash depend on the last 64 bytes only */
+    for (i = CHUNK_MIN_SIZE; i < limit; i++)
+    {
+        fingerprint = (fingerprint << 1) + gear_table[data[i]];
+        if ((fingerprint >> CHUNK_BOUNDARY_SHIFT) == 0)
+        {
+            return i + 1;
+        }
+    }
+
+    return limit;
+}
+
+/**
+ * Format a digest as lowercase hex
+ * @param digest Digest to format
+ * @param hex Buffer of at least DIGEST_HEX_LENGTH + 1 bytes
+ */
+static void digest_to_hex(const unsigned char *digest, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+    {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+    }
+    hex[DIGEST_HEX_LENGTH] = '\0';
+}
+
+/**
+ * Parse a hex digest
+ * @param hex Hex string (at least DIGEST_HEX_LENGTH characters)
+ * @param digest Receives the parsed digest
+ * @return SUCCESS on success, FAILURE if the string is not a digest
+ */
+static int hex_to_digest(const char *hex, unsigned char *digest)
+{
+    int i;
+
+    for (i = 0; i < DIGEST_HEX_LENGTH; i++)
+    {
+        char c = hex[i];
+        int v;
+
+        if (c >= '0' && c <= '9')
+        {
+            v = c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            v = c - 'a' + 10;
+        }
+        else
+        {
+            return FAILURE;
+        }
+
+        if (i % 2 == 0)
+        {
+            digest[i / 2] = (unsigned char)(v << 4);
+        }
+        else
+        {
+            digest[i / 2] |= (unsigned char)v;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Store a chunk unless an identical one is already present
+ * @param data Chunk data
+ * @param len Chunk length
+ * @param digest Digest of the chunk
+ * @param hex Hex digest of the chunk
+ * @param backup Backup state, records new bytes and dirty buckets
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int store_chunk(const unsigned char *data, size_t len, const unsigned char *digest,
+                       const char *hex, ChunkBackup *backup)
+{
+    char dir_path[MAX_PATH_LENGTH];
+    char chunk_path[MAX_PATH_LENGTH];
+    char temp_path[MAX_PATH_LENGTH];
+    int fd;
+
+    if (snprintf(dir_path, sizeof(dir_path), "%s/%s/%.2s", BACKUP_DIR, CHUNK_STORE_NAME, hex) >= (int)sizeof(dir_path) ||
+        snprintf(chunk_path, sizeof(chunk_path), "%s/%s", dir_path, hex) >= (int)sizeof(chunk_path) ||
+        snprintf(temp_path, sizeof(temp_path), "%s/.tmp.%d.%.16s", dir_path, (int)getpid(), hex) >= (int)sizeof(temp_path))
+    {
+        log_error("Chunk path too long for %s", hex);
+        return FAILURE;
+    }
+
+    /* Already stored: this is the deduplication. Touching it keeps it
+     * inside the GC grace period until this backup's manifest is in place. */
+    if (utimensat(AT_FDCWD, chunk_path, NULL, 0) == 0)
+    {
+        return SUCCESS;
+    }
+    if (errno != ENOENT)
+    {
+        log_error("Failed to refresh chunk %s: %s", chunk_path, strerror(errno));
+        return FAILURE;
+    }
+
+    if (mkdir(dir_path, 0755) == 0)
+    {
+        backup->new_buckets = TRUE;
+    }
+    else if (errno != EEXIST)
+    {
+        log_error("Failed to create chunk directory %s: %s", dir_path, strerror(errno));
+        return FAILURE;
+    }
+
+    /* Write under a temporary name so a crash never leaves a torn chunk */
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        log_error("Failed to create chunk %s: %s", temp_path, strerror(errno));
+        return FAILURE;
+    }
+
+    throttle_io(len);
+    if (write(fd, data, len) != (ssize_t)len || fsync(fd) != 0)
+    {
+        log_error("Failed to write chunk %s: %s", temp_path, strerror(errno));
+        close(fd);
+        unlink(temp_path);
+        return FAILURE;
+    }
+    close(fd);
+
+    if (rename(temp_path, chunk_path) != 0)
+    {
+        log_error("Failed to install chunk %s: %s", chunk_path, strerror(errno));
+        unlink(temp_path);
+        return FAILURE;
+    }
+
+    backup->dirty_buckets[digest[0]] = TRUE;
+    backup->stored_bytes += (long long)len;
+    return SUCCESS;
+}
+
+/**
+ * Flush a directory's entries to disk
+ * @param path Directory path
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int sync_directory(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    int result = SUCCESS;
+
+    if (fd == -1 || fsync(fd) != 0)
+    {
+        log_error("Failed to sync directory %s: %s", path, strerror(errno));
+        result = FAILURE;
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return result;
+}
+
+/**
+ * Make the chunks written by a backup durable before its manifest refers to them
+ * @param store_path Chunk store directory
+ * @param backup Backup state listing the touched buckets
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int sync_chunk_buckets(const char *store_path, const ChunkBackup *backup)
+{
+    char bucket_path[MAX_PATH_LENGTH];
+    int result = SUCCESS;
+    int i;
+
+    for (i = 0; i < 256; i++)
+    {
+        if (backup->dirty_buckets[i])
+        {
+            if (snprintf(bucket_path, sizeof(bucket_path), "%s/%02x", store_path, i) >= (int)sizeof(bucket_path) ||
+                sync_directory(bucket_path) != SUCCESS)
+            {
+                result = FAILURE;
+            }
+        }
+    }
+
+    if (backup->new_buckets && sync_directory(store_path) != SUCCESS)
+    {
+        result = FAILURE;
+    }
+    return result;
+}
+
+/**
+ * Chunk one file into the store and append its entry to the manifest
+ * @param path Path to the file
+ * @param name File name recorded in the manifest
+ * @param st Stat information for the file
+ * @param manifest Open manifest stream
+ * @param backup Backup state, records new bytes and dirty buckets
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int chunk_file(const char *path, const char *name, const struct stat *st,
+                      FILE *manifest, ChunkBackup *backup)
+{
+    const unsigned char *data = NULL;
+    size_t size = (size_t)st->st_size;
+    size_t offset = 0;
+    int chunk_count = 0;
+    int result = SUCCESS;
+    char *entry = NULL;
+    size_t entry_size = 0;
+    uint64_t file_hash;
+    FILE *lines;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        log_error("Failed to open %s for chunking: %s", path, strerror(errno));
+        return FAILURE;
+    }
+
+    if (size > 0)
+    {
+        data = (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            log_error("Failed to map %s for chunking: %s", path, strerror(errno));
+            close(fd);
+            return FAILURE;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    /* Restore checks the rebuilt file against this as well as each chunk */
+    file_hash = hash_buffer(data, size);
+
+    /* The chunk lines are collected apart and only reach the manifest once
+     * every chunk is stored, so a failure never leaves a short file entry */
+    lines = open_memstream(&entry, &entry_size);
+    if (lines == NULL)
+    {
+        log_error("Memory allocation failed chunking %s", path);
+        if (data != NULL)
+        {
+            munmap((void *)data, size);
+        }
+        return FAILURE;
+    }
+
+    while (offset < size)
+    {
+        size_t len = find_chunk_boundary(data + offset, size - offset);
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        char hex[DIGEST_HEX_LENGTH + 1];
+
+        sha256_buffer(data + offset, len, digest);
+        digest_to_hex(digest, hex);
+
+        if (store_chunk(data + offset, len, digest, hex, backup) != SUCCESS)
+        {
+            result = FAILURE;
+            break;
+        }
+
+        fprintf(lines, "%s %zu\n", hex, len);
+        offset += len;
+        chunk_count++;
+    }
+
+    if (data != NULL)
+    {
+        munmap((void *)data, size);
+    }
+
+    if (fclose(lines) != 0)
+    {
+        result = FAILURE;
+    }
+    if (result == SUCCESS)
+    {
+        fprintf(manifest, "file %lld %lld %d %016" PRIx64 " %o %s\n", (long long)st->st_size,
+                (long long)st->st_mtime, chunk_count, file_hash, (unsigned int)(st->st_mode & 07777), name);
+        fwrite(entry, 1, entry_size, manifest);
+    }
+    free(entry);
+
+    return result;
+}
+
+/**
+ * Back up every file in a directory into the chunk store and write a
+ * snapshot manifest listing each file's chunks
+ * @param source_dir Directory to back up
+ * @param manifest_path Path of the snapshot manifest to create
+ * @param created Snapshot start time
+ * @return SUCCESS on success, FAILURE on error
+ */
+int chunk_store_backup(const char *source_dir, const char *manifest_path, time_t created)
+{
+    char store_path[MAX_PATH_LENGTH];
+    char temp_path[MAX_PATH_LENGTH];
+    DIR *dir;
+    struct dirent *entry;
+    FILE *manifest;
+    ChunkBackup backup;
+    long long logical_bytes = 0;
+    int file_count = 0;
+    int success_count = 0;
+    int store_fd;
+
+    if (!gear_table_ready)
+    {
+        init_gear_table();
+    }
+
+    memset(&backup, 0, sizeof(backup));
+
+    snprintf(store_path, sizeof(store_path), "%s/%s", BACKUP_DIR, CHUNK_STORE_NAME);
+    if (create_directory_if_not_exists(store_path) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    /* Shared with other backups, exclusive with the GC: a chunk this backup
+     * deduplicates against cannot be collected before the manifest exists */
+    store_fd = open(store_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store_fd == -1 || flock(store_fd, LOCK_SH) != 0)
+    {
+        log_error("Failed to lock chunk store %s: %s", store_path, strerror(errno));
+        if (store_fd != -1)
+        {
+            close(store_fd);
+        }
+        return FAILURE;
+    }
+
+    dir = opendir(source_dir);
+    if (dir == NULL)
+    {
+        log_error("Failed to open %s for chunked backup: %s", source_dir, strerror(errno));
+        close(store_fd);
+        return FAILURE;
+    }
+
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", manifest_path) >= (int)sizeof(temp_path))
+    {
+        log_error("Chunk manifest path too long: %s", manifest_path);
+        closedir(dir);
+        close(store_fd);
+        return FAILURE;
+    }
+
+    manifest = fopen(temp_path, "w");
+    if (manifest == NULL)
+    {
+        log_error("Failed to create chunk manifest %s: %s", temp_path, strerror(errno));
+        closedir(dir);
+        close(store_fd);
+        return FAILURE;
+    }
+
+    fprintf(manifest, "%s\ncreated %lld\n", CHUNK_MANIFEST_HEADER, (long long)created);
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char path[MAX_PATH_LENGTH];
+        struct stat st;
+
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        if (snprintf(path, sizeof(path), "%s/%s", source_dir, entry->d_name) >= (int)sizeof(path) ||
+            stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+
+        file_count++;
+        if (chunk_file(path, entry->d_name, &st, manifest, &backup) == SUCCESS)
+        {
+            success_count++;
+            logical_bytes += (long long)st.st_size;
+        }
+        else
+        {
+            log_error("Failed to back up %s into chunk store", entry->d_name);
+        }
+    }
+
+    closedir(dir);
+
+    /* Chunks and their directory entries must be on disk before a manifest names them */
+    if (sync_chunk_buckets(store_path, &backup) != SUCCESS ||
+        fflush(manifest) != 0 || fsync(fileno(manifest)) != 0)
+    {
+        log_error("Failed to write chunk manifest %s: %s", temp_path, strerror(errno));
+        fclose(manifest);
+        unlink(temp_path);
+        close(store_fd);
+        return FAILURE;
+    }
+    fclose(manifest);
+
+    if (rename(temp_path, manifest_path) != 0)
+    {
+        log_error("Failed to install chunk manifest %s: %s", manifest_path, strerror(errno));
+        unlink(temp_path);
+        close(store_fd);
+        return FAILURE;
+    }
+    close(store_fd);
+
+    log_operation("Chunked backup: %d/%d files, %lld logical bytes, %lld new bytes stored (%.1fx dedup)",
+                  success_count, file_count, logical_bytes, backup.stored_bytes,
+                  backup.stored_bytes > 0 ? (double)logical_bytes / (double)backup.stored_bytes : 0.0);
+
+    if (success_count == file_count)
+    {
+        return SUCCESS;
+    }
+    return (success_count > 0) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Add a file to a chunk manifest being loaded
+ * @return Pointer to the new file, NULL on allocation failure
+ */
+static ChunkFile *add_chunk_file(ChunkManifest *manifest, int *capacity)
+{
+    if (manifest->count >= *capacity)
+    {
+        int new_capacity = (*capacity == 0) ? 64 : *capacity * 2;
+        ChunkFile *grown = (ChunkFile *)realloc(manifest->files, new_capacity * sizeof(ChunkFile));
+
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        manifest->files = grown;
+        *capacity = new_capacity;
+    }
+
+    memset(&manifest->files[manifest->count], 0, sizeof(ChunkFile));
+    manifest->files[manifest->count].first_chunk = manifest->chunk_count;
+    return &manifest->files[manifest->count++];
+}
+
+/**
+ * Add a chunk to a chunk manifest being loaded
+ * @return Pointer to the new chunk, NULL on allocation failure
+ */
+static ChunkRef *add_chunk_ref(ChunkManifest *manifest, size_t *capacity)
+{
+    if (manifest->chunk_count >= *capacity)
+    {
+        size_t new_capacity = (*capacity == 0) ? 1024 : *capacity * 2;
+        ChunkRef *grown = (ChunkRef *)realloc(manifest->chunks, new_capacity * sizeof(ChunkRef));
+
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        manifest->chunks = grown;
+        *capacity = new_capacity;
+    }
+
+    return &manifest->chunks[manifest->chunk_count++];
+}
+
+/**
+ * Parse the "file" line of a chunk manifest
+ * @param text Line after "file "
+ * @param version Manifest version, 1 or 2
+ * @param file File to fill in
+ * @return SUCCESS on success, FAILURE if the line is malformed
+ */
+static int parse_chunk_file_line(const char *text, int version, ChunkFile *file)
+{
+    size_t name_len;
+    int name_offset = -1;
+
+    if (version == 1)
+    {
+        sscanf(text, "%lld %lld %d %n", &file->size, &file->mtime, &file->chunk_count, &name_offset);
+    }
+    else
+    {
+        sscanf(text, "%lld %lld %d %" SCNx64 " %o %n", &file->size, &file->mtime, &file->chunk_count,
+               &file->hash, &file->mode, &name_offset);
+        file->has_hash = TRUE;
+    }
+    if (name_offset < 0 || file->size < 0 || file->chunk_count < 0)
+    {
+        return FAILURE;
+    }
+
+    name_len = strcspn(text + name_offset, "\n");
+    if (name_len == 0 || name_len >= sizeof(file->name))
+    {
+        return FAILURE;
+    }
+    memcpy(file->name, text + name_offset, name_len);
+    file->name[name_len] = '\0';
+    return SUCCESS;
+}
+
+/**
+ * Load a chunk manifest
+ * @param manifest_path Path to the manifest
+ * @param manifest Receives the manifest
+ * @return SUCCESS on success, FAILURE if it cannot be read or is malformed
+ */
+int load_chunk_manifest(const char *manifest_path, ChunkManifest *manifest)
+{
+    char line[MAX_PATH_LENGTH + 128];
+    ChunkFile *file = NULL;
+    int file_capacity = 0;
+    size_t chunk_capacity = 0;
+    int version;
+    int result = SUCCESS;
+    FILE *fp;
+
+    memset(manifest, 0, sizeof(*manifest));
+
+    fp = fopen(manifest_path, "r");
+    if (fp == NULL)
+    {
+        log_error("Failed to open chunk manifest %s: %s", manifest_path, strerror(errno));
+        return FAILURE;
+    }
+
+    if (fgets(line, sizeof(line), fp) == NULL)
+    {
+        line[0] = '\0';
+    }
+    line[strcspn(line, "\n")] = '\0';
+    if (strcmp(line, CHUNK_MANIFEST_HEADER) == 0)
+    {
+        version = 2;
+    }
+    else if (strcmp(line, CHUNK_MANIFEST_HEADER_V1) == 0)
+    {
+        version = 1;
+    }
+    else
+    {
+        log_error("%s is not a chunk manifest", manifest_path);
+        fclose(fp);
+        return FAILURE;
+    }
+
+    while (result == SUCCESS && fgets(line, sizeof(line), fp) != NULL)
+    {
+        long long created;
+
+        if (strncmp(line, "created ", 8) == 0 && sscanf(line + 8, "%lld", &created) == 1)
+        {
+            manifest->created = (time_t)created;
+        }
+        else if (strncmp(line, "file ", 5) == 0)
+        {
+            /* The previous file must have all its chunks before the next starts */
+            if (file != NULL && manifest->chunk_count - file->first_chunk != (size_t)file->chunk_count)
+            {
+                result = FAILURE;
+                break;
+            }
+            file = add_chunk_file(manifest, &file_capacity);
+            if (file == NULL || parse_chunk_file_line(line + 5, version, file) != SUCCESS)
+            {
+                result = FAILURE;
+            }
+        }
+        else
+        {
+            ChunkRef *chunk;
+            size_t length;
+
+            if (file == NULL || strlen(line) <= DIGEST_HEX_LENGTH || line[DIGEST_HEX_LENGTH] != ' ' ||
+                sscanf(line + DIGEST_HEX_LENGTH + 1, "%zu", &length) != 1 ||
+                (chunk = add_chunk_ref(manifest, &chunk_capacity)) == NULL ||
+                hex_to_digest(line, chunk->digest) != SUCCESS)
+            {
+                result = FAILURE;
+                break;
+            }
+            chunk->length = length;
+        }
+    }
+
+    if (result == SUCCESS && file != NULL && manifest->chunk_count - file->first_chunk != (size_t)file->chunk_count)
+    {
+        result = FAILURE;
+    }
+    fclose(fp);
+
+    if (result != SUCCESS)
+    {
+        log_error("Chunk manifest %s is malformed", manifest_path);
+        free_chunk_manifest(manifest);
+    }
+    return result;
+}
+
+/**
+ * Look up a file in a chunk manifest
+ * @param manifest Loaded manifest
+ * @param name File name
+ * @return Pointer to the file or NULL if not present
+ */
+const ChunkFile *find_chunk_file(const ChunkManifest *manifest, const char *name)
+{
+    int i;
+
+    for (i = 0; i < manifest->count; i++)
+    {
+        if (strcmp(manifest->files[i].name, name) == 0)
+        {
+            return &manifest->files[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Read one stored chunk and check it against its digest
+ * @param chunk Chunk to read
+ * @param buffer Buffer of at least CHUNK_MAX_SIZE bytes
+ * @return SUCCESS on success, FAILURE if missing, short or corrupt
+ */
+static int read_chunk(const ChunkRef *chunk, unsigned char *buffer)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char hex[DIGEST_HEX_LENGTH + 1];
+    char chunk_path[MAX_PATH_LENGTH];
+    struct stat st;
+    size_t done = 0;
+    int fd;
+
+    digest_to_hex(chunk->digest, hex);
+    if (chunk->length > CHUNK_MAX_SIZE ||
+        snprintf(chunk_path, sizeof(chunk_path), "%s/%s/%.2s/%s", BACKUP_DIR, CHUNK_STORE_NAME, hex, hex) >= (int)sizeof(chunk_path))
+    {
+        log_error("Invalid chunk %s in manifest", hex);
+        return FAILURE;
+    }
+
+    fd = open(chunk_path, O_RDONLY);
+    if (fd == -1)
+    {
+        log_error("Chunk %s is missing: %s", hex, strerror(errno));
+        return FAILURE;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size != (off_t)chunk->length)
+    {
+        log_error("Chunk %s is not the recorded %zu bytes", hex, chunk->length);
+        close(fd);
+        return FAILURE;
+    }
+
+    throttle_io(chunk->length);
+    while (done < chunk->length)
+    {
+        ssize_t got = read(fd, buffer + done, chunk->length - done);
+
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            break;
+        }
+        done += (size_t)got;
+    }
+    close(fd);
+
+    if (done != chunk->length)
+    {
+        log_error("Chunk %s is shorter than recorded", hex);
+        return FAILURE;
+    }
+
+    sha256_buffer(buffer, chunk->length, digest);
+    if (memcmp(digest, chunk->digest, SHA256_DIGEST_LENGTH) != 0)
+    {
+        log_error("Chunk %s is corrupt", hex);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Rebuild a file from its chunks into an open file, checking every chunk's
+ * SHA-256 and the whole file's size and hash
+ * @param manifest Manifest the file belongs to
+ * @param file File to rebuild
+ * @param out_fd File descriptor to write the data to
+ * @return SUCCESS on success, FAILURE on error or mismatch
+ */
+int chunk_store_extract(const ChunkManifest *manifest, const ChunkFile *file, int out_fd)
+{
+    unsigned char *buffer = (unsigned char *)malloc(CHUNK_MAX_SIZE);
+    long long produced = 0;
+    HashState state;
+    int result = SUCCESS;
+    int i;
+
+    if (buffer == NULL)
+    {
+        log_error("Memory allocation failed restoring %s", file->name);
+        return FAILURE;
+    }
+
+    hash_init(&state, HASH_SEED);
+    for (i = 0; i < file->chunk_count && result == SUCCESS; i++)
+    {
+        const ChunkRef *chunk = &manifest->chunks[file->first_chunk + i];
+        size_t written = 0;
+
+        result = read_chunk(chunk, buffer);
+        while (result == SUCCESS && written < chunk->length)
+        {
+            ssize_t n = write(out_fd, buffer + written, chunk->length - written);
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                log_error("Failed to write %s: %s", file->name, strerror(errno));
+                result = FAILURE;
+                break;
+            }
+            written += (size_t)n;
+        }
+        hash_update(&state, buffer, chunk->length);
+        produced += (long long)chunk->length;
+    }
+    free(buffer);
+
+    if (result == SUCCESS && produced != file->size)
+    {
+        log_error("%s rebuilt to %lld bytes, manifest says %lld", file->name, produced, file->size);
+        result = FAILURE;
+    }
+    if (result == SUCCESS && file->has_hash && hash_final(&state) != file->hash)
+    {
+        log_error("Checksum mismatch for %s rebuilt from chunks", file->name);
+        result = FAILURE;
+    }
+
+    return result;
+}
+
+/**
+ * Free memory held by a chunk manifest
+ * @param manifest Manifest to free
+ */
+void free_chunk_manifest(ChunkManifest *manifest)
+{
+    free(manifest->files);
+    free(manifest->chunks);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+/**
+ * Compare two digests for qsort/bsearch
+ */
+static int compare_digests(const void *a, const void *b)
+{
+    return memcmp(a, b, SHA256_DIGEST_LENGTH);
+}
+
+/**
+ * Read every chunk manifest in BACKUP_DIR and collect the chunks they reference
+ * @param refs Reference set to fill (sorted on return)
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int collect_chunk_references(ChunkReferences *refs)
+{
+    size_t suffix_len = strlen(CHUNK_MANIFEST_SUFFIX);
+    DIR *dir;
+    struct dirent *entry;
+
+    memset(refs, 0, sizeof(*refs));
+
+    dir = opendir(BACKUP_DIR);
+    if (dir == NULL)
+    {
+        log_error("Failed to open backup directory: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t name_len = strlen(entry->d_name);
+        char path[MAX_PATH_LENGTH];
+        char line[MAX_PATH_LENGTH + 128];
+        FILE *fp;
+
+        if (strncmp(entry->d_name, SNAPSHOT_PREFIX, strlen(SNAPSHOT_PREFIX)) != 0 ||
+            name_len <= suffix_len ||
+            strcmp(entry->d_name + name_len - suffix_len, CHUNK_MANIFEST_SUFFIX) != 0)
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", BACKUP_DIR, entry->d_name);
+        fp = fopen(path, "r");
+        if (fp == NULL)
+        {
+            log_error("Failed to open chunk manifest %s: %s", path, strerror(errno));
+            continue;
+        }
+
+        while (fgets(line, sizeof(line), fp) != NULL)
+        {
+            long long size;
+
+            if (strncmp(line, "file ", 5) == 0)
+            {
+                if (sscanf(line + 5, "%lld", &size) == 1)
+                {
+                    refs->logical_bytes += size;
+                }
+                continue;
+            }
+
+            if (refs->count >= refs->capacity)
+            {
+                size_t new_capacity = (refs->capacity == 0) ? 1024 : refs->capacity * 2;
+                void *grown = realloc(refs->digests, new_capacity * SHA256_DIGEST_LENGTH);
+
+                if (grown == NULL)
+                {
+                    log_error("Memory allocation failed for chunk references");
+                    fclose(fp);
+                    closedir(dir);
+                    free(refs->digests);
+                    refs->digests = NULL;
+                    return FAILURE;
+                }
+                refs->digests = grown;
+                refs->capacity = new_capacity;
+            }
+
+            if (hex_to_digest(line, refs->digests[refs->count]) == SUCCESS)
+            {
+                refs->count++;
+            }
+        }
+
+        fclose(fp);
+    }
+
+    closedir(dir);
+
+    if (refs->count > 1)
+    {
+        qsort(refs->digests, refs->count, SHA256_DIGEST_LENGTH, compare_digests);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Delete chunks no longer referenced by any snapshot manifest
+ * @return SUCCESS on success, FAILURE on error
+ */
+int chunk_store_gc(void)
+{
+    ChunkReferences refs;
+    char store_path[MAX_PATH_LENGTH];
+    DIR *store;
+    struct dirent *bucket;
+    time_t cutoff = time(NULL) - CHUNK_GC_GRACE;
+    long long freed_bytes = 0;
+    int removed = 0;
+
+    snprintf(store_path, sizeof(store_path), "%s/%s", BACKUP_DIR, CHUNK_STORE_NAME);
+    store = opendir(store_path);
+    if (store == NULL)
+    {
+        /* No chunk store, nothing to collect */
+        return SUCCESS;
+    }
+
+    /* A backup in progress may rely on chunks no manifest names yet;
+     * leave them for the next retention pass */
+    if (flock(dirfd(store), LOCK_EX | LOCK_NB) != 0)
+    {
+        log_operation("Chunk store garbage collection skipped: a chunked backup is running");
+        closedir(store);
+        return SUCCESS;
+    }
+
+    if (collect_chunk_references(&refs) != SUCCESS)
+    {
+        closedir(store);
+        return FAILURE;
+    }
+
+    /* Sweep every bucket directory for unreferenced chunks */
+    while ((bucket = readdir(store)) != NULL)
+    {
+        char bucket_path[MAX_PATH_LENGTH];
+        struct dirent *entry;
+        DIR *dir;
+
+        if (bucket->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        if (snprintf(bucket_path, sizeof(bucket_path), "%s/%s", store_path, bucket->d_name) >= (int)sizeof(bucket_path))
+        {
+            continue;
+        }
+        dir = opendir(bucket_path);
+        if (dir == NULL)
+        {
+            continue;
+        }
+
+        while ((entry = readdir(dir)) != NULL)
+        {
+            unsigned char digest[SHA256_DIGEST_LENGTH];
+            char chunk_path[MAX_PATH_LENGTH];
+            struct stat st;
+            int is_temp = (strncmp(entry->d_name, ".tmp.", 5) == 0);
+
+            if (!is_temp && (strlen(entry->d_name) != DIGEST_HEX_LENGTH ||
+                             hex_to_digest(entry->d_name, digest) != SUCCESS))
+            {
+                continue;
+            }
+
+            if (!is_temp && bsearch(digest, refs.digests, refs.count,
+                                    SHA256_DIGEST_LENGTH, compare_digests) != NULL)
+            {
+                continue;
+            }
+
+            if (snprintf(chunk_path, sizeof(chunk_path), "%s/%s", bucket_path, entry->d_name) >= (int)sizeof(chunk_path) ||
+                stat(chunk_path, &st) != 0 || st.st_mtime > cutoff)
+            {
+                continue;
+            }
+
+            if (unlink(chunk_path) == 0)
+            {
+                removed++;
+                freed_bytes += (long long)st.st_size;
+            }
+            else
+            {
+                log_error("Failed to remove chunk %s: %s", chunk_path, strerror(errno));
+            }
+        }
+
+        closedir(dir);
+    }
+
+    closedir(store);
+    free(refs.digests);
+
+    log_operation("Chunk store garbage collection: %d chunks removed, %lld bytes freed",
+                  removed, freed_bytes);
+    return SUCCESS;
+}
+
+/**
+ * Write a deduplication report (logical vs stored bytes) for the chunk store
+ * @param out Stream to write the report to
+ * @return SUCCESS on success, FAILURE on error
+ */
+int chunk_store_report(FILE *out)
+{
+    ChunkReferences refs;
+    char store_path[MAX_PATH_LENGTH];
+    DIR *store;
+    struct dirent *bucket;
+    long long stored_bytes = 0;
+    long long chunk_count = 0;
+
+    if (collect_chunk_references(&refs) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    snprintf(store_path, sizeof(store_path), "%s/%s", BACKUP_DIR, CHUNK_STORE_NAME);
+    store = opendir(store_path);
+    if (store != NULL)
+    {
+        while ((bucket = readdir(store)) != NULL)
+        {
+            char bucket_path[MAX_PATH_LENGTH];
+            struct dirent *entry;
+            DIR *dir;
+
+            if (bucket->d_name[0] == '.')
+            {
+                continue;
+            }
+
+            if (snprintf(bucket_path, sizeof(bucket_path), "%s/%s", store_path, bucket->d_name) >= (int)sizeof(bucket_path))
+            {
+                continue;
+            }
+            dir = opendir(bucket_path);
+            if (dir == NULL)
+            {
+                continue;
+            }
+
+            while ((entry = readdir(dir)) != NULL)
+            {
+                char chunk_path[MAX_PATH_LENGTH];
+                struct stat st;
+
+                if (entry->d_name[0] == '.')
+                {
+                    continue;
+                }
+
+                if (snprintf(chunk_path, sizeof(chunk_path), "%s/%s", bucket_path, entry->d_name) < (int)sizeof(chunk_path) &&
+                    stat(chunk_path, &st) == 0)
+                {
+                    stored_bytes += (long long)st.st_size;
+                    chunk_count++;
+                }
+            }
+
+            closedir(dir);
+        }
+
+        closedir(store);
+    }
+
+    fprintf(out, "chunk references: %zu\n", refs.count);
+    fprintf(out, "unique chunks:    %lld\n", chunk_count);
+    fprintf(out, "logical bytes:    %lld\n", refs.logical_bytes);
+    fprintf(out, "stored bytes:     %lld\n", stored_bytes);
+    fprintf(out, "dedup ratio:      %.2fx\n",
+            stored_bytes > 0 ? (double)refs.logical_bytes / (double)stored_bytes : 0.0);
+
+    free(refs.digests);
+    return SUCCESS;
+}
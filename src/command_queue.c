@@ -0,0 +1,451 @@
+/**
+ * @file command_queue.c
+ * @brief Prioritized, coalescing queue of daemon commands
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "command_queue.h"
+#include "backup.h"
+#include <string.h>
+#include <time.h>
+
+/* Waiting commands; a slot is free when its kind is -1 */
+static Command queue[COMMAND_QUEUE_SIZE];
+static int queue_ready = FALSE;
+static uint32_t next_id = 1;
+
+/* Cumulative counters; the depth fields are filled in on demand */
+static CommandQueueStats totals;
+
+/* Request bytes held by waiting commands */
+static size_t queued_bytes = 0;
+
+static const char *const kind_names[CMD_KINDS] = {"urgent_change", "transfer", "backup", "housekeeping"};
+
+/**
+ * Get a monotonic clock reading in milliseconds
+ */
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+/**
+ * Mark every slot free on first use
+ */
+static void queue_prepare(void)
+{
+    int i;
+
+    if (queue_ready)
+    {
+        return;
+    }
+
+    for (i = 0; i < COMMAND_QUEUE_SIZE; i++)
+    {
+        queue[i].kind = -1;
+    }
+    queue_ready = TRUE;
+}
+
+/**
+ * Hand out the next command ID, never 0
+ */
+static uint32_t take_id(void)
+{
+    uint32_t id = next_id++;
+
+    if (next_id == 0)
+    {
+        next_id = 1;
+    }
+    return id;
+}
+
+/**
+ * Count the waiting commands
+ */
+static int queue_depth(void)
+{
+    int i, depth = 0;
+
+    for (i = 0; i < COMMAND_QUEUE_SIZE; i++)
+    {
+        if (queue[i].kind != -1)
+        {
+            depth++;
+        }
+    }
+    return depth;
+}
+
+/**
+ * Check whether a waiting command has passed its deadline
+ */
+static int is_expired(const Command *command, double now)
+{
+    return command->deadline_ms > 0.0 && now >= command->deadline_ms;
+}
+
+/**
+ * Get the request bytes a command holds
+ */
+static size_t held_bytes(const Command *command)
+{
+    return command->has_request ? command->request.frame.length : 0;
+}
+
+/**
+ * Move a command out of its slot and free the slot
+ */
+static void take_slot(int slot, Command *command)
+{
+    queued_bytes -= held_bytes(&queue[slot]);
+    memcpy(command, &queue[slot], sizeof(*command));
+    queue[slot].kind = -1;
+    queue[slot].has_request = FALSE;
+}
+
+/**
+ * Get the name of a command kind
+ * @param kind CMD_* kind
+ * @return Static name string
+ */
+const char *command_kind_name(int kind)
+{
+    return (kind >= 0 && kind < CMD_KINDS) ? kind_names[kind] : "unknown";
+}
+
+/**
+ * Queue a command, coalescing it with a pending one of the same kind and key
+ * @param kind CMD_* kind
+ * @param key Coalescing key, "" or NULL for none
+ * @param deadline_ms Milliseconds it may wait, 0 for no limit
+ * @param request Request to hold until the command ends, or NULL
+ * @param replaced Receives the displaced command, if any
+ * @param was_replaced Set to TRUE if replaced was filled in
+ * @return Command ID, or 0 when the queue is full or out of bytes
+ */
+uint32_t command_queue_push(int kind, const char *key, long deadline_ms, ControlRequest *request,
+                            Command *replaced, int *was_replaced)
+{
+    double now = now_ms();
+    double deadline = (deadline_ms > 0) ? now + (double)deadline_ms : 0.0;
+    size_t bytes = (request != NULL) ? request->frame.length : 0;
+    int free_slot = -1;
+    int depth;
+    int i;
+
+    queue_prepare();
+    *was_replaced = FALSE;
+    if (key == NULL)
+    {
+        key = "";
+    }
+
+    for (i = 0; i < COMMAND_QUEUE_SIZE; i++)
+    {
+        Command *pending = &queue[i];
+
+        if (pending->kind == -1)
+        {
+            if (free_slot == -1)
+            {
+                free_slot = i;
+            }
+            continue;
+        }
+        if (pending->kind != kind || strcmp(pending->key, key) != 0)
+        {
+            continue;
+        }
+
+        totals.merged++;
+
+        if (request == NULL)
+        {
+            /* Running it once satisfies both, so wait as long as either allows */
+            pending->merged++;
+            if (pending->deadline_ms > 0.0 && (deadline == 0.0 || deadline > pending->deadline_ms))
+            {
+                pending->deadline_ms = deadline;
+            }
+            return pending->id;
+        }
+
+        /* The newer request wins, keeping the older one's place in line */
+        if (queued_bytes - held_bytes(pending) + bytes > COMMAND_QUEUE_MAX_BYTES)
+        {
+            totals.rejected++;
+            return 0;
+        }
+        queued_bytes = queued_bytes - held_bytes(pending) + bytes;
+        memcpy(replaced, pending, sizeof(*replaced));
+        *was_replaced = TRUE;
+        pending->id = take_id();
+        pending->deadline_ms = deadline;
+        pending->merged++;
+        pending->has_request = TRUE;
+        memcpy(&pending->request, request, sizeof(*request));
+        return pending->id;
+    }
+
+    if (free_slot == -1 || queued_bytes + bytes > COMMAND_QUEUE_MAX_BYTES)
+    {
+        totals.rejected++;
+        return 0;
+    }
+    queued_bytes += bytes;
+
+    queue[free_slot].id = take_id();
+    queue[free_slot].kind = kind;
+    strncpy(queue[free_slot].key, key, sizeof(queue[free_slot].key) - 1);
+    queue[free_slot].key[sizeof(queue[free_slot].key) - 1] = '\0';
+    queue[free_slot].enqueued_ms = now;
+    queue[free_slot].deadline_ms = deadline;
+    queue[free_slot].merged = 0;
+    queue[free_slot].has_request = (request != NULL);
+    if (request != NULL)
+    {
+        memcpy(&queue[free_slot].request, request, sizeof(*request));
+    }
+
+    totals.queued++;
+    depth = queue_depth();
+    if (depth > totals.max_depth)
+    {
+        totals.max_depth = depth;
+    }
+
+    return queue[free_slot].id;
+}
+
+/**
+ * Take the highest-priority runnable command, oldest first within a priority
+ * @param runnable Mask of kinds (1 << CMD_*) that may start now
+ * @param command Receives the command
+ * @return SUCCESS if a command was taken, FAILURE if none is runnable
+ */
+int command_queue_pop(unsigned int runnable, Command *command)
+{
+    double now = now_ms();
+    double wait;
+    int best = -1;
+    int i;
+
+    queue_prepare();
+
+    for (i = 0; i < COMMAND_QUEUE_SIZE; i++)
+    {
+        const Command *pending = &queue[i];
+
+        /* Expired commands are left for command_queue_expire() to answer */
+        if (pending->kind == -1 || !(runnable & (1u << pending->kind)) || is_expired(pending, now))
+        {
+            continue;
+        }
+        if (best == -1 || pending->kind < queue[best].kind ||
+            (pending->kind == queue[best].kind && pending->enqueued_ms < queue[best].enqueued_ms))
+        {
+            best = i;
+        }
+    }
+
+    if (best == -1)
+    {
+        return FAILURE;
+    }
+
+    take_slot(best, command);
+
+    wait = now - command->enqueued_ms;
+    totals.started[command->kind]++;
+    totals.wait_ms_total[command->kind] += wait;
+    if (wait > totals.wait_ms_max[command->kind])
+    {
+        totals.wait_ms_max[command->kind] = wait;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Remove one command that has passed its deadline
+ * @param command Receives the expired command
+ * @return SUCCESS if one was removed, FAILURE if none has expired
+ */
+int command_queue_expire(Command *command)
+{
+    double now = now_ms();
+    int i;
+
+    queue_prepare();
+
+    for (i = 0; i < COMMAND_QUEUE_SIZE; i++)
+    {
+        if (queue[i].kind != -1 && is_expired(&queue[i], now))
+        {
+            take_slot(i, command);
+            totals.expired++;
+            return SUCCESS;
+        }
+    }
+
+    return FAILURE;
+}
+
+/**
+ * Cancel a waiting command
+ * @param id Command ID
+ * @param command Receives the cancelled command
+ * @return SUCCESS if it was cancelled, FAILURE if it is not waiting
+ */
+int command_queue_cancel(uint32_t id, Command *command)
+{
+    int i;
+
+    queue_prepare();
+
+    for (i = 0; i < COMMAND_QUEUE_SIZE; i++)
+    {
+        if (queue[i].kind != -1 && queue[i].id == id)
+        {
+            take_slot(i, command);
+            totals.cancelled++;
+            return SUCCESS;
+        }
+    }
+
+    return FAILURE;
+}
+
+/**
+ * Drop the waiting commands of a kind that something else has satisfied
+ * @param kind CMD_* kind
+ * @return Number of commands dropped
+ */
+int command_queue_absorb(int kind)
+{
+    int dropped = 0;
+    int i;
+
+    queue_prepare();
+
+    for (i = 0; i < COMMAND_QUEUE_SIZE; i++)
+    {
+        if (queue[i].kind == kind && !queue[i].has_request)
+        {
+            queue[i].kind = -1;
+            totals.merged++;
+            dropped++;
+        }
+    }
+
+    return dropped;
+}
+
+/**
+ * Get a snapshot of the queue statistics
+ * @param stats Receives the statistics
+ */
+void command_queue_stats(CommandQueueStats *stats)
+{
+    double now = now_ms();
+    int i;
+
+    queue_prepare();
+    memcpy(stats, &totals, sizeof(*stats));
+    stats->bytes = queued_bytes;
+
+    for (i = 0; i < COMMAND_QUEUE_SIZE; i++)
+    {
+        if (queue[i].kind == -1)
+        {
+            continue;
+        }
+        stats->depth++;
+        stats->depth_by_kind[queue[i].kind]++;
+        if (now - queue[i].enqueued_ms > stats->oldest_wait_ms)
+        {
+            stats->oldest_wait_ms = now - queue[i].enqueued_ms;
+        }
+    }
+}
+
+/**
+ * Summarize the queue on one line
+ * @param buffer Destination
+ * @param size Size of buffer
+ */
+void format_queue_summary(char *buffer, size_t size)
+{
+    CommandQueueStats stats;
+
+    command_queue_stats(&stats);
+    snprintf(buffer, size,
+             "queue_depth=%d (urgent=%d transfer=%d backup=%d housekeeping=%d) queue_bytes=%lu oldest_wait_ms=%.0f "
+             "merged=%llu expired=%llu cancelled=%llu rejected=%llu",
+             stats.depth, stats.depth_by_kind[CMD_URGENT_CHANGE], stats.depth_by_kind[CMD_TRANSFER],
+             stats.depth_by_kind[CMD_BACKUP], stats.depth_by_kind[CMD_HOUSEKEEPING],
+             (unsigned long)stats.bytes, stats.oldest_wait_ms,
+             stats.merged, stats.expired, stats.cancelled, stats.rejected);
+}
+
+/**
+ * Write the queue statistics in Prometheus text format
+ * @param out Destination stream
+ */
+void write_command_queue_metrics(FILE *out)
+{
+    CommandQueueStats stats;
+    int kind;
+
+    command_queue_stats(&stats);
+
+    fprintf(out, "# HELP company_daemon_queue_depth Commands waiting to run.\n");
+    fprintf(out, "# TYPE company_daemon_queue_depth gauge\n");
+    for (kind = 0; kind < CMD_KINDS; kind++)
+    {
+        fprintf(out, "company_daemon_queue_depth{kind=\"%s\"} %d\n", kind_names[kind], stats.depth_by_kind[kind]);
+    }
+    fprintf(out, "# HELP company_daemon_queue_max_depth Deepest the queue has been.\n");
+    fprintf(out, "# TYPE company_daemon_queue_max_depth gauge\n");
+    fprintf(out, "company_daemon_queue_max_depth %d\n", stats.max_depth);
+    fprintf(out, "# HELP company_daemon_queue_bytes Request bytes held by waiting commands.\n");
+    fprintf(out, "# TYPE company_daemon_queue_bytes gauge\n");
+    fprintf(out, "company_daemon_queue_bytes %lu\n", (unsigned long)stats.bytes);
+    fprintf(out, "# HELP company_daemon_queue_oldest_wait_seconds Age of the longest waiting command.\n");
+    fprintf(out, "# TYPE company_daemon_queue_oldest_wait_seconds gauge\n");
+    fprintf(out, "company_daemon_queue_oldest_wait_seconds %.6f\n", stats.oldest_wait_ms / 1000.0);
+
+    fprintf(out, "# HELP company_daemon_queue_requests_total Command requests by outcome.\n");
+    fprintf(out, "# TYPE company_daemon_queue_requests_total counter\n");
+    fprintf(out, "company_daemon_queue_requests_total{outcome=\"queued\"} %llu\n", stats.queued);
+    fprintf(out, "company_daemon_queue_requests_total{outcome=\"merged\"} %llu\n", stats.merged);
+    fprintf(out, "company_daemon_queue_requests_total{outcome=\"rejected\"} %llu\n", stats.rejected);
+    fprintf(out, "company_daemon_queue_requests_total{outcome=\"expired\"} %llu\n", stats.expired);
+    fprintf(out, "company_daemon_queue_requests_total{outcome=\"cancelled\"} %llu\n", stats.cancelled);
+
+    fprintf(out, "# HELP company_daemon_queue_wait_seconds Time commands waited before starting.\n");
+    fprintf(out, "# TYPE company_daemon_queue_wait_seconds summary\n");
+    for (kind = 0; kind < CMD_KINDS; kind++)
+    {
+        fprintf(out, "company_daemon_queue_wait_seconds_sum{kind=\"%s\"} %.6f\n",
+                kind_names[kind], stats.wait_ms_total[kind] / 1000.0);
+        fprintf(out, "company_daemon_queue_wait_seconds_count{kind=\"%s\"} %llu\n",
+                kind_names[kind], stats.started[kind]);
+    }
+    fprintf(out, "# HELP company_daemon_queue_wait_max_seconds Longest wait before starting.\n");
+    fprintf(out, "# TYPE company_daemon_queue_wait_max_seconds gauge\n");
+    for (kind = 0; kind < CMD_KINDS; kind++)
+    {
+        fprintf(out, "company_daemon_queue_wait_max_seconds{kind=\"%s\"} %.6f\n",
+                kind_names[kind], stats.wait_ms_max[kind] / 1000.0);
+    }
+}
@@ -0,0 +1,346 @@
+/**
+ * @file copy_pool.c
+ * @brief Parallel file copier with per-device concurrency limits
+ */
+
+#define _GNU_SOURCE  // For qsort_r
+
+#include "copy_pool.h"
+#include "utils.h"
+#include "backup.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * Structure counting copies in flight on one device
+ */
+typedef struct {
+    dev_t device;   /* Backing device */
+    int in_flight;  /* Copies currently using it */
+} DeviceSlot;
+
+/**
+ * Shared state of a pool run
+ */
+typedef struct {
+    CopyJob *jobs;                                 /* Jobs being run */
+    int *order;                                    /* Job indexes, largest first */
+    char *claimed;                                 /* Per job: taken by a worker */
+    int count;                                     /* Number of jobs */
+    int first_unclaimed;                           /* Position in order to scan from */
+    int unclaimed;                                 /* Jobs not yet taken */
+    int per_device_limit;                          /* Concurrency cap per device */
+    DeviceSlot devices[COPY_POOL_MAX_DEVICES];     /* Devices seen so far */
+    int device_count;                              /* Entries in devices */
+    pthread_mutex_t lock;                          /* Protects everything above */
+    pthread_cond_t slot_freed;                     /* Signalled when a copy finishes */
+} CopyPool;
+
+/**
+ * Order job indexes by descending size
+ * @param context The jobs the indexes refer to
+ */
+static int compare_job_size(const void *a, const void *b, void *context)
+{
+    const CopyJob *jobs = (const CopyJob *)context;
+    long long size_a = jobs[*(const int *)a].size;
+    long long size_b = jobs[*(const int *)b].size;
+
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+/**
+ * Order latencies ascending
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Get a monotonic clock reading in seconds
+ */
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Find (or start tracking) the slot for a device; called with the lock held
+ * @return Slot pointer, or NULL when the table is full (device unlimited)
+ */
+static DeviceSlot *device_slot(CopyPool *pool, dev_t device)
+{
+    int i;
+
+    for (i = 0; i < pool->device_count; i++)
+    {
+        if (pool->devices[i].device == device)
+        {
+            return &pool->devices[i];
+        }
+    }
+
+    if (pool->device_count >= COPY_POOL_MAX_DEVICES)
+    {
+        return NULL;
+    }
+
+    pool->devices[pool->device_count].device = device;
+    pool->devices[pool->device_count].in_flight = 0;
+    return &pool->devices[pool->device_count++];
+}
+
+/**
+ * Take the largest job whose devices have a free slot, waiting if none do
+ * @return Job index, or -1 when every job has been taken
+ */
+static int claim_job(CopyPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->unclaimed > 0)
+    {
+        int k;
+
+        for (k = pool->first_unclaimed; k < pool->count; k++)
+        {
+            int index = pool->order[k];
+            CopyJob *job = &pool->jobs[index];
+            DeviceSlot *src, *dst;
+
+            if (pool->claimed[index])
+            {
+                continue;
+            }
+
+            src = device_slot(pool, job->source_device);
+            dst = device_slot(pool, job->destination_device);
+            if ((src != NULL && src->in_flight >= pool->per_device_limit) ||
+                (dst != NULL && dst != src && dst->in_flight >= pool->per_device_limit))
+            {
+                continue;
+            }
+
+            pool->claimed[index] = 1;
+            pool->unclaimed--;
+            if (src != NULL)
+            {
+                src->in_flight++;
+            }
+            if (dst != NULL && dst != src)
+            {
+                dst->in_flight++;
+            }
+
+            while (pool->first_unclaimed < pool->count &&
+                   pool->claimed[pool->order[pool->first_unclaimed]])
+            {
+                pool->first_unclaimed++;
+            }
+
+            pthread_mutex_unlock(&pool->lock);
+            return index;
+        }
+
+        /* Every remaining job targets a saturated device */
+        pthread_cond_wait(&pool->slot_freed, &pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return -1;
+}
+
+/**
+ * Give back the device slots held by a finished job
+ */
+static void release_job(CopyPool *pool, const CopyJob *job)
+{
+    DeviceSlot *src, *dst;
+
+    pthread_mutex_lock(&pool->lock);
+
+    src = device_slot(pool, job->source_device);
+    dst = device_slot(pool, job->destination_device);
+    if (src != NULL)
+    {
+        src->in_flight--;
+    }
+    if (dst != NULL && dst != src)
+    {
+        dst->in_flight--;
+    }
+
+    pthread_cond_broadcast(&pool->slot_freed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Worker thread: copy jobs until none are left
+ */
+static void *copy_worker(void *arg)
+{
+    CopyPool *pool = (CopyPool *)arg;
+    int index;
+
+    while ((index = claim_job(pool)) >= 0)
+    {
+        CopyJob *job = &pool->jobs[index];
+        double start = now_seconds();
+
+        job->result = copy_file_hashed(job->source, job->destination, &job->hash);
+        job->latency = now_seconds() - start;
+
+        release_job(pool, job);
+    }
+
+    return NULL;
+}
+
+/**
+ * Pick a percentile from sorted samples
+ */
+static double percentile(const double *sorted, int count, double fraction)
+{
+    int index = (int)(fraction * (count - 1) + 0.5);
+
+    return sorted[index];
+}
+
+/**
+ * Copy a batch of files with a worker pool, largest files first, keeping
+ * at most per_device_limit copies in flight on any backing device
+ * @param jobs Jobs to run; result, hash and latency are filled in
+ * @param count Number of jobs
+ * @param workers Number of worker threads
+ * @param per_device_limit Maximum concurrent copies per device
+ * @param stats Receives throughput and latency statistics (may be NULL)
+ * @return SUCCESS if every copy succeeded, FAILURE otherwise
+ */
+int run_copy_pool(CopyJob *jobs, int count, int workers, int per_device_limit, CopyPoolStats *stats)
+{
+    CopyPool pool;
+    pthread_t *threads;
+    int started = 0;
+    double start;
+    int i;
+
+    if (stats != NULL)
+    {
+        memset(stats, 0, sizeof(*stats));
+    }
+
+    if (count <= 0)
+    {
+        return SUCCESS;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.jobs = jobs;
+    pool.count = count;
+    pool.unclaimed = count;
+    pool.per_device_limit = (per_device_limit > 0) ? per_device_limit : 1;
+    pool.order = (int *)malloc(count * sizeof(int));
+    pool.claimed = (char *)calloc(count, 1);
+    threads = (pthread_t *)malloc((workers > 1 ? workers - 1 : 1) * sizeof(pthread_t));
+    if (pool.order == NULL || pool.claimed == NULL || threads == NULL)
+    {
+        log_error("Memory allocation failed for copy pool");
+        free(pool.order);
+        free(pool.claimed);
+        free(threads);
+        return FAILURE;
+    }
+
+    /* Largest files first so the run does not end on one long copy */
+    for (i = 0; i < count; i++)
+    {
+        pool.order[i] = i;
+        jobs[i].result = FAILURE;
+        jobs[i].latency = 0.0;
+    }
+    qsort_r(pool.order, count, sizeof(int), compare_job_size, jobs);
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.slot_freed, NULL);
+
+    start = now_seconds();
+
+    /* The calling thread is a worker too, so a failed spawn only costs parallelism */
+    for (i = 0; i < workers - 1 && i < count - 1; i++)
+    {
+        if (pthread_create(&threads[started], NULL, copy_worker, &pool) != 0)
+        {
+            log_error("Failed to start copy worker %d, continuing with %d", i + 1, started + 1);
+            break;
+        }
+        started++;
+    }
+
+    copy_worker(&pool);
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool.slot_freed);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.order);
+    free(pool.claimed);
+    free(threads);
+
+    if (stats != NULL)
+    {
+        double *latencies = (double *)malloc(count * sizeof(double));
+
+        stats->files = count;
+        stats->elapsed = now_seconds() - start;
+        for (i = 0; i < count; i++)
+        {
+            if (jobs[i].result == SUCCESS)
+            {
+                stats->bytes += jobs[i].size;
+            }
+            else
+            {
+                stats->failed++;
+            }
+        }
+        stats->mb_per_sec = (stats->elapsed > 0.0)
+                                ? ((double)stats->bytes / (1024.0 * 1024.0)) / stats->elapsed
+                                : 0.0;
+
+        if (latencies != NULL)
+        {
+            for (i = 0; i < count; i++)
+            {
+                latencies[i] = jobs[i].latency * 1000.0;
+            }
+            qsort(latencies, count, sizeof(double), compare_double);
+            stats->p50_ms = percentile(latencies, count, 0.50);
+            stats->p90_ms = percentile(latencies, count, 0.90);
+            stats->p99_ms = percentile(latencies, count, 0.99);
+            stats->max_ms = latencies[count - 1];
+            free(latencies);
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (jobs[i].result != SUCCESS)
+        {
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // For memfd_create and file sealing
 #define _POSIX_C_SOURCE 200809L
 #define _DEFAULT_SOURCE // For DT_DIR on some systems
 
@@ -7,20 +8,39 @@
 #include "backup.h"
 #include "file_operations.h"
 #include "ipc.h"
+#include "chunk_store.h"
+#include "retention.h"
+#include "restore.h"
+#include "throttle.h"
+#include "metrics.h"
+#include "event_ring.h"
+#include "command_queue.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <limits.h>
 
 /* Global variables */
 static volatile sig_atomic_t daemon_exit = 0;
 static volatile sig_atomic_t force_backup = 0;
 static volatile sig_atomic_t force_transfer = 0;
 
+/* Workers started from the command queue, -1 when none is running */
+static pid_t transfer_pid = -1;
+static pid_t backup_pid = -1;
+
+/* Post-transfer backup held back while another backup runs */
+static int backup_deferred = FALSE;
+static char deferred_view[MAX_PATH_LENGTH];
+
 /**
  * Signal handler for the daemon
  * @param sig Signal number
@@ -64,12 +84,16 @@ void setup_signal_handlers(void)
     sigaction(SIGUSR2, &sa, NULL);
     sigaction(SIGHUP, &sa, NULL);
 
+    /* Workers are reaped with waitpid() in check_workers(); ignoring
+     * SIGCHLD would let a reused PID pass for a running worker */
+    signal(SIGCHLD, SIG_DFL);
+
     /* Ignore these signals */
-    signal(SIGCHLD, SIG_IGN);
     signal(SIGTSTP, SIG_IGN);
     signal(SIGTTOU, SIG_IGN);
     signal(SIGTTIN, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
+    signal(SIGIO, SIG_IGN); /* Upload lease breaks are polled with F_GETLEASE */
 }
 
 /**
@@ -132,6 +156,7 @@ int check_singleton(void)
  */
 int daemon_init(void)
 {
+    static char syslog_ident[MAX_INSTANCE_LENGTH + 16];
     pid_t pid, sid;
 
     /* Check if another instance is already running */
@@ -141,6 +166,13 @@ int daemon_init(void)
         return FAILURE;
     }
 
+    /* Under a root prefix, the roots themselves may not exist yet */
+    if (create_path_roots() != SUCCESS)
+    {
+        fprintf(stderr, "Cannot create %s, %s or %s: %s\n", COMPANY_ROOT, LOG_ROOT, RUN_ROOT, strerror(errno));
+        return FAILURE;
+    }
+
     /* Fork the parent process */
     pid = fork();
 
@@ -195,15 +227,130 @@ int daemon_init(void)
     setup_signal_handlers();
 
     /* Setup logging */
-    openlog("report_daemon", LOG_PID, LOG_DAEMON);
+    if (get_daemon_paths()->instance[0] != '\0')
+    {
+        snprintf(syslog_ident, sizeof(syslog_ident), "report_daemon-%s", get_daemon_paths()->instance);
+    }
+    else
+    {
+        snprintf(syslog_ident, sizeof(syslog_ident), "report_daemon");
+    }
+    openlog(syslog_ident, LOG_PID, LOG_DAEMON);
     syslog(LOG_INFO, "Report daemon started");
 
+    /* Apply log level override from the environment */
+    if (getenv(LOG_LEVEL_ENV) != NULL)
+    {
+        int level = parse_log_level(getenv(LOG_LEVEL_ENV));
+
+        if (level >= 0)
+        {
+            set_log_level(level);
+        }
+        else
+        {
+            log_error("Ignoring invalid %s value: %s", LOG_LEVEL_ENV, getenv(LOG_LEVEL_ENV));
+        }
+    }
+
+    /* Select the backup backend */
+    if (getenv(BACKUP_MODE_ENV) != NULL)
+    {
+        int mode = parse_backup_mode(getenv(BACKUP_MODE_ENV));
+
+        if (mode >= 0)
+        {
+            set_backup_mode(mode);
+        }
+        else
+        {
+            log_error("Ignoring invalid %s value: %s", BACKUP_MODE_ENV, getenv(BACKUP_MODE_ENV));
+        }
+    }
+
+    /* Select how transfers are protected */
+    if (getenv(LOCK_MODE_ENV) != NULL)
+    {
+        int mode = parse_lock_mode(getenv(LOCK_MODE_ENV));
+
+        if (mode >= 0)
+        {
+            set_lock_mode(mode);
+        }
+        else
+        {
+            log_error("Ignoring invalid %s value: %s", LOCK_MODE_ENV, getenv(LOCK_MODE_ENV));
+        }
+    }
+
+    /* Select the backup retention policy */
+    if (getenv(RETENTION_POLICY_ENV) != NULL)
+    {
+        int policy = parse_retention_policy(getenv(RETENTION_POLICY_ENV));
+
+        if (policy >= 0)
+        {
+            set_retention_policy(policy);
+        }
+        else
+        {
+            log_error("Ignoring invalid %s value: %s", RETENTION_POLICY_ENV, getenv(RETENTION_POLICY_ENV));
+        }
+    }
+
+    /* Shared I/O throttle, created before any backup or transfer is forked */
+    if (throttle_init() == SUCCESS)
+    {
+        long long bandwidth = 0;
+        long long ops = 0;
+
+        if (getenv(IO_BANDWIDTH_ENV) != NULL && (bandwidth = parse_io_rate(getenv(IO_BANDWIDTH_ENV))) < 0)
+        {
+            log_error("Ignoring invalid %s value: %s", IO_BANDWIDTH_ENV, getenv(IO_BANDWIDTH_ENV));
+            bandwidth = 0;
+        }
+        if (getenv(IO_OPS_ENV) != NULL && (ops = parse_io_rate(getenv(IO_OPS_ENV))) < 0)
+        {
+            log_error("Ignoring invalid %s value: %s", IO_OPS_ENV, getenv(IO_OPS_ENV));
+            ops = 0;
+        }
+        set_io_limits(bandwidth, ops);
+        set_io_idle(getenv(IO_IDLE_ENV) != NULL && strcmp(getenv(IO_IDLE_ENV), "1") == 0);
+    }
+
+    /* Notification ring the workers publish to instead of the FIFO */
+    event_ring_init();
+
+    /* Lock telemetry, shared with the transfer and backup processes */
+    if (metrics_init() == SUCCESS && getenv(LOCK_HOLD_ALERT_ENV) != NULL)
+    {
+        long alert_ms = atol(getenv(LOCK_HOLD_ALERT_ENV));
+
+        if (alert_ms > 0)
+        {
+            set_lock_hold_alert(alert_ms);
+        }
+        else
+        {
+            log_error("Ignoring invalid %s value: %s", LOCK_HOLD_ALERT_ENV, getenv(LOCK_HOLD_ALERT_ENV));
+        }
+    }
+
     /* Create necessary directories if they don't exist */
     create_directory_if_not_exists(UPLOAD_DIR);
     create_directory_if_not_exists(DASHBOARD_DIR);
     create_directory_if_not_exists(BACKUP_DIR);
     create_directory_if_not_exists(LOG_DIR);
 
+    /* A backup interrupted by a crash or restart leaves its view behind */
+    remove_stale_dashboard_views();
+
+    /* A crash while the directories were chmod-locked leaves them at 0000 */
+    recover_directory_locks();
+
+    /* A crash in the middle of an urgent batch leaves undo links to roll back */
+    recover_urgent_batches();
+
     /* Setup IPC */
     if (setup_ipc() != SUCCESS)
     {
@@ -215,7 +362,8 @@ int daemon_init(void)
     set_directory_permissions(UPLOAD_DIR, UPLOAD_PERMISSIONS);
     set_directory_permissions(DASHBOARD_DIR, DASHBOARD_PERMISSIONS);
 
-    log_operation("Daemon initialization complete");
+    log_operation("Daemon initialization complete (instance \"%s\", company root %s)",
+                  get_daemon_paths()->instance, COMPANY_ROOT);
     return SUCCESS;
 }
 
@@ -237,223 +385,1476 @@ void daemon_cleanup(void)
 }
 
 /**
- * Main daemon loop
+ * Check whether a control socket caller may run its request. Status and
+ * event subscriptions are open to everyone; anything that changes state
+ * needs root or the daemon's own user.
+ * @param request The request, with the caller's credentials
+ * @return TRUE if allowed, FALSE otherwise
  */
-void daemon_main_loop(void)
+static int control_request_allowed(const ControlRequest *request)
 {
-    time_t now, last_check = 0;
-    struct tm *tm_now;
-    int last_check_hour = -1;
-    int last_check_minute = -1;
-    IPCMessage msg;
-    pid_t transfer_pid = -1, backup_pid = -1;
+    return request->frame.type == MSG_STATUS || request->frame.type == MSG_SUBSCRIBE ||
+           control_peer_privileged(request->peer_uid);
+}
 
-    log_operation("Entering main daemon loop");
+/**
+ * Queue a command that carries no request of its own
+ * @param kind CMD_* kind
+ * @param deadline_ms Milliseconds it may wait, 0 for no limit
+ * @param origin Who asked for it, for the log
+ * @return Command ID, or 0 when the queue is full
+ */
+static uint32_t queue_command(int kind, long deadline_ms, const char *origin)
+{
+    Command unused;
+    int replaced;
+    uint32_t id = command_queue_push(kind, NULL, deadline_ms, NULL, &unused, &replaced);
 
-    while (!daemon_exit)
+    if (id == 0)
     {
-        /* Get current time */
-        now = time(NULL);
-        tm_now = localtime(&now);
+        log_error("Command queue full, dropping %s requested by %s", command_kind_name(kind), origin);
+    }
+    else
+    {
+        log_debug("Queued %s as command %u for %s", command_kind_name(kind), id, origin);
+    }
+    return id;
+}
+
+/**
+ * Get the deadline a request asks for
+ * @param msg The request
+ * @param default_ms Deadline when the request names none
+ * @return Milliseconds the command may wait, 0 for no limit
+ */
+static long request_deadline(const Frame *msg, long default_ms)
+{
+    uint64_t deadline;
+
+    if (frame_get_u64(msg, FIELD_DEADLINE, &deadline) == SUCCESS && deadline <= LONG_MAX)
+    {
+        return (long)deadline;
+    }
+    return default_ms;
+}
+
+/**
+ * Start a backup worker, in the main process if forking fails
+ * @param view Dashboard view to back up, or NULL to take one
+ */
+static void start_backup(const char *view)
+{
+    if (view != NULL)
+    {
+        set_backup_source(view);
+    }
+    backup_pid = create_reporting_process(backup_dashboard, MSG_BACKUP_COMPLETE);
 
-        /* Check if it's time to transfer files (1:00 AM) */
-        if (((tm_now->tm_hour == TRANSFER_HOUR &&
-              tm_now->tm_min == TRANSFER_MINUTE) &&
-             (last_check_hour != TRANSFER_HOUR ||
-              last_check_minute != TRANSFER_MINUTE)) ||
-            force_transfer)
+    if (backup_pid == -1)
+    {
+        log_error("Failed to create backup process");
+        /* Do it in the main process as fallback */
+        if (backup_dashboard() == SUCCESS)
+        {
+            log_operation("Backup completed successfully (in main process)");
+        }
+        else
         {
+            log_error("Backup failed (in main process)");
+        }
+    }
 
-            log_operation("Starting scheduled file transfer and backup");
+    /* The view now belongs to the backup process */
+    set_backup_source(NULL);
+}
 
-            /* Lock directories before operations */
-            if (lock_directories() == SUCCESS)
-            {
-                /* Use IPC to create a child process for transfer */
-                transfer_pid = create_reporting_process(transfer_reports, MSG_TRANSFER_COMPLETE);
+/**
+ * Complete a transfer once its worker is done: check for missing
+ * reports, publish the dashboard, unlock and back it up
+ */
+static void finish_transfer(void)
+{
+    char view[MAX_PATH_LENGTH];
+    int have_view;
+    int merged;
 
-                if (transfer_pid == -1)
-                {
-                    log_error("Failed to create transfer process");
-                    /* Do it in the main process as fallback */
-                    if (transfer_reports() == SUCCESS)
-                    {
-                        log_operation("File transfer completed successfully (in main process)");
-                    }
-                    else
-                    {
-                        log_error("File transfer failed (in main process)");
-                    }
-                }
+    /* Check for missing department reports */
+    check_missing_reports();
 
-                /* Check for missing department reports */
-                check_missing_reports();
+    /* Capture the freshly published dashboard, then let everything else back in */
+    have_view = (create_dashboard_view(view, sizeof(view)) == SUCCESS);
+    unlock_directories();
+    write_metrics_file();
 
-                /* Use IPC to create a child process for backup */
-                backup_pid = create_reporting_process(backup_dashboard, MSG_BACKUP_COMPLETE);
+    /* The backup reads the view, overlapping freely with later transfers */
+    merged = command_queue_absorb(CMD_BACKUP);
+    if (merged > 0)
+    {
+        log_operation("Merged %d waiting backup request(s) into the post-transfer backup", merged);
+    }
 
-                if (backup_pid == -1)
-                {
-                    log_error("Failed to create backup process");
-                    /* Do it in the main process as fallback */
-                    if (backup_dashboard() == SUCCESS)
-                    {
-                        log_operation("Backup completed successfully (in main process)");
-                    }
-                    else
-                    {
-                        log_error("Backup failed (in main process)");
-                    }
-                }
+    /* Backups are named by the second, so two must not run at once */
+    if (backup_pid != -1)
+    {
+        log_operation("Post-transfer backup waits for backup process %d", backup_pid);
+        snprintf(deferred_view, sizeof(deferred_view), "%s", have_view ? view : "");
+        backup_deferred = TRUE;
+        return;
+    }
+    start_backup(have_view ? view : NULL);
+}
 
-                /* Wait for both processes to complete before unlocking */
-                /* This is a simplified approach - in a more complex system you'd use IPC for coordination */
-                sleep(5);
+/**
+ * Lock the directories and start a transfer worker. The main loop keeps
+ * serving requests while it runs; finish_transfer() follows once the
+ * worker reports back.
+ */
+static void start_transfer(void)
+{
+    log_operation("Starting file transfer and backup");
 
-                /* Unlock directories after operations */
-                unlock_directories();
-            }
-            else
-            {
-                log_error("Failed to lock directories, aborting transfer and backup");
-            }
+    /* Lock directories for the transfer only; the backup reads a view */
+    if (lock_directories() != SUCCESS)
+    {
+        log_error("Failed to lock directories, aborting transfer and backup");
+        return;
+    }
 
-            /* Reset forced transfer flag */
-            force_transfer = 0;
-        }
+    /* Use IPC to create a child process for transfer */
+    transfer_pid = create_reporting_process(transfer_reports, MSG_TRANSFER_COMPLETE);
 
-        /* Check for directory changes every 5 seconds */
-        if (now - last_check >= 5)
+    if (transfer_pid == -1)
+    {
+        log_error("Failed to create transfer process");
+        /* Do it in the main process as fallback */
+        if (transfer_reports() == SUCCESS)
         {
-            monitor_directory_changes();
-            last_check = now;
+            log_operation("File transfer completed successfully (in main process)");
+        }
+        else
+        {
+            log_error("File transfer failed (in main process)");
         }
+        finish_transfer();
+    }
+}
 
-        /* Handle force_backup flag */
-        if (force_backup)
+/**
+ * Note that a worker has finished, completing its transfer if it ran one
+ * @param pid PID of the worker
+ */
+static void worker_done(pid_t pid)
+{
+    if (pid == transfer_pid)
+    {
+        transfer_pid = -1;
+        finish_transfer();
+    }
+    else if (pid == backup_pid)
+    {
+        backup_pid = -1;
+        if (backup_deferred)
         {
-            log_operation("Starting manual backup");
+            backup_deferred = FALSE;
+            start_backup(deferred_view[0] != '\0' ? deferred_view : NULL);
+        }
+    }
+}
 
-            /* Lock directories */
-            if (lock_directories() == SUCCESS)
-            {
-                /* Use IPC to create a child process for backup */
-                backup_pid = create_reporting_process(backup_dashboard, MSG_BACKUP_COMPLETE);
+/**
+ * Check whether a PID is a worker the daemon has not yet seen finish.
+ * No liveness probe: a worker often exits right after writing its notice,
+ * and check_workers() only forgets it once it has been reaped.
+ * @param pid PID to check
+ * @return TRUE if it is the current transfer or backup process
+ */
+static int is_running_worker(pid_t pid)
+{
+    return pid > 0 && (pid == transfer_pid || pid == backup_pid);
+}
 
-                if (backup_pid == -1)
-                {
-                    log_error("Failed to create backup process");
-                    /* Do it in the main process as fallback */
-                    if (backup_dashboard() == SUCCESS)
-                    {
-                        log_operation("Manual backup completed successfully (in main process)");
-                    }
-                    else
-                    {
-                        log_error("Manual backup failed (in main process)");
-                    }
-                }
+/**
+ * Get the command kinds that may start now. Urgent changes wait while
+ * a transfer or a restore holds the directory lock, but not for a
+ * backup, which reads its own view; a backup waits for the transfer,
+ * whose own backup follows anyway.
+ * @return Mask of (1 << CMD_*) bits
+ */
+static unsigned int runnable_commands(void)
+{
+    unsigned int runnable = 0;
 
-                /* Wait for the process to complete */
-                sleep(3);
+    if (!are_directories_locked())
+    {
+        runnable |= 1u << CMD_URGENT_CHANGE;
+    }
 
-                /* Unlock directories */
-                unlock_directories();
-            }
-            else
-            {
-                log_error("Failed to lock directories, aborting manual backup");
-            }
+    if (transfer_pid == -1)
+    {
+        runnable |= (1u << CMD_TRANSFER) | (1u << CMD_HOUSEKEEPING);
+        if (backup_pid == -1 && !backup_deferred)
+        {
+            runnable |= 1u << CMD_BACKUP;
+        }
+    }
+    return runnable;
+}
 
-            /* Reset forced backup flag */
-            force_backup = 0;
+/**
+ * Apply a queued urgent change
+ * @param msg The MSG_URGENT_CHANGE request, already validated
+ * @param reply Receives a short result text
+ * @param reply_size Size of reply
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int apply_urgent_change(const Frame *msg, char *reply, size_t reply_size)
+{
+    char filename[MAX_PATH_LENGTH] = "";
+    char username[MAX_LINE_LENGTH] = "";
+    const FrameField *content = frame_find(msg, FIELD_CONTENT);
+    uint64_t hash = 0;
+
+    frame_get_string(msg, FIELD_FILENAME, filename, sizeof(filename));
+    frame_get_string(msg, FIELD_USERNAME, username, sizeof(username));
+
+    if (content == NULL
+            ? make_urgent_change_from_fd(filename, msg->passed_fd, username, &hash) == SUCCESS
+            : make_urgent_change(filename, (const char *)frame_field_data(msg, content),
+                                 content->length, username) == SUCCESS)
+    {
+        log_operation("Urgent change processed successfully");
+        publish_event(EVENT_FILE_MODIFY, SUCCESS, filename, username, "urgent change");
+        /* A passed file may have changed after it was sent; tell the caller what was installed */
+        if (content == NULL)
+        {
+            snprintf(reply, reply_size, "OK, hash %016llx", (unsigned long long)hash);
         }
+        else
+        {
+            snprintf(reply, reply_size, "OK");
+        }
+        return SUCCESS;
+    }
+
+    log_error("Failed to process urgent change");
+    snprintf(reply, reply_size, "Urgent change failed (see %s)", ERROR_LOG);
+    return FAILURE;
+}
+
+/**
+ * Check that a name refers to a file directly in the dashboard directory
+ * @param filename Name from a request
+ * @return TRUE if valid, FALSE otherwise
+ */
+static int is_dashboard_file_name(const char *filename)
+{
+    return filename[0] != '\0' && strchr(filename, '/') == NULL &&
+           strcmp(filename, "..") != 0 && strcmp(filename, ".") != 0;
+}
+
+/**
+ * Read the files of an urgent batch request
+ * @param msg The MSG_URGENT_BATCH request
+ * @param changes Receives up to URGENT_BATCH_MAX_FILES changes, whose
+ *        content points into msg
+ * @param count Receives the number of changes
+ * @param error Receives why the request is invalid
+ * @param error_size Size of error
+ * @return SUCCESS if the request is valid, FAILURE otherwise
+ */
+static int parse_urgent_batch(const Frame *msg, UrgentChange *changes, int *count,
+                              char *error, size_t error_size)
+{
+    int expect_content = FALSE;
+    int i, j;
+
+    *count = 0;
+    if (msg->passed_fd != -1)
+    {
+        snprintf(error, error_size, "Urgent batch content must be inline");
+        return FAILURE;
+    }
+
+    for (i = 0; i < msg->field_count; i++)
+    {
+        const FrameField *field = &msg->fields[i];
+        const unsigned char *data = frame_field_data(msg, field);
 
-        /* Check for IPC messages */
-        while (receive_ipc_message(&msg) == SUCCESS)
+        if (field->tag == FIELD_FILENAME && !expect_content)
         {
-            /* Process the message based on its type */
-            switch (msg.type)
+            if (*count == URGENT_BATCH_MAX_FILES)
             {
-            case MSG_BACKUP_COMPLETE:
-                log_operation("Received backup completion message from PID %d: %s",
-                              msg.sender_pid, msg.message);
-                break;
-            case MSG_TRANSFER_COMPLETE:
-                log_operation("Received transfer completion message from PID %d: %s",
-                              msg.sender_pid, msg.message);
-                break;
-            case MSG_ERROR:
-                log_error("Received error message from PID %d: %s",
-                          msg.sender_pid, msg.message);
-                break;
-            case MSG_URGENT_CHANGE:
-                log_operation("Received urgent change request from PID %d", msg.sender_pid);
-                /* Parse the message to extract filename, content, and user */
-                /* The message format is expected to be: "filename|username|content" */
+                snprintf(error, error_size, "Urgent batch holds at most %d files", URGENT_BATCH_MAX_FILES);
+                return FAILURE;
+            }
+            if (field->length >= sizeof(changes[*count].filename) || memchr(data, '\0', field->length) != NULL)
+            {
+                snprintf(error, error_size, "Invalid file name");
+                return FAILURE;
+            }
+            memcpy(changes[*count].filename, data, field->length);
+            changes[*count].filename[field->length] = '\0';
+            if (!is_dashboard_file_name(changes[*count].filename))
+            {
+                snprintf(error, error_size, "Invalid file name");
+                return FAILURE;
+            }
+            for (j = 0; j < *count; j++)
+            {
+                if (strcmp(changes[j].filename, changes[*count].filename) == 0)
                 {
-                    char *filename = msg.message;
-                    char *username = strchr(msg.message, '|');
-                    char *content = NULL;
-
-                    if (username)
-                    {
-                        *username = '\0'; /* Terminate filename string */
-                        username++;       /* Move past the separator */
-                        content = strchr(username, '|');
-
-                        if (content)
-                        {
-                            *content = '\0'; /* Terminate username string */
-                            content++;       /* Move past the separator */
-
-                            /* Process the urgent change */
-                            if (make_urgent_change(filename, content, username) == SUCCESS)
-                            {
-                                log_operation("Urgent change processed successfully");
-                            }
-                            else
-                            {
-                                log_error("Failed to process urgent change");
-                            }
-                        }
-                        else
-                        {
-                            log_error("Invalid urgent change message format: missing content");
-                        }
-                    }
-                    else
-                    {
-                        log_error("Invalid urgent change message format: missing separator");
-                    }
+                    snprintf(error, error_size, "%s appears twice in the batch", changes[j].filename);
+                    return FAILURE;
                 }
-                break;
-            default:
-                log_operation("Received unknown message type %d from PID %d: %s",
-                              msg.type, msg.sender_pid, msg.message);
-                break;
             }
+            expect_content = TRUE;
+        }
+        else if (field->tag == FIELD_CONTENT && expect_content)
+        {
+            changes[*count].content = (const char *)data;
+            changes[*count].content_length = field->length;
+            (*count)++;
+            expect_content = FALSE;
         }
+        else if (field->tag == FIELD_FILENAME || field->tag == FIELD_CONTENT)
+        {
+            snprintf(error, error_size, "Urgent batch needs a content field after each file name");
+            return FAILURE;
+        }
+    }
 
-        /* Update last check time for scheduled tasks */
-        last_check_hour = tm_now->tm_hour;
-        last_check_minute = tm_now->tm_min;
+    if (expect_content || *count == 0)
+    {
+        snprintf(error, error_size, "Urgent batch needs file names, each followed by its content");
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Apply a queued urgent batch
+ * @param msg The MSG_URGENT_BATCH request, already validated
+ * @param reply Receives a short result text
+ * @param reply_size Size of reply
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int apply_urgent_batch(const Frame *msg, char *reply, size_t reply_size)
+{
+    static UrgentChange changes[URGENT_BATCH_MAX_FILES];
+    char username[MAX_LINE_LENGTH] = "";
+    int count;
+    int i;
 
-        /* Sleep for 1 second before next iteration */
-        sleep(1);
+    frame_get_string(msg, FIELD_USERNAME, username, sizeof(username));
+    if (parse_urgent_batch(msg, changes, &count, reply, reply_size) != SUCCESS)
+    {
+        return FAILURE;
     }
 
-    log_operation("Exiting main daemon loop");
+    if (make_urgent_changes(changes, count, username) != SUCCESS)
+    {
+        snprintf(reply, reply_size, "Urgent batch failed, no file changed (see %s)", ERROR_LOG);
+        return FAILURE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        publish_event(EVENT_FILE_MODIFY, SUCCESS, changes[i].filename, username, "urgent batch");
+    }
+    snprintf(reply, reply_size, "OK, %d files changed", count);
+    return SUCCESS;
 }
 
 /**
- * Main entry point for the daemon
+ * Read the ranges of an urgent patch request
+ * @param msg The MSG_URGENT_PATCH request
+ * @param ranges Receives up to URGENT_PATCH_MAX_RANGES ranges, whose
+ *        inserts point into msg
+ * @param count Receives the number of ranges
+ * @param error Receives why the request is invalid
+ * @param error_size Size of error
+ * @return SUCCESS if the request is valid, FAILURE otherwise
  */
-int main(int argc, char *argv[])
+static int parse_urgent_patch(const Frame *msg, UrgentPatch *ranges, int *count,
+                              char *error, size_t error_size)
+{
+    uint64_t end = 0;
+    int i;
+
+    *count = 0;
+    for (i = 0; i < msg->field_count; i++)
+    {
+        const FrameField *field = &msg->fields[i];
+        UrgentPatch *range = &ranges[*count];
+
+        if (field->tag != FIELD_PATCH_OFFSET)
+        {
+            continue;
+        }
+        if (*count == URGENT_PATCH_MAX_RANGES)
+        {
+            snprintf(error, error_size, "Urgent patch holds at most %d ranges", URGENT_PATCH_MAX_RANGES);
+            return FAILURE;
+        }
+
+        /* Each range is an offset, a delete length and the bytes to insert, in that order */
+        if (i + 2 >= msg->field_count ||
+            msg->fields[i + 1].tag != FIELD_PATCH_DELETE || msg->fields[i + 2].tag != FIELD_CONTENT ||
+            frame_field_u64(msg, field, &range->offset) != SUCCESS ||
+            frame_field_u64(msg, &msg->fields[i + 1], &range->delete_length) != SUCCESS)
+        {
+            snprintf(error, error_size, "Urgent patch ranges need an offset, a delete length and content");
+            return FAILURE;
+        }
+        if (range->offset < end || range->delete_length > UINT64_MAX - range->offset)
+        {
+            snprintf(error, error_size, "Urgent patch ranges must be in order and not overlap");
+            return FAILURE;
+        }
+        range->insert = (const char *)frame_field_data(msg, &msg->fields[i + 2]);
+        range->insert_length = msg->fields[i + 2].length;
+        end = range->offset + range->delete_length;
+        (*count)++;
+        i += 2;
+    }
+
+    if (*count == 0)
+    {
+        snprintf(error, error_size, "Urgent patch needs at least one range");
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Apply a queued urgent patch
+ * @param msg The MSG_URGENT_PATCH request, already validated
+ * @param reply Receives a short result text
+ * @param reply_size Size of reply
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int apply_urgent_patch(const Frame *msg, char *reply, size_t reply_size)
 {
-    /* Suppress unused parameter warning */
-    (void)argc;
-    (void)argv;
+    UrgentPatch ranges[URGENT_PATCH_MAX_RANGES];
+    char filename[MAX_PATH_LENGTH] = "";
+    char username[MAX_LINE_LENGTH] = "";
+    uint64_t base_hash, new_hash = 0;
+    int has_base;
+    int count;
+
+    frame_get_string(msg, FIELD_FILENAME, filename, sizeof(filename));
+    frame_get_string(msg, FIELD_USERNAME, username, sizeof(username));
+    has_base = (frame_get_u64(msg, FIELD_BASE_HASH, &base_hash) == SUCCESS);
+    if (parse_urgent_patch(msg, ranges, &count, reply, reply_size) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    if (make_urgent_patch(filename, ranges, count, has_base ? &base_hash : NULL, &new_hash, username) != SUCCESS)
+    {
+        if (has_base && new_hash != 0 && new_hash != base_hash)
+        {
+            snprintf(reply, reply_size, "Report changed: base hash is now %016llx", (unsigned long long)new_hash);
+        }
+        else
+        {
+            snprintf(reply, reply_size, "Urgent patch failed (see %s)", ERROR_LOG);
+        }
+        return FAILURE;
+    }
+
+    publish_event(EVENT_FILE_MODIFY, SUCCESS, filename, username, "urgent patch");
+    if (has_base)
+    {
+        snprintf(reply, reply_size, "OK, hash %016llx", (unsigned long long)new_hash);
+    }
+    else
+    {
+        snprintf(reply, reply_size, "OK");
+    }
+    return SUCCESS;
+}
+
+/**
+ * Apply a queued urgent change, batch or patch
+ * @param msg The request, already validated
+ * @param reply Receives a short result text
+ * @param reply_size Size of reply
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int apply_urgent_request(const Frame *msg, char *reply, size_t reply_size)
+{
+    switch (msg->type)
+    {
+    case MSG_URGENT_BATCH:
+        return apply_urgent_batch(msg, reply, reply_size);
+    case MSG_URGENT_PATCH:
+        return apply_urgent_patch(msg, reply, reply_size);
+    default:
+        return apply_urgent_change(msg, reply, reply_size);
+    }
+}
+
+/**
+ * Check an urgent change, batch or patch request and queue it; the
+ * caller is answered when it has run. A newer change to the same file
+ * replaces one still waiting; batches and patches never replace
+ * anything, since they build on what came before.
+ * @param request The request; answered or taken over by the queue
+ */
+static void queue_urgent_change(ControlRequest *request)
+{
+    static UrgentChange changes[URGENT_BATCH_MAX_FILES];
+    UrgentPatch ranges[URGENT_PATCH_MAX_RANGES];
+    const Frame *msg = &request->frame;
+    char filename[MAX_PATH_LENGTH];
+    char username[MAX_LINE_LENGTH];
+    char reply[MAX_LINE_LENGTH];
+    Command replaced;
+    int was_replaced;
+    int count;
+    uint32_t id;
+
+    if (msg->type == MSG_URGENT_BATCH)
+    {
+        log_operation("Received urgent batch request from PID %d", request->peer_pid);
+
+        if (frame_get_string(msg, FIELD_USERNAME, username, sizeof(username)) != SUCCESS)
+        {
+            log_error("Invalid urgent batch message: needs a user name");
+            send_control_reply(request, FAILURE, "Urgent batch needs a user name");
+            return;
+        }
+        if (parse_urgent_batch(msg, changes, &count, reply, sizeof(reply)) != SUCCESS)
+        {
+            log_error("Refused urgent batch from PID %d: %s", request->peer_pid, reply);
+            send_control_reply(request, FAILURE, reply);
+            return;
+        }
+
+        /* Unlike any file name, the key holds slashes, so it only ever matches itself */
+        snprintf(filename, sizeof(filename), "/batch/%d/%u/%u",
+                 request->peer_pid, request->generation, msg->request_id);
+    }
+    else if (msg->type == MSG_URGENT_PATCH)
+    {
+        log_operation("Received urgent patch request from PID %d", request->peer_pid);
+
+        if (frame_get_string(msg, FIELD_FILENAME, filename, sizeof(filename)) != SUCCESS ||
+            frame_get_string(msg, FIELD_USERNAME, username, sizeof(username)) != SUCCESS ||
+            !is_dashboard_file_name(filename))
+        {
+            log_error("Invalid urgent patch message: needs a dashboard file name and user name");
+            send_control_reply(request, FAILURE, "Urgent patch needs a valid file name and user name");
+            return;
+        }
+        if (parse_urgent_patch(msg, ranges, &count, reply, sizeof(reply)) != SUCCESS)
+        {
+            log_error("Refused urgent patch from PID %d: %s", request->peer_pid, reply);
+            send_control_reply(request, FAILURE, reply);
+            return;
+        }
+
+        snprintf(filename, sizeof(filename), "/patch/%d/%u/%u",
+                 request->peer_pid, request->generation, msg->request_id);
+    }
+    else
+    {
+        log_operation("Received urgent change request from PID %d", request->peer_pid);
+
+        if (frame_get_string(msg, FIELD_FILENAME, filename, sizeof(filename)) != SUCCESS ||
+            frame_get_string(msg, FIELD_USERNAME, username, sizeof(username)) != SUCCESS ||
+            (frame_find(msg, FIELD_CONTENT) == NULL) == (msg->passed_fd == -1))
+        {
+            log_error("Invalid urgent change message: needs file name, user name and content");
+            send_control_reply(request, FAILURE, "Urgent change needs file name, user name and content");
+            return;
+        }
+        if (!is_dashboard_file_name(filename))
+        {
+            log_error("Refused urgent change to \"%s\" from PID %d: not a dashboard file name",
+                      filename, request->peer_pid);
+            send_control_reply(request, FAILURE, "Invalid file name");
+            return;
+        }
+    }
+
+    id = command_queue_push(CMD_URGENT_CHANGE, filename,
+                            request_deadline(msg, URGENT_CHANGE_DEADLINE_MS),
+                            request, &replaced, &was_replaced);
+    if (id == 0)
+    {
+        log_error("Command queue full, refusing urgent change to %s", filename);
+        send_control_reply(request, FAILURE, "Command queue full");
+        return;
+    }
+
+    if (was_replaced)
+    {
+        log_operation("Urgent change %u to %s superseded by %u", replaced.id, filename, id);
+        snprintf(reply, sizeof(reply), "Superseded by command %u", id);
+        send_control_reply(&replaced.request, FAILURE, reply);
+    }
+}
+
+/**
+ * Subscribe a control socket caller to pushed events, or unsubscribe it
+ * with an empty mask. The reply goes out before any event.
+ * @param request The MSG_SUBSCRIBE request; answered
+ */
+static void subscribe_events(ControlRequest *request)
+{
+    char filter[MAX_EVENT_FILTER] = "";
+    char reply[MAX_LINE_LENGTH];
+    uint64_t mask = 0;
+
+    if (frame_get_u64(&request->frame, FIELD_EVENT_MASK, &mask) != SUCCESS || (mask & ~(uint64_t)EVENT_ALL) != 0)
+    {
+        send_control_reply(request, FAILURE, "Subscription needs a valid event mask");
+        return;
+    }
+    frame_get_string(&request->frame, FIELD_FILTER, filter, sizeof(filter));
+
+    if (subscribe_control_client(request, (uint32_t)mask, filter) != SUCCESS)
+    {
+        send_control_reply(request, FAILURE, "Subscriptions need the control socket");
+        return;
+    }
+
+    if (mask == 0)
+    {
+        log_operation("PID %d unsubscribed from events", request->peer_pid);
+        snprintf(reply, sizeof(reply), "Unsubscribed");
+    }
+    else
+    {
+        log_operation("PID %d subscribed to events 0x%02llx%s%s", request->peer_pid,
+                      (unsigned long long)mask, filter[0] != '\0' ? " matching " : "", filter);
+        snprintf(reply, sizeof(reply), "Subscribed");
+    }
+    send_control_reply(request, SUCCESS, reply);
+}
+
+/**
+ * Run a command taken from the queue
+ * @param command The command; a request it holds is answered
+ */
+static void run_command(Command *command)
+{
+    char reply[MAX_LINE_LENGTH];
+    int status;
+
+    switch (command->kind)
+    {
+    case CMD_URGENT_CHANGE:
+        status = apply_urgent_request(&command->request.frame, reply, sizeof(reply));
+        send_control_reply(&command->request, status, reply);
+        break;
+    case CMD_TRANSFER:
+        start_transfer();
+        break;
+    case CMD_BACKUP:
+        log_operation("Starting manual backup");
+        /* No lock needed: the backup process works from its own dashboard view */
+        start_backup(NULL);
+        break;
+    case CMD_HOUSEKEEPING:
+        monitor_directory_changes();
+        break;
+    }
+}
+
+/**
+ * Answer and log a command that is being dropped unrun
+ * @param command The command
+ * @param reason Why it is dropped
+ */
+static void drop_command(Command *command, const char *reason)
+{
+    log_warning("Dropped %s command %u: %s", command_kind_name(command->kind), command->id, reason);
+    if (command->has_request)
+    {
+        send_control_reply(&command->request, FAILURE, reason);
+    }
+}
+
+/**
+ * Log a notice from a worker process
+ * @param type MSG_* type
+ * @param sender PID of the worker
+ * @param status Outcome the worker reported
+ * @param text Notice text
+ * @return SUCCESS if the type is a worker notice, FAILURE otherwise
+ */
+static int log_worker_notice(int type, pid_t sender, int status, const char *text)
+{
+    switch (type)
+    {
+    case MSG_BACKUP_COMPLETE:
+        log_operation("Received backup completion message from PID %d: %s", sender, text);
+        publish_event(EVENT_BACKUP_COMPLETE, status, NULL, NULL, text);
+        worker_done(sender);
+        return SUCCESS;
+    case MSG_TRANSFER_COMPLETE:
+        log_operation("Received transfer completion message from PID %d: %s", sender, text);
+        worker_done(sender);
+        return SUCCESS;
+    case MSG_FILE_TRANSFERRED:
+        log_debug("PID %d transferred %s", sender, text);
+        publish_event(EVENT_FILE_TRANSFER, status, text, NULL, "dashboard");
+        return SUCCESS;
+    case MSG_ERROR:
+        log_error("Received error message from PID %d: %s", sender, text);
+        return SUCCESS;
+    default:
+        return FAILURE;
+    }
+}
+
+/**
+ * Act on a request from a control socket client. Worker notices are
+ * only taken from the event ring and the FIFO, never from a client.
+ * @param msg The message
+ * @param sender PID of the sender
+ * @param reply Receives a short result text for control socket callers
+ * @param reply_size Size of reply
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int handle_ipc_message(const Frame *msg, pid_t sender, char *reply, size_t reply_size)
+{
+    char text[MAX_LINE_LENGTH] = "";
+    int result = SUCCESS;
+
+    snprintf(reply, reply_size, "OK");
+    frame_get_string(msg, FIELD_TEXT, text, sizeof(text));
+
+    /* Process the message based on its type */
+    switch (msg->type)
+    {
+    case MSG_STATUS:
+        {
+            long long bandwidth, ops;
+            int length;
+
+            get_io_limits(&bandwidth, &ops);
+            length = snprintf(reply, reply_size, "pid=%d instance=%s root=%s log_level=%d io_bandwidth=%lld io_ops=%lld "
+                              "transfer_pid=%d backup_pid=%d ",
+                              getpid(), get_daemon_paths()->instance[0] != '\0' ? get_daemon_paths()->instance : "default",
+                              COMPANY_ROOT, get_log_level(), bandwidth, ops, transfer_pid, backup_pid);
+            if (length > 0 && (size_t)length < reply_size)
+            {
+                format_lock_summary(reply + length, reply_size - length);
+                length = strlen(reply);
+            }
+            if (length > 0 && (size_t)length + 1 < reply_size)
+            {
+                reply[length++] = ' ';
+                format_queue_summary(reply + length, reply_size - length);
+                length = strlen(reply);
+            }
+            if (length > 0 && (size_t)length < reply_size)
+            {
+                int subscribers;
+                unsigned long long dropped;
+
+                get_subscription_stats(&subscribers, &dropped);
+                snprintf(reply + length, reply_size - length, " subscribers=%d events_dropped=%llu ring_abandoned=%llu ring_dropped=%llu",
+                         subscribers, dropped, (unsigned long long)event_ring_abandoned(),
+                         (unsigned long long)event_ring_dropped());
+            }
+        }
+        break;
+    case MSG_FORCE_BACKUP:
+    case MSG_FORCE_TRANSFER:
+        {
+            int kind = (msg->type == MSG_FORCE_BACKUP) ? CMD_BACKUP : CMD_TRANSFER;
+            char origin[32];
+            uint32_t id;
+
+            snprintf(origin, sizeof(origin), "PID %d", sender);
+            id = queue_command(kind, request_deadline(msg, kind == CMD_BACKUP ? BACKUP_DEADLINE_MS
+                                                                              : TRANSFER_DEADLINE_MS),
+                               origin);
+            if (id == 0)
+            {
+                snprintf(reply, reply_size, "Command queue full");
+                result = FAILURE;
+            }
+            else
+            {
+                log_operation("%s requested by PID %d, queued as command %u",
+                              kind == CMD_BACKUP ? "Backup" : "Transfer", sender, id);
+                snprintf(reply, reply_size, "%s queued as command %u",
+                         kind == CMD_BACKUP ? "Backup" : "Transfer", id);
+            }
+        }
+        break;
+    case MSG_CANCEL_COMMAND:
+        {
+            uint64_t id;
+            Command cancelled;
+
+            if (frame_get_u64(msg, FIELD_COMMAND_ID, &id) != SUCCESS || id > UINT32_MAX ||
+                command_queue_cancel((uint32_t)id, &cancelled) != SUCCESS)
+            {
+                snprintf(reply, reply_size, "No waiting command with that ID");
+                result = FAILURE;
+            }
+            else
+            {
+                snprintf(text, sizeof(text), "Cancelled by PID %d", sender);
+                drop_command(&cancelled, text);
+                snprintf(reply, reply_size, "Cancelled %s command %u", command_kind_name(cancelled.kind), cancelled.id);
+            }
+        }
+        break;
+    case MSG_SET_LOG_LEVEL:
+        {
+            int32_t level;
+
+            if (frame_get_i32(msg, FIELD_LOG_LEVEL, &level) == SUCCESS &&
+                level >= LOG_LEVEL_ERROR && level <= LOG_LEVEL_DEBUG)
+            {
+                set_log_level(level);
+                log_operation("Log level set to %d by PID %d", level, sender);
+            }
+            else
+            {
+                log_error("Invalid log level requested by PID %d", sender);
+                snprintf(reply, reply_size, "Invalid log level");
+                result = FAILURE;
+            }
+        }
+        break;
+    case MSG_SET_IO_LIMITS:
+        {
+            uint64_t bandwidth, ops;
+
+            if (frame_get_u64(msg, FIELD_BANDWIDTH, &bandwidth) == SUCCESS &&
+                frame_get_u64(msg, FIELD_OPS, &ops) == SUCCESS &&
+                bandwidth <= LLONG_MAX && ops <= LLONG_MAX)
+            {
+                set_io_limits((long long)bandwidth, (long long)ops);
+                log_operation("I/O limits set to %llu bytes/s, %llu ops/s by PID %d",
+                              (unsigned long long)bandwidth, (unsigned long long)ops, sender);
+            }
+            else
+            {
+                log_error("Invalid I/O limits requested by PID %d", sender);
+                snprintf(reply, reply_size, "Invalid I/O limits");
+                result = FAILURE;
+            }
+        }
+        break;
+    default:
+        log_operation("Received unknown message type %d from PID %d: %s", msg->type, sender, text);
+        snprintf(reply, reply_size, "Unknown message type %d", msg->type);
+        result = FAILURE;
+        break;
+    }
+
+    return result;
+}
+
+/**
+ * Act on a notice a worker sent over the FIFO. Only the notice types
+ * workers send are accepted, and only from a worker that is still
+ * running; every client command goes through the control socket.
+ * @param msg The notice
+ */
+static void serve_worker_message(const Frame *msg)
+{
+    char text[MAX_LINE_LENGTH] = "";
+    int32_t sender = 0;
+    int32_t status = SUCCESS;
+
+    frame_get_i32(msg, FIELD_PID, &sender);
+    if (!is_running_worker(sender))
+    {
+        log_warning("Ignored FIFO message type %d claiming PID %d: not a running worker",
+                    msg->type, (int)sender);
+        return;
+    }
+
+    frame_get_i32(msg, FIELD_STATUS, &status);
+    frame_get_string(msg, FIELD_TEXT, text, sizeof(text));
+    if (log_worker_notice(msg->type, sender, status, text) != SUCCESS)
+    {
+        log_error("Ignored FIFO message type %d from PID %d: not a worker notice", msg->type, (int)sender);
+    }
+}
+
+/**
+ * Act on every worker notice waiting in the shared ring or the FIFO
+ */
+static void drain_worker_notices(void)
+{
+    RingEvent events[EVENT_BATCH];
+    Frame msg;
+    int event_count;
+    int i;
+
+    /* Drain worker notifications from the shared ring in batches */
+    while ((event_count = event_ring_drain(events, EVENT_BATCH)) > 0)
+    {
+        for (i = 0; i < event_count; i++)
+        {
+            if (log_worker_notice(events[i].type, events[i].pid, events[i].status, events[i].text) != SUCCESS)
+            {
+                log_operation("Received unknown event type %u from PID %d: %s",
+                              events[i].type, events[i].pid, events[i].text);
+            }
+        }
+    }
+
+    /* Worker notices that did not fit the ring come over the FIFO */
+    while (receive_ipc_message(&msg) == SUCCESS)
+    {
+        serve_worker_message(&msg);
+        frame_free(&msg);
+    }
+}
+
+/**
+ * Reap finished children and notice workers that exited without
+ * reporting back. A worker's PID stays ours until it is reaped here, so
+ * it cannot be reused while the daemon still counts it as running.
+ */
+static void check_workers(void)
+{
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        if (!is_running_worker(pid))
+        {
+            continue;
+        }
+
+        /* Its notice was sent before it exited, so it is waiting by now */
+        drain_worker_notices();
+        if (!is_running_worker(pid))
+        {
+            continue;
+        }
+
+        if (WIFSIGNALED(status))
+        {
+            log_warning("%s process %d killed by signal %d without reporting",
+                        (pid == transfer_pid) ? "Transfer" : "Backup", pid, WTERMSIG(status));
+        }
+        else
+        {
+            log_warning("%s process %d exited with status %d without reporting",
+                        (pid == transfer_pid) ? "Transfer" : "Backup", pid, WEXITSTATUS(status));
+        }
+        worker_done(pid);
+    }
+}
+
+/**
+ * Serve one request from the control socket. Commands that
+ * do work go to the queue; everything else is answered straight away.
+ * @param request The request; answered or taken over by the queue
+ */
+static void serve_request(ControlRequest *request)
+{
+    char reply[MAX_LINE_LENGTH];
+    int status;
+
+    if (!control_request_allowed(request))
+    {
+        log_error("Refused message type %d from PID %d (UID %d)",
+                  request->frame.type, request->peer_pid, (int)request->peer_uid);
+        send_control_reply(request, FAILURE, "Permission denied");
+        return;
+    }
+
+    if (request->frame.type == MSG_URGENT_CHANGE || request->frame.type == MSG_URGENT_BATCH ||
+        request->frame.type == MSG_URGENT_PATCH)
+    {
+        queue_urgent_change(request);
+        return;
+    }
+
+    if (request->frame.type == MSG_SUBSCRIBE)
+    {
+        subscribe_events(request);
+        return;
+    }
+
+    status = handle_ipc_message(&request->frame, request->peer_pid, reply, sizeof(reply));
+    send_control_reply(request, status, reply);
+}
+
+/**
+ * Main daemon loop
+ */
+void daemon_main_loop(void)
+{
+    time_t now, last_check = 0;
+    struct tm *tm_now;
+    int last_check_hour = -1;
+    int last_check_minute = -1;
+    time_t last_metrics = 0;
+    ControlRequest request;
+    Command command;
+
+    log_operation("Entering main daemon loop");
+
+    while (!daemon_exit)
+    {
+        /* Get current time */
+        now = time(NULL);
+        tm_now = localtime(&now);
+
+        /* Queue the scheduled transfer (1:00 AM) and signalled requests */
+        if (tm_now->tm_hour == TRANSFER_HOUR && tm_now->tm_min == TRANSFER_MINUTE &&
+            (last_check_hour != TRANSFER_HOUR || last_check_minute != TRANSFER_MINUTE))
+        {
+            log_operation("Queueing scheduled file transfer and backup");
+            queue_command(CMD_TRANSFER, TRANSFER_DEADLINE_MS, "the schedule");
+        }
+        if (force_transfer)
+        {
+            force_transfer = 0;
+            queue_command(CMD_TRANSFER, TRANSFER_DEADLINE_MS, "SIGUSR2");
+        }
+        if (force_backup)
+        {
+            force_backup = 0;
+            queue_command(CMD_BACKUP, BACKUP_DEADLINE_MS, "SIGUSR1");
+        }
+
+        /* Check for directory changes every 5 seconds */
+        if (now - last_check >= 5)
+        {
+            queue_command(CMD_HOUSEKEEPING, HOUSEKEEPING_DEADLINE_MS, "the change monitor");
+            last_check = now;
+        }
+
+        drain_worker_notices();
+
+        /* Serve control socket requests */
+        while (receive_control_request(&request) == SUCCESS)
+        {
+            serve_request(&request);
+        }
+
+        /* Run what is queued, most urgent first */
+        check_workers();
+        while (command_queue_expire(&command) == SUCCESS)
+        {
+            drop_command(&command, "Deadline passed before it could run");
+        }
+        while (command_queue_pop(runnable_commands(), &command) == SUCCESS)
+        {
+            run_command(&command);
+        }
+
+        /* Publish lock and queue telemetry; flag lock holds that run past the threshold */
+        if (now - last_metrics >= METRICS_INTERVAL)
+        {
+            metrics_check_lock_alert();
+            write_metrics_file();
+            last_metrics = now;
+        }
+
+        /* Emit any held back duplicate log summaries */
+        log_flush_repeats();
+
+        /* Update last check time for scheduled tasks */
+        last_check_hour = tm_now->tm_hour;
+        last_check_minute = tm_now->tm_min;
+
+        /* Wait up to a second, waking early for IPC traffic or signals */
+        wait_for_ipc(1000);
+    }
+
+    /* A running transfer holds the directory lock; see it through */
+    if (transfer_pid != -1)
+    {
+        log_operation("Waiting for transfer process %d before exiting", transfer_pid);
+        waitpid(transfer_pid, NULL, 0);
+        worker_done(transfer_pid);
+    }
+
+    /* Callers still waiting on a queued command get an answer */
+    while (command_queue_expire(&command) == SUCCESS ||
+           command_queue_pop(~0u, &command) == SUCCESS)
+    {
+        drop_command(&command, "Daemon shutting down");
+    }
+
+    log_operation("Exiting main daemon loop");
+}
+
+/**
+ * Check whether an argument names one of the reporting departments
+ */
+static int is_department_name(const char *name)
+{
+    static const char *const departments[] = {
+        DEPT_WAREHOUSE, DEPT_MANUFACTURING, DEPT_SALES, DEPT_DISTRIBUTION};
+    size_t i;
+
+    for (i = 0; i < sizeof(departments) / sizeof(departments[0]); i++)
+    {
+        if (strcasecmp(name, departments[i]) == 0)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Check whether every argument names a department
+ */
+static int all_department_names(char *const *names, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!is_department_name(names[i]))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Send a message to the running daemon over its control socket and free it
+ * @param msg Message to send
+ * @param reply_text Receives the daemon's reply text (may be NULL)
+ * @param reply_size Size of reply_text
+ * @return SUCCESS if the daemon carried out the request, FAILURE otherwise
+ */
+static int send_daemon_message(Frame *msg, char *reply_text, size_t reply_size)
+{
+    char text[MAX_LINE_LENGTH] = "";
+    int32_t status = FAILURE;
+    Frame reply;
+    int result;
+
+    result = send_control_request(msg, &reply);
+    frame_free(msg);
+    if (result != SUCCESS)
+    {
+        fprintf(stderr, "Cannot reach the daemon at %s: %s\n", CONTROL_SOCKET_PATH, strerror(errno));
+        return FAILURE;
+    }
+
+    frame_get_i32(&reply, FIELD_STATUS, &status);
+    frame_get_string(&reply, FIELD_TEXT, text, sizeof(text));
+    frame_free(&reply);
+
+    if (status != SUCCESS)
+    {
+        fprintf(stderr, "Daemon refused the request: %s\n", text);
+        return FAILURE;
+    }
+
+    if (reply_text != NULL)
+    {
+        snprintf(reply_text, reply_size, "%s", text);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Get a descriptor holding the new content from standard input: stdin
+ * itself when it is a regular file, else a sealed memfd filled from it
+ * @return Descriptor for the caller to pass and close, or -1 on error
+ */
+static int stdin_content_fd(void)
+{
+    char buffer[65536];
+    struct stat st;
+    ssize_t got;
+    int fd;
+
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        return dup(STDIN_FILENO);
+    }
+
+    fd = memfd_create("urgent-change", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    while ((got = read(STDIN_FILENO, buffer, sizeof(buffer))) != 0)
+    {
+        if (got == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got == -1 || write(fd, buffer, got) != got)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    /* The daemon only accepts content that can no longer change */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Print the live lock state and the metrics last published by the daemon
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int print_status(void)
+{
+    Frame request, reply;
+    char text[MAX_LINE_LENGTH];
+    char line[512];
+    struct stat st;
+    FILE *file;
+
+    if (frame_init(&request, MSG_STATUS, 0) == SUCCESS && send_control_request(&request, &reply) == SUCCESS)
+    {
+        if (frame_get_string(&reply, FIELD_TEXT, text, sizeof(text)) != SUCCESS)
+        {
+            snprintf(text, sizeof(text), "no status in reply");
+        }
+        printf("Daemon: %s\n", text);
+        frame_free(&reply);
+    }
+    else
+    {
+        printf("Daemon: not reachable at %s (%s)\n", CONTROL_SOCKET_PATH, strerror(errno));
+    }
+    frame_free(&request);
+
+    if (are_directories_locked())
+    {
+        int holder = 0;
+
+        file = fopen(LOCK_FILE, "r");
+        if (file != NULL)
+        {
+            if (fscanf(file, "%d", &holder) != 1)
+            {
+                holder = 0;
+            }
+            fclose(file);
+        }
+        printf("Directory lock: held by PID %d\n", holder);
+    }
+    else
+    {
+        printf("Directory lock: free\n");
+    }
+
+    file = fopen(METRICS_FILE, "r");
+    if (file == NULL || fstat(fileno(file), &st) != 0)
+    {
+        fprintf(stderr, "No metrics at %s: %s\n", METRICS_FILE, strerror(errno));
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        return FAILURE;
+    }
+
+    printf("Metrics published %ld s ago:\n", (long)(time(NULL) - st.st_mtime));
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (line[0] != '#')
+        {
+            printf("  %s", line);
+        }
+    }
+
+    fclose(file);
+    return SUCCESS;
+}
+
+/**
+ * Run an administrative command in the foreground
+ * @param argc Argument count
+ * @param argv Argument vector (argv[1] is the command)
+ * @return Process exit status
+ */
+static int run_admin_command(int argc, char *argv[])
+{
+    if (strcmp(argv[1], "dedup-report") == 0)
+    {
+        return (chunk_store_report(stdout) == SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "io-limit") == 0 && (argc == 3 || argc == 4))
+    {
+        long long bandwidth = parse_io_rate(argv[2]);
+        long long ops = (argc == 4) ? parse_io_rate(argv[3]) : 0;
+        Frame msg;
+
+        if (bandwidth < 0 || ops < 0)
+        {
+            fprintf(stderr, "Invalid rate; use e.g. 20M for bytes/s, 0 for unlimited\n");
+            return EXIT_FAILURE;
+        }
+
+        if (frame_init(&msg, MSG_SET_IO_LIMITS, 0) != SUCCESS ||
+            frame_add_u64(&msg, FIELD_BANDWIDTH, (uint64_t)bandwidth) != SUCCESS ||
+            frame_add_u64(&msg, FIELD_OPS, (uint64_t)ops) != SUCCESS ||
+            send_daemon_message(&msg, NULL, 0) != SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+        printf("I/O limits set to %lld bytes/s, %lld ops/s\n", bandwidth, ops);
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(argv[1], "urgent-change") == 0 && (argc == 4 || argc == 5))
+    {
+        Frame msg;
+        int result;
+
+        result = frame_init(&msg, MSG_URGENT_CHANGE, 0);
+        if (result == SUCCESS &&
+            (frame_add_string(&msg, FIELD_FILENAME, argv[2]) != SUCCESS ||
+             frame_add_string(&msg, FIELD_USERNAME, argv[3]) != SUCCESS))
+        {
+            result = FAILURE;
+        }
+
+        /* Short content goes inline; standard input is handed over as a descriptor */
+        if (result == SUCCESS && argc == 5 && frame_add_string(&msg, FIELD_CONTENT, argv[4]) != SUCCESS)
+        {
+            result = FAILURE;
+        }
+        if (result == SUCCESS && argc == 4 && (msg.passed_fd = stdin_content_fd()) == -1)
+        {
+            result = FAILURE;
+        }
+
+        if (result != SUCCESS)
+        {
+            fprintf(stderr, "Failed to prepare the urgent change: %s\n", strerror(errno));
+            frame_free(&msg);
+            return EXIT_FAILURE;
+        }
+
+        if (send_daemon_message(&msg, NULL, 0) != SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+        printf("Urgent change to %s applied\n", argv[2]);
+        return EXIT_SUCCESS;
+    }
+
+    if ((strcmp(argv[1], "backup") == 0 || strcmp(argv[1], "transfer") == 0) && argc == 2)
+    {
+        char text[MAX_LINE_LENGTH];
+        Frame msg;
+
+        if (frame_init(&msg, strcmp(argv[1], "backup") == 0 ? MSG_FORCE_BACKUP : MSG_FORCE_TRANSFER, 0) != SUCCESS ||
+            send_daemon_message(&msg, text, sizeof(text)) != SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+        printf("%s\n", text);
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(argv[1], "cancel") == 0 && argc == 3)
+    {
+        char text[MAX_LINE_LENGTH];
+        char *end;
+        unsigned long id = strtoul(argv[2], &end, 10);
+        Frame msg;
+
+        if (*argv[2] == '\0' || *end != '\0' || id == 0 || id > UINT32_MAX)
+        {
+            fprintf(stderr, "Invalid command ID: %s\n", argv[2]);
+            return EXIT_FAILURE;
+        }
+
+        if (frame_init(&msg, MSG_CANCEL_COMMAND, 0) != SUCCESS ||
+            frame_add_u64(&msg, FIELD_COMMAND_ID, id) != SUCCESS ||
+            send_daemon_message(&msg, text, sizeof(text)) != SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+        printf("%s\n", text);
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(argv[1], "status") == 0 && argc == 2)
+    {
+        return (print_status() == SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "verify") == 0)
+    {
+        return (verify_snapshots(argv + 2, argc - 2, stdout) == SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "restore") == 0 && argc >= 3)
+    {
+        int result;
+
+        /* A single non-department argument names one report */
+        if (argc == 4 && !is_department_name(argv[3]))
+        {
+            result = restore_snapshot_file(argv[2], argv[3]);
+        }
+        else if (argc == 3 || all_department_names(argv + 3, argc - 3))
+        {
+            result = restore_snapshot(argv[2], argv + 3, argc - 3);
+        }
+        else
+        {
+            fprintf(stderr, "restore takes either one report name or department names\n");
+            return EXIT_FAILURE;
+        }
+
+        if (result != SUCCESS)
+        {
+            fprintf(stderr, "Restore from %s failed (see %s)\n", argv[2], ERROR_LOG);
+            return EXIT_FAILURE;
+        }
+        printf("Restore from %s completed\n", argv[2]);
+        return EXIT_SUCCESS;
+    }
+
+    fprintf(stderr, "Usage: %s [status | backup | transfer | cancel <id> | urgent-change <file> <user> [content] | dedup-report | verify [snapshot...] | "
+                    "restore <snapshot> [file | department...] | io-limit <bytes/s> [ops/s]]\n", argv[0]);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Main entry point for the daemon
+ */
+int main(int argc, char *argv[])
+{
+    /* Every path below depends on the root prefix and instance name */
+    if (init_paths_from_env() != SUCCESS)
+    {
+        fprintf(stderr, "Invalid %s or %s: %s\n", ROOT_PREFIX_ENV, INSTANCE_ENV, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Administrative commands run in the foreground and exit */
+    if (argc > 1)
+    {
+        return run_admin_command(argc, argv);
+    }
 
     /* Initialize the daemon */
     if (daemon_init() != SUCCESS)
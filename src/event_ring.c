@@ -0,0 +1,443 @@
+/**
+ * @file event_ring.c
+ * @brief Shared-memory MPSC ring for worker-to-daemon notifications
+ *
+ * Bounded queue with a sequence number per slot: producers claim a slot
+ * by advancing the tail with a compare-and-swap, fill it and publish it
+ * by bumping its sequence; the single consumer reads slots in order. The
+ * ring lives in a memfd mapped before fork(), so every worker shares it.
+ * The eventfd doorbell is only rung when the consumer said it was going
+ * to sleep, so a busy daemon drains events without any system calls.
+ *
+ * A producer that dies between claiming a slot and publishing it would
+ * stall the consumer for good, so each slot also has a claim word naming
+ * the lap that owns it, and the owner records its PID. The consumer
+ * abandons a claimed slot whose producer is gone, or that stays
+ * unpublished past EVENT_SLOT_STALE_MS, by marking the claim word. The
+ * producer builds its event in a local copy and, before writing it into
+ * the slot, swaps the claim word to "writing"; if the consumer got there
+ * first, the event is dropped (and counted) and the caller falls back to
+ * the FIFO. A slot being written is only taken back once its producer has
+ * exited, so a slow producer can never tear the event of the next lap.
+ */
+
+#define _GNU_SOURCE  // For memfd_create
+
+#include "event_ring.h"
+#include "utils.h"
+#include "backup.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+/* Claim word: position + 1 of the owning lap, plus one of these states */
+#define CLAIM_WRITING       (1ULL << 63)          /* Owner is copying its event in */
+#define CLAIM_ABANDONED     (1ULL << 62)          /* Consumer took the slot back */
+#define CLAIM_POSITION_MASK (CLAIM_ABANDONED - 1)
+
+/**
+ * Structure for one slot
+ */
+typedef struct {
+    _Atomic uint64_t sequence;  /* Position + 1 when full, position when free */
+    _Atomic uint64_t claimed;   /* Claim word of the lap that owns it */
+    _Atomic int32_t claimer;    /* PID of the owner, valid once it is writing */
+    RingEvent event;            /* Payload */
+} RingSlot;
+
+/**
+ * Structure of the shared mapping
+ */
+typedef struct {
+    _Alignas(64) _Atomic uint64_t tail;  /* Next position producers claim */
+    _Alignas(64) _Atomic int waiting;    /* Consumer is (about to be) asleep */
+    _Atomic uint64_t overflows;          /* Events refused because the ring was full */
+    _Atomic uint64_t abandoned;          /* Claimed slots never published */
+    _Atomic uint64_t dropped;            /* Events whose slot was taken back before they were written */
+    _Alignas(64) RingSlot slots[EVENT_RING_SLOTS];
+} EventRing;
+
+static EventRing *ring = NULL;
+static int doorbell_fd = -1;
+static uint64_t head = 0;  /* Consumer position; only the daemon consumes */
+
+/* When the consumer first found the slot at stall_position claimed but unpublished */
+static uint64_t stall_position = UINT64_MAX;
+static uint64_t stall_since_ns = 0;
+
+/**
+ * Get a CLOCK_MONOTONIC reading in nanoseconds, as used for sent_ns
+ */
+uint64_t event_ring_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Create the shared ring and its doorbell. Must run before workers are
+ * forked; without it, publishing fails and workers use the FIFO.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int event_ring_init(void)
+{
+    EventRing *mapped;
+    uint64_t i;
+    int fd;
+
+    if (ring != NULL)
+    {
+        return SUCCESS;
+    }
+
+    fd = memfd_create("company_daemon_events", MFD_CLOEXEC);
+    if (fd == -1 || ftruncate(fd, sizeof(EventRing)) != 0)
+    {
+        log_error("Failed to create event ring: %s", strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return FAILURE;
+    }
+
+    mapped = (EventRing *)mmap(NULL, sizeof(EventRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        log_error("Failed to map event ring: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (doorbell_fd == -1)
+    {
+        log_error("Failed to create event ring doorbell: %s", strerror(errno));
+        munmap(mapped, sizeof(EventRing));
+        return FAILURE;
+    }
+
+    atomic_init(&mapped->tail, 0);
+    atomic_init(&mapped->waiting, 0);
+    atomic_init(&mapped->overflows, 0);
+    atomic_init(&mapped->abandoned, 0);
+    atomic_init(&mapped->dropped, 0);
+    for (i = 0; i < EVENT_RING_SLOTS; i++)
+    {
+        atomic_init(&mapped->slots[i].sequence, i);
+        atomic_init(&mapped->slots[i].claimed, 0);
+        atomic_init(&mapped->slots[i].claimer, 0);
+    }
+
+    ring = mapped;
+    head = 0;
+    stall_position = UINT64_MAX;
+    return SUCCESS;
+}
+
+/**
+ * Publish an event from any process sharing the ring; no system call
+ * unless the consumer is asleep
+ * @param type MSG_* type
+ * @param status Status code
+ * @param text Message text
+ * @return SUCCESS on success, FAILURE if the ring is full, not set up, or
+ *         the consumer gave up on the claimed slot before it was written
+ */
+int event_ring_publish(int type, int status, const char *text)
+{
+    uint64_t position;
+    uint64_t owner;
+    RingSlot *slot;
+    RingEvent event;
+
+    if (ring == NULL)
+    {
+        return FAILURE;
+    }
+
+    /* Fill the event first, so the slot is held for as short a time as possible */
+    event.type = (uint32_t)type;
+    event.pid = getpid();
+    event.status = status;
+    snprintf(event.text, sizeof(event.text), "%s", text);
+
+    position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;)
+    {
+        uint64_t sequence;
+
+        slot = &ring->slots[position & (EVENT_RING_SLOTS - 1)];
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+        if (sequence == position)
+        {
+            /* Free slot; claim it unless another producer got there first */
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (sequence < position)
+        {
+            /* The consumer has not freed this slot yet: full */
+            atomic_fetch_add_explicit(&ring->overflows, 1, memory_order_relaxed);
+            return FAILURE;
+        }
+        else
+        {
+            position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    /* Take the claim word for this lap, unless the consumer already gave up on it */
+    owner = atomic_load_explicit(&slot->claimed, memory_order_acquire);
+    do
+    {
+        if ((owner & CLAIM_POSITION_MASK) >= position + 1)
+        {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return FAILURE;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&slot->claimed, &owner, position + 1,
+                                                    memory_order_acq_rel, memory_order_acquire));
+
+    /* Let the consumer tell a dead owner from a slow one, then confirm the
+     * slot is still ours before touching it: once writing, it is not taken
+     * back while this process lives */
+    atomic_store_explicit(&slot->claimer, event.pid, memory_order_relaxed);
+    owner = position + 1;
+    if (!atomic_compare_exchange_strong_explicit(&slot->claimed, &owner, (position + 1) | CLAIM_WRITING,
+                                                 memory_order_acq_rel, memory_order_relaxed))
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return FAILURE;
+    }
+
+    event.sent_ns = event_ring_now_ns();
+    slot->event = event;
+
+    /* Sequentially consistent so the doorbell check below cannot be reordered before it */
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_seq_cst);
+
+    if (atomic_exchange_explicit(&ring->waiting, 0, memory_order_seq_cst))
+    {
+        uint64_t one = 1;
+
+        if (write(doorbell_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        {
+            log_warning("Failed to ring event doorbell: %s", strerror(errno));
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Check whether the slot at the consumer position is published
+ */
+static int event_ready(void)
+{
+    RingSlot *slot = &ring->slots[head & (EVENT_RING_SLOTS - 1)];
+
+    return atomic_load_explicit(&slot->sequence, memory_order_seq_cst) == head + 1;
+}
+
+/**
+ * Check whether the slot at the consumer position was claimed and then
+ * left unpublished by a producer that died or stalled
+ * @param slot The slot at head, not yet published
+ * @param owner Receives the claim word the decision was based on
+ * @return TRUE if it should be abandoned
+ */
+static int slot_abandoned(RingSlot *slot, uint64_t *owner)
+{
+    uint64_t now;
+    pid_t claimer;
+
+    /* Nothing claimed it yet: the ring is simply empty here */
+    if (atomic_load_explicit(&ring->tail, memory_order_acquire) <= head)
+    {
+        return FALSE;
+    }
+
+    *owner = atomic_load_explicit(&slot->claimed, memory_order_acquire);
+    if ((*owner & ~CLAIM_WRITING) == head + 1)
+    {
+        claimer = atomic_load_explicit(&slot->claimer, memory_order_relaxed);
+        if (kill(claimer, 0) != 0 && errno == ESRCH)
+        {
+            log_warning("Event ring slot %llu abandoned: producer %d exited before publishing",
+                        (unsigned long long)head, (int)claimer);
+            return TRUE;
+        }
+
+        /* Mid-copy: reusing the slot now could tear the next lap's event */
+        if (*owner & CLAIM_WRITING)
+        {
+            return FALSE;
+        }
+    }
+
+    /* A producer that died before recording its PID is only found by the clock */
+    now = event_ring_now_ns();
+    if (stall_position != head)
+    {
+        stall_position = head;
+        stall_since_ns = now;
+        return FALSE;
+    }
+    if (now - stall_since_ns >= (uint64_t)EVENT_SLOT_STALE_MS * 1000000ULL)
+    {
+        log_warning("Event ring slot %llu abandoned: unpublished for %d ms",
+                    (unsigned long long)head, EVENT_SLOT_STALE_MS);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * Take up to max published events, in order (single consumer only)
+ * @param events Receives the events
+ * @param max Capacity of events
+ * @return Number of events taken
+ */
+int event_ring_drain(RingEvent *events, int max)
+{
+    int count = 0;
+
+    if (ring == NULL)
+    {
+        return 0;
+    }
+
+    while (count < max)
+    {
+        RingSlot *slot = &ring->slots[head & (EVENT_RING_SLOTS - 1)];
+
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != head + 1)
+        {
+            uint64_t expected = head;
+            uint64_t owner;
+
+            if (!slot_abandoned(slot, &owner))
+            {
+                break;
+            }
+
+            /* Mark the claim word first, so a producer that was only slow
+             * finds the slot gone before it writes anything into it */
+            if (!atomic_compare_exchange_strong_explicit(&slot->claimed, &owner, (head + 1) | CLAIM_ABANDONED,
+                                                         memory_order_acq_rel, memory_order_relaxed))
+            {
+                break;
+            }
+
+            /* Free the slot for the next lap, unless its producer published before dying */
+            if (atomic_compare_exchange_strong_explicit(&slot->sequence, &expected, head + EVENT_RING_SLOTS,
+                                                        memory_order_acq_rel, memory_order_acquire))
+            {
+                atomic_fetch_add_explicit(&ring->abandoned, 1, memory_order_relaxed);
+                head++;
+                continue;
+            }
+            if (expected != head + 1)
+            {
+                break;
+            }
+        }
+
+        events[count++] = slot->event;
+
+        /* Hand the slot back to producers for the next lap */
+        atomic_store_explicit(&slot->sequence, head + EVENT_RING_SLOTS, memory_order_release);
+        head++;
+    }
+
+    return count;
+}
+
+/**
+ * Get the doorbell descriptor to poll for readability
+ * @return eventfd descriptor, or -1 if the ring is not set up
+ */
+int event_ring_fd(void)
+{
+    return doorbell_fd;
+}
+
+/**
+ * Announce that the consumer is about to sleep on the doorbell
+ * @return TRUE if events are already waiting and it should not sleep
+ */
+int event_ring_prepare_wait(void)
+{
+    if (ring == NULL)
+    {
+        return FALSE;
+    }
+
+    atomic_store_explicit(&ring->waiting, 1, memory_order_seq_cst);
+
+    /* An event published before the flag was seen would not ring the bell */
+    if (event_ready())
+    {
+        atomic_store_explicit(&ring->waiting, 0, memory_order_relaxed);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * Reset the doorbell after waking up
+ */
+void event_ring_ack_doorbell(void)
+{
+    uint64_t count;
+
+    if (ring != NULL)
+    {
+        atomic_store_explicit(&ring->waiting, 0, memory_order_relaxed);
+    }
+    if (doorbell_fd != -1 && read(doorbell_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        log_warning("Failed to reset event doorbell: %s", strerror(errno));
+    }
+}
+
+/**
+ * Count events refused because the ring was full
+ * @return Number of refused events
+ */
+uint64_t event_ring_overflows(void)
+{
+    return (ring != NULL) ? atomic_load_explicit(&ring->overflows, memory_order_relaxed) : 0;
+}
+
+/**
+ * Count events a producer dropped because its slot was taken back first
+ * @return Number of dropped events
+ */
+uint64_t event_ring_dropped(void)
+{
+    return (ring != NULL) ? atomic_load_explicit(&ring->dropped, memory_order_relaxed) : 0;
+}
+
+/**
+ * Count claimed slots the consumer gave up on
+ * @return Number of events dropped because their producer died or stalled
+ */
+uint64_t event_ring_abandoned(void)
+{
+    return (ring != NULL) ? atomic_load_explicit(&ring->abandoned, memory_order_relaxed) : 0;
+}
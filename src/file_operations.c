@@ -3,25 +3,93 @@
  * @brief Implementation of file transfer and monitoring functions
  */
 
-#define _DEFAULT_SOURCE // For DT_DIR on some systems
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // For DT_DIR, F_SETLEASE, F_OFD_SETLK, F_GET_SEALS and copy_file_range
 
 #include "file_operations.h"
 #include "utils.h"
 #include "backup.h"
 #include "daemon.h"
+#include "hash.h"
+#include "throttle.h"
+#include "event_ring.h"
+#include "ipc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 
 /* Static variables for tracking directory state */
 time_t last_scan_time = 0;
 ReportFile *previous_files = NULL;
 int previous_file_count = 0;
 
+/**
+ * Get a monotonic clock reading in milliseconds
+ */
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+/**
+ * Protect one upload while it is validated and moved. A read lease fails
+ * while anyone has the file open for writing and is broken as soon as
+ * someone opens it for writing, whether or not they use locks. An OFD read
+ * lock on top keeps out cooperative writers that take OFD/POSIX write locks.
+ * @param fd Upload opened read-only
+ * @param leased Receives TRUE if a lease was taken
+ * @return SUCCESS if the file may be moved, FAILURE if it is busy
+ */
+static int lock_upload_file(int fd, int *leased)
+{
+    struct flock lock;
+
+    *leased = FALSE;
+    if (fcntl(fd, F_SETLEASE, F_RDLCK) == 0)
+    {
+        *leased = TRUE;
+    }
+    else if (errno == EAGAIN || errno == EBUSY)
+    {
+        /* Still being written by the uploader */
+        return FAILURE;
+    }
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl(fd, F_OFD_SETLK, &lock) != 0 && errno != EINVAL)
+    {
+        if (*leased)
+        {
+            fcntl(fd, F_SETLEASE, F_UNLCK);
+            *leased = FALSE;
+        }
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Check that nobody has opened a leased upload for writing since the lease was taken
+ */
+static int upload_lease_intact(int fd, int leased)
+{
+    return !leased || fcntl(fd, F_GETLEASE) == F_RDLCK;
+}
+
 /**
  * Transfer reports from upload directory to dashboard directory
  * @return SUCCESS on success, FAILURE on error
@@ -33,6 +101,11 @@ int transfer_reports(void)
     char src_path[MAX_PATH_LENGTH];
     char dest_path[MAX_PATH_LENGTH];
     int result = SUCCESS;
+    int file_locks = (get_lock_mode() == LOCK_MODE_FILE);
+    int locked_count = 0;
+    int busy_count = 0;
+    double blocked_ms = 0.0;
+    double max_blocked_ms = 0.0;
 
     log_operation("Starting report transfer from upload to dashboard");
 
@@ -75,9 +148,35 @@ int transfer_reports(void)
         snprintf(src_path, MAX_PATH_LENGTH, "%s/%s", UPLOAD_DIR, entry->d_name);
         snprintf(dest_path, MAX_PATH_LENGTH, "%s/%s", DASHBOARD_DIR, entry->d_name);
 
+        /* In file lock mode only this upload is protected, and only until it is renamed */
+        int lock_fd = -1;
+        int leased = FALSE;
+        double locked_at = 0.0;
+
+        if (file_locks)
+        {
+            lock_fd = open(src_path, O_RDONLY | O_NONBLOCK);
+            if (lock_fd == -1 || lock_upload_file(lock_fd, &leased) != SUCCESS)
+            {
+                log_operation("Upload %s is still being written, leaving it for the next transfer", entry->d_name);
+                if (lock_fd != -1)
+                {
+                    close(lock_fd);
+                }
+                busy_count++;
+                continue;
+            }
+            locked_at = now_ms();
+            locked_count++;
+        }
+
         if (!is_valid_xml_report(src_path))
         {
             log_error("Skipping invalid XML file: %s", entry->d_name);
+            if (lock_fd != -1)
+            {
+                close(lock_fd);
+            }
             continue;
         }
 
@@ -88,15 +187,42 @@ int transfer_reports(void)
             /* We still transfer the file but log it as late */
         }
 
-        /* Move the file */
+        /* A writer that opened the file since we validated it wins; retry next time */
+        if (lock_fd != -1 && !upload_lease_intact(lock_fd, leased))
+        {
+            log_operation("Upload %s was reopened for writing, leaving it for the next transfer", entry->d_name);
+            close(lock_fd);
+            busy_count++;
+            continue;
+        }
+
+        /* Move the file; the rename hands it over to the dashboard atomically */
         log_operation("Moving file: %s to %s", entry->d_name, DASHBOARD_DIR);
-        if (move_file(src_path, dest_path) != SUCCESS)
+        int moved = move_file(src_path, dest_path);
+
+        if (lock_fd != -1)
+        {
+            double held = now_ms() - locked_at;
+
+            /* Closing the descriptor drops both the lease and the OFD lock */
+            close(lock_fd);
+            blocked_ms += held;
+            if (held > max_blocked_ms)
+            {
+                max_blocked_ms = held;
+            }
+        }
+
+        if (moved != SUCCESS)
         {
             log_error("Failed to move file %s to dashboard", entry->d_name);
             result = FAILURE;
             continue;
         }
 
+        /* Progress is best effort; a full ring just drops it */
+        event_ring_publish(MSG_FILE_TRANSFERRED, SUCCESS, entry->d_name);
+
         /* Log the transfer operation */
         char owner[MAX_USER_LENGTH];
         if (get_file_owner(dest_path, owner, MAX_USER_LENGTH) == SUCCESS)
@@ -106,6 +232,14 @@ int transfer_reports(void)
     }
 
     closedir(dir);
+
+    if (file_locks)
+    {
+        log_operation("Transfer file locks: %d uploads locked for %.2f ms in total (max %.2f ms), "
+                      "%d busy uploads deferred",
+                      locked_count, blocked_ms, max_blocked_ms, busy_count);
+    }
+
     return result;
 }
 
@@ -168,7 +302,8 @@ int check_missing_reports(void)
     {
         if (!found[i])
         {
-            log_error("Missing report from department: %s", department_reports[i]);
+            log_warning("Missing report from department: %s", department_reports[i]);
+            publish_event(EVENT_MISSING_REPORT, FAILURE, NULL, NULL, department_reports[i]);
             missing_count++;
         }
     }
@@ -260,6 +395,8 @@ int monitor_directory_changes(void)
                     log_file_change(current_files[i].owner,
                                     current_files[i].filename,
                                     "modify");
+                    publish_event(EVENT_FILE_MODIFY, SUCCESS, current_files[i].filename,
+                                  current_files[i].owner, "upload");
                 }
 
                 break;
@@ -272,6 +409,8 @@ int monitor_directory_changes(void)
             log_file_change(current_files[i].owner,
                             current_files[i].filename,
                             "create");
+            publish_event(EVENT_FILE_CREATE, SUCCESS, current_files[i].filename,
+                          current_files[i].owner, "upload");
         }
     }
 
@@ -295,6 +434,8 @@ int monitor_directory_changes(void)
             log_file_change(previous_files[j].owner,
                             previous_files[j].filename,
                             "delete");
+            publish_event(EVENT_FILE_DELETE, SUCCESS, previous_files[j].filename,
+                          previous_files[j].owner, "upload");
         }
     }
 
@@ -541,11 +682,25 @@ int move_file(const char *source, const char *destination)
  * @return SUCCESS on success, FAILURE on error
  */
 int copy_file(const char *source, const char *destination)
+{
+    return copy_file_hashed(source, destination, NULL);
+}
+
+/**
+ * Copy a file from source to destination, hashing the data on the way
+ *
+ * @param source Source file path
+ * @param destination Destination file path
+ * @param hash Receives the content hash of the copied data (may be NULL)
+ * @return SUCCESS on success, FAILURE on error
+ */
+int copy_file_hashed(const char *source, const char *destination, uint64_t *hash)
 {
     int src_fd, dest_fd;
-    char buffer[4096];
+    char buffer[COPY_BUFFER_SIZE];
     ssize_t bytes_read, bytes_written;
     int result = SUCCESS;
+    HashState state;
 
     /* Open source file for reading */
     src_fd = open(source, O_RDONLY);
@@ -565,9 +720,13 @@ int copy_file(const char *source, const char *destination)
         return FAILURE;
     }
 
+    hash_init(&state, HASH_SEED);
+
     /* Copy data */
     while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0)
     {
+        throttle_io((size_t)bytes_read);
+
         bytes_written = write(dest_fd, buffer, bytes_read);
         if (bytes_written != bytes_read)
         {
@@ -575,6 +734,11 @@ int copy_file(const char *source, const char *destination)
             result = FAILURE;
             break;
         }
+
+        if (hash != NULL)
+        {
+            hash_update(&state, buffer, (size_t)bytes_read);
+        }
     }
 
     /* Check for read error */
@@ -588,6 +752,11 @@ int copy_file(const char *source, const char *destination)
     close(src_fd);
     close(dest_fd);
 
+    if (result == SUCCESS && hash != NULL)
+    {
+        *hash = hash_final(&state);
+    }
+
     return result;
 }
 
@@ -693,8 +862,8 @@ int is_file_uploaded_on_time(const char *filepath)
     {
         char time_str[MAX_TIME_LENGTH];
         get_timestamp_string(file_timestamp, time_str, MAX_TIME_LENGTH);
-        log_error("File %s was uploaded late at %s (deadline: %02d:%02d)",
-                  filepath, time_str, UPLOAD_DEADLINE_HOUR, UPLOAD_DEADLINE_MINUTE);
+        log_warning("File %s was uploaded late at %s (deadline: %02d:%02d)",
+                    filepath, time_str, UPLOAD_DEADLINE_HOUR, UPLOAD_DEADLINE_MINUTE);
         return FALSE;
     }
 
@@ -702,82 +871,1013 @@ int is_file_uploaded_on_time(const char *filepath)
 }
 
 /**
- * Make an urgent change to a file in the dashboard directory
- * This bypasses the normal permissions to allow emergency updates
+ * Check that an urgent change target is a regular file in the dashboard
+ * @param dir_fd Dashboard directory
+ * @param filename Name of the file to update
+ * @param st Receives the file's status, for its mode and owner
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int check_urgent_target(int dir_fd, const char* filename, struct stat* st) {
+    if (fstatat(dir_fd, filename, st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st->st_mode)) {
+        log_error("File not found for urgent change: %s/%s", DASHBOARD_DIR, filename);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Open the dashboard directory and check an urgent change target there
+ * @param filename Name of the file to update
+ * @param st Receives the file's status, for its mode and owner
+ * @return Directory descriptor, or -1 on error
+ */
+static int open_urgent_target(const char* filename, struct stat* st) {
+    int dir_fd = open(DASHBOARD_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    
+    if (dir_fd == -1) {
+        log_error("Failed to open dashboard directory: %s", strerror(errno));
+        return -1;
+    }
+    
+    if (check_urgent_target(dir_fd, filename, st) != SUCCESS) {
+        close(dir_fd);
+        return -1;
+    }
+    
+    return dir_fd;
+}
+
+/**
+ * Create the file an urgent change is staged in. It is unnamed
+ * (O_TMPFILE) where the filesystem allows, so a crash leaves nothing
+ * behind; otherwise it is a hidden file next to the report.
+ * @param dir_fd Dashboard directory
+ * @param filename Name of the file to update
+ * @param temp_name Receives the hidden file's name, "" when unnamed
+ * @param temp_size Size of temp_name
+ * @return Descriptor open for reading and writing, or -1 on error
+ */
+static int create_urgent_temp(int dir_fd, const char* filename, char* temp_name, size_t temp_size) {
+    char temp_path[MAX_PATH_LENGTH];
+    int fd;
+    
+    temp_name[0] = '\0';
+    fd = openat(dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        return fd;
+    }
+    
+    if (snprintf(temp_path, sizeof(temp_path), "%s/.%s.urgent.XXXXXX", DASHBOARD_DIR, filename) >= (int)sizeof(temp_path)) {
+        log_error("Path too long for urgent change: %s", filename);
+        return -1;
+    }
+    
+    fd = mkostemp(temp_path, O_CLOEXEC);
+    if (fd == -1) {
+        log_error("Failed to create temporary file for urgent change: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(temp_name, temp_size, "%s", strrchr(temp_path, '/') + 1);
+    return fd;
+}
+
+/**
+ * Finish a staged urgent change: give it the report's mode and owner,
+ * optionally make it durable, and make sure it has a hidden name it can
+ * be renamed from
+ * @param dir_fd Dashboard directory
+ * @param temp_fd Staged content; closed here
+ * @param temp_name Name from create_urgent_temp(), "" when unnamed;
+ *        receives the hidden name. The file is removed on failure.
+ * @param temp_size Size of temp_name
+ * @param filename Name of the file to update
+ * @param st Status of the report being replaced
+ * @param sync Whether to fsync the content; a batch syncs once for all
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int seal_urgent_temp(int dir_fd, int temp_fd, char* temp_name, size_t temp_size,
+                            const char* filename, const struct stat* st, int sync) {
+    char proc_path[64];
+    int result = SUCCESS;
+    
+    if (fchmod(temp_fd, st->st_mode & 07777) != 0 ||
+        fchown(temp_fd, st->st_uid, st->st_gid) != 0 ||
+        (sync && fsync(temp_fd) != 0)) {
+        log_error("Failed to prepare urgent change to %s: %s", filename, strerror(errno));
+        result = FAILURE;
+    } else if (temp_name[0] == '\0') {
+        /* An unnamed file needs a name before it can be renamed over the report */
+        snprintf(temp_name, temp_size, ".%s.urgent.%d", filename, (int)getpid());
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", temp_fd);
+        unlinkat(dir_fd, temp_name, 0);
+        if (linkat(AT_FDCWD, proc_path, dir_fd, temp_name, AT_SYMLINK_FOLLOW) != 0) {
+            log_error("Failed to link urgent change to %s: %s", filename, strerror(errno));
+            temp_name[0] = '\0';
+            result = FAILURE;
+        }
+    }
+    
+    if (close(temp_fd) != 0 && result == SUCCESS) {
+        log_error("Failed to write urgent change to %s: %s", filename, strerror(errno));
+        result = FAILURE;
+    }
+    
+    if (result != SUCCESS && temp_name[0] != '\0') {
+        unlinkat(dir_fd, temp_name, 0);
+        temp_name[0] = '\0';
+    }
+    return result;
+}
+
+/**
+ * Stage new content for a report in a hidden file next to it
+ * @param dir_fd Dashboard directory
+ * @param filename Name of the file to update
+ * @param content New content
+ * @param content_length Bytes of content
+ * @param st Status of the report being replaced
+ * @param temp_name Receives the staged file's name
+ * @param temp_size Size of temp_name
+ * @param sync Whether to fsync the content
+ * @return SUCCESS on success, FAILURE on error (nothing left behind)
+ */
+static int stage_urgent_content(int dir_fd, const char* filename, const char* content, size_t content_length,
+                                const struct stat* st, char* temp_name, size_t temp_size, int sync) {
+    size_t written = 0;
+    int temp_fd;
+    
+    temp_fd = create_urgent_temp(dir_fd, filename, temp_name, temp_size);
+    if (temp_fd == -1) {
+        return FAILURE;
+    }
+    
+    /* Write the new content */
+    while (written < content_length) {
+        ssize_t n = write(temp_fd, content + written, content_length - written);
+        
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += (size_t)n;
+    }
+    
+    if (written < content_length) {
+        log_error("Failed to write content for urgent change: %s", strerror(errno));
+        close(temp_fd);
+        if (temp_name[0] != '\0') {
+            unlinkat(dir_fd, temp_name, 0);
+        }
+        return FAILURE;
+    }
+    
+    return seal_urgent_temp(dir_fd, temp_fd, temp_name, temp_size, filename, st, sync);
+}
+
+/**
+ * Rename a sealed urgent change over its report and make the rename
+ * durable, so readers see either the old or the new content
+ * @param dir_fd Dashboard directory
+ * @param temp_name Name from seal_urgent_temp(); removed on failure
+ * @param filename Name of the file to update
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int publish_urgent_temp(int dir_fd, const char* temp_name, const char* filename) {
+    if (renameat(dir_fd, temp_name, dir_fd, filename) != 0) {
+        log_error("Failed to install urgent change to %s: %s", filename, strerror(errno));
+        unlinkat(dir_fd, temp_name, 0);
+        return FAILURE;
+    }
+    
+    /* The rename itself survives a crash only once the directory is synced */
+    if (fsync(dir_fd) != 0) {
+        log_warning("Failed to sync dashboard directory after urgent change: %s", strerror(errno));
+    }
+    return SUCCESS;
+}
+
+/**
+ * Make an urgent change to a file in the dashboard directory. The new
+ * content is staged in a temporary file and renamed over the report, so
+ * readers never see a truncated report and no permissions are loosened.
  * @param filename Name of the file to update
  * @param content New content for the file
+ * @param content_length Bytes of content; it may hold any byte, NUL included
  * @param user_name Name of the user making the change
  * @return SUCCESS on success, FAILURE on error
  */
-int make_urgent_change(const char* filename, const char* content, const char* user_name) {
-    char filepath[MAX_PATH_LENGTH];
-    FILE *file;
-    mode_t old_mask;
-    mode_t old_permissions;
+int make_urgent_change(const char* filename, const char* content, size_t content_length, const char* user_name) {
+    char temp_name[MAX_PATH_LENGTH];
     struct stat st;
+    int dir_fd;
+    int result;
     
     log_operation("Attempting urgent change to file %s by user %s", filename, user_name);
     
-    /* Construct the full path */
-    snprintf(filepath, MAX_PATH_LENGTH, "%s/%s", DASHBOARD_DIR, filename);
+    dir_fd = open_urgent_target(filename, &st);
+    if (dir_fd == -1) {
+        return FAILURE;
+    }
     
-    /* Check if file exists */
-    if (stat(filepath, &st) != 0) {
-        log_error("File not found for urgent change: %s", filepath);
+    result = stage_urgent_content(dir_fd, filename, content, content_length, &st,
+                                  temp_name, sizeof(temp_name), TRUE);
+    if (result == SUCCESS) {
+        result = publish_urgent_temp(dir_fd, temp_name, filename);
+    }
+    close(dir_fd);
+    if (result != SUCCESS) {
         return FAILURE;
     }
     
-    /* Save old permissions */
-    old_permissions = st.st_mode & 0777;
+    /* Log the change */
+    log_file_change(user_name, filename, "urgent_change");
+    
+    log_operation("Urgent change to file %s by user %s completed successfully", filename, user_name);
+    
+    return SUCCESS;
+}
+
+/**
+ * Name the marker that records a batch as committed, so recovery keeps
+ * its reports instead of rolling them back
+ * @param pid Process that ran the batch
+ * @param name Receives the marker's name
+ * @param size Size of name
+ */
+static void urgent_commit_marker(pid_t pid, char* name, size_t size) {
+    snprintf(name, size, "%s%d%s", URGENT_COMMIT_PREFIX, (int)pid, URGENT_COMMIT_SUFFIX);
+}
+
+/**
+ * Remove the hidden files left by a batch that is being abandoned, and
+ * put back the reports it had already replaced
+ * @param dir_fd Dashboard directory
+ * @param changes The batch
+ * @param staged Changes whose content is staged
+ * @param saved Changes whose report has an undo link
+ * @param published Changes already renamed over their report
+ * @return Number of reports that could not be put back
+ */
+static int unwind_urgent_batch(int dir_fd, UrgentChange* changes, int staged, int saved, int published) {
+    int failed = 0;
+    int i;
+    
+    for (i = 0; i < staged; i++) {
+        if (i < published) {
+            if (renameat(dir_fd, changes[i].undo_name, dir_fd, changes[i].filename) != 0) {
+                log_error("Failed to restore %s after a failed urgent batch, old content kept as %s: %s",
+                          changes[i].filename, changes[i].undo_name, strerror(errno));
+                failed++;
+            }
+        } else {
+            unlinkat(dir_fd, changes[i].temp_name, 0);
+            if (i < saved) {
+                unlinkat(dir_fd, changes[i].undo_name, 0);
+            }
+        }
+    }
+    
+    if (published > 0 && fsync(dir_fd) != 0) {
+        log_warning("Failed to sync dashboard directory after undoing urgent batch: %s", strerror(errno));
+    }
+    return failed;
+}
+
+/**
+ * Apply several urgent changes as one: every file is staged and synced
+ * before any report is replaced, then the reports are renamed over in
+ * one pass. If anything fails, the reports already replaced are put back
+ * from hard links taken beforehand, so the batch applies whole or not
+ * at all. The directory lock is held throughout, so no transfer or
+ * restore sees the dashboard half changed; a crash before the commit
+ * marker is written is rolled back by recover_urgent_batches().
+ * @param changes Files and contents; the staging fields are used here
+ * @param count Number of changes, each to a different file
+ * @param user_name Name of the user making the changes
+ * @return SUCCESS on success, FAILURE on error (no report changed unless
+ *         an undo failed, which is logged)
+ */
+int make_urgent_changes(UrgentChange* changes, int count, const char* user_name) {
+    char marker[MAX_PATH_LENGTH];
+    struct stat st;
+    double started = now_ms();
+    int staged = 0, saved = 0, published = 0;
+    int marker_fd;
+    int dir_fd;
+    int failed;
+    int i;
     
-    /* Temporarily set write permissions on the dashboard directory */
-    chmod(DASHBOARD_DIR, 0777);
+    log_operation("Attempting urgent batch of %d files by user %s", count, user_name);
     
-    /* Set umask to allow file creation */
-    old_mask = umask(0);
+    if (create_lock_file() != SUCCESS) {
+        log_error("Urgent batch by user %s refused: directory lock unavailable", user_name);
+        return FAILURE;
+    }
     
-    /* Temporarily set write permissions on the file if it exists */
-    chmod(filepath, 0666);
+    dir_fd = open(DASHBOARD_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        log_error("Failed to open dashboard directory: %s", strerror(errno));
+        remove_lock_file();
+        return FAILURE;
+    }
     
-    /* Open the file for writing */
-    file = fopen(filepath, "w");
+    /* Stage and sync everything first; a failure here has changed nothing */
+    for (; staged < count; staged++) {
+        UrgentChange* change = &changes[staged];
+        
+        if (check_urgent_target(dir_fd, change->filename, &st) != SUCCESS ||
+            stage_urgent_content(dir_fd, change->filename, change->content, change->content_length, &st,
+                                 change->temp_name, sizeof(change->temp_name), TRUE) != SUCCESS) {
+            break;
+        }
+    }
     
-    /* Reset umask */
-    umask(old_mask);
+    /* Keep a link to every report being replaced, so the batch can be undone */
+    if (staged == count) {
+        for (; saved < count; saved++) {
+            UrgentChange* change = &changes[saved];
+            
+            snprintf(change->undo_name, sizeof(change->undo_name), ".%s%s%d",
+                     change->filename, URGENT_UNDO_INFIX, (int)getpid());
+            unlinkat(dir_fd, change->undo_name, 0);
+            if (linkat(dir_fd, change->filename, dir_fd, change->undo_name, 0) != 0) {
+                log_error("Failed to keep %s for undo: %s", change->filename, strerror(errno));
+                break;
+            }
+        }
+    }
     
-    if (file == NULL) {
-        log_error("Failed to open file for urgent change: %s", strerror(errno));
-        /* Restore directory permissions */
-        chmod(DASHBOARD_DIR, DASHBOARD_PERMISSIONS);
-        /* Restore file permissions */
-        chmod(filepath, old_permissions);
+    /* The staged names and undo links must be on disk before any report is replaced */
+    if (saved == count && fsync(dir_fd) != 0) {
+        log_error("Failed to sync urgent batch: %s", strerror(errno));
+        unwind_urgent_batch(dir_fd, changes, staged, count, 0);
+        close(dir_fd);
+        remove_lock_file();
         return FAILURE;
     }
     
-    /* Write the new content */
-    if (fputs(content, file) == EOF) {
-        log_error("Failed to write content for urgent change: %s", strerror(errno));
-        fclose(file);
-        /* Restore directory permissions */
-        chmod(DASHBOARD_DIR, DASHBOARD_PERMISSIONS);
-        /* Restore file permissions */
-        chmod(filepath, old_permissions);
+    if (saved == count) {
+        for (; published < count; published++) {
+            if (renameat(dir_fd, changes[published].temp_name, dir_fd, changes[published].filename) != 0) {
+                log_error("Failed to install urgent change to %s: %s",
+                          changes[published].filename, strerror(errno));
+                break;
+            }
+        }
+    }
+    
+    /* Committed once the renames are durable and the marker says so */
+    urgent_commit_marker(getpid(), marker, sizeof(marker));
+    marker_fd = -1;
+    if (published == count && fsync(dir_fd) == 0) {
+        marker_fd = openat(dir_fd, marker, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (marker_fd != -1 && (close(marker_fd) != 0 || fsync(dir_fd) != 0)) {
+            unlinkat(dir_fd, marker, 0);
+            marker_fd = -1;
+        }
+    }
+    
+    if (marker_fd == -1) {
+        if (published == count) {
+            log_error("Failed to commit urgent batch: %s", strerror(errno));
+        }
+        failed = unwind_urgent_batch(dir_fd, changes, staged, saved, published);
+        close(dir_fd);
+        remove_lock_file();
+        if (failed > 0) {
+            log_error("Urgent batch by user %s abandoned, %d of %d replaced reports could not be put back",
+                      user_name, failed, published);
+        } else {
+            log_error("Urgent batch by user %s abandoned, no report changed", user_name);
+        }
         return FAILURE;
     }
     
-    /* Close the file */
-    fclose(file);
+    /* The undo links are no longer needed; the marker goes last */
+    for (i = 0; i < count; i++) {
+        unlinkat(dir_fd, changes[i].undo_name, 0);
+    }
+    unlinkat(dir_fd, marker, 0);
+    close(dir_fd);
+    remove_lock_file();
+    
+    for (i = 0; i < count; i++) {
+        log_file_change(user_name, changes[i].filename, "urgent_change");
+    }
+    
+    log_operation("Urgent batch of %d files by user %s completed successfully in %.2f ms",
+                  count, user_name, now_ms() - started);
+    
+    return SUCCESS;
+}
+
+/**
+ * Get the report an undo link left by an urgent batch belongs to
+ * @param name Directory entry, ".<report>.undo.<pid>"
+ * @param report Receives the report's name
+ * @param size Size of report
+ * @param pid Receives the PID that ran the batch
+ * @return TRUE if name is an undo link, FALSE otherwise
+ */
+static int parse_undo_name(const char* name, char* report, size_t size, pid_t* pid) {
+    const char* infix = NULL;
+    const char* found;
+    const char* digits;
+    size_t length;
+    
+    if (name[0] != '.') {
+        return FALSE;
+    }
+    for (found = strstr(name, URGENT_UNDO_INFIX); found != NULL; found = strstr(found + 1, URGENT_UNDO_INFIX)) {
+        infix = found;
+    }
+    if (infix == NULL || infix == name + 1) {
+        return FALSE;
+    }
+    
+    digits = infix + strlen(URGENT_UNDO_INFIX);
+    if (*digits == '\0' || strspn(digits, "0123456789") != strlen(digits)) {
+        return FALSE;
+    }
+    
+    length = (size_t)(infix - name - 1);
+    if (length >= size) {
+        return FALSE;
+    }
+    memcpy(report, name + 1, length);
+    report[length] = '\0';
+    *pid = (pid_t)atoi(digits);
+    return TRUE;
+}
+
+/**
+ * Finish what urgent batches interrupted by a crash left in the dashboard:
+ * a batch without its commit marker is rolled back from its undo links,
+ * a committed one just loses them, and staged files are removed. Skipped
+ * if someone holds the directory lock, since a batch may then be running.
+ * @return SUCCESS on success, FAILURE if a report could not be put back
+ */
+int recover_urgent_batches(void) {
+    char report[MAX_PATH_LENGTH];
+    char marker[MAX_PATH_LENGTH];
+    struct dirent* entry;
+    DIR* dir;
+    pid_t pid;
+    int dir_fd;
+    int changed = FALSE;
+    int result = SUCCESS;
+    
+    if (try_lock_file(0) != SUCCESS) {
+        log_warning("Directory lock held, leaving urgent batch leftovers for later");
+        return SUCCESS;
+    }
+    
+    dir_fd = open(DASHBOARD_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir = (dir_fd != -1) ? fdopendir(dup(dir_fd)) : NULL;
+    if (dir == NULL) {
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+        remove_lock_file();
+        return SUCCESS;
+    }
+    
+    while ((entry = readdir(dir)) != NULL) {
+        if (parse_undo_name(entry->d_name, report, sizeof(report), &pid)) {
+            urgent_commit_marker(pid, marker, sizeof(marker));
+            if (faccessat(dir_fd, marker, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+                unlinkat(dir_fd, entry->d_name, 0);
+            } else if (renameat(dir_fd, entry->d_name, dir_fd, report) == 0) {
+                /* A report the batch never replaced is the same inode, which rename leaves alone */
+                unlinkat(dir_fd, entry->d_name, 0);
+                log_warning("Rolled back %s from an urgent batch interrupted in PID %d", report, (int)pid);
+            } else {
+                log_error("Failed to roll back %s from %s: %s", report, entry->d_name, strerror(errno));
+                result = FAILURE;
+            }
+            changed = TRUE;
+        } else if (entry->d_name[0] == '.' && strstr(entry->d_name, ".urgent.") != NULL) {
+            /* Content staged for a change that never got installed */
+            unlinkat(dir_fd, entry->d_name, 0);
+            changed = TRUE;
+        }
+    }
     
-    /* Restore file permissions */
-    chmod(filepath, old_permissions);
+    /* Markers go only once every undo link they cover is gone */
+    rewinddir(dir);
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, URGENT_COMMIT_PREFIX, strlen(URGENT_COMMIT_PREFIX)) == 0) {
+            unlinkat(dir_fd, entry->d_name, 0);
+            changed = TRUE;
+        }
+    }
+    closedir(dir);
+    
+    if (changed && fsync(dir_fd) != 0) {
+        log_warning("Failed to sync dashboard directory after urgent batch recovery: %s", strerror(errno));
+    }
+    close(dir_fd);
+    remove_lock_file();
+    return result;
+}
+
+/**
+ * Hash a file's whole content through its descriptor
+ * @param fd File to hash, read from offset 0
+ * @param hash Receives the content hash
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int hash_descriptor(int fd, uint64_t* hash) {
+    char buffer[COPY_BUFFER_SIZE];
+    HashState state;
+    off_t offset = 0;
+    ssize_t n;
+    
+    hash_init(&state, HASH_SEED);
+    while ((n = pread(fd, buffer, sizeof(buffer), offset)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return FAILURE;
+        }
+        hash_update(&state, buffer, (size_t)n);
+        offset += n;
+    }
+    
+    *hash = hash_final(&state);
+    return SUCCESS;
+}
+
+/**
+ * Copy a whole file between descriptors inside the kernel: a reflink
+ * where the filesystem shares extents, else copy_file_range, else sendfile
+ * @param source_fd File to read, from offset 0 whatever its position
+ * @param dest_fd Empty file to fill
+ * @param size Bytes to copy
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int copy_fd_contents(int source_fd, int dest_fd, off_t size) {
+    off_t offset = 0;
+    ssize_t copied = 0;
+    int use_sendfile = FALSE;
     
-    /* Restore directory permissions */
-    chmod(DASHBOARD_DIR, DASHBOARD_PERMISSIONS);
+    if (ioctl(dest_fd, FICLONE, source_fd) == 0) {
+        return SUCCESS;
+    }
+    
+    while (offset < size) {
+        if (!use_sendfile) {
+            loff_t in_offset = offset;
+            
+            copied = copy_file_range(source_fd, &in_offset, dest_fd, NULL, size - offset, 0);
+            /* Cross-filesystem copies (e.g. from a memfd) are refused; fall back */
+            if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                use_sendfile = TRUE;
+                continue;
+            }
+        } else {
+            off_t in_offset = offset;
+            
+            copied = sendfile(dest_fd, source_fd, &in_offset, size - offset);
+        }
+        
+        if (copied == -1 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            if (copied == 0) {
+                errno = EIO;  /* The source shrank underneath us */
+            }
+            log_error("Failed to copy urgent change content: %s", strerror(errno));
+            return FAILURE;
+        }
+        offset += copied;
+    }
+    
+    return SUCCESS;
+}
+
+/**
+ * Copy a file between descriptors inside the kernel until its end,
+ * however far that is by then: a reflink where the filesystem shares
+ * extents, else copy_file_range, else sendfile
+ * @param source_fd File to read, from offset 0 whatever its position
+ * @param dest_fd Empty file to fill
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int copy_fd_to_end(int source_fd, int dest_fd) {
+    off_t offset = 0;
+    ssize_t copied;
+    int use_sendfile = FALSE;
+    
+    if (ioctl(dest_fd, FICLONE, source_fd) == 0) {
+        return SUCCESS;
+    }
+    
+    for (;;) {
+        if (!use_sendfile) {
+            loff_t in_offset = offset;
+            
+            copied = copy_file_range(source_fd, &in_offset, dest_fd, NULL, COPY_CHUNK_SIZE, 0);
+            if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                use_sendfile = TRUE;
+                continue;
+            }
+        } else {
+            off_t in_offset = offset;
+            
+            copied = sendfile(dest_fd, source_fd, &in_offset, COPY_CHUNK_SIZE);
+        }
+        
+        if (copied == -1 && errno == EINTR) {
+            continue;
+        }
+        if (copied == -1) {
+            log_error("Failed to copy urgent change content: %s", strerror(errno));
+            return FAILURE;
+        }
+        if (copied == 0) {
+            return SUCCESS;
+        }
+        offset += copied;
+    }
+}
+
+/**
+ * Make an urgent change from a descriptor passed by the client. The
+ * content is copied inside the kernel into a temporary file next to the
+ * report, which then replaces it with a rename, so the content never
+ * passes through the IPC channel. An unsealed file may still be written
+ * by the client, so it is copied to whatever end it has, and the hash
+ * reported is that of the copy that was installed.
+ * @param filename Name of the file to update
+ * @param source_fd Readable regular file or memfd; a memfd must be sealed
+ *        against writes and resizing
+ * @param user_name Name of the user making the change
+ * @param content_hash Receives the hash of the installed content
+ * @return SUCCESS on success, FAILURE on error
+ */
+int make_urgent_change_from_fd(const char* filename, int source_fd, const char* user_name, uint64_t* content_hash) {
+    char temp_name[MAX_PATH_LENGTH];
+    struct stat st, source_st, copy_st;
+    int required_seals = F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW;
+    int seals;
+    int dir_fd, temp_fd;
+    int result;
+    
+    log_operation("Attempting urgent change to file %s by user %s (passed descriptor)", filename, user_name);
+    
+    if (fstat(source_fd, &source_st) != 0 || !S_ISREG(source_st.st_mode) ||
+        (fcntl(source_fd, F_GETFL) & O_ACCMODE) == O_WRONLY) {
+        log_error("Urgent change content must be a readable regular file");
+        return FAILURE;
+    }
+    
+    /* A memfd the client can still write to could change while it is copied */
+    seals = fcntl(source_fd, F_GET_SEALS);
+    if (seals != -1 && (seals & required_seals) != required_seals) {
+        log_error("Urgent change memfd must be sealed against writes and resizing");
+        return FAILURE;
+    }
+    
+    dir_fd = open_urgent_target(filename, &st);
+    if (dir_fd == -1) {
+        return FAILURE;
+    }
+    
+    temp_fd = create_urgent_temp(dir_fd, filename, temp_name, sizeof(temp_name));
+    if (temp_fd == -1) {
+        close(dir_fd);
+        return FAILURE;
+    }
+    
+    /* Size and hash come from the copy, not from what the source looked like before */
+    if (copy_fd_to_end(source_fd, temp_fd) != SUCCESS ||
+        fstat(temp_fd, &copy_st) != 0 || hash_descriptor(temp_fd, content_hash) != SUCCESS) {
+        log_error("Failed to stage urgent change to %s: %s", filename, strerror(errno));
+        close(temp_fd);
+        if (temp_name[0] != '\0') {
+            unlinkat(dir_fd, temp_name, 0);
+        }
+        close(dir_fd);
+        return FAILURE;
+    }
+    
+    if (seals == -1 && copy_st.st_size != source_st.st_size) {
+        log_warning("Urgent change content for %s changed size while copied (%lld to %lld bytes)",
+                    filename, (long long)source_st.st_size, (long long)copy_st.st_size);
+    }
+    
+    result = seal_urgent_temp(dir_fd, temp_fd, temp_name, sizeof(temp_name), filename, &st, TRUE);
+    if (result == SUCCESS) {
+        result = publish_urgent_temp(dir_fd, temp_name, filename);
+    }
+    close(dir_fd);
+    if (result != SUCCESS) {
+        return FAILURE;
+    }
     
     /* Log the change */
     log_file_change(user_name, filename, "urgent_change");
     
-    log_operation("Urgent change to file %s by user %s completed successfully", filename, user_name);
+    log_operation("Urgent change to file %s by user %s completed successfully (%lld bytes, hash %016llx)",
+                  filename, user_name, (long long)copy_st.st_size, (unsigned long long)*content_hash);
+    
+    return SUCCESS;
+}
+
+/**
+ * Copy a byte range between files inside the kernel where possible
+ * @param source_fd File to read
+ * @param in_offset Where to read from
+ * @param dest_fd File to write
+ * @param out_offset Where to write to
+ * @param length Bytes to copy
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int copy_fd_range(int source_fd, off_t in_offset, int dest_fd, off_t out_offset, off_t length) {
+    char buffer[COPY_BUFFER_SIZE];
+    int use_buffer = FALSE;
+    ssize_t copied;
+    
+    while (length > 0) {
+        if (!use_buffer) {
+            loff_t in = in_offset, out = out_offset;
+            
+            copied = copy_file_range(source_fd, &in, dest_fd, &out, length, 0);
+            if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                use_buffer = TRUE;
+                continue;
+            }
+        } else {
+            copied = pread(source_fd, buffer, length < (off_t)sizeof(buffer) ? (size_t)length : sizeof(buffer), in_offset);
+            if (copied > 0 && pwrite(dest_fd, buffer, (size_t)copied, out_offset) != copied) {
+                copied = -1;
+            }
+        }
+        
+        if (copied == -1 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            if (copied == 0) {
+                errno = EIO;  /* The report shrank underneath us */
+            }
+            return FAILURE;
+        }
+        in_offset += copied;
+        out_offset += copied;
+        length -= copied;
+    }
+    
+    return SUCCESS;
+}
+
+/**
+ * Write a patch into a copy of the report
+ * @param source_fd The report
+ * @param size Its size
+ * @param temp_fd Empty file to fill
+ * @param ranges Checked ranges, ascending and non-overlapping
+ * @param count Number of ranges
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int write_urgent_patch(int source_fd, off_t size, int temp_fd, const UrgentPatch* ranges, int count) {
+    off_t in_offset = 0, out_offset = 0;
+    int same_size = TRUE;
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        if (ranges[i].delete_length != ranges[i].insert_length) {
+            same_size = FALSE;
+        }
+    }
+    
+    /* Overwrites keep every offset, so share the extents and touch only the ranges */
+    if (same_size) {
+        if (copy_fd_contents(source_fd, temp_fd, size) != SUCCESS) {
+            return FAILURE;
+        }
+        for (i = 0; i < count; i++) {
+            if (ranges[i].insert_length > 0 &&
+                pwrite(temp_fd, ranges[i].insert, ranges[i].insert_length, (off_t)ranges[i].offset) !=
+                    (ssize_t)ranges[i].insert_length) {
+                return FAILURE;
+            }
+        }
+        return SUCCESS;
+    }
+    
+    /* Otherwise the bytes between ranges move; copy_file_range still keeps them in the kernel */
+    for (i = 0; i < count; i++) {
+        off_t unchanged = (off_t)ranges[i].offset - in_offset;
+        
+        if (copy_fd_range(source_fd, in_offset, temp_fd, out_offset, unchanged) != SUCCESS) {
+            return FAILURE;
+        }
+        out_offset += unchanged;
+        if (ranges[i].insert_length > 0 &&
+            pwrite(temp_fd, ranges[i].insert, ranges[i].insert_length, out_offset) != (ssize_t)ranges[i].insert_length) {
+            return FAILURE;
+        }
+        out_offset += (off_t)ranges[i].insert_length;
+        in_offset = (off_t)(ranges[i].offset + ranges[i].delete_length);
+    }
+    
+    return copy_fd_range(source_fd, in_offset, temp_fd, out_offset, size - in_offset);
+}
+
+/**
+ * Hash a report and what it becomes once patched, in one read
+ * @param source_fd The report
+ * @param size Its size
+ * @param ranges Checked ranges, ascending and non-overlapping
+ * @param count Number of ranges
+ * @param base_hash Receives the report's hash
+ * @param patched_hash Receives the patched content's hash
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int hash_urgent_patch(int source_fd, off_t size, const UrgentPatch* ranges, int count,
+                             uint64_t* base_hash, uint64_t* patched_hash) {
+    char buffer[COPY_BUFFER_SIZE];
+    HashState base, patched;
+    off_t offset = 0;
+    int inserted = FALSE;
+    int i = 0;
+    
+    hash_init(&base, HASH_SEED);
+    hash_init(&patched, HASH_SEED);
+    
+    while (offset < size) {
+        ssize_t n = pread(source_fd, buffer, (size - offset < (off_t)sizeof(buffer)) ? (size_t)(size - offset) : sizeof(buffer), offset);
+        off_t position = offset;
+        
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;  /* The report shrank underneath us */
+            }
+            return FAILURE;
+        }
+        hash_update(&base, buffer, (size_t)n);
+        
+        /* The patched content is the unchanged bytes with each range's insert in place of its deletion */
+        while (position < offset + n) {
+            off_t next = offset + n;
+            
+            if (i < count && (off_t)ranges[i].offset <= position) {
+                off_t range_end = (off_t)(ranges[i].offset + ranges[i].delete_length);
+                
+                if (!inserted) {
+                    hash_update(&patched, ranges[i].insert, ranges[i].insert_length);
+                    inserted = TRUE;
+                }
+                if (position < range_end) {
+                    position = (range_end < next) ? range_end : next;
+                } else {
+                    i++;
+                    inserted = FALSE;
+                }
+                continue;
+            }
+            
+            if (i < count && (off_t)ranges[i].offset < next) {
+                next = (off_t)ranges[i].offset;
+            }
+            hash_update(&patched, buffer + (position - offset), (size_t)(next - position));
+            position = next;
+        }
+        offset += n;
+    }
+    
+    /* Ranges at the very end only insert */
+    for (; i < count; i++) {
+        if (!inserted) {
+            hash_update(&patched, ranges[i].insert, ranges[i].insert_length);
+        }
+        inserted = FALSE;
+    }
     
+    *base_hash = hash_final(&base);
+    *patched_hash = hash_final(&patched);
     return SUCCESS;
-}
\ No newline at end of file
+}
+
+/**
+ * Patch byte ranges of a report through a reflinked copy and a rename
+ * @param filename Name of the file to update
+ * @param ranges Ranges in ascending, non-overlapping order
+ * @param count Number of ranges
+ * @param base_hash Content hash the report must have, or NULL
+ * @param new_hash Receives the patched (or, on a mismatch, actual) hash
+ * @param user_name Name of the user making the change
+ * @return SUCCESS on success, FAILURE on error
+ */
+int make_urgent_patch(const char* filename, const UrgentPatch* ranges, int count,
+                      const uint64_t* base_hash, uint64_t* new_hash, const char* user_name) {
+    char temp_name[MAX_PATH_LENGTH];
+    struct stat st;
+    uint64_t end = 0;
+    uint64_t patched_hash = 0;
+    size_t inserted = 0;
+    int dir_fd, source_fd, temp_fd;
+    int result;
+    int i;
+    
+    log_operation("Attempting urgent patch of %d ranges to file %s by user %s", count, filename, user_name);
+    
+    dir_fd = open_urgent_target(filename, &st);
+    if (dir_fd == -1) {
+        return FAILURE;
+    }
+    
+    source_fd = openat(dir_fd, filename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (source_fd == -1) {
+        log_error("Failed to open %s for urgent patch: %s", filename, strerror(errno));
+        close(dir_fd);
+        return FAILURE;
+    }
+    
+    /* The name may have been replaced since it was checked; the open file is what gets patched */
+    if (fstat(source_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        log_error("File not found for urgent patch: %s/%s", DASHBOARD_DIR, filename);
+        close(source_fd);
+        close(dir_fd);
+        return FAILURE;
+    }
+    
+    for (i = 0; i < count; i++) {
+        if (ranges[i].offset < end || ranges[i].offset > (uint64_t)st.st_size ||
+            ranges[i].delete_length > (uint64_t)st.st_size - ranges[i].offset) {
+            log_error("Urgent patch range %d (offset %llu, %llu bytes) does not fit %s (%lld bytes)",
+                      i + 1, (unsigned long long)ranges[i].offset, (unsigned long long)ranges[i].delete_length,
+                      filename, (long long)st.st_size);
+            close(source_fd);
+            close(dir_fd);
+            return FAILURE;
+        }
+        end = ranges[i].offset + ranges[i].delete_length;
+        inserted += ranges[i].insert_length;
+    }
+    
+    /* One read of the report gives both the hash it is checked against and the patched one */
+    if (base_hash != NULL) {
+        if (hash_urgent_patch(source_fd, st.st_size, ranges, count, new_hash, &patched_hash) != SUCCESS) {
+            log_error("Failed to hash %s for urgent patch: %s", filename, strerror(errno));
+            close(source_fd);
+            close(dir_fd);
+            return FAILURE;
+        }
+        if (*new_hash != *base_hash) {
+            log_error("Refused urgent patch to %s: based on %016llx, report is at %016llx",
+                      filename, (unsigned long long)*base_hash, (unsigned long long)*new_hash);
+            close(source_fd);
+            close(dir_fd);
+            return FAILURE;
+        }
+    }
+    
+    temp_fd = create_urgent_temp(dir_fd, filename, temp_name, sizeof(temp_name));
+    if (temp_fd == -1) {
+        close(source_fd);
+        close(dir_fd);
+        return FAILURE;
+    }
+    
+    if (write_urgent_patch(source_fd, st.st_size, temp_fd, ranges, count) != SUCCESS) {
+        log_error("Failed to patch %s: %s", filename, strerror(errno));
+        close(temp_fd);
+        if (temp_name[0] != '\0') {
+            unlinkat(dir_fd, temp_name, 0);
+        }
+        close(source_fd);
+        close(dir_fd);
+        return FAILURE;
+    }
+    close(source_fd);
+    
+    result = seal_urgent_temp(dir_fd, temp_fd, temp_name, sizeof(temp_name), filename, &st, TRUE);
+    if (result == SUCCESS) {
+        result = publish_urgent_temp(dir_fd, temp_name, filename);
+    }
+    close(dir_fd);
+    if (result != SUCCESS) {
+        return FAILURE;
+    }
+    if (base_hash != NULL) {
+        *new_hash = patched_hash;
+    }
+    
+    /* Log the change */
+    log_file_change(user_name, filename, "urgent_patch");
+    
+    log_operation("Urgent patch to file %s by user %s completed successfully (%d ranges, %zu bytes written)",
+                  filename, user_name, count, inserted);
+    
+    return SUCCESS;
+}
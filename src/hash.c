@@ -0,0 +1,339 @@
+/**
+ * @file hash.c
+ * @brief Content hashing: fast XXH64 for manifests, SHA-256 for chunk addresses
+ */
+
+#include "hash.h"
+#include "utils.h"
+#include "backup.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define HASH_READ_BUFFER (64 * 1024)
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t merge_round64(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * Initialise a streaming hash state
+ * @param state State to initialise
+ * @param seed Hash seed
+ */
+void hash_init(HashState *state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    state->acc[1] = seed + PRIME64_2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME64_1;
+}
+
+/**
+ * Feed data into a streaming hash state
+ * @param state State to update
+ * @param data Data to hash
+ * @param len Number of bytes
+ */
+void hash_update(HashState *state, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+
+    state->total_len += len;
+
+    /* Not enough for a full stripe yet, just buffer it */
+    if (state->mem_size + len < 32)
+    {
+        memcpy(state->mem + state->mem_size, p, len);
+        state->mem_size += len;
+        return;
+    }
+
+    /* Complete the buffered stripe */
+    if (state->mem_size > 0)
+    {
+        size_t fill = 32 - state->mem_size;
+
+        memcpy(state->mem + state->mem_size, p, fill);
+        state->acc[0] = round64(state->acc[0], read64(state->mem));
+        state->acc[1] = round64(state->acc[1], read64(state->mem + 8));
+        state->acc[2] = round64(state->acc[2], read64(state->mem + 16));
+        state->acc[3] = round64(state->acc[3], read64(state->mem + 24));
+        p += fill;
+        state->mem_size = 0;
+    }
+
+    /* Process whole stripes straight from the input */
+    while (p + 32 <= end)
+    {
+        state->acc[0] = round64(state->acc[0], read64(p));
+        state->acc[1] = round64(state->acc[1], read64(p + 8));
+        state->acc[2] = round64(state->acc[2], read64(p + 16));
+        state->acc[3] = round64(state->acc[3], read64(p + 24));
+        p += 32;
+    }
+
+    /* Keep the tail for next time */
+    if (p < end)
+    {
+        memcpy(state->mem, p, (size_t)(end - p));
+        state->mem_size = (size_t)(end - p);
+    }
+}
+
+/**
+ * Produce the digest of everything fed so far
+ * @param state State to finalise (left unchanged)
+ * @return 64-bit digest
+ */
+uint64_t hash_final(const HashState *state)
+{
+    const unsigned char *p = state->mem;
+    const unsigned char *end = p + state->mem_size;
+    uint64_t h;
+
+    if (state->total_len >= 32)
+    {
+        h = rotl64(state->acc[0], 1) + rotl64(state->acc[1], 7) +
+            rotl64(state->acc[2], 12) + rotl64(state->acc[3], 18);
+        h = merge_round64(h, state->acc[0]);
+        h = merge_round64(h, state->acc[1]);
+        h = merge_round64(h, state->acc[2]);
+        h = merge_round64(h, state->acc[3]);
+    }
+    else
+    {
+        h = state->seed + PRIME64_5;
+    }
+
+    h += state->total_len;
+
+    while (p + 8 <= end)
+    {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end)
+    {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    /* Final avalanche */
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/**
+ * Hash a memory buffer in one call
+ * @param data Data to hash
+ * @param len Number of bytes
+ * @return 64-bit digest
+ */
+uint64_t hash_buffer(const void *data, size_t len)
+{
+    HashState state;
+
+    hash_init(&state, HASH_SEED);
+    hash_update(&state, data, len);
+    return hash_final(&state);
+}
+
+/**
+ * Hash the contents of a file
+ * @param path Path to the file
+ * @param hash Receives the 64-bit digest
+ * @return SUCCESS on success, FAILURE on error
+ */
+int hash_file(const char *path, uint64_t *hash)
+{
+    unsigned char buffer[HASH_READ_BUFFER];
+    HashState state;
+    ssize_t bytes_read;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        log_error("Failed to open %s for hashing: %s", path, strerror(errno));
+        return FAILURE;
+    }
+
+    hash_init(&state, HASH_SEED);
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        hash_update(&state, buffer, (size_t)bytes_read);
+    }
+
+    close(fd);
+
+    if (bytes_read == -1)
+    {
+        log_error("Failed to read %s for hashing: %s", path, strerror(errno));
+        return FAILURE;
+    }
+
+    *hash = hash_final(&state);
+    return SUCCESS;
+}
+
+/* SHA-256 round constants */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+/**
+ * Process one 64-byte SHA-256 block
+ * @param h Hash state words
+ * @param block Block to process
+ */
+static void sha256_block(uint32_t h[8], const unsigned char *block)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, k;
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; k = h[7];
+
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = k + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+/**
+ * Compute the SHA-256 digest of a memory buffer
+ * @param data Data to hash
+ * @param len Number of bytes
+ * @param digest Receives the 32-byte digest
+ */
+void sha256_buffer(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned char tail[128];
+    uint64_t bit_len = (uint64_t)len * 8;
+    size_t remaining = len;
+    size_t tail_len;
+    int i;
+
+    while (remaining >= 64)
+    {
+        sha256_block(h, p);
+        p += 64;
+        remaining -= 64;
+    }
+
+    /* Pad: 0x80, zeros, then the 64-bit big-endian bit length */
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, p, remaining);
+    tail[remaining] = 0x80;
+    tail_len = (remaining < 56) ? 64 : 128;
+    for (i = 0; i < 8; i++)
+    {
+        tail[tail_len - 1 - i] = (unsigned char)(bit_len >> (i * 8));
+    }
+
+    sha256_block(h, tail);
+    if (tail_len == 128)
+    {
+        sha256_block(h, tail + 64);
+    }
+
+    for (i = 0; i < 8; i++)
+    {
+        digest[i * 4] = (unsigned char)(h[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(h[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(h[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)h[i];
+    }
+}
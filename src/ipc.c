@@ -1,28 +1,304 @@
+#define _GNU_SOURCE  // For struct ucred and accept4
+
 #include "ipc.h"
 #include "utils.h"
+#include "event_ring.h"
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <limits.h>  // For PIPE_BUF
+#include <poll.h>
 #include <sys/stat.h>  // For mkfifo
+#include <sys/socket.h>
+#include <sys/un.h>
 
-/* Static file descriptor for the FIFO */
+/* Static file descriptor for the FIFO, and its partially read frame */
 static int fifo_fd = -1;
+static FrameReader fifo_reader;
 
 /**
- * Setup IPC mechanisms
+ * Encoded frame waiting for a client to read
+ */
+typedef struct {
+    unsigned char* buffer;  /* Frame bytes, owned by the queue */
+    size_t length;          /* Bytes in buffer */
+} QueuedFrame;
+
+/**
+ * Connected control socket client
+ */
+typedef struct {
+    int fd;              /* Connection, -1 when the slot is free */
+    pid_t pid;           /* Peer PID from SO_PEERCRED */
+    uid_t uid;           /* Peer UID from SO_PEERCRED */
+    unsigned int generation; /* Connection number, so late replies never reach a reused slot */
+    FrameReader reader;  /* Partially received request */
+    QueuedFrame queue[CLIENT_QUEUE_FRAMES]; /* Ring of frames the socket had no room for */
+    int queue_first;     /* Oldest queued frame */
+    int queue_count;     /* Frames queued */
+    size_t queue_sent;   /* Bytes of the oldest frame already sent */
+    uint32_t event_mask; /* EVENT_* bits subscribed to, 0 if none */
+    uint32_t subscription_id;             /* Request ID events are tagged with */
+    char filter[MAX_EVENT_FILTER];        /* Substring events must contain, "" for all */
+    unsigned long long dropped;           /* Events lost to a full queue */
+} ControlClient;
+
+/* Listening control socket and its connections */
+static int control_fd = -1;
+static ControlClient clients[MAX_CONTROL_CLIENTS];
+static int next_client = 0;
+static unsigned int next_generation = 1;
+
+/* Events lost by connections since closed, for the status totals */
+static unsigned long long closed_dropped = 0;
+
+/**
+ * Create the listening control socket
  * @return SUCCESS on success, FAILURE on error
  */
-int setup_ipc(void) {
-    /* Create FIFO if it doesn't exist */
-    if (access(FIFO_PATH, F_OK) != 0) {
-        if (mkfifo(FIFO_PATH, 0666) != 0) {
-            log_error("Failed to create FIFO: %s", strerror(errno));
+static int setup_control_socket(void) {
+    struct sockaddr_un addr;
+    int i;
+    
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+    
+    control_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (control_fd == -1) {
+        log_error("Failed to create control socket: %s", strerror(errno));
+        return FAILURE;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, CONTROL_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    
+    /* Only one daemon runs at a time, so an existing socket is left over from a crash */
+    unlink(CONTROL_SOCKET_PATH);
+    
+    if (bind(control_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(control_fd, MAX_CONTROL_CLIENTS) != 0) {
+        log_error("Failed to listen on %s: %s", CONTROL_SOCKET_PATH, strerror(errno));
+        close(control_fd);
+        control_fd = -1;
+        return FAILURE;
+    }
+    
+    /* Anyone may connect; SO_PEERCRED decides what they may do */
+    chmod(CONTROL_SOCKET_PATH, 0666);
+    return SUCCESS;
+}
+
+/**
+ * Drop a control socket connection
+ */
+static void close_control_client(int client) {
+    ControlClient* c = &clients[client];
+    
+    close(c->fd);
+    c->fd = -1;
+    frame_reader_free(&c->reader);
+    
+    while (c->queue_count > 0) {
+        free(c->queue[c->queue_first].buffer);
+        c->queue_first = (c->queue_first + 1) % CLIENT_QUEUE_FRAMES;
+        c->queue_count--;
+    }
+    closed_dropped += c->dropped;
+    c->dropped = 0;
+    c->event_mask = 0;
+}
+
+/**
+ * Send a client's queued frames until its socket is full
+ * @return SUCCESS unless the connection failed and was closed
+ */
+static int flush_control_client(int client) {
+    ControlClient* c = &clients[client];
+    Frame pending;
+    
+    memset(&pending, 0, sizeof(pending));
+    pending.passed_fd = -1;
+    
+    while (c->queue_count > 0) {
+        pending.buffer = c->queue[c->queue_first].buffer;
+        pending.length = c->queue[c->queue_first].length;
+        
+        if (frame_send_resume(c->fd, &pending, TRUE, &c->queue_sent) != SUCCESS) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return SUCCESS;
+            }
+            log_error("Dropping control client PID %d: %s", c->pid, strerror(errno));
+            close_control_client(client);
+            return FAILURE;
+        }
+        
+        free(c->queue[c->queue_first].buffer);
+        c->queue_first = (c->queue_first + 1) % CLIENT_QUEUE_FRAMES;
+        c->queue_count--;
+        c->queue_sent = 0;
+    }
+    
+    return SUCCESS;
+}
+
+/**
+ * Send a frame to a client, queueing what the socket has no room for.
+ * Events may not take the last CLIENT_REPLY_RESERVE slots and are dropped
+ * and counted when the queue is that full; a client whose queue is full
+ * even for a reply has stopped reading and is disconnected.
+ * @param client Connection
+ * @param frame Frame to send, without a passed descriptor
+ * @param is_event Whether the frame is a droppable event
+ * @return SUCCESS if sent or queued, FAILURE if dropped or the client closed
+ */
+static int send_to_client(int client, const Frame* frame, int is_event) {
+    ControlClient* c = &clients[client];
+    int limit = is_event ? CLIENT_QUEUE_FRAMES - CLIENT_REPLY_RESERVE : CLIENT_QUEUE_FRAMES;
+    size_t sent = 0;
+    QueuedFrame* slot;
+    
+    /* Nothing ahead of it, so try the socket first */
+    if (c->queue_count == 0) {
+        if (frame_send_resume(c->fd, frame, TRUE, &sent) == SUCCESS) {
+            return SUCCESS;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_error("Dropping control client PID %d: %s", c->pid, strerror(errno));
+            close_control_client(client);
             return FAILURE;
         }
     }
     
+    if (c->queue_count >= limit) {
+        if (is_event) {
+            c->dropped++;
+            return FAILURE;
+        }
+        log_error("Dropping control client PID %d: it stopped reading replies", c->pid);
+        close_control_client(client);
+        return FAILURE;
+    }
+    
+    slot = &c->queue[(c->queue_first + c->queue_count) % CLIENT_QUEUE_FRAMES];
+    slot->buffer = malloc(frame->length);
+    if (slot->buffer == NULL) {
+        log_error("Failed to queue frame for control client PID %d: %s", c->pid, strerror(errno));
+        if (is_event) {
+            c->dropped++;
+            return FAILURE;
+        }
+        close_control_client(client);
+        return FAILURE;
+    }
+    memcpy(slot->buffer, frame->buffer, frame->length);
+    slot->length = frame->length;
+    if (c->queue_count == 0) {
+        c->queue_sent = sent;
+    }
+    c->queue_count++;
+    return SUCCESS;
+}
+
+/**
+ * Close every control socket descriptor; used by forked children, which
+ * must not keep client connections open behind the daemon's back
+ */
+static void close_control_sockets(void) {
+    int i;
+    
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        if (clients[i].fd != -1) {
+            close_control_client(i);
+        }
+    }
+    
+    if (control_fd != -1) {
+        close(control_fd);
+        control_fd = -1;
+    }
+}
+
+/**
+ * Check whether a control socket caller may change the daemon's state
+ * @param uid Caller's UID from SO_PEERCRED
+ * @return TRUE for root and the daemon's own user, FALSE otherwise
+ */
+int control_peer_privileged(uid_t uid) {
+    return uid == 0 || uid == geteuid();
+}
+
+/**
+ * Accept pending connections and record who made them
+ */
+static void accept_control_clients(void) {
+    struct ucred cred;
+    socklen_t cred_len;
+    int fd, i;
+    
+    while ((fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        cred_len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
+            log_error("Failed to get control client credentials: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+        
+        for (i = 0; i < MAX_CONTROL_CLIENTS && clients[i].fd != -1; i++) {
+        }
+        if (i == MAX_CONTROL_CLIENTS) {
+            log_warning("Rejecting control connection from PID %d: %d clients connected",
+                        cred.pid, MAX_CONTROL_CLIENTS);
+            close(fd);
+            continue;
+        }
+        
+        clients[i].fd = fd;
+        clients[i].pid = cred.pid;
+        clients[i].uid = cred.uid;
+        clients[i].generation = next_generation++;
+        frame_reader_init(&clients[i].reader);
+        
+        /* Refuse big requests from callers who could only be told no */
+        if (!control_peer_privileged(cred.uid)) {
+            frame_reader_set_limit(&clients[i].reader, UNPRIVILEGED_FRAME_SIZE);
+        }
+        clients[i].queue_first = 0;
+        clients[i].queue_count = 0;
+        clients[i].queue_sent = 0;
+        clients[i].event_mask = 0;
+        clients[i].dropped = 0;
+        log_debug("Control client connected: PID %d, UID %d", cred.pid, (int)cred.uid);
+    }
+    
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        log_error("Failed to accept control connection: %s", strerror(errno));
+    }
+}
+
+/**
+ * Setup IPC mechanisms
+ * @return SUCCESS on success, FAILURE on error
+ */
+int setup_ipc(void) {
+    /* Only workers write to the FIFO, and they inherit the descriptor, so
+     * it is private to the daemon's user; a leftover one may have been
+     * created with looser permissions and is replaced */
+    if (unlink(FIFO_PATH) != 0 && errno != ENOENT) {
+        log_error("Failed to remove old FIFO: %s", strerror(errno));
+        return FAILURE;
+    }
+    if (mkfifo(FIFO_PATH, 0600) != 0) {
+        log_error("Failed to create FIFO: %s", strerror(errno));
+        return FAILURE;
+    }
+    
+    frame_reader_init(&fifo_reader);
+    frame_reader_set_limit(&fifo_reader, PIPE_BUF);
+    
     /* Open FIFO for both reading and writing */
     fifo_fd = open(FIFO_PATH, O_RDWR | O_NONBLOCK);
     if (fifo_fd == -1) {
@@ -30,6 +306,11 @@ int setup_ipc(void) {
         return FAILURE;
     }
     
+    /* The FIFO keeps working without the control socket */
+    if (setup_control_socket() != SUCCESS) {
+        log_error("Control socket unavailable, only the FIFO will be served");
+    }
+    
     log_operation("IPC setup completed");
     return SUCCESS;
 }
@@ -49,6 +330,7 @@ int cleanup_ipc(void) {
         }
         fifo_fd = -1;
     }
+    frame_reader_free(&fifo_reader);
     
     /* Remove FIFO */
     if (unlink(FIFO_PATH) != 0 && errno != ENOENT) {
@@ -56,30 +338,41 @@ int cleanup_ipc(void) {
         result = FAILURE;
     }
     
+    /* Close the control socket and its connections */
+    if (control_fd != -1) {
+        close_control_sockets();
+        if (unlink(CONTROL_SOCKET_PATH) != 0 && errno != ENOENT) {
+            log_error("Failed to remove control socket: %s", strerror(errno));
+            result = FAILURE;
+        }
+    }
+    
     log_operation("IPC cleanup completed");
     return result;
 }
 
 /**
- * Send an IPC message
- * @param msg Pointer to the message to send
+ * Send a worker notice to the daemon over the FIFO. Frames up to PIPE_BUF
+ * bytes are written atomically, so larger ones are refused. The daemon
+ * only accepts notices from its own workers here; clients use the
+ * control socket.
+ * @param frame Frame to send
  * @return SUCCESS on success, FAILURE on error
  */
-int send_ipc_message(IPCMessage* msg) {
-    ssize_t bytes_written;
-    
+int send_ipc_message(const Frame* frame) {
     /* Check if FIFO is open */
     if (fifo_fd == -1) {
         log_error("FIFO not open for sending message");
         return FAILURE;
     }
     
-    /* Set the sender PID */
-    msg->sender_pid = getpid();
+    /* Several workers share the FIFO; only atomic writes keep their frames apart */
+    if (frame->length > PIPE_BUF) {
+        log_error("Message of %lu bytes is too large for the FIFO", (unsigned long)frame->length);
+        return FAILURE;
+    }
     
-    /* Write the message to the FIFO */
-    bytes_written = write(fifo_fd, msg, sizeof(IPCMessage));
-    if (bytes_written != sizeof(IPCMessage)) {
+    if (frame_send(fifo_fd, frame, FALSE) != SUCCESS) {
         log_error("Failed to write to FIFO: %s", strerror(errno));
         return FAILURE;
     }
@@ -88,12 +381,12 @@ int send_ipc_message(IPCMessage* msg) {
 }
 
 /**
- * Receive an IPC message (non-blocking)
- * @param msg Pointer to store the received message
- * @return SUCCESS on success, FAILURE on error or no message available
+ * Receive a frame from the FIFO (non-blocking)
+ * @param frame Receives the frame; free it with frame_free()
+ * @return SUCCESS on success, FAILURE on error or no complete frame available
  */
-int receive_ipc_message(IPCMessage* msg) {
-    ssize_t bytes_read;
+int receive_ipc_message(Frame* frame) {
+    char discard[PIPE_BUF];
     
     /* Check if FIFO is open */
     if (fifo_fd == -1) {
@@ -101,25 +394,318 @@ int receive_ipc_message(IPCMessage* msg) {
         return FAILURE;
     }
     
-    /* Try to read a message from the FIFO */
-    bytes_read = read(fifo_fd, msg, sizeof(IPCMessage));
+    if (frame_reader_read(&fifo_reader, fifo_fd, FALSE, frame) == SUCCESS) {
+        return SUCCESS;
+    }
     
-    /* Check for errors or no data */
-    if (bytes_read == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            /* No message available (non-blocking) */
-            return FAILURE;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* No complete message available (non-blocking) */
+        return FAILURE;
+    }
+    
+    /* A byte stream cannot be resynchronized, so drop whatever is queued */
+    log_error("Discarding malformed FIFO data: %s", strerror(errno));
+    frame_reader_free(&fifo_reader);
+    while (read(fifo_fd, discard, sizeof(discard)) > 0) {
+    }
+    return FAILURE;
+}
+
+/**
+ * Wait until IPC traffic arrives or the timeout passes, accepting new
+ * control socket connections
+ * @param timeout_ms Milliseconds to wait at most
+ * @return SUCCESS if something is ready, FAILURE on timeout, signal or error
+ */
+int wait_for_ipc(int timeout_ms) {
+    struct pollfd fds[MAX_CONTROL_CLIENTS + 3];
+    int nfds = 0;
+    int ready, i;
+    
+    /* Workers only ring the doorbell once told the daemon is going to sleep */
+    if (event_ring_prepare_wait()) {
+        timeout_ms = 0;
+    }
+    
+    if (fifo_fd != -1) {
+        fds[nfds].fd = fifo_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    if (control_fd != -1) {
+        fds[nfds].fd = control_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        if (clients[i].fd != -1) {
+            fds[nfds].fd = clients[i].fd;
+            fds[nfds].events = (clients[i].queue_count > 0) ? (POLLIN | POLLOUT) : POLLIN;
+            nfds++;
+        }
+    }
+    
+    if (event_ring_fd() != -1) {
+        fds[nfds].fd = event_ring_fd();
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    
+    ready = poll(fds, nfds, timeout_ms);
+    event_ring_ack_doorbell();
+    if (ready == -1 && errno != EINTR) {
+        log_error("Failed to wait for IPC: %s", strerror(errno));
+    }
+    if (ready <= 0) {
+        return FAILURE;
+    }
+    
+    /* The listening socket, when open, is always the entry after the FIFO */
+    if (control_fd != -1 && (fds[fifo_fd != -1 ? 1 : 0].revents & POLLIN)) {
+        accept_control_clients();
+    }
+    
+    /* Sending is non-blocking, so clients that cannot take more just keep their queue */
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        if (clients[i].fd != -1 && clients[i].queue_count > 0) {
+            flush_control_client(i);
+        }
+    }
+    
+    return SUCCESS;
+}
+
+/**
+ * Receive the next control socket request (non-blocking); connected
+ * clients are served round-robin, one request each per turn
+ * @param request Pointer to store the request
+ * @return SUCCESS on success, FAILURE if no complete request is waiting
+ */
+int receive_control_request(ControlRequest* request) {
+    int n, i;
+    
+    for (n = 0; n < MAX_CONTROL_CLIENTS; n++) {
+        i = (next_client + n) % MAX_CONTROL_CLIENTS;
+        if (clients[i].fd == -1) {
+            continue;
+        }
+        
+        if (frame_reader_read(&clients[i].reader, clients[i].fd, TRUE, &request->frame) != SUCCESS) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            /* ECONNRESET is an orderly disconnect */
+            if (errno == EMSGSIZE && !control_peer_privileged(clients[i].uid)) {
+                log_error("Dropping control client PID %d (UID %d): request over %d bytes",
+                          clients[i].pid, (int)clients[i].uid, UNPRIVILEGED_FRAME_SIZE);
+            } else if (errno != ECONNRESET) {
+                log_error("Dropping control client PID %d: %s", clients[i].pid, strerror(errno));
+            }
+            close_control_client(i);
+            continue;
+        }
+        
+        request->client = i;
+        request->peer_pid = clients[i].pid;
+        request->peer_uid = clients[i].uid;
+        request->generation = clients[i].generation;
+        
+        next_client = (i + 1) % MAX_CONTROL_CLIENTS;
+        return SUCCESS;
+    }
+    
+    return FAILURE;
+}
+
+/**
+ * Reply to a control socket request and release it
+ * @param request The request being answered
+ * @param status Status code for the caller
+ * @param text Reply text
+ * @return SUCCESS on success, FAILURE on error
+ */
+int send_control_reply(ControlRequest* request, int status, const char* text) {
+    Frame reply;
+    int result = SUCCESS;
+    
+    /* Requests without a connection get no reply */
+    if (request->client < 0) {
+        frame_free(&request->frame);
+        return SUCCESS;
+    }
+    
+    /* The caller disconnected while its request waited */
+    if (clients[request->client].generation != request->generation ||
+        clients[request->client].fd == -1) {
+        log_debug("No one left to answer for request %u from PID %d", request->frame.request_id, request->peer_pid);
+        frame_free(&request->frame);
+        return FAILURE;
+    }
+    
+    if (frame_init(&reply, request->frame.type, request->frame.request_id) != SUCCESS ||
+        frame_add_i32(&reply, FIELD_STATUS, status) != SUCCESS ||
+        frame_add_string(&reply, FIELD_TEXT, text) != SUCCESS) {
+        log_error("Failed to build control reply: %s", strerror(errno));
+        result = FAILURE;
+    } else if (send_to_client(request->client, &reply, FALSE) != SUCCESS) {
+        result = FAILURE;
+    }
+    
+    frame_free(&reply);
+    frame_free(&request->frame);
+    return result;
+}
+
+/**
+ * Subscribe the caller's connection to pushed events
+ * @param request The MSG_SUBSCRIBE request
+ * @param mask EVENT_* bits, 0 to unsubscribe
+ * @param filter Substring events must contain, "" for every event
+ * @return SUCCESS on success, FAILURE if the caller is gone or not on the socket
+ */
+int subscribe_control_client(const ControlRequest* request, uint32_t mask, const char* filter) {
+    ControlClient* c;
+    
+    if (request->client < 0 ||
+        clients[request->client].generation != request->generation ||
+        clients[request->client].fd == -1) {
+        return FAILURE;
+    }
+    
+    c = &clients[request->client];
+    c->event_mask = mask & EVENT_ALL;
+    c->subscription_id = request->frame.request_id;
+    snprintf(c->filter, sizeof(c->filter), "%s", filter);
+    return SUCCESS;
+}
+
+/**
+ * Push an event to every subscriber that wants it
+ * @param event EVENT_* bit
+ * @param status Outcome, SUCCESS or FAILURE
+ * @param filename Report file name, or NULL
+ * @param user User responsible, or NULL
+ * @param text Further detail, or NULL
+ */
+void publish_event(int event, int status, const char* filename, const char* user, const char* text) {
+    const char* subject = (filename != NULL) ? filename : text;
+    Frame frame;
+    int i;
+    
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        ControlClient* c = &clients[i];
+        
+        if (c->fd == -1 || !(c->event_mask & (uint32_t)event)) {
+            continue;
+        }
+        if (c->filter[0] != '\0' && (subject == NULL || strcasestr(subject, c->filter) == NULL)) {
+            continue;
+        }
+        
+        /* The count sent is the one before this event, so a drop shows up on the next delivery */
+        if (frame_init(&frame, MSG_EVENT, c->subscription_id) != SUCCESS ||
+            frame_add_i32(&frame, FIELD_EVENT_TYPE, event) != SUCCESS ||
+            frame_add_i32(&frame, FIELD_STATUS, status) != SUCCESS ||
+            frame_add_u64(&frame, FIELD_EVENT_TIME, (uint64_t)time(NULL)) != SUCCESS ||
+            frame_add_u64(&frame, FIELD_DROPPED, c->dropped) != SUCCESS ||
+            (filename != NULL && frame_add_string(&frame, FIELD_FILENAME, filename) != SUCCESS) ||
+            (user != NULL && frame_add_string(&frame, FIELD_USERNAME, user) != SUCCESS) ||
+            (text != NULL && frame_add_string(&frame, FIELD_TEXT, text) != SUCCESS)) {
+            log_error("Failed to build event: %s", strerror(errno));
+            c->dropped++;
         } else {
-            log_error("Failed to read from FIFO: %s", strerror(errno));
+            send_to_client(i, &frame, TRUE);
+        }
+        frame_free(&frame);
+    }
+}
+
+/**
+ * Get subscription statistics
+ * @param subscribers Receives the number of subscribed connections
+ * @param dropped Receives the events dropped across all subscribers
+ */
+void get_subscription_stats(int* subscribers, unsigned long long* dropped) {
+    int i;
+    
+    *subscribers = 0;
+    *dropped = closed_dropped;
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        if (clients[i].fd != -1 && clients[i].event_mask != 0) {
+            (*subscribers)++;
+            *dropped += clients[i].dropped;
+        }
+    }
+}
+
+/**
+ * Connect to the daemon, send one request and wait for its reply
+ * @param fd Unconnected SEQPACKET socket
+ * @param request Request to send
+ * @param reply Receives the reply
+ * @return SUCCESS on success, FAILURE on error or timeout
+ */
+static int exchange_control_message(int fd, const Frame* request, Frame* reply) {
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    FrameReader reader;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, CONTROL_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        frame_send(fd, request, TRUE) != SUCCESS) {
+        return FAILURE;
+    }
+    
+    frame_reader_init(&reader);
+    for (;;) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, CONTROL_REPLY_TIMEOUT_MS) != 1) {
+            frame_reader_free(&reader);
+            errno = ETIMEDOUT;
+            return FAILURE;
+        }
+        
+        if (frame_reader_read(&reader, fd, TRUE, reply) == SUCCESS) {
+            /* Skip anything that is not the reply to this request */
+            if (reply->request_id == request->request_id) {
+                return SUCCESS;
+            }
+            frame_free(reply);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            frame_reader_free(&reader);
             return FAILURE;
         }
-    } else if (bytes_read != sizeof(IPCMessage)) {
-        /* Partial read */
-        log_error("Partial read from FIFO: %ld bytes", (long)bytes_read);
+    }
+}
+
+/**
+ * Send a request to the daemon over the control socket and wait for the
+ * reply. Meant for client processes; reports errors through errno only.
+ * @param request Frame to send; its request ID is assigned here
+ * @param reply Receives the reply; free it with frame_free()
+ * @return SUCCESS if a reply was received, FAILURE on error or timeout
+ */
+int send_control_request(Frame* request, Frame* reply) {
+    static uint32_t last_request_id = 0;
+    int saved_errno;
+    int result;
+    int fd;
+    
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
         return FAILURE;
     }
     
-    return SUCCESS;
+    frame_set_request_id(request, ++last_request_id);
+    result = exchange_control_message(fd, request, reply);
+    
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return result;
 }
 
 /**
@@ -140,33 +726,41 @@ pid_t create_reporting_process(int (*function)(void), int msg_type) {
         return -1;
     } else if (pid == 0) {
         /* Child process */
-        IPCMessage msg;
+        char text[MAX_LINE_LENGTH];
+        Frame msg;
         int result;
         
+        close_control_sockets();
+        
         log_operation("Starting child process (PID: %d) for operation type: %d", getpid(), msg_type);
         
         /* Execute the function */
         result = function();
         
-        /* Prepare completion message */
-        msg.type = msg_type;
-        msg.sender_pid = getpid();
-        msg.status = result;
-        
         if (result == SUCCESS) {
-            snprintf(msg.message, MAX_LINE_LENGTH, "Operation type %d completed successfully by PID %d", 
+            snprintf(text, sizeof(text), "Operation type %d completed successfully by PID %d",
                     msg_type, getpid());
-            log_operation("%s", msg.message);
+            log_operation("%s", text);
         } else {
-            snprintf(msg.message, MAX_LINE_LENGTH, "Operation type %d failed (executed by PID %d)", 
+            snprintf(text, sizeof(text), "Operation type %d failed (executed by PID %d)",
                     msg_type, getpid());
-            log_error("%s", msg.message);
+            log_error("%s", text);
+        }
+        
+        /* Prefer the shared event ring; the FIFO is the fallback when it is full */
+        if (event_ring_publish(msg_type, result, text) == SUCCESS) {
+            exit(result == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
         }
         
-        /* Send the completion message */
-        if (send_ipc_message(&msg) != SUCCESS) {
+        /* Prepare and send the completion message */
+        if (frame_init(&msg, msg_type, 0) != SUCCESS ||
+            frame_add_i32(&msg, FIELD_PID, getpid()) != SUCCESS ||
+            frame_add_i32(&msg, FIELD_STATUS, result) != SUCCESS ||
+            frame_add_string(&msg, FIELD_TEXT, text) != SUCCESS ||
+            send_ipc_message(&msg) != SUCCESS) {
             log_error("Failed to send completion message for operation type %d", msg_type);
         }
+        frame_free(&msg);
         
         /* Exit with the result code */
         exit(result == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
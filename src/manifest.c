@@ -0,0 +1,235 @@
+/**
+ * @file manifest.c
+ * @brief Snapshot manifests recording name, size, mtime and content hash
+ */
+
+#include "manifest.h"
+#include "utils.h"
+#include "backup.h"
+#include "file_operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/**
+ * Compare two manifest entries by name for qsort/bsearch
+ */
+static int compare_manifest_entries(const void *a, const void *b)
+{
+    return strcmp(((const ManifestEntry *)a)->name, ((const ManifestEntry *)b)->name);
+}
+
+/**
+ * Initialise an empty manifest
+ * @param manifest Manifest to initialise
+ * @param created Snapshot start time
+ */
+void init_snapshot_manifest(SnapshotManifest *manifest, time_t created)
+{
+    manifest->entries = NULL;
+    manifest->count = 0;
+    manifest->capacity = 0;
+    manifest->created = created;
+}
+
+/**
+ * Append an entry to a manifest
+ * @param manifest Manifest to extend
+ * @param entry Entry to copy in
+ * @return SUCCESS on success, FAILURE on error
+ */
+int add_manifest_entry(SnapshotManifest *manifest, const ManifestEntry *entry)
+{
+    /* Grow the array if needed */
+    if (manifest->count >= manifest->capacity)
+    {
+        int new_capacity = (manifest->capacity == 0) ? 64 : manifest->capacity * 2;
+        ManifestEntry *new_entries = (ManifestEntry *)realloc(manifest->entries,
+                                                              new_capacity * sizeof(ManifestEntry));
+        if (new_entries == NULL)
+        {
+            log_error("Memory allocation failed for manifest");
+            return FAILURE;
+        }
+        manifest->entries = new_entries;
+        manifest->capacity = new_capacity;
+    }
+
+    manifest->entries[manifest->count++] = *entry;
+    return SUCCESS;
+}
+
+/**
+ * Look up an entry by file name (manifest must be sorted)
+ * @param manifest Manifest to search
+ * @param name File name
+ * @return Pointer to the entry or NULL if not present
+ */
+const ManifestEntry *find_manifest_entry(const SnapshotManifest *manifest, const char *name)
+{
+    ManifestEntry key;
+
+    if (manifest->count == 0 || strlen(name) >= MANIFEST_NAME_LENGTH)
+    {
+        return NULL;
+    }
+
+    strcpy(key.name, name);
+    return (const ManifestEntry *)bsearch(&key, manifest->entries, manifest->count,
+                                          sizeof(ManifestEntry), compare_manifest_entries);
+}
+
+/**
+ * Sort manifest entries by name
+ * @param manifest Manifest to sort
+ */
+void sort_snapshot_manifest(SnapshotManifest *manifest)
+{
+    if (manifest->count > 1)
+    {
+        qsort(manifest->entries, manifest->count, sizeof(ManifestEntry), compare_manifest_entries);
+    }
+}
+
+/**
+ * Load the manifest of a snapshot directory
+ * @param snapshot_path Path to the snapshot directory
+ * @param manifest Manifest to fill (initialised by this call)
+ * @return SUCCESS on success, FAILURE on error or missing manifest
+ */
+int load_snapshot_manifest(const char *snapshot_path, SnapshotManifest *manifest)
+{
+    char path[MAX_PATH_LENGTH];
+    char line[MAX_PATH_LENGTH + 128];
+    FILE *fp;
+    long long created = 0;
+
+    init_snapshot_manifest(manifest, 0);
+
+    snprintf(path, sizeof(path), "%s/%s", snapshot_path, SNAPSHOT_MANIFEST);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return FAILURE;
+    }
+
+    /* Check the header so older or foreign files are not misread */
+    if (fgets(line, sizeof(line), fp) == NULL ||
+        strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) != 0 ||
+        fgets(line, sizeof(line), fp) == NULL ||
+        sscanf(line, "created %lld", &created) != 1)
+    {
+        log_error("Unrecognised manifest format in %s", path);
+        fclose(fp);
+        return FAILURE;
+    }
+    manifest->created = (time_t)created;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        ManifestEntry entry;
+        unsigned long long hash;
+        int name_offset = 0;
+        size_t name_len;
+
+        if (sscanf(line, "%16llx %lld %lld %n", &hash, &entry.size, &entry.mtime, &name_offset) != 3 ||
+            name_offset == 0)
+        {
+            log_error("Skipping malformed manifest line in %s", path);
+            continue;
+        }
+
+        /* The name is the remainder of the line */
+        name_len = strcspn(line + name_offset, "\n");
+        if (name_len == 0 || name_len >= MANIFEST_NAME_LENGTH)
+        {
+            continue;
+        }
+        memcpy(entry.name, line + name_offset, name_len);
+        entry.name[name_len] = '\0';
+        entry.hash = (uint64_t)hash;
+
+        if (add_manifest_entry(manifest, &entry) != SUCCESS)
+        {
+            fclose(fp);
+            free_snapshot_manifest(manifest);
+            return FAILURE;
+        }
+    }
+
+    fclose(fp);
+    sort_snapshot_manifest(manifest);
+    return SUCCESS;
+}
+
+/**
+ * Write the manifest into a snapshot directory (atomically via rename)
+ * @param snapshot_path Path to the snapshot directory
+ * @param manifest Manifest to write, sorted by this call
+ * @return SUCCESS on success, FAILURE on error
+ */
+int write_snapshot_manifest(const char *snapshot_path, SnapshotManifest *manifest)
+{
+    char path[MAX_PATH_LENGTH];
+    char temp_path[MAX_PATH_LENGTH];
+    FILE *fp;
+    int i;
+
+    sort_snapshot_manifest(manifest);
+
+    snprintf(path, sizeof(path), "%s/%s", snapshot_path, SNAPSHOT_MANIFEST);
+    if (snprintf(temp_path, sizeof(temp_path), "%s/%s.tmp", snapshot_path, SNAPSHOT_MANIFEST) >=
+        (int)sizeof(temp_path))
+    {
+        log_error("Manifest path too long for %s", snapshot_path);
+        return FAILURE;
+    }
+
+    fp = fopen(temp_path, "w");
+    if (fp == NULL)
+    {
+        log_error("Failed to create manifest %s: %s", temp_path, strerror(errno));
+        return FAILURE;
+    }
+
+    fprintf(fp, "%s\ncreated %lld\n", MANIFEST_HEADER, (long long)manifest->created);
+    for (i = 0; i < manifest->count; i++)
+    {
+        const ManifestEntry *entry = &manifest->entries[i];
+
+        fprintf(fp, "%016llx %lld %lld %s\n", (unsigned long long)entry->hash,
+                entry->size, entry->mtime, entry->name);
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    {
+        log_error("Failed to write manifest %s: %s", temp_path, strerror(errno));
+        fclose(fp);
+        unlink(temp_path);
+        return FAILURE;
+    }
+    fclose(fp);
+
+    if (rename(temp_path, path) != 0)
+    {
+        log_error("Failed to install manifest %s: %s", path, strerror(errno));
+        unlink(temp_path);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Free memory held by a manifest
+ * @param manifest Manifest to free
+ */
+void free_snapshot_manifest(SnapshotManifest *manifest)
+{
+    free(manifest->entries);
+    manifest->entries = NULL;
+    manifest->count = 0;
+    manifest->capacity = 0;
+}
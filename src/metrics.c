@@ -0,0 +1,394 @@
+/**
+ * @file metrics.c
+ * @brief Lock telemetry shared between the daemon and its workers
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "metrics.h"
+#include "utils.h"
+#include "backup.h"
+#include "command_queue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Counters, in an anonymous shared mapping inherited across fork()
+ */
+typedef struct {
+    pthread_mutex_t lock;                                  /* Process-shared; protects everything below */
+    unsigned long long acquisitions;                       /* Successful lock acquisitions */
+    unsigned long long contended;                          /* Acquisitions or attempts that found the lock held */
+    unsigned long long timeouts;                           /* Attempts that gave up */
+    double acquire_ms_total;                               /* Time spent acquiring */
+    double acquire_ms_max;                                 /* Slowest acquisition */
+    unsigned long long hold_buckets[LOCK_HOLD_BUCKETS + 1]; /* Non-cumulative; last is +Inf */
+    unsigned long long holds;                              /* Completed holds */
+    double hold_ms_total;                                  /* Total hold time */
+    double hold_ms_max;                                    /* Longest hold */
+    double last_hold_ms;                                   /* Most recent hold */
+    pid_t holder_pid;                                      /* Current holder, 0 when free */
+    double held_since_ms;                                  /* Monotonic start of the current hold */
+    int alerted;                                           /* Current hold already raised an alert */
+    long alert_ms;                                         /* Alert threshold */
+} MetricsState;
+
+static MetricsState *metrics = NULL;
+
+static const double hold_bounds_ms[LOCK_HOLD_BUCKETS] = LOCK_HOLD_BUCKET_BOUNDS;
+
+/**
+ * Get a monotonic clock reading in milliseconds
+ */
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+/**
+ * Forget a holder that exited without releasing; the kernel has already
+ * dropped its OFD lock. Called with the lock held.
+ */
+static void clear_dead_holder(MetricsState *state)
+{
+    if (state->holder_pid != 0 && kill(state->holder_pid, 0) != 0 && errno == ESRCH)
+    {
+        state->holder_pid = 0;
+        state->alerted = FALSE;
+    }
+}
+
+/**
+ * Take the metrics lock. The mutex is robust: if a worker died holding
+ * it, the lock is made usable again instead of wedging the daemon and the
+ * scrape endpoint; counters are at worst one update short.
+ */
+static void lock_metrics(MetricsState *state)
+{
+    if (pthread_mutex_lock(&state->lock) == EOWNERDEAD)
+    {
+        clear_dead_holder(state);
+        pthread_mutex_consistent(&state->lock);
+        log_warning("Metrics lock recovered from a process that died holding it");
+    }
+}
+
+/**
+ * Create the shared metrics area. Must run before worker processes are
+ * forked so that locks taken by children are counted too. Without it,
+ * the metrics_* calls do nothing.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int metrics_init(void)
+{
+    pthread_mutexattr_t attr;
+    MetricsState *state;
+
+    if (metrics != NULL)
+    {
+        return SUCCESS;
+    }
+
+    state = (MetricsState *)mmap(NULL, sizeof(MetricsState), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED)
+    {
+        log_error("Failed to create metrics area: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    memset(state, 0, sizeof(*state));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&state->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    state->alert_ms = LOCK_HOLD_ALERT_MS;
+
+    metrics = state;
+    return SUCCESS;
+}
+
+/**
+ * Set the hold time after which the lock raises an alert
+ * @param alert_ms Threshold in milliseconds
+ */
+void set_lock_hold_alert(long alert_ms)
+{
+    if (metrics != NULL && alert_ms > 0)
+    {
+        metrics->alert_ms = alert_ms;
+    }
+}
+
+/**
+ * Record a successful directory lock acquisition
+ * @param wait_ms Time spent acquiring it
+ * @param contended TRUE if another holder had to be waited for
+ */
+void metrics_lock_acquired(double wait_ms, int contended)
+{
+    if (metrics == NULL)
+    {
+        return;
+    }
+
+    lock_metrics(metrics);
+    metrics->acquisitions++;
+    if (contended)
+    {
+        metrics->contended++;
+    }
+    metrics->acquire_ms_total += wait_ms;
+    if (wait_ms > metrics->acquire_ms_max)
+    {
+        metrics->acquire_ms_max = wait_ms;
+    }
+    metrics->holder_pid = getpid();
+    metrics->held_since_ms = now_ms();
+    metrics->alerted = FALSE;
+    pthread_mutex_unlock(&metrics->lock);
+}
+
+/**
+ * Record an acquisition that gave up because another process held the lock
+ * @param wait_ms Time spent waiting
+ */
+void metrics_lock_timed_out(double wait_ms)
+{
+    if (metrics == NULL)
+    {
+        return;
+    }
+
+    lock_metrics(metrics);
+    metrics->contended++;
+    metrics->timeouts++;
+    metrics->acquire_ms_total += wait_ms;
+    if (wait_ms > metrics->acquire_ms_max)
+    {
+        metrics->acquire_ms_max = wait_ms;
+    }
+    pthread_mutex_unlock(&metrics->lock);
+}
+
+/**
+ * Record the release of the directory lock, alerting on long holds
+ */
+void metrics_lock_released(void)
+{
+    double held;
+    long alert_ms;
+    int bucket;
+
+    if (metrics == NULL)
+    {
+        return;
+    }
+
+    lock_metrics(metrics);
+    if (metrics->holder_pid == 0)
+    {
+        pthread_mutex_unlock(&metrics->lock);
+        return;
+    }
+
+    held = now_ms() - metrics->held_since_ms;
+    for (bucket = 0; bucket < LOCK_HOLD_BUCKETS && held > hold_bounds_ms[bucket]; bucket++)
+    {
+    }
+    metrics->hold_buckets[bucket]++;
+    metrics->holds++;
+    metrics->hold_ms_total += held;
+    metrics->last_hold_ms = held;
+    if (held > metrics->hold_ms_max)
+    {
+        metrics->hold_ms_max = held;
+    }
+    metrics->holder_pid = 0;
+    alert_ms = metrics->alert_ms;
+    pthread_mutex_unlock(&metrics->lock);
+
+    if (held > (double)alert_ms)
+    {
+        log_warning("ALERT: directory lock was held for %.0f ms (threshold %ld ms)", held, alert_ms);
+    }
+}
+
+/**
+ * Alert once if the lock has been held beyond the threshold and is still held
+ */
+void metrics_check_lock_alert(void)
+{
+    pid_t holder = 0;
+    double held = 0.0;
+    long alert_ms = 0;
+
+    if (metrics == NULL)
+    {
+        return;
+    }
+
+    lock_metrics(metrics);
+    clear_dead_holder(metrics);
+    if (metrics->holder_pid != 0 && !metrics->alerted &&
+        now_ms() - metrics->held_since_ms > (double)metrics->alert_ms)
+    {
+        metrics->alerted = TRUE;
+        holder = metrics->holder_pid;
+        held = now_ms() - metrics->held_since_ms;
+        alert_ms = metrics->alert_ms;
+    }
+    pthread_mutex_unlock(&metrics->lock);
+
+    if (holder != 0)
+    {
+        log_warning("ALERT: directory lock held by PID %d for %.0f ms and counting (threshold %ld ms)",
+                    (int)holder, held, alert_ms);
+    }
+}
+
+/**
+ * Format the lock state and counters as one line of key=value pairs
+ * @param buffer Destination buffer
+ * @param size Size of buffer
+ */
+void format_lock_summary(char *buffer, size_t size)
+{
+    MetricsState snapshot;
+    double current_hold = 0.0;
+
+    if (metrics == NULL)
+    {
+        snprintf(buffer, size, "lock_metrics=unavailable");
+        return;
+    }
+
+    lock_metrics(metrics);
+    clear_dead_holder(metrics);
+    memcpy(&snapshot, metrics, sizeof(snapshot));
+    if (snapshot.holder_pid != 0)
+    {
+        current_hold = now_ms() - snapshot.held_since_ms;
+    }
+    pthread_mutex_unlock(&metrics->lock);
+
+    snprintf(buffer, size,
+             "lock_holder_pid=%d lock_held_ms=%.1f lock_acquisitions=%llu lock_contended=%llu "
+             "lock_timeouts=%llu lock_acquire_max_ms=%.1f lock_hold_last_ms=%.1f lock_hold_max_ms=%.1f",
+             (int)snapshot.holder_pid, current_hold, snapshot.acquisitions, snapshot.contended,
+             snapshot.timeouts, snapshot.acquire_ms_max, snapshot.last_hold_ms, snapshot.hold_ms_max);
+}
+
+/**
+ * Write all metrics in Prometheus text format
+ * @param out Stream to write to
+ */
+void write_metrics(FILE *out)
+{
+    MetricsState snapshot;
+    unsigned long long cumulative = 0;
+    double current_hold = 0.0;
+    int i;
+
+    if (metrics == NULL)
+    {
+        return;
+    }
+
+    lock_metrics(metrics);
+    clear_dead_holder(metrics);
+    memcpy(&snapshot, metrics, sizeof(snapshot));
+    if (snapshot.holder_pid != 0)
+    {
+        current_hold = now_ms() - snapshot.held_since_ms;
+    }
+    pthread_mutex_unlock(&metrics->lock);
+
+    fprintf(out, "# HELP company_daemon_lock_acquisitions_total Directory lock acquisitions.\n");
+    fprintf(out, "# TYPE company_daemon_lock_acquisitions_total counter\n");
+    fprintf(out, "company_daemon_lock_acquisitions_total %llu\n", snapshot.acquisitions);
+    fprintf(out, "# HELP company_daemon_lock_contended_total Lock attempts that found another holder.\n");
+    fprintf(out, "# TYPE company_daemon_lock_contended_total counter\n");
+    fprintf(out, "company_daemon_lock_contended_total %llu\n", snapshot.contended);
+    fprintf(out, "# HELP company_daemon_lock_timeouts_total Lock attempts that gave up waiting.\n");
+    fprintf(out, "# TYPE company_daemon_lock_timeouts_total counter\n");
+    fprintf(out, "company_daemon_lock_timeouts_total %llu\n", snapshot.timeouts);
+    fprintf(out, "# HELP company_daemon_lock_acquire_seconds Time spent acquiring the lock.\n");
+    fprintf(out, "# TYPE company_daemon_lock_acquire_seconds summary\n");
+    fprintf(out, "company_daemon_lock_acquire_seconds_sum %.6f\n", snapshot.acquire_ms_total / 1000.0);
+    fprintf(out, "company_daemon_lock_acquire_seconds_count %llu\n", snapshot.acquisitions + snapshot.timeouts);
+    fprintf(out, "# HELP company_daemon_lock_acquire_max_seconds Slowest lock acquisition.\n");
+    fprintf(out, "# TYPE company_daemon_lock_acquire_max_seconds gauge\n");
+    fprintf(out, "company_daemon_lock_acquire_max_seconds %.6f\n", snapshot.acquire_ms_max / 1000.0);
+
+    fprintf(out, "# HELP company_daemon_lock_hold_seconds How long the lock was held.\n");
+    fprintf(out, "# TYPE company_daemon_lock_hold_seconds histogram\n");
+    for (i = 0; i < LOCK_HOLD_BUCKETS; i++)
+    {
+        cumulative += snapshot.hold_buckets[i];
+        fprintf(out, "company_daemon_lock_hold_seconds_bucket{le=\"%g\"} %llu\n",
+                hold_bounds_ms[i] / 1000.0, cumulative);
+    }
+    fprintf(out, "company_daemon_lock_hold_seconds_bucket{le=\"+Inf\"} %llu\n", snapshot.holds);
+    fprintf(out, "company_daemon_lock_hold_seconds_sum %.6f\n", snapshot.hold_ms_total / 1000.0);
+    fprintf(out, "company_daemon_lock_hold_seconds_count %llu\n", snapshot.holds);
+    fprintf(out, "# HELP company_daemon_lock_hold_max_seconds Longest completed hold.\n");
+    fprintf(out, "# TYPE company_daemon_lock_hold_max_seconds gauge\n");
+    fprintf(out, "company_daemon_lock_hold_max_seconds %.6f\n", snapshot.hold_ms_max / 1000.0);
+    fprintf(out, "# HELP company_daemon_lock_hold_last_seconds Most recent completed hold.\n");
+    fprintf(out, "# TYPE company_daemon_lock_hold_last_seconds gauge\n");
+    fprintf(out, "company_daemon_lock_hold_last_seconds %.6f\n", snapshot.last_hold_ms / 1000.0);
+
+    fprintf(out, "# HELP company_daemon_lock_holder_pid PID holding the lock, 0 when free.\n");
+    fprintf(out, "# TYPE company_daemon_lock_holder_pid gauge\n");
+    fprintf(out, "company_daemon_lock_holder_pid %d\n", (int)snapshot.holder_pid);
+    fprintf(out, "# HELP company_daemon_lock_current_hold_seconds Age of the current hold.\n");
+    fprintf(out, "# TYPE company_daemon_lock_current_hold_seconds gauge\n");
+    fprintf(out, "company_daemon_lock_current_hold_seconds %.6f\n", current_hold / 1000.0);
+}
+
+/**
+ * Rewrite METRICS_FILE atomically
+ * @return SUCCESS on success, FAILURE on error
+ */
+int write_metrics_file(void)
+{
+    char temp_path[MAX_PATH_LENGTH + 8];
+    FILE *out;
+
+    if (metrics == NULL)
+    {
+        return FAILURE;
+    }
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", METRICS_FILE);
+    out = fopen(temp_path, "w");
+    if (out == NULL)
+    {
+        log_error("Failed to write metrics file: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    write_metrics(out);
+    write_command_queue_metrics(out);
+
+    if (fclose(out) != 0 || rename(temp_path, METRICS_FILE) != 0)
+    {
+        log_error("Failed to install metrics file: %s", strerror(errno));
+        unlink(temp_path);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
@@ -0,0 +1,213 @@
+/**
+ * @file paths.c
+ * @brief Runtime layout of the daemon's files for a root prefix and an
+ * instance name
+ *
+ * Kept free of logging so the client library can link it to find the
+ * control socket of an instance.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "paths.h"
+#include "ipc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+static DaemonPaths paths;
+static int paths_ready = FALSE;
+
+/* Instance roots are <company root>/<name>: these would put an instance
+ * inside the default instance's trees */
+static const char *const reserved_instances[] = { UPLOAD_TREE, DASHBOARD_TREE, BACKUP_TREE };
+
+/**
+ * Check an instance name
+ * @return TRUE if it is empty or valid
+ */
+static int valid_instance(const char *instance)
+{
+    size_t i;
+
+    if (strlen(instance) > MAX_INSTANCE_LENGTH || instance[0] == '.')
+    {
+        return FALSE;
+    }
+    for (i = 0; i < sizeof(reserved_instances) / sizeof(reserved_instances[0]); i++)
+    {
+        if (strcmp(instance, reserved_instances[i]) == 0)
+        {
+            return FALSE;
+        }
+    }
+    for (i = 0; instance[i] != '\0'; i++)
+    {
+        char c = instance[i];
+
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+              c == '-' || c == '_' || c == '.'))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Format one path, failing if it does not fit
+ */
+static int set_path(char *path, size_t size, const char *format, ...)
+{
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(path, size, format, args);
+    va_end(args);
+
+    return (length >= 0 && (size_t)length < size) ? SUCCESS : FAILURE;
+}
+
+/* Format a member of the DaemonPaths being resolved */
+#define SET_PATH(member, ...) set_path(resolved.member, sizeof(resolved.member), __VA_ARGS__)
+
+/**
+ * Resolve every path for a root prefix and instance name
+ * @param prefix Absolute directory, NULL, "" or "/" for none
+ * @param instance Instance name, NULL or "" for the default instance
+ * @return SUCCESS on success, FAILURE on error
+ */
+int init_paths(const char *prefix, const char *instance)
+{
+    DaemonPaths resolved;
+    char suffix[MAX_INSTANCE_LENGTH + 2] = "";
+    size_t length;
+    int result = SUCCESS;
+
+    if (prefix == NULL)
+    {
+        prefix = "";
+    }
+    if (instance == NULL)
+    {
+        instance = "";
+    }
+    if ((prefix[0] != '\0' && prefix[0] != '/') || !valid_instance(instance))
+    {
+        errno = EINVAL;
+        return FAILURE;
+    }
+
+    memset(&resolved, 0, sizeof(resolved));
+
+    /* "/srv/unit1/" and "/" carry no more than "/srv/unit1" and "" */
+    length = strlen(prefix);
+    while (length > 0 && prefix[length - 1] == '/')
+    {
+        length--;
+    }
+    if (length >= sizeof(resolved.prefix))
+    {
+        errno = ENAMETOOLONG;
+        return FAILURE;
+    }
+    memcpy(resolved.prefix, prefix, length);
+    strcpy(resolved.instance, instance);
+    if (instance[0] != '\0')
+    {
+        snprintf(suffix, sizeof(suffix), "-%s", instance);
+    }
+
+    /* Each instance keeps its reports in its own tree */
+    result |= SET_PATH(company_root, (instance[0] != '\0') ? "%s%s/%s" : "%s%s",
+                       resolved.prefix, DEFAULT_COMPANY_ROOT, instance);
+    result |= SET_PATH(log_root, "%s%s", resolved.prefix, DEFAULT_LOG_ROOT);
+    result |= SET_PATH(run_root, "%s%s", resolved.prefix, DEFAULT_RUN_ROOT);
+
+    result |= SET_PATH(upload_dir, "%s/%s", resolved.company_root, UPLOAD_TREE);
+    result |= SET_PATH(dashboard_dir, "%s/%s", resolved.company_root, DASHBOARD_TREE);
+    result |= SET_PATH(backup_dir, "%s/%s", resolved.company_root, BACKUP_TREE);
+
+    result |= SET_PATH(operation_log, "%s/%s%s.log", resolved.log_root, DAEMON_FILE_BASE, suffix);
+    result |= SET_PATH(change_log, "%s/%s%s.log", resolved.log_root, CHANGE_LOG_BASE, suffix);
+    result |= SET_PATH(pid_file, "%s/%s%s.pid", resolved.run_root, DAEMON_FILE_BASE, suffix);
+    result |= SET_PATH(lock_file, "%s/%s%s.lock", resolved.run_root, DAEMON_FILE_BASE, suffix);
+    result |= SET_PATH(fifo_path, "%s/%s%s_pipe", resolved.run_root, DAEMON_FILE_BASE, suffix);
+    result |= SET_PATH(control_socket_path, "%s/%s%s.sock", resolved.run_root, DAEMON_FILE_BASE, suffix);
+    result |= SET_PATH(metrics_file, "%s/%s%s.metrics", resolved.run_root, DAEMON_FILE_BASE, suffix);
+
+    if (result != SUCCESS)
+    {
+        errno = ENAMETOOLONG;
+        return FAILURE;
+    }
+
+    paths = resolved;
+    paths_ready = TRUE;
+    return SUCCESS;
+}
+
+/**
+ * Resolve every path from ROOT_PREFIX_ENV and INSTANCE_ENV
+ * @return SUCCESS on success, FAILURE on error
+ */
+int init_paths_from_env(void)
+{
+    return init_paths(getenv(ROOT_PREFIX_ENV), getenv(INSTANCE_ENV));
+}
+
+/**
+ * Get the resolved paths
+ * @return The paths
+ */
+const DaemonPaths *get_daemon_paths(void)
+{
+    if (!paths_ready && init_paths_from_env() != SUCCESS)
+    {
+        init_paths(NULL, NULL);
+    }
+    return &paths;
+}
+
+/**
+ * Create a directory and any missing parents
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int make_directories(const char *dir)
+{
+    char path[MAX_PATH_LENGTH];
+    char *slash;
+
+    snprintf(path, sizeof(path), "%s", dir);
+    for (slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST)
+        {
+            return FAILURE;
+        }
+        *slash = '/';
+    }
+    return (mkdir(path, 0755) == 0 || errno == EEXIST) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Create the company, log and run roots
+ * @return SUCCESS on success, FAILURE on error
+ */
+int create_path_roots(void)
+{
+    const DaemonPaths *resolved = get_daemon_paths();
+
+    if (make_directories(resolved->company_root) != SUCCESS ||
+        make_directories(resolved->log_root) != SUCCESS ||
+        make_directories(resolved->run_root) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    return SUCCESS;
+}
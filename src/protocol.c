@@ -0,0 +1,724 @@
+/**
+ * @file protocol.c
+ * @brief Length-prefixed IPC frames with typed fields
+ *
+ * Shared by the daemon and its clients, so nothing here logs; failures
+ * are reported through the return value and errno.
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "protocol.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Buffer size a new frame starts with; most messages fit */
+#define FRAME_INITIAL_CAPACITY 256
+
+static void put_u16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        p[i] = (unsigned char)(v >> (i * 8));
+    }
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        p[i] = (unsigned char)(v >> (i * 8));
+    }
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/**
+ * Make room for more bytes in a buffer, doubling its size
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+static int reserve(unsigned char **buffer, size_t *capacity, size_t needed)
+{
+    size_t size = (*capacity > 0) ? *capacity : FRAME_INITIAL_CAPACITY;
+    unsigned char *grown;
+
+    if (needed <= *capacity)
+    {
+        return SUCCESS;
+    }
+
+    while (size < needed)
+    {
+        size *= 2;
+    }
+
+    grown = (unsigned char *)realloc(*buffer, size);
+    if (grown == NULL)
+    {
+        errno = ENOMEM;
+        return FAILURE;
+    }
+
+    *buffer = grown;
+    *capacity = size;
+    return SUCCESS;
+}
+
+/**
+ * Start an empty frame
+ * @param frame Frame to initialize
+ * @param type Message type
+ * @param request_id Request ID, 0 when unused
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_init(Frame *frame, uint8_t type, uint32_t request_id)
+{
+    memset(frame, 0, sizeof(*frame));
+    frame->passed_fd = -1;
+    if (reserve(&frame->buffer, &frame->capacity, FRAME_INITIAL_CAPACITY) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    frame->type = type;
+    frame->request_id = request_id;
+    frame->length = FRAME_HEADER_SIZE;
+
+    frame->buffer[0] = PROTOCOL_VERSION;
+    frame->buffer[1] = type;
+    put_u16(frame->buffer + 2, 0);
+    put_u32(frame->buffer + 4, request_id);
+    put_u32(frame->buffer + 8, 0);
+    return SUCCESS;
+}
+
+/**
+ * Change the request ID of a frame
+ * @param frame Frame to update
+ * @param request_id New request ID
+ */
+void frame_set_request_id(Frame *frame, uint32_t request_id)
+{
+    frame->request_id = request_id;
+    put_u32(frame->buffer + 4, request_id);
+}
+
+/**
+ * Append a field
+ * @param frame Frame to extend
+ * @param tag Field tag
+ * @param data Payload
+ * @param length Payload bytes
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_add(Frame *frame, uint16_t tag, const void *data, size_t length)
+{
+    FrameField *field;
+
+    if (frame->field_count >= MAX_FRAME_FIELDS ||
+        length > MAX_FRAME_SIZE - frame->length - FIELD_HEADER_SIZE)
+    {
+        errno = EMSGSIZE;
+        return FAILURE;
+    }
+
+    if (reserve(&frame->buffer, &frame->capacity, frame->length + FIELD_HEADER_SIZE + length) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    put_u16(frame->buffer + frame->length, tag);
+    put_u32(frame->buffer + frame->length + 2, (uint32_t)length);
+    if (length > 0)
+    {
+        memcpy(frame->buffer + frame->length + FIELD_HEADER_SIZE, data, length);
+    }
+
+    field = &frame->fields[frame->field_count++];
+    field->tag = tag;
+    field->length = (uint32_t)length;
+    field->offset = frame->length + FIELD_HEADER_SIZE;
+
+    frame->length += FIELD_HEADER_SIZE + length;
+    put_u32(frame->buffer + 8, (uint32_t)(frame->length - FRAME_HEADER_SIZE));
+    return SUCCESS;
+}
+
+/**
+ * Append a string field, without its terminator
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_add_string(Frame *frame, uint16_t tag, const char *value)
+{
+    return frame_add(frame, tag, value, strlen(value));
+}
+
+/**
+ * Append a 32-bit signed integer field
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_add_i32(Frame *frame, uint16_t tag, int32_t value)
+{
+    unsigned char bytes[4];
+
+    put_u32(bytes, (uint32_t)value);
+    return frame_add(frame, tag, bytes, sizeof(bytes));
+}
+
+/**
+ * Append a 64-bit unsigned integer field
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int frame_add_u64(Frame *frame, uint16_t tag, uint64_t value)
+{
+    unsigned char bytes[8];
+
+    put_u64(bytes, value);
+    return frame_add(frame, tag, bytes, sizeof(bytes));
+}
+
+/**
+ * Find the first field with a tag
+ * @return Field, or NULL if absent
+ */
+const FrameField *frame_find(const Frame *frame, uint16_t tag)
+{
+    int i;
+
+    for (i = 0; i < frame->field_count; i++)
+    {
+        if (frame->fields[i].tag == tag)
+        {
+            return &frame->fields[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Get the payload of a field
+ * @return Pointer into the frame buffer
+ */
+const unsigned char *frame_field_data(const Frame *frame, const FrameField *field)
+{
+    return frame->buffer + field->offset;
+}
+
+/**
+ * Read a 32-bit signed integer field
+ * @return SUCCESS on success, FAILURE if absent or malformed
+ */
+int frame_get_i32(const Frame *frame, uint16_t tag, int32_t *value)
+{
+    const FrameField *field = frame_find(frame, tag);
+
+    if (field == NULL || field->length != 4)
+    {
+        return FAILURE;
+    }
+
+    *value = (int32_t)get_u32(frame_field_data(frame, field));
+    return SUCCESS;
+}
+
+/**
+ * Read a 64-bit unsigned integer field
+ * @return SUCCESS on success, FAILURE if absent or malformed
+ */
+int frame_get_u64(const Frame *frame, uint16_t tag, uint64_t *value)
+{
+    return frame_field_u64(frame, frame_find(frame, tag), value);
+}
+
+/**
+ * Read a 64-bit unsigned integer from a given field, for fields that repeat
+ * @return SUCCESS on success, FAILURE if absent or malformed
+ */
+int frame_field_u64(const Frame *frame, const FrameField *field, uint64_t *value)
+{
+    if (field == NULL || field->length != 8)
+    {
+        return FAILURE;
+    }
+
+    *value = get_u64(frame_field_data(frame, field));
+    return SUCCESS;
+}
+
+/**
+ * Copy a string field into a terminated buffer
+ * @param out Destination buffer
+ * @param size Size of out
+ * @return SUCCESS on success, FAILURE if absent, too long or containing NUL
+ */
+int frame_get_string(const Frame *frame, uint16_t tag, char *out, size_t size)
+{
+    const FrameField *field = frame_find(frame, tag);
+    const unsigned char *data;
+
+    if (field == NULL || field->length >= size)
+    {
+        return FAILURE;
+    }
+
+    data = frame_field_data(frame, field);
+    if (memchr(data, '\0', field->length) != NULL)
+    {
+        return FAILURE;
+    }
+
+    memcpy(out, data, field->length);
+    out[field->length] = '\0';
+    return SUCCESS;
+}
+
+/**
+ * Release a frame's buffer and close its passed descriptor
+ * @param frame Frame to free
+ */
+void frame_free(Frame *frame)
+{
+    if (frame->passed_fd != -1)
+    {
+        close(frame->passed_fd);
+        frame->passed_fd = -1;
+    }
+    free(frame->buffer);
+    frame->buffer = NULL;
+    frame->length = 0;
+    frame->capacity = 0;
+    frame->field_count = 0;
+}
+
+/**
+ * Check a frame header and get the full frame size
+ * @return Frame size, or 0 if the header is invalid (errno set)
+ */
+static size_t parse_header(const unsigned char *header)
+{
+    uint32_t body_length = get_u32(header + 8);
+
+    if (header[0] != PROTOCOL_VERSION || get_u16(header + 2) != 0)
+    {
+        errno = EPROTO;
+        return 0;
+    }
+    if (body_length > MAX_FRAME_SIZE - FRAME_HEADER_SIZE)
+    {
+        errno = EMSGSIZE;
+        return 0;
+    }
+
+    return FRAME_HEADER_SIZE + (size_t)body_length;
+}
+
+/**
+ * Build the field table of a received frame, taking over its buffer
+ * @return SUCCESS on success, FAILURE if the body is malformed (errno set)
+ */
+static int frame_parse(Frame *frame, unsigned char *buffer, size_t length, size_t capacity)
+{
+    size_t offset = FRAME_HEADER_SIZE;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->passed_fd = -1;
+    frame->type = buffer[1];
+    frame->request_id = get_u32(buffer + 4);
+
+    while (offset < length)
+    {
+        FrameField *field;
+        uint32_t field_length;
+
+        if (length - offset < FIELD_HEADER_SIZE || frame->field_count >= MAX_FRAME_FIELDS)
+        {
+            errno = EPROTO;
+            return FAILURE;
+        }
+
+        field_length = get_u32(buffer + offset + 2);
+        if (field_length > length - offset - FIELD_HEADER_SIZE)
+        {
+            errno = EPROTO;
+            return FAILURE;
+        }
+
+        field = &frame->fields[frame->field_count++];
+        field->tag = get_u16(buffer + offset);
+        field->length = field_length;
+        field->offset = offset + FIELD_HEADER_SIZE;
+        offset += FIELD_HEADER_SIZE + field_length;
+    }
+
+    frame->buffer = buffer;
+    frame->length = length;
+    frame->capacity = capacity;
+    return SUCCESS;
+}
+
+/**
+ * Send one record with a descriptor attached
+ * @return Bytes sent, or -1 on error (errno set)
+ */
+static ssize_t send_record_with_fd(int fd, const void *data, size_t length, int passed_fd)
+{
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = length;
+
+    memset(&message, 0, sizeof(message));
+    memset(&control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+
+    return sendmsg(fd, &message, MSG_NOSIGNAL);
+}
+
+/**
+ * Send a frame, splitting it into records on packet sockets. A passed
+ * descriptor goes with the first record and stays open on the sender.
+ * @param fd Destination descriptor
+ * @param frame Frame to send
+ * @param packet TRUE for a SEQPACKET socket, FALSE for a byte stream
+ * @return SUCCESS on success, FAILURE on error (errno set; EINVAL when
+ *         a descriptor is passed over a byte stream)
+ */
+int frame_send(int fd, const Frame *frame, int packet)
+{
+    size_t sent = 0;
+
+    return frame_send_resume(fd, frame, packet, &sent);
+}
+
+/**
+ * Send as much of a frame as the descriptor takes, starting at *sent
+ * @param fd Destination descriptor, possibly non-blocking
+ * @param frame Frame to send
+ * @param packet TRUE for a SEQPACKET socket, FALSE for a byte stream
+ * @param sent Bytes already sent; advanced past what is sent now
+ * @return SUCCESS once the whole frame is out, FAILURE otherwise (errno
+ *         EAGAIN when the descriptor is full and the call can be repeated)
+ */
+int frame_send_resume(int fd, const Frame *frame, int packet, size_t *sent)
+{
+    if (frame->passed_fd != -1 && !packet)
+    {
+        errno = EINVAL;
+        return FAILURE;
+    }
+
+    while (*sent < frame->length)
+    {
+        size_t chunk = frame->length - *sent;
+        ssize_t written;
+
+        if (packet)
+        {
+            /* Records are never split by the kernel, so each is sent whole or not at all */
+            if (chunk > FRAME_RECORD_SIZE)
+            {
+                chunk = FRAME_RECORD_SIZE;
+            }
+            if (*sent == 0 && frame->passed_fd != -1)
+            {
+                written = send_record_with_fd(fd, frame->buffer, chunk, frame->passed_fd);
+            }
+            else
+            {
+                written = send(fd, frame->buffer + *sent, chunk, MSG_NOSIGNAL);
+            }
+        }
+        else
+        {
+            written = write(fd, frame->buffer + *sent, chunk);
+        }
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return FAILURE;
+        }
+
+        *sent += (size_t)written;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Receive one record, keeping a descriptor that comes with it
+ * @return Real record size (may exceed length), or -1 on error (errno set)
+ */
+static ssize_t receive_record(FrameReader *reader, int fd, void *data, size_t length)
+{
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t got;
+
+    iov.iov_base = data;
+    iov.iov_len = length;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    /* MSG_TRUNC reports the real record size, exposing oversized records */
+    got = recvmsg(fd, &message, MSG_DONTWAIT | MSG_TRUNC | MSG_CMSG_CLOEXEC);
+    if (got == -1)
+    {
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        {
+            int received;
+
+            memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+            if (reader->passed_fd != -1)
+            {
+                /* Only one descriptor per frame */
+                close(received);
+                message.msg_flags |= MSG_CTRUNC;
+            }
+            else
+            {
+                reader->passed_fd = received;
+            }
+        }
+    }
+
+    /* The kernel closes descriptors that did not fit */
+    if (message.msg_flags & MSG_CTRUNC)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return got;
+}
+
+/**
+ * Start an empty reader
+ * @param reader Reader to initialize
+ */
+void frame_reader_init(FrameReader *reader)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->passed_fd = -1;
+}
+
+/**
+ * Refuse frames larger than a limit
+ * @param reader Reader to restrict
+ * @param limit Largest frame in bytes, 0 for MAX_FRAME_SIZE
+ */
+void frame_reader_set_limit(FrameReader *reader, size_t limit)
+{
+    reader->limit = limit;
+}
+
+/**
+ * Read what is available towards the next frame
+ * @param reader Reassembly state for the descriptor
+ * @param fd Source descriptor
+ * @param packet TRUE for a SEQPACKET socket, FALSE for a byte stream
+ * @param frame Receives the frame once it is complete
+ * @return SUCCESS when a frame is complete, FAILURE otherwise with errno
+ *         EAGAIN (incomplete), ECONNRESET (peer closed), EPROTO or
+ *         EMSGSIZE (malformed), or the read error
+ */
+int frame_reader_read(FrameReader *reader, int fd, int packet, Frame *frame)
+{
+    size_t limit = (reader->limit != 0) ? reader->limit : MAX_FRAME_SIZE;
+
+    for (;;)
+    {
+        size_t want;
+        ssize_t got;
+
+        /* A stream is read exactly to frame boundaries; a packet socket one record at a time */
+        if (reader->expected == 0)
+        {
+            want = packet ? FRAME_RECORD_SIZE : FRAME_HEADER_SIZE - reader->length;
+            if (packet && want > limit)
+            {
+                want = limit;
+            }
+        }
+        else
+        {
+            want = reader->expected - reader->length;
+            if (packet && want > FRAME_RECORD_SIZE)
+            {
+                want = FRAME_RECORD_SIZE;
+            }
+        }
+
+        if (reserve(&reader->buffer, &reader->capacity, reader->length + want) != SUCCESS)
+        {
+            return FAILURE;
+        }
+
+        if (packet)
+        {
+            got = receive_record(reader, fd, reader->buffer + reader->length, want);
+            if (got > (ssize_t)want)
+            {
+                errno = EMSGSIZE;
+                return FAILURE;
+            }
+        }
+        else
+        {
+            got = read(fd, reader->buffer + reader->length, want);
+        }
+
+        if (got == 0)
+        {
+            errno = ECONNRESET;
+            return FAILURE;
+        }
+        if (got == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return FAILURE;
+        }
+
+        reader->length += (size_t)got;
+
+        if (reader->expected == 0 && reader->length >= FRAME_HEADER_SIZE)
+        {
+            reader->expected = parse_header(reader->buffer);
+            if (reader->expected == 0)
+            {
+                return FAILURE;
+            }
+            if (reader->expected > limit)
+            {
+                errno = EMSGSIZE;
+                return FAILURE;
+            }
+        }
+
+        /* A record running past the end of its frame means the sender is confused */
+        if (reader->expected != 0 && reader->length > reader->expected)
+        {
+            errno = EPROTO;
+            return FAILURE;
+        }
+
+        if (reader->expected != 0 && reader->length == reader->expected)
+        {
+            unsigned char *buffer = reader->buffer;
+            size_t length = reader->length;
+            size_t capacity = reader->capacity;
+            int passed_fd = reader->passed_fd;
+
+            frame_reader_init(reader);
+            reader->limit = limit;
+            if (frame_parse(frame, buffer, length, capacity) != SUCCESS)
+            {
+                free(buffer);
+                if (passed_fd != -1)
+                {
+                    close(passed_fd);
+                }
+                return FAILURE;
+            }
+            frame->passed_fd = passed_fd;
+            return SUCCESS;
+        }
+
+        if (packet && reader->expected == 0)
+        {
+            /* A first record shorter than a header can never be completed */
+            errno = EPROTO;
+            return FAILURE;
+        }
+    }
+}
+
+/**
+ * Drop a partially received frame and release the reader's buffer
+ * @param reader Reader to reset
+ */
+void frame_reader_free(FrameReader *reader)
+{
+    size_t limit = reader->limit;
+
+    if (reader->passed_fd != -1)
+    {
+        close(reader->passed_fd);
+    }
+    free(reader->buffer);
+    frame_reader_init(reader);
+    reader->limit = limit;
+}
@@ -0,0 +1,1058 @@
+/**
+ * @file restore.c
+ * @brief Verify backups and restore reports from them
+ */
+
+#define _GNU_SOURCE
+
+#include "restore.h"
+#include "archive.h"
+#include "backup.h"
+#include "chunk_store.h"
+#include "copy_pool.h"
+#include "file_operations.h"
+#include "hash.h"
+#include "manifest.h"
+#include "retention.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Snapshot kinds, decided from the entry in BACKUP_DIR */
+#define SNAPSHOT_KIND_DIRECTORY 0
+#define SNAPSHOT_KIND_ARCHIVE   1
+#define SNAPSHOT_KIND_CHUNKED   2
+#define SNAPSHOT_KIND_OTHER     3
+
+/**
+ * Structure describing a snapshot being verified or restored
+ */
+typedef struct {
+    char name[MANIFEST_NAME_LENGTH]; /* Entry name in BACKUP_DIR */
+    char path[MAX_PATH_LENGTH];      /* Full path */
+    int kind;                        /* SNAPSHOT_KIND_* */
+    SnapshotManifest manifest;       /* Directory snapshots */
+    ArchiveIndex index;              /* Archives */
+    ChunkManifest chunks;            /* Chunked backups */
+    int loaded;                      /* Manifest or index loaded */
+    int failed;                      /* Members that failed verification */
+} SnapshotRef;
+
+/**
+ * Structure describing one file to verify or extract
+ */
+typedef struct {
+    SnapshotRef *snapshot;          /* Snapshot the file belongs to */
+    const ManifestEntry *file;      /* Directory snapshot entry */
+    const ArchiveEntry *member;     /* Archive entry */
+    const ChunkFile *chunked;       /* Chunked backup entry */
+    char destination[MAX_PATH_LENGTH]; /* Extraction target (restore only) */
+    int result;                     /* SUCCESS or FAILURE */
+} SnapshotJob;
+
+/**
+ * Shared state of a parallel run over snapshot jobs
+ */
+typedef struct {
+    SnapshotJob *jobs;           /* Jobs to run */
+    int count;                   /* Number of jobs */
+    int next;                    /* Next job to hand out */
+    int (*run)(SnapshotJob *);   /* Work done per job */
+    pthread_mutex_t lock;        /* Protects next */
+} JobQueue;
+
+/**
+ * Check that a name is a single path component
+ */
+static int is_plain_name(const char *name)
+{
+    return name[0] != '\0' && strchr(name, '/') == NULL &&
+           strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/**
+ * Worker thread: run jobs until none are left
+ */
+static void *job_worker(void *arg)
+{
+    JobQueue *queue = (JobQueue *)arg;
+
+    for (;;)
+    {
+        int index;
+
+        pthread_mutex_lock(&queue->lock);
+        index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (index >= queue->count)
+        {
+            return NULL;
+        }
+        queue->jobs[index].result = queue->run(&queue->jobs[index]);
+    }
+}
+
+/**
+ * Run jobs on COPY_POOL_WORKERS threads, the caller included
+ * @return Number of jobs that failed
+ */
+static int run_jobs(SnapshotJob *jobs, int count, int (*run)(SnapshotJob *))
+{
+    pthread_t threads[COPY_POOL_WORKERS];
+    JobQueue queue;
+    int started = 0;
+    int failed = 0;
+    int i;
+
+    queue.jobs = jobs;
+    queue.count = count;
+    queue.next = 0;
+    queue.run = run;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    for (i = 0; i < COPY_POOL_WORKERS - 1 && i < count - 1; i++)
+    {
+        if (pthread_create(&threads[started], NULL, job_worker, &queue) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+
+    job_worker(&queue);
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+
+    for (i = 0; i < count; i++)
+    {
+        if (jobs[i].result != SUCCESS)
+        {
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * Check whether a name ends with a suffix
+ */
+static int ends_with(const char *name, const char *suffix)
+{
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+
+    return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+/**
+ * Find a snapshot in BACKUP_DIR, accepting archive and chunk manifest
+ * names without their suffix
+ * @param name Snapshot name
+ * @param snapshot Receives the name, path and kind
+ * @return SUCCESS if found, FAILURE otherwise
+ */
+static int resolve_snapshot(const char *name, SnapshotRef *snapshot)
+{
+    struct stat st;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    if (!is_plain_name(name) ||
+        snprintf(snapshot->name, sizeof(snapshot->name), "%s", name) >= (int)sizeof(snapshot->name) ||
+        snprintf(snapshot->path, sizeof(snapshot->path), "%s/%s", BACKUP_DIR, name) >= (int)sizeof(snapshot->path))
+    {
+        log_error("Invalid backup name: %s", name);
+        return FAILURE;
+    }
+
+    if (stat(snapshot->path, &st) != 0 &&
+        (snprintf(snapshot->path, sizeof(snapshot->path), "%s/%s%s", BACKUP_DIR, name, ARCHIVE_SUFFIX) >= (int)sizeof(snapshot->path) ||
+         stat(snapshot->path, &st) != 0) &&
+        (snprintf(snapshot->path, sizeof(snapshot->path), "%s/%s%s", BACKUP_DIR, name, CHUNK_MANIFEST_SUFFIX) >= (int)sizeof(snapshot->path) ||
+         stat(snapshot->path, &st) != 0))
+    {
+        log_error("Backup not found: %s", name);
+        return FAILURE;
+    }
+
+    if (S_ISDIR(st.st_mode))
+    {
+        snapshot->kind = SNAPSHOT_KIND_DIRECTORY;
+    }
+    else if (ends_with(snapshot->path, ARCHIVE_SUFFIX))
+    {
+        snapshot->kind = SNAPSHOT_KIND_ARCHIVE;
+    }
+    else if (ends_with(snapshot->path, CHUNK_MANIFEST_SUFFIX))
+    {
+        snapshot->kind = SNAPSHOT_KIND_CHUNKED;
+    }
+    else
+    {
+        snapshot->kind = SNAPSHOT_KIND_OTHER;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Load the manifest or index of a snapshot
+ * @return SUCCESS on success, FAILURE if the snapshot cannot be read
+ */
+static int load_snapshot_contents(SnapshotRef *snapshot)
+{
+    int result = FAILURE;
+
+    if (snapshot->kind == SNAPSHOT_KIND_DIRECTORY)
+    {
+        result = load_snapshot_manifest(snapshot->path, &snapshot->manifest);
+        if (result != SUCCESS)
+        {
+            log_error("Snapshot %s has no manifest", snapshot->path);
+        }
+    }
+    else if (snapshot->kind == SNAPSHOT_KIND_ARCHIVE)
+    {
+        result = load_archive_index(snapshot->path, &snapshot->index);
+    }
+    else if (snapshot->kind == SNAPSHOT_KIND_CHUNKED)
+    {
+        result = load_chunk_manifest(snapshot->path, &snapshot->chunks);
+    }
+    else
+    {
+        log_error("Backup %s is not a snapshot directory, archive or chunk manifest", snapshot->path);
+    }
+
+    snapshot->loaded = (result == SUCCESS);
+    return result;
+}
+
+/**
+ * Release the manifest or index of a snapshot
+ */
+static void free_snapshot_contents(SnapshotRef *snapshot)
+{
+    if (!snapshot->loaded)
+    {
+        return;
+    }
+
+    if (snapshot->kind == SNAPSHOT_KIND_DIRECTORY)
+    {
+        free_snapshot_manifest(&snapshot->manifest);
+    }
+    else if (snapshot->kind == SNAPSHOT_KIND_CHUNKED)
+    {
+        free_chunk_manifest(&snapshot->chunks);
+    }
+    else
+    {
+        free_archive_index(&snapshot->index);
+    }
+    snapshot->loaded = FALSE;
+}
+
+/**
+ * Number of files recorded in a loaded snapshot
+ */
+static int snapshot_file_count(const SnapshotRef *snapshot)
+{
+    if (!snapshot->loaded)
+    {
+        return 0;
+    }
+    if (snapshot->kind == SNAPSHOT_KIND_DIRECTORY)
+    {
+        return snapshot->manifest.count;
+    }
+    if (snapshot->kind == SNAPSHOT_KIND_CHUNKED)
+    {
+        return snapshot->chunks.count;
+    }
+    return (int)snapshot->index.count;
+}
+
+/**
+ * Point a job at the i'th file of a loaded snapshot
+ */
+static void set_job_file(SnapshotJob *job, SnapshotRef *snapshot, int i)
+{
+    memset(job, 0, sizeof(*job));
+    job->snapshot = snapshot;
+    job->result = FAILURE;
+    if (snapshot->kind == SNAPSHOT_KIND_DIRECTORY)
+    {
+        job->file = &snapshot->manifest.entries[i];
+    }
+    else if (snapshot->kind == SNAPSHOT_KIND_CHUNKED)
+    {
+        job->chunked = &snapshot->chunks.files[i];
+    }
+    else
+    {
+        job->member = &snapshot->index.entries[i];
+    }
+}
+
+/**
+ * Name of the file a job refers to
+ */
+static const char *job_file_name(const SnapshotJob *job)
+{
+    if (job->file != NULL)
+    {
+        return job->file->name;
+    }
+    return (job->chunked != NULL) ? job->chunked->name : job->member->name;
+}
+
+/**
+ * Write the archive member or chunked file of a job into an open file
+ * @return SUCCESS on success, FAILURE on error or hash mismatch
+ */
+static int extract_job_data(const SnapshotJob *job, int fd)
+{
+    if (job->chunked != NULL)
+    {
+        return chunk_store_extract(&job->snapshot->chunks, job->chunked, fd);
+    }
+    return archive_extract_entry(job->snapshot->path, job->member, fd);
+}
+
+/**
+ * Permission bits recorded for the file of an extract job
+ */
+static mode_t job_file_mode(const SnapshotJob *job)
+{
+    if (job->chunked != NULL)
+    {
+        /* v1 chunk manifests carry no mode */
+        return (job->chunked->mode != 0) ? (mode_t)job->chunked->mode : (DASHBOARD_PERMISSIONS & 0666);
+    }
+    return (mode_t)job->member->mode;
+}
+
+/**
+ * Verify one file against the recorded size and hash
+ * @return SUCCESS if the file matches, FAILURE otherwise
+ */
+static int verify_job(SnapshotJob *job)
+{
+    char path[MAX_PATH_LENGTH];
+    const unsigned char *data;
+    struct stat st;
+    uint64_t hash;
+    int fd;
+
+    /* Archive members and chunked files are checked by extracting them to nowhere */
+    if (job->file == NULL)
+    {
+        int result;
+
+        fd = open("/dev/null", O_WRONLY);
+        if (fd == -1)
+        {
+            return FAILURE;
+        }
+        result = extract_job_data(job, fd);
+        close(fd);
+        return result;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%s", job->snapshot->path, job->file->name) >= (int)sizeof(path))
+    {
+        return FAILURE;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        log_error("Verify: cannot read %s: %s", path, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return FAILURE;
+    }
+
+    if ((long long)st.st_size != job->file->size)
+    {
+        log_error("Verify: %s is %lld bytes, manifest says %lld", path,
+                  (long long)st.st_size, job->file->size);
+        close(fd);
+        return FAILURE;
+    }
+
+    if (st.st_size == 0)
+    {
+        close(fd);
+        hash = hash_buffer(NULL, 0);
+    }
+    else
+    {
+        data = (const unsigned char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            log_error("Verify: cannot map %s: %s", path, strerror(errno));
+            return FAILURE;
+        }
+        madvise((void *)data, (size_t)st.st_size, MADV_SEQUENTIAL);
+        hash = hash_buffer(data, (size_t)st.st_size);
+        munmap((void *)data, (size_t)st.st_size);
+    }
+
+    if (hash != job->file->hash)
+    {
+        log_error("Verify: checksum mismatch for %s", path);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Order snapshot names oldest first
+ */
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Collect the names of every snapshot directory, archive and chunk manifest in BACKUP_DIR
+ * @param names Receives a malloc'd array of malloc'd names, oldest first
+ * @param count Receives the number of names
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int list_backup_names(char ***names, int *count)
+{
+    struct dirent *entry;
+    int capacity = 32;
+    DIR *dir;
+
+    *count = 0;
+    *names = (char **)malloc(capacity * sizeof(char *));
+    dir = opendir(BACKUP_DIR);
+    if (*names == NULL || dir == NULL)
+    {
+        log_error("Failed to list backups: %s", strerror(errno));
+        free(*names);
+        if (dir != NULL)
+        {
+            closedir(dir);
+        }
+        return FAILURE;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, SNAPSHOT_PREFIX, strlen(SNAPSHOT_PREFIX)) != 0 ||
+            (entry->d_type != DT_DIR && !ends_with(entry->d_name, ARCHIVE_SUFFIX) &&
+             !ends_with(entry->d_name, CHUNK_MANIFEST_SUFFIX)))
+        {
+            continue;
+        }
+
+        if (*count >= capacity)
+        {
+            char **grown = (char **)realloc(*names, capacity * 2 * sizeof(char *));
+
+            if (grown == NULL)
+            {
+                break;
+            }
+            *names = grown;
+            capacity *= 2;
+        }
+        (*names)[*count] = strdup(entry->d_name);
+        if ((*names)[*count] != NULL)
+        {
+            (*count)++;
+        }
+    }
+
+    closedir(dir);
+    qsort(*names, *count, sizeof(char *), compare_names);
+    return SUCCESS;
+}
+
+/**
+ * Verify snapshots against their manifests (directories), indexes
+ * (archives) or chunk manifests (chunked backups). Files from every
+ * snapshot are checked in parallel.
+ * @param names Snapshot names; NULL or empty to verify every backup
+ * @param count Number of names
+ * @param out Stream receiving one summary line per snapshot
+ * @return SUCCESS if every file verified, FAILURE otherwise
+ */
+int verify_snapshots(char *const *names, int count, FILE *out)
+{
+    char **all_names = NULL;
+    SnapshotRef *snapshots;
+    SnapshotJob *jobs;
+    int total = 0;
+    int bad_snapshots = 0;
+    int job_count = 0;
+    int i, j;
+
+    if (names == NULL || count == 0)
+    {
+        if (list_backup_names(&all_names, &count) != SUCCESS)
+        {
+            return FAILURE;
+        }
+        names = all_names;
+    }
+
+    snapshots = (SnapshotRef *)calloc(count ? count : 1, sizeof(SnapshotRef));
+    if (snapshots == NULL)
+    {
+        log_error("Memory allocation failed for verify");
+        return FAILURE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (resolve_snapshot(names[i], &snapshots[i]) == SUCCESS)
+        {
+            load_snapshot_contents(&snapshots[i]);
+        }
+        total += snapshot_file_count(&snapshots[i]);
+    }
+
+    jobs = (SnapshotJob *)malloc((total ? total : 1) * sizeof(SnapshotJob));
+    if (jobs == NULL)
+    {
+        log_error("Memory allocation failed for verify");
+        total = -1;
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            for (j = 0; j < snapshot_file_count(&snapshots[i]); j++)
+            {
+                set_job_file(&jobs[job_count++], &snapshots[i], j);
+            }
+        }
+
+        run_jobs(jobs, job_count, verify_job);
+
+        for (i = 0; i < job_count; i++)
+        {
+            if (jobs[i].result != SUCCESS)
+            {
+                jobs[i].snapshot->failed++;
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        int files = snapshot_file_count(&snapshots[i]);
+
+        if (!snapshots[i].loaded || snapshots[i].failed > 0 || total < 0)
+        {
+            bad_snapshots++;
+        }
+
+        if (!snapshots[i].loaded)
+        {
+            fprintf(out, "%s: cannot be verified (no readable manifest or index)\n", names[i]);
+        }
+        else if (snapshots[i].failed > 0)
+        {
+            fprintf(out, "%s: %d of %d files FAILED\n", names[i], snapshots[i].failed, files);
+        }
+        else
+        {
+            fprintf(out, "%s: %d files OK\n", names[i], files);
+        }
+        free_snapshot_contents(&snapshots[i]);
+    }
+
+    log_operation("Verified %d backups (%d files), %d with errors", count, job_count, bad_snapshots);
+
+    free(jobs);
+    free(snapshots);
+    if (all_names != NULL)
+    {
+        for (i = 0; i < count; i++)
+        {
+            free(all_names[i]);
+        }
+        free(all_names);
+    }
+
+    return (bad_snapshots == 0) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Extract one archive member or chunked file into its restore destination
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int extract_job(SnapshotJob *job)
+{
+    mode_t mode = job_file_mode(job);
+    int result;
+    int fd;
+
+    fd = open(job->destination, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
+    if (fd == -1)
+    {
+        log_error("Failed to create %s: %s", job->destination, strerror(errno));
+        return FAILURE;
+    }
+
+    result = extract_job_data(job, fd);
+    if (result == SUCCESS && fchmod(fd, mode) != 0)
+    {
+        result = FAILURE;
+    }
+    close(fd);
+
+    return result;
+}
+
+/**
+ * Check whether a report belongs to one of the selected departments
+ * @param name Report file name
+ * @param departments Department names; NULL selects everything
+ * @param count Number of departments
+ */
+static int is_selected(const char *name, char *const *departments, int count)
+{
+    char department[MAX_USER_LENGTH];
+    int i;
+
+    if (departments == NULL || count == 0)
+    {
+        return TRUE;
+    }
+
+    if (extract_department_from_filename(name, department, sizeof(department)) == NULL)
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (strcasecmp(department, departments[i]) == 0)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Hard-link the reports being kept from the live dashboard into the staging directory
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int stage_kept_reports(const char *staging, char *const *departments, int count)
+{
+    struct dirent *entry;
+    int result = SUCCESS;
+    DIR *dir;
+
+    dir = opendir(DASHBOARD_DIR);
+    if (dir == NULL)
+    {
+        log_error("Failed to open dashboard directory: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char source[MAX_PATH_LENGTH];
+        char destination[MAX_PATH_LENGTH];
+
+        if (entry->d_name[0] == '.' || entry->d_type == DT_DIR ||
+            is_selected(entry->d_name, departments, count))
+        {
+            continue;
+        }
+
+        if (snprintf(source, sizeof(source), "%s/%s", DASHBOARD_DIR, entry->d_name) >= (int)sizeof(source) ||
+            snprintf(destination, sizeof(destination), "%s/%s", staging, entry->d_name) >= (int)sizeof(destination) ||
+            link(source, destination) != 0)
+        {
+            log_error("Failed to keep %s during restore: %s", entry->d_name, strerror(errno));
+            result = FAILURE;
+            break;
+        }
+    }
+
+    closedir(dir);
+    return result;
+}
+
+/**
+ * Fill the staging directory from a snapshot with parallel workers
+ * @return Number of files restored, or -1 on error
+ */
+static int stage_snapshot_reports(SnapshotRef *snapshot, const char *staging,
+                                  char *const *departments, int count)
+{
+    int files = snapshot_file_count(snapshot);
+    SnapshotJob *jobs;
+    CopyJob *copies = NULL;
+    CopyPoolStats stats;
+    struct stat staging_st;
+    int selected = 0;
+    int failed = 0;
+    int i;
+
+    jobs = (SnapshotJob *)malloc((files ? files : 1) * sizeof(SnapshotJob));
+    if (snapshot->kind == SNAPSHOT_KIND_DIRECTORY)
+    {
+        copies = (CopyJob *)malloc((files ? files : 1) * sizeof(CopyJob));
+    }
+    if (jobs == NULL || (snapshot->kind == SNAPSHOT_KIND_DIRECTORY && copies == NULL) ||
+        stat(staging, &staging_st) != 0)
+    {
+        log_error("Failed to prepare restore of %s", snapshot->path);
+        free(jobs);
+        free(copies);
+        return -1;
+    }
+
+    for (i = 0; i < files; i++)
+    {
+        SnapshotJob *job = &jobs[selected];
+
+        set_job_file(job, snapshot, i);
+        if (!is_selected(job_file_name(job), departments, count) ||
+            snprintf(job->destination, sizeof(job->destination), "%s/%s", staging,
+                     job_file_name(job)) >= (int)sizeof(job->destination))
+        {
+            continue;
+        }
+
+        if (copies != NULL)
+        {
+            CopyJob *copy = &copies[selected];
+            struct stat st;
+
+            if (snprintf(copy->source, sizeof(copy->source), "%s/%s", snapshot->path,
+                         job->file->name) >= (int)sizeof(copy->source))
+            {
+                continue;
+            }
+            memcpy(copy->destination, job->destination, sizeof(copy->destination));
+            copy->size = job->file->size;
+            copy->source_device = (stat(copy->source, &st) == 0) ? st.st_dev : 0;
+            copy->destination_device = staging_st.st_dev;
+        }
+        selected++;
+    }
+
+    if (copies != NULL)
+    {
+        /* Copies are checked against the manifest hash as they are written */
+        run_copy_pool(copies, selected, COPY_POOL_WORKERS, COPY_DEVICE_CONCURRENCY, &stats);
+        for (i = 0; i < selected; i++)
+        {
+            if (copies[i].result != SUCCESS || copies[i].hash != jobs[i].file->hash)
+            {
+                log_error("Restore: %s failed verification", copies[i].source);
+                failed++;
+            }
+        }
+        log_operation("Restore copied %lld bytes in %.2fs (%.1f MB/s)",
+                      stats.bytes, stats.elapsed, stats.mb_per_sec);
+    }
+    else
+    {
+        failed = run_jobs(jobs, selected, extract_job);
+    }
+
+    free(jobs);
+    free(copies);
+    return (failed == 0) ? selected : -1;
+}
+
+/**
+ * Swap the staging directory with DASHBOARD_DIR in one step
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int swap_into_dashboard(const char *staging)
+{
+    char old_path[MAX_PATH_LENGTH];
+
+    if (renameat2(AT_FDCWD, staging, AT_FDCWD, DASHBOARD_DIR, RENAME_EXCHANGE) == 0)
+    {
+        return SUCCESS;
+    }
+
+    if (errno != EINVAL && errno != ENOSYS)
+    {
+        log_error("Failed to swap restored reports into place: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    /* Filesystem without RENAME_EXCHANGE: two renames, with a short gap */
+    if (snprintf(old_path, sizeof(old_path), "%s.old", staging) >= (int)sizeof(old_path) ||
+        rename(DASHBOARD_DIR, old_path) != 0)
+    {
+        log_error("Failed to move dashboard aside: %s", strerror(errno));
+        return FAILURE;
+    }
+    if (rename(staging, DASHBOARD_DIR) != 0)
+    {
+        log_error("Failed to install restored reports: %s", strerror(errno));
+        rename(old_path, DASHBOARD_DIR);
+        return FAILURE;
+    }
+    if (rename(old_path, staging) != 0)
+    {
+        log_error("Failed to clean up previous dashboard %s: %s", old_path, strerror(errno));
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Check that the dashboard directory is still the one staged against and
+ * that no entry was added, removed or renamed in it since
+ * @param staged Status of DASHBOARD_DIR when staging started
+ * @return TRUE if unchanged, FALSE if not
+ */
+static int dashboard_unchanged(const struct stat *staged)
+{
+    struct stat now;
+
+    return stat(DASHBOARD_DIR, &now) == 0 && now.st_ino == staged->st_ino && now.st_dev == staged->st_dev &&
+           now.st_mtim.tv_sec == staged->st_mtim.tv_sec && now.st_mtim.tv_nsec == staged->st_mtim.tv_nsec;
+}
+
+/**
+ * Restore a whole snapshot, or only the reports of some departments, into
+ * DASHBOARD_DIR. A department restore replaces that department's reports
+ * with the snapshot's and keeps everything else. Files are staged next to the dashboard with parallel
+ * workers, checked against their recorded hashes, and the staging
+ * directory is then swapped with the dashboard atomically. The directory
+ * lock is held from staging to cleanup.
+ * @param snapshot Snapshot name in BACKUP_DIR
+ * @param departments Departments to restore; NULL or empty for everything
+ * @param count Number of departments
+ * @return SUCCESS on success, FAILURE on error
+ */
+int restore_snapshot(const char *snapshot, char *const *departments, int count)
+{
+    char staging[MAX_PATH_LENGTH];
+    const char *base;
+    SnapshotRef ref;
+    struct stat dashboard_st;
+    int restored;
+    int result = FAILURE;
+
+    if (resolve_snapshot(snapshot, &ref) != SUCCESS || load_snapshot_contents(&ref) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    /* Keep transfers, backups and urgent changes out from the first kept
+     * report linked until the previous dashboard is gone: anything they
+     * put in the dashboard meanwhile would be deleted with it */
+    if (create_lock_file() != SUCCESS)
+    {
+        log_error("Restore from %s needs the directory lock", snapshot);
+        free_snapshot_contents(&ref);
+        return FAILURE;
+    }
+
+    /* Stage beside the dashboard so the swap stays on one filesystem */
+    base = strrchr(DASHBOARD_DIR, '/');
+    if (stat(DASHBOARD_DIR, &dashboard_st) != 0 ||
+        snprintf(staging, sizeof(staging), "%.*s/.%s.restore.XXXXXX",
+                 (int)(base - DASHBOARD_DIR), DASHBOARD_DIR, base + 1) >= (int)sizeof(staging) ||
+        mkdtemp(staging) == NULL)
+    {
+        log_error("Failed to create restore staging directory: %s", strerror(errno));
+        free_snapshot_contents(&ref);
+        remove_lock_file();
+        return FAILURE;
+    }
+
+    log_operation("Restoring %s into %s (%s)", ref.path, DASHBOARD_DIR,
+                  (count > 0) ? "selected departments" : "whole snapshot");
+
+    restored = -1;
+    if (stage_kept_reports(staging, departments, count) == SUCCESS)
+    {
+        restored = stage_snapshot_reports(&ref, staging, departments, count);
+    }
+    free_snapshot_contents(&ref);
+
+    if (restored == 0)
+    {
+        log_error("No reports in %s match the restore request", ref.path);
+    }
+
+    if (restored > 0 &&
+        chmod(staging, dashboard_st.st_mode & 07777) == 0 &&
+        chown(staging, dashboard_st.st_uid, dashboard_st.st_gid) == 0)
+    {
+        /* An urgent change already under way when the lock was taken may
+         * still have renamed into the dashboard; never swap that away */
+        if (dashboard_unchanged(&dashboard_st))
+        {
+            result = swap_into_dashboard(staging);
+        }
+        else
+        {
+            log_error("Dashboard changed while the restore was staged");
+        }
+    }
+
+    /* After a swap the staging name holds the previous dashboard */
+    remove_tree_at(AT_FDCWD, staging);
+    remove_lock_file();
+
+    if (result == SUCCESS)
+    {
+        log_operation("Restored %d reports from %s", restored, snapshot);
+    }
+    else
+    {
+        log_error("Restore from %s failed, dashboard left unchanged", snapshot);
+    }
+
+    return result;
+}
+
+/**
+ * Restore a single report from a backup into the dashboard directory.
+ * The snapshot may be a snapshot directory, an archive or a chunk
+ * manifest, named with or without its suffix; archives are read through
+ * their index and chunked files are rebuilt from the chunk store.
+ * @param snapshot Snapshot name in BACKUP_DIR (e.g. backup_2024-01-31_23-00-00)
+ * @param file Report file name
+ * @return SUCCESS on success, FAILURE on error
+ */
+int restore_snapshot_file(const char *snapshot, const char *file)
+{
+    char source_path[MAX_PATH_LENGTH];
+    char temp_path[MAX_PATH_LENGTH];
+    char dest_path[MAX_PATH_LENGTH];
+    mode_t mode = DASHBOARD_PERMISSIONS & 0666;
+    SnapshotRef ref;
+    int result = FAILURE;
+    int fd;
+
+    if (!is_plain_name(file))
+    {
+        log_error("Invalid restore request: %s %s", snapshot, file);
+        return FAILURE;
+    }
+
+    if (resolve_snapshot(snapshot, &ref) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    if (snprintf(dest_path, sizeof(dest_path), "%s/%s", DASHBOARD_DIR, file) >= (int)sizeof(dest_path) ||
+        snprintf(temp_path, sizeof(temp_path), "%s/.%s.XXXXXX", DASHBOARD_DIR, file) >= (int)sizeof(temp_path))
+    {
+        log_error("Restore path too long: %s", file);
+        return FAILURE;
+    }
+
+    /* Restore next to the destination so the final rename is atomic */
+    fd = mkstemp(temp_path);
+    if (fd == -1)
+    {
+        log_error("Failed to create restore file in %s: %s", DASHBOARD_DIR, strerror(errno));
+        return FAILURE;
+    }
+
+    if (ref.kind == SNAPSHOT_KIND_DIRECTORY)
+    {
+        struct stat source_st;
+
+        if (snprintf(source_path, sizeof(source_path), "%s/%s", ref.path, file) < (int)sizeof(source_path) &&
+            stat(source_path, &source_st) == 0)
+        {
+            mode = source_st.st_mode & 07777;
+            result = copy_file(source_path, temp_path);
+        }
+        else
+        {
+            log_error("%s is not in snapshot %s", file, ref.path);
+        }
+    }
+    else if (ref.kind == SNAPSHOT_KIND_ARCHIVE && load_snapshot_contents(&ref) == SUCCESS)
+    {
+        const ArchiveEntry *entry = find_archive_entry(&ref.index, file);
+
+        if (entry != NULL)
+        {
+            mode = (mode_t)entry->mode;
+            result = archive_extract_entry(ref.path, entry, fd);
+        }
+        else
+        {
+            log_error("%s is not in archive %s", file, ref.path);
+        }
+        free_snapshot_contents(&ref);
+    }
+    else if (ref.kind == SNAPSHOT_KIND_CHUNKED && load_snapshot_contents(&ref) == SUCCESS)
+    {
+        SnapshotJob job;
+
+        memset(&job, 0, sizeof(job));
+        job.snapshot = &ref;
+        job.chunked = find_chunk_file(&ref.chunks, file);
+        if (job.chunked != NULL)
+        {
+            mode = job_file_mode(&job);
+            result = extract_job_data(&job, fd);
+        }
+        else
+        {
+            log_error("%s is not in chunked backup %s", file, ref.path);
+        }
+        free_snapshot_contents(&ref);
+    }
+
+    if (result == SUCCESS && (fchmod(fd, mode) != 0 || fsync(fd) != 0))
+    {
+        log_error("Failed to finish restore file %s: %s", temp_path, strerror(errno));
+        result = FAILURE;
+    }
+    close(fd);
+
+    if (result == SUCCESS && rename(temp_path, dest_path) != 0)
+    {
+        log_error("Failed to install restored file %s: %s", dest_path, strerror(errno));
+        result = FAILURE;
+    }
+
+    if (result != SUCCESS)
+    {
+        unlink(temp_path);
+        return FAILURE;
+    }
+
+    log_operation("Restored %s from %s", file, ref.path);
+    return SUCCESS;
+}
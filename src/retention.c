@@ -0,0 +1,658 @@
+/**
+ * @file retention.c
+ * @brief Backup retention policies and fast background tree deletion
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "retention.h"
+#include "backup.h"
+#include "utils.h"
+#include "chunk_store.h"
+#include "archive.h"
+#include "file_operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+/* Policy used by apply_retention_policy() */
+static int retention_policy = RETENTION_POLICY_AGE_COUNT;
+
+/**
+ * Structure describing one snapshot found in BACKUP_DIR
+ */
+typedef struct {
+    char name[MAX_PATH_LENGTH / 4]; /* Entry name in BACKUP_DIR */
+    time_t created;                 /* Parsed from the name, mtime as fallback */
+    int is_directory;               /* Snapshot directory, or a manifest/archive file */
+    int keep;                       /* Retained by the policy */
+} SnapshotInfo;
+
+/**
+ * Shared state of the parallel trash purge
+ */
+typedef struct {
+    int trash_fd;             /* Trash directory */
+    char (*names)[256];       /* Top-level entries to delete */
+    int count;                /* Number of entries */
+    int next;                 /* Next entry to hand out */
+    int failed;               /* Entries that could not be removed */
+    pthread_mutex_t lock;     /* Protects next and failed */
+} PurgeWork;
+
+/**
+ * Order snapshots newest first
+ */
+static int compare_snapshot_age(const void *a, const void *b)
+{
+    time_t x = ((const SnapshotInfo *)a)->created;
+    time_t y = ((const SnapshotInfo *)b)->created;
+
+    return (x < y) - (x > y);
+}
+
+/**
+ * Select the retention policy
+ * @param policy One of the RETENTION_POLICY_* values
+ */
+void set_retention_policy(int policy)
+{
+    retention_policy = policy;
+}
+
+/**
+ * Get the retention policy
+ * @return Current RETENTION_POLICY_* value
+ */
+int get_retention_policy(void)
+{
+    return retention_policy;
+}
+
+/**
+ * Parse a retention policy name ("age", "gfs")
+ * @param name Policy name
+ * @return RETENTION_POLICY_* value, or -1 if the name is not recognised
+ */
+int parse_retention_policy(const char *name)
+{
+    if (name == NULL)
+    {
+        return -1;
+    }
+    if (strcmp(name, "age") == 0)
+    {
+        return RETENTION_POLICY_AGE_COUNT;
+    }
+    if (strcmp(name, "gfs") == 0)
+    {
+        return RETENTION_POLICY_GFS;
+    }
+    return -1;
+}
+
+/**
+ * Parse the timestamp embedded in a snapshot name
+ * @param name Snapshot name (backup_YYYY-MM-DD_HH-MM-SS[...])
+ * @param created Receives the timestamp
+ * @return SUCCESS if the name carried a timestamp, FAILURE otherwise
+ */
+static int parse_snapshot_time(const char *name, time_t *created)
+{
+    struct tm tm_info;
+
+    memset(&tm_info, 0, sizeof(tm_info));
+    if (sscanf(name + strlen(SNAPSHOT_PREFIX), "%4d-%2d-%2d_%2d-%2d-%2d",
+               &tm_info.tm_year, &tm_info.tm_mon, &tm_info.tm_mday,
+               &tm_info.tm_hour, &tm_info.tm_min, &tm_info.tm_sec) != 6)
+    {
+        return FAILURE;
+    }
+
+    tm_info.tm_year -= 1900;
+    tm_info.tm_mon -= 1;
+    tm_info.tm_isdst = -1;
+    *created = mktime(&tm_info);
+    return (*created == (time_t)-1) ? FAILURE : SUCCESS;
+}
+
+/**
+ * Check whether a name ends with a suffix
+ */
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t name_len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+
+    return name_len > suffix_len && strcmp(name + name_len - suffix_len, suffix) == 0;
+}
+
+/**
+ * List every snapshot (directory, chunk manifest or archive) in BACKUP_DIR
+ * @param snapshots Receives a malloc'd array, newest first
+ * @param count Receives the number of snapshots
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int list_snapshots(SnapshotInfo **snapshots, int *count)
+{
+    DIR *dir;
+    struct dirent *entry;
+    int capacity = 32;
+
+    *count = 0;
+    *snapshots = (SnapshotInfo *)malloc(capacity * sizeof(SnapshotInfo));
+    if (*snapshots == NULL)
+    {
+        log_error("Memory allocation failed for snapshot list");
+        return FAILURE;
+    }
+
+    dir = opendir(BACKUP_DIR);
+    if (dir == NULL)
+    {
+        log_error("Failed to open backup directory: %s", strerror(errno));
+        free(*snapshots);
+        *snapshots = NULL;
+        return FAILURE;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t name_len = strlen(entry->d_name);
+        char path[MAX_PATH_LENGTH];
+        SnapshotInfo *info;
+        struct stat st;
+
+        if (strncmp(entry->d_name, SNAPSHOT_PREFIX, strlen(SNAPSHOT_PREFIX)) != 0 ||
+            name_len >= sizeof(info->name))
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", BACKUP_DIR, entry->d_name);
+        if (lstat(path, &st) != 0)
+        {
+            continue;
+        }
+
+        /* Only snapshot directories, chunk manifests and archives take part */
+        if (!S_ISDIR(st.st_mode) &&
+            !(S_ISREG(st.st_mode) && (has_suffix(entry->d_name, CHUNK_MANIFEST_SUFFIX) ||
+                                      has_suffix(entry->d_name, ARCHIVE_SUFFIX))))
+        {
+            continue;
+        }
+
+        if (*count >= capacity)
+        {
+            SnapshotInfo *grown;
+
+            capacity *= 2;
+            grown = (SnapshotInfo *)realloc(*snapshots, capacity * sizeof(SnapshotInfo));
+            if (grown == NULL)
+            {
+                log_error("Memory allocation failed for snapshot list");
+                break;
+            }
+            *snapshots = grown;
+        }
+
+        info = &(*snapshots)[*count];
+        memcpy(info->name, entry->d_name, name_len + 1);
+        info->is_directory = S_ISDIR(st.st_mode);
+        info->keep = FALSE;
+        if (parse_snapshot_time(entry->d_name, &info->created) != SUCCESS)
+        {
+            info->created = st.st_mtime;
+        }
+        (*count)++;
+    }
+
+    closedir(dir);
+    qsort(*snapshots, *count, sizeof(SnapshotInfo), compare_snapshot_age);
+    return SUCCESS;
+}
+
+/**
+ * Mark snapshots to keep under the age/count policy
+ */
+static void select_age_count(SnapshotInfo *snapshots, int count, time_t now)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        snapshots[i].keep = (i < MAX_BACKUPS && now - snapshots[i].created <= MAX_BACKUP_AGE);
+    }
+}
+
+/**
+ * Keep the newest snapshot of each of the most recent 'limit' periods
+ * @param snapshots Snapshots, newest first
+ * @param count Number of snapshots
+ * @param format strftime format naming the period (day, ISO week, month)
+ * @param limit Number of periods to keep
+ */
+static void select_gfs_period(SnapshotInfo *snapshots, int count, const char *format, int limit)
+{
+    char last_period[32] = "";
+    int kept = 0;
+    int i;
+
+    for (i = 0; i < count && kept < limit; i++)
+    {
+        char period[32];
+        struct tm tm_info;
+
+        localtime_r(&snapshots[i].created, &tm_info);
+        strftime(period, sizeof(period), format, &tm_info);
+
+        /* Newest first, so the first snapshot seen in a period is its newest */
+        if (strcmp(period, last_period) != 0)
+        {
+            snapshots[i].keep = TRUE;
+            snprintf(last_period, sizeof(last_period), "%s", period);
+            kept++;
+        }
+    }
+}
+
+/**
+ * Move an expired snapshot directory into the trash. Its trash name
+ * carries the time and an attempt number, so a same-named entry left
+ * behind by an interrupted or failed purge never blocks the move.
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int move_to_trash(const char *name)
+{
+    char source[MAX_PATH_LENGTH];
+    char target[MAX_PATH_LENGTH];
+    long long now = (long long)time(NULL);
+    int attempt;
+
+    if (snprintf(source, sizeof(source), "%s/%s", BACKUP_DIR, name) >= (int)sizeof(source))
+    {
+        log_error("Backup path too long for %s", name);
+        return FAILURE;
+    }
+
+    for (attempt = 0; attempt < TRASH_NAME_ATTEMPTS; attempt++)
+    {
+        if (snprintf(target, sizeof(target), "%s/%s/%s.%lld.%d", BACKUP_DIR, BACKUP_TRASH_NAME,
+                     name, now, attempt) >= (int)sizeof(target))
+        {
+            log_error("Backup path too long for %s", name);
+            return FAILURE;
+        }
+
+        /* A directory only replaces an empty one; a leftover is never empty */
+        if (rename(source, target) == 0)
+        {
+            return SUCCESS;
+        }
+        if (errno != EEXIST && errno != ENOTEMPTY)
+        {
+            break;
+        }
+    }
+
+    log_error("Failed to move old backup %s to trash: %s", name, strerror(errno));
+    return FAILURE;
+}
+
+/**
+ * Apply the retention policy to BACKUP_DIR: expired snapshot directories
+ * are moved to the trash and purged in the background, expired chunk
+ * manifests are removed and their chunks collected
+ * @return SUCCESS on success, FAILURE on error
+ */
+int apply_retention_policy(void)
+{
+    SnapshotInfo *snapshots;
+    char trash_path[MAX_PATH_LENGTH];
+    int count;
+    int trashed = 0;
+    int manifests_deleted = 0;
+    int deleted_count = 0;
+    int i;
+
+    if (list_snapshots(&snapshots, &count) != SUCCESS)
+    {
+        return FAILURE;
+    }
+
+    if (retention_policy == RETENTION_POLICY_GFS)
+    {
+        select_gfs_period(snapshots, count, "%Y-%m-%d", GFS_KEEP_DAILY);
+        select_gfs_period(snapshots, count, "%G-W%V", GFS_KEEP_WEEKLY);
+        select_gfs_period(snapshots, count, "%Y-%m", GFS_KEEP_MONTHLY);
+    }
+    else
+    {
+        select_age_count(snapshots, count, time(NULL));
+    }
+
+    /* Never delete the newest snapshot, whatever the policy says */
+    if (count > 0)
+    {
+        snapshots[0].keep = TRUE;
+    }
+
+    snprintf(trash_path, sizeof(trash_path), "%s/%s", BACKUP_DIR, BACKUP_TRASH_NAME);
+
+    for (i = 0; i < count; i++)
+    {
+        if (snapshots[i].keep)
+        {
+            continue;
+        }
+
+        log_operation("Deleting old backup: %s", snapshots[i].name);
+
+        if (snapshots[i].is_directory)
+        {
+            if (trashed == 0 && create_directory_if_not_exists(trash_path) != SUCCESS)
+            {
+                break;
+            }
+            if (move_to_trash(snapshots[i].name) == SUCCESS)
+            {
+                trashed++;
+                deleted_count++;
+            }
+        }
+        else
+        {
+            char path[MAX_PATH_LENGTH];
+
+            snprintf(path, sizeof(path), "%s/%s", BACKUP_DIR, snapshots[i].name);
+            if (unlink(path) != 0)
+            {
+                log_error("Failed to delete old backup %s: %s", path, strerror(errno));
+            }
+            else
+            {
+                if (has_suffix(snapshots[i].name, CHUNK_MANIFEST_SUFFIX))
+                {
+                    manifests_deleted++;
+                }
+                deleted_count++;
+            }
+        }
+    }
+
+    log_operation("Backup cleanup completed: %d backups found, %d deleted (%s policy)",
+                  count, deleted_count, retention_policy == RETENTION_POLICY_GFS ? "gfs" : "age/count");
+
+    free(snapshots);
+
+    /* Release chunks only the deleted manifests referenced */
+    if (manifests_deleted > 0)
+    {
+        chunk_store_gc();
+    }
+
+    /* The expensive part, unlinking every file, happens off the critical path */
+    if (trashed > 0)
+    {
+        purge_backup_trash_async();
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Recursively delete a directory tree with dirfd-relative unlinkat()
+ * @param parent_fd Directory file descriptor containing the tree
+ * @param name Name of the tree within parent_fd
+ * @return SUCCESS on success, FAILURE on error
+ */
+int remove_tree_at(int parent_fd, const char *name)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int result = SUCCESS;
+    int fd;
+
+    fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+    {
+        /* Plain files and symlinks are simply unlinked */
+        if ((errno == ENOTDIR || errno == ELOOP) && unlinkat(parent_fd, name, 0) == 0)
+        {
+            return SUCCESS;
+        }
+        if (errno == ENOENT)
+        {
+            return SUCCESS;
+        }
+        log_error("Failed to open %s for deletion: %s", name, strerror(errno));
+        return FAILURE;
+    }
+
+    dir = fdopendir(fd);
+    if (dir == NULL)
+    {
+        log_error("Failed to read %s for deletion: %s", name, strerror(errno));
+        close(fd);
+        return FAILURE;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        int is_dir = (entry->d_type == DT_DIR);
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        /* Some filesystems do not fill in d_type */
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+
+            is_dir = (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+        }
+
+        if (is_dir)
+        {
+            if (remove_tree_at(fd, entry->d_name) != SUCCESS)
+            {
+                result = FAILURE;
+            }
+        }
+        else if (unlinkat(fd, entry->d_name, 0) != 0 && errno != ENOENT)
+        {
+            log_error("Failed to delete %s/%s: %s", name, entry->d_name, strerror(errno));
+            result = FAILURE;
+        }
+    }
+
+    closedir(dir);
+
+    if (unlinkat(parent_fd, name, AT_REMOVEDIR) != 0 && errno != ENOENT)
+    {
+        log_error("Failed to remove directory %s: %s", name, strerror(errno));
+        result = FAILURE;
+    }
+
+    return result;
+}
+
+/**
+ * Purge worker: delete trash entries until none are left
+ */
+static void *purge_worker(void *arg)
+{
+    PurgeWork *work = (PurgeWork *)arg;
+
+    for (;;)
+    {
+        int index;
+
+        pthread_mutex_lock(&work->lock);
+        index = (work->next < work->count) ? work->next++ : -1;
+        pthread_mutex_unlock(&work->lock);
+
+        if (index < 0)
+        {
+            break;
+        }
+
+        if (remove_tree_at(work->trash_fd, work->names[index]) != SUCCESS)
+        {
+            pthread_mutex_lock(&work->lock);
+            work->failed++;
+            pthread_mutex_unlock(&work->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Delete every entry of the trash directory with a pool of threads
+ * @param trash_fd Open trash directory (also holds the purge lock)
+ * @return Number of entries found in the trash
+ */
+static int purge_trash(int trash_fd)
+{
+    PurgeWork work;
+    pthread_t threads[PURGE_WORKERS];
+    struct dirent *entry;
+    int started = 0;
+    int capacity = 16;
+    DIR *dir;
+    int i;
+
+    memset(&work, 0, sizeof(work));
+    work.trash_fd = trash_fd;
+    work.names = malloc(capacity * sizeof(*work.names));
+    if (work.names == NULL)
+    {
+        return 0;
+    }
+
+    /* fdopendir takes ownership, so read through a duplicate */
+    dir = fdopendir(dup(trash_fd));
+    if (dir == NULL)
+    {
+        free(work.names);
+        return 0;
+    }
+    rewinddir(dir);
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strlen(entry->d_name) >= sizeof(work.names[0]))
+        {
+            continue;
+        }
+
+        if (work.count >= capacity)
+        {
+            void *grown = realloc(work.names, capacity * 2 * sizeof(*work.names));
+
+            if (grown == NULL)
+            {
+                break;
+            }
+            work.names = grown;
+            capacity *= 2;
+        }
+
+        strcpy(work.names[work.count++], entry->d_name);
+    }
+    closedir(dir);
+
+    pthread_mutex_init(&work.lock, NULL);
+
+    for (i = 0; i < PURGE_WORKERS - 1 && i < work.count - 1; i++)
+    {
+        if (pthread_create(&threads[started], NULL, purge_worker, &work) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+
+    purge_worker(&work);
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&work.lock);
+    free(work.names);
+
+    if (work.count > 0)
+    {
+        log_operation("Backup trash purge pass: %d snapshots deleted, %d failed",
+                      work.count - work.failed, work.failed);
+    }
+
+    /* Entries that failed stay behind; do not spin on them */
+    return work.count - work.failed;
+}
+
+/**
+ * Delete everything in the backup trash from a background process running
+ * at idle I/O priority
+ * @return PID of the purge process, -1 on error
+ */
+pid_t purge_backup_trash_async(void)
+{
+    char trash_path[MAX_PATH_LENGTH];
+    pid_t pid;
+    int trash_fd;
+
+    snprintf(trash_path, sizeof(trash_path), "%s/%s", BACKUP_DIR, BACKUP_TRASH_NAME);
+
+    pid = fork();
+    if (pid < 0)
+    {
+        log_error("Failed to fork backup purge process: %s", strerror(errno));
+        return -1;
+    }
+    if (pid > 0)
+    {
+        log_operation("Started backup purge process with PID %d", pid);
+        return pid;
+    }
+
+    /* Child: stay out of the way of dashboard readers and uploads */
+    set_idle_io_priority();
+    setpriority(PRIO_PROCESS, 0, 10);
+
+    trash_fd = open(trash_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (trash_fd == -1)
+    {
+        _exit(EXIT_SUCCESS);
+    }
+
+    /* One purger at a time; a running one picks up new entries on its next pass */
+    if (flock(trash_fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        close(trash_fd);
+        _exit(EXIT_SUCCESS);
+    }
+
+    while (purge_trash(trash_fd) > 0)
+    {
+        /* Keep going until a pass finds nothing new */
+    }
+    close(trash_fd);
+    _exit(EXIT_SUCCESS);
+}
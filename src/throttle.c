@@ -0,0 +1,310 @@
+/**
+ * @file throttle.c
+ * @brief Token bucket limiting copy bandwidth and operations per second
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "throttle.h"
+#include "utils.h"
+#include "backup.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/**
+ * Bucket state, in an anonymous shared mapping inherited across fork()
+ */
+typedef struct {
+    pthread_mutex_t lock;     /* Process-shared; protects everything below */
+    long long bytes_per_sec;  /* Bandwidth limit, 0 for unlimited */
+    long long ops_per_sec;    /* Operation limit, 0 for unlimited */
+    int idle_io;              /* Backup workers use the idle I/O class */
+    double byte_tokens;       /* Available bytes; negative while in debt */
+    double op_tokens;         /* Available operations; negative while in debt */
+    double last_refill;       /* Monotonic time of the last refill */
+} ThrottleState;
+
+static ThrottleState *throttle = NULL;
+
+/**
+ * Get a monotonic clock reading in seconds
+ */
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Take the bucket lock. The mutex is robust: if a worker died holding it,
+ * the tokens it may have left half updated are reset and the lock is
+ * made usable again instead of blocking every process forever.
+ */
+static void lock_throttle(ThrottleState *state)
+{
+    if (pthread_mutex_lock(&state->lock) == EOWNERDEAD)
+    {
+        state->byte_tokens = 0.0;
+        state->op_tokens = 0.0;
+        state->last_refill = now_seconds();
+        pthread_mutex_consistent(&state->lock);
+        log_warning("I/O throttle lock recovered from a process that died holding it");
+    }
+}
+
+/**
+ * Add the tokens earned since the last refill, capped at one second's worth
+ * (the burst size); called with the lock held
+ */
+static void refill(ThrottleState *state, double now)
+{
+    double elapsed = now - state->last_refill;
+
+    state->last_refill = now;
+    if (elapsed <= 0.0)
+    {
+        return;
+    }
+
+    if (state->bytes_per_sec > 0)
+    {
+        state->byte_tokens += elapsed * (double)state->bytes_per_sec;
+        if (state->byte_tokens > (double)state->bytes_per_sec)
+        {
+            state->byte_tokens = (double)state->bytes_per_sec;
+        }
+    }
+    if (state->ops_per_sec > 0)
+    {
+        state->op_tokens += elapsed * (double)state->ops_per_sec;
+        if (state->op_tokens > (double)state->ops_per_sec)
+        {
+            state->op_tokens = (double)state->ops_per_sec;
+        }
+    }
+}
+
+/**
+ * Create the shared token bucket. Must run before worker processes are
+ * forked so that they share one bucket with the daemon, which is what
+ * lets limits changed over IPC reach a backup that is already running.
+ * Without it, copies are never throttled.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int throttle_init(void)
+{
+    pthread_mutexattr_t attr;
+    ThrottleState *state;
+
+    if (throttle != NULL)
+    {
+        return SUCCESS;
+    }
+
+    state = (ThrottleState *)mmap(NULL, sizeof(ThrottleState), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED)
+    {
+        log_error("Failed to create I/O throttle: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    memset(state, 0, sizeof(*state));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&state->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    state->last_refill = now_seconds();
+
+    throttle = state;
+    return SUCCESS;
+}
+
+/**
+ * Change the I/O limits, taking effect immediately for every process
+ * @param bytes_per_sec Bandwidth limit, 0 for unlimited
+ * @param ops_per_sec Copy operation limit, 0 for unlimited
+ */
+void set_io_limits(long long bytes_per_sec, long long ops_per_sec)
+{
+    if (throttle == NULL)
+    {
+        return;
+    }
+
+    lock_throttle(throttle);
+    refill(throttle, now_seconds());
+    throttle->bytes_per_sec = (bytes_per_sec > 0) ? bytes_per_sec : 0;
+    throttle->ops_per_sec = (ops_per_sec > 0) ? ops_per_sec : 0;
+
+    /* Debt run up under the old limits is forgiven, so a speed-up is immediate */
+    throttle->byte_tokens = 0.0;
+    throttle->op_tokens = 0.0;
+    pthread_mutex_unlock(&throttle->lock);
+}
+
+/**
+ * Get the current I/O limits
+ * @param bytes_per_sec Receives the bandwidth limit (may be NULL)
+ * @param ops_per_sec Receives the operation limit (may be NULL)
+ */
+void get_io_limits(long long *bytes_per_sec, long long *ops_per_sec)
+{
+    long long bytes = 0;
+    long long ops = 0;
+
+    if (throttle != NULL)
+    {
+        lock_throttle(throttle);
+        bytes = throttle->bytes_per_sec;
+        ops = throttle->ops_per_sec;
+        pthread_mutex_unlock(&throttle->lock);
+    }
+
+    if (bytes_per_sec != NULL)
+    {
+        *bytes_per_sec = bytes;
+    }
+    if (ops_per_sec != NULL)
+    {
+        *ops_per_sec = ops;
+    }
+}
+
+/**
+ * Choose whether backup workers run in the idle I/O scheduling class
+ * @param enabled TRUE or FALSE
+ */
+void set_io_idle(int enabled)
+{
+    if (throttle != NULL)
+    {
+        throttle->idle_io = enabled ? TRUE : FALSE;
+    }
+}
+
+/**
+ * Check whether backup workers should run in the idle I/O scheduling class
+ * @return TRUE or FALSE
+ */
+int get_io_idle(void)
+{
+    return (throttle != NULL) ? throttle->idle_io : FALSE;
+}
+
+/**
+ * Parse a rate such as "20M" or "500"
+ * @param text Rate text
+ * @return Rate, or -1 if the text is not a valid rate
+ */
+long long parse_io_rate(const char *text)
+{
+    char *end;
+    long long value;
+
+    if (text == NULL || *text == '\0')
+    {
+        return -1;
+    }
+
+    errno = 0;
+    value = strtoll(text, &end, 10);
+    if (errno != 0 || end == text || value < 0)
+    {
+        return -1;
+    }
+
+    switch (*end)
+    {
+    case 'K':
+    case 'k':
+        value *= 1024LL;
+        end++;
+        break;
+    case 'M':
+    case 'm':
+        value *= 1024LL * 1024LL;
+        end++;
+        break;
+    case 'G':
+    case 'g':
+        value *= 1024LL * 1024LL * 1024LL;
+        end++;
+        break;
+    default:
+        break;
+    }
+
+    return (*end == '\0') ? value : -1;
+}
+
+/**
+ * Account for one read/write of a copy, sleeping until the bucket allows it
+ * @param bytes Bytes about to be transferred
+ */
+void throttle_io(size_t bytes)
+{
+    if (throttle == NULL)
+    {
+        return;
+    }
+
+    /* Take the tokens up front; the bucket may go into debt */
+    lock_throttle(throttle);
+    if (throttle->bytes_per_sec == 0 && throttle->ops_per_sec == 0)
+    {
+        pthread_mutex_unlock(&throttle->lock);
+        return;
+    }
+    refill(throttle, now_seconds());
+    if (throttle->bytes_per_sec > 0)
+    {
+        throttle->byte_tokens -= (double)bytes;
+    }
+    if (throttle->ops_per_sec > 0)
+    {
+        throttle->op_tokens -= 1.0;
+    }
+    pthread_mutex_unlock(&throttle->lock);
+
+    /* Then wait until the debt is repaid, re-reading the limits as we go */
+    for (;;)
+    {
+        double wait = 0.0;
+        struct timespec ts;
+
+        lock_throttle(throttle);
+        refill(throttle, now_seconds());
+        if (throttle->bytes_per_sec > 0 && throttle->byte_tokens < 0.0)
+        {
+            wait = -throttle->byte_tokens / (double)throttle->bytes_per_sec;
+        }
+        if (throttle->ops_per_sec > 0 && throttle->op_tokens < 0.0 &&
+            -throttle->op_tokens / (double)throttle->ops_per_sec > wait)
+        {
+            wait = -throttle->op_tokens / (double)throttle->ops_per_sec;
+        }
+        pthread_mutex_unlock(&throttle->lock);
+
+        if (wait <= 0.0)
+        {
+            return;
+        }
+
+        if (wait > THROTTLE_MAX_SLEEP)
+        {
+            wait = THROTTLE_MAX_SLEEP;
+        }
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* For PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP */
+
 #include "utils.h"
 #include "backup.h"
 #include <unistd.h>
@@ -5,58 +7,269 @@
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
+#include <stdint.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/* ioprio_set(2) has no glibc wrapper */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+
+/* Current runtime log level */
+static int current_log_level = DEFAULT_LOG_LEVEL;
+
+/* Serialises logging from worker threads; recursive because log rotation logs its own errors */
+static pthread_mutex_t log_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 /**
- * Log an error message
- * @param format Format string for the message
- * @param ... Variable arguments
+ * Token bucket for a single log call site, keyed by the address of its
+ * format string (string literals are unique per call site)
  */
-void log_error(const char *format, ...)
+typedef struct {
+    const char *format;        /* Call site key, NULL if slot unused */
+    double tokens;             /* Messages this site may still emit */
+    double last_refill;        /* Monotonic time of last refill */
+    unsigned long suppressed;  /* Messages dropped since the last one emitted */
+} LogRateBucket;
+
+static LogRateBucket rate_buckets[LOG_RATE_SLOTS];
+
+/* Deduplication state for consecutive identical messages */
+static char last_message[MAX_LOG_MESSAGE];
+static int last_message_level = -1;
+static unsigned long repeat_count = 0;
+static time_t repeat_since = 0;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+static const int level_priorities[] = {LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG};
+
+/**
+ * Get a monotonic clock reading in seconds
+ * @return Seconds since an arbitrary fixed point
+ */
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Take a token from the bucket belonging to a call site
+ * @param format Format string identifying the call site
+ * @param level LOG_LEVEL_* value, selects the burst and refill rate
+ * @param dropped Set to the number of messages suppressed since the site last logged
+ * @return TRUE if the message may be logged, FALSE if it is rate limited
+ */
+static int rate_limit_allow(const char *format, int level, unsigned long *dropped)
+{
+    size_t slot = (size_t)(((uintptr_t)format >> 3) * 2654435761u) & (LOG_RATE_SLOTS - 1);
+    LogRateBucket *bucket = NULL;
+    double now = monotonic_seconds();
+    double burst = LOG_RATE_BURST;
+    double refill = LOG_RATE_REFILL;
+    int probe;
+
+    /* Errors and warnings repeat on the 5 second checks, so they refill
+     * over a window long enough to hold those back as well */
+    if (level <= LOG_LEVEL_WARN)
+    {
+        burst = LOG_ERROR_RATE_BURST;
+        refill = (double)LOG_ERROR_RATE_BURST / LOG_ERROR_RATE_WINDOW;
+    }
+
+    *dropped = 0;
+
+    /* Linear probing over a handful of slots */
+    for (probe = 0; probe < 8; probe++)
+    {
+        LogRateBucket *candidate = &rate_buckets[(slot + probe) & (LOG_RATE_SLOTS - 1)];
+
+        if (candidate->format == format)
+        {
+            bucket = candidate;
+            break;
+        }
+        if (candidate->format == NULL)
+        {
+            candidate->format = format;
+            candidate->tokens = burst;
+            candidate->last_refill = now;
+            candidate->suppressed = 0;
+            bucket = candidate;
+            break;
+        }
+    }
+
+    /* Table is crowded around this slot, let the message through */
+    if (bucket == NULL)
+    {
+        return TRUE;
+    }
+
+    /* Refill according to elapsed time */
+    bucket->tokens += (now - bucket->last_refill) * refill;
+    if (bucket->tokens > burst)
+    {
+        bucket->tokens = burst;
+    }
+    bucket->last_refill = now;
+
+    if (bucket->tokens < 1.0)
+    {
+        bucket->suppressed++;
+        return FALSE;
+    }
+
+    bucket->tokens -= 1.0;
+    *dropped = bucket->suppressed;
+    bucket->suppressed = 0;
+    return TRUE;
+}
+
+/**
+ * Write a fully formatted line to the log file and syslog
+ * @param level LOG_LEVEL_* value
+ * @param text Message text without trailing newline
+ */
+static void write_log_line(int level, const char *text)
 {
     FILE *log_fp;
-    va_list args;
-    time_t now;
     char time_str[MAX_TIME_LENGTH];
+    const char *log_path = (level == LOG_LEVEL_ERROR) ? ERROR_LOG : OPERATION_LOG;
 
-    /* Get current time */
-    now = time(NULL);
-    get_timestamp_string(now, time_str, MAX_TIME_LENGTH);
+    get_timestamp_string(time(NULL), time_str, MAX_TIME_LENGTH);
 
     /* Check if log needs rotation */
-    check_and_rotate_log(ERROR_LOG);     /* For log_error */
-    check_and_rotate_log(OPERATION_LOG); /* For log_operation */
+    if (level == LOG_LEVEL_ERROR)
+    {
+        check_and_rotate_log(ERROR_LOG);     /* For log_error */
+        check_and_rotate_log(OPERATION_LOG); /* For log_operation */
+    }
 
-    /* Open the error log file for appending */
-    log_fp = fopen(ERROR_LOG, "a");
-    if (log_fp == NULL)
+    /* Open the log file for appending, syslog still gets the message on failure */
+    log_fp = fopen(log_path, "a");
+    if (log_fp != NULL)
+    {
+        fprintf(log_fp, "[%s] %s: %s\n", time_str, level_names[level], text);
+        fclose(log_fp);
+    }
+
+    /* Also log to syslog */
+    syslog(level_priorities[level], "%s", text);
+}
+
+/**
+ * Write the "last message repeated" summary for held back duplicates
+ */
+static void flush_repeat_summary(void)
+{
+    char summary[MAX_LOG_MESSAGE];
+
+    if (repeat_count == 0)
     {
-        /* Fall back to syslog if file can't be opened */
-        va_start(args, format);
-        vsyslog(LOG_ERR, format, args);
-        va_end(args);
         return;
     }
 
-    /* Write timestamp and error prefix */
-    fprintf(log_fp, "[%s] ERROR: ", time_str);
+    snprintf(summary, sizeof(summary), "last message repeated %lu times", repeat_count);
+    repeat_count = 0;
+    write_log_line(last_message_level, summary);
+}
 
-    /* Write the formatted message */
-    va_start(args, format);
-    vfprintf(log_fp, format, args);
-    va_end(args);
+/**
+ * Common log path: level filter, rate limiting, formatting and deduplication
+ * @param level LOG_LEVEL_* value
+ * @param format Format string for the message
+ * @param args Variable arguments
+ */
+static void log_message(int level, const char *format, va_list args)
+{
+    char text[MAX_LOG_MESSAGE];
+    unsigned long dropped;
+    size_t len;
 
-    /* Add newline if not present */
-    if (format[strlen(format) - 1] != '\n')
+    /* Drop filtered levels before paying for formatting */
+    if (level > current_log_level)
     {
-        fprintf(log_fp, "\n");
+        return;
     }
 
-    /* Close the log file */
-    fclose(log_fp);
+    pthread_mutex_lock(&log_lock);
+
+    if (!rate_limit_allow(format, level, &dropped))
+    {
+        pthread_mutex_unlock(&log_lock);
+        return;
+    }
+
+    vsnprintf(text, sizeof(text), format, args);
+
+    /* Strip the newline some callers include */
+    len = strlen(text);
+    if (len > 0 && text[len - 1] == '\n')
+    {
+        text[len - 1] = '\0';
+    }
+
+    /* Hold back identical consecutive messages */
+    if (level == last_message_level && strcmp(text, last_message) == 0)
+    {
+        if (repeat_count++ == 0)
+        {
+            repeat_since = time(NULL);
+        }
+        log_flush_repeats();
+        pthread_mutex_unlock(&log_lock);
+        return;
+    }
+
+    flush_repeat_summary();
+
+    if (dropped > 0)
+    {
+        char note[MAX_LOG_MESSAGE];
+
+        snprintf(note, sizeof(note), "%lu messages suppressed by rate limit at call site \"%s\"",
+                 dropped, format);
+        write_log_line(level, note);
+    }
+
+    write_log_line(level, text);
+
+    memcpy(last_message, text, sizeof(last_message));
+    last_message_level = level;
+
+    pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * Log an error message
+ * @param format Format string for the message
+ * @param ... Variable arguments
+ */
+void log_error(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    log_message(LOG_LEVEL_ERROR, format, args);
+    va_end(args);
+}
+
+/**
+ * Log a warning message
+ * @param format Format string for the message
+ * @param ... Variable arguments
+ */
+void log_warning(const char *format, ...)
+{
+    va_list args;
 
-    /* Also log to syslog */
     va_start(args, format);
-    vsyslog(LOG_ERR, format, args);
+    log_message(LOG_LEVEL_WARN, format, args);
     va_end(args);
 }
 
@@ -67,47 +280,118 @@ void log_error(const char *format, ...)
  */
 void log_operation(const char *format, ...)
 {
-    FILE *log_fp;
     va_list args;
-    time_t now;
-    char time_str[MAX_TIME_LENGTH];
 
-    /* Get current time */
-    now = time(NULL);
-    get_timestamp_string(now, time_str, MAX_TIME_LENGTH);
+    va_start(args, format);
+    log_message(LOG_LEVEL_INFO, format, args);
+    va_end(args);
+}
 
-    /* Open the operation log file for appending */
-    log_fp = fopen(OPERATION_LOG, "a");
-    if (log_fp == NULL)
+/**
+ * Log a debug message
+ * @param format Format string for the message
+ * @param ... Variable arguments
+ */
+void log_debug(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    log_message(LOG_LEVEL_DEBUG, format, args);
+    va_end(args);
+}
+
+/**
+ * Set the runtime log level
+ * @param level One of the LOG_LEVEL_* values
+ */
+void set_log_level(int level)
+{
+    if (level < LOG_LEVEL_ERROR)
     {
-        /* Fall back to syslog if file can't be opened */
-        va_start(args, format);
-        vsyslog(LOG_INFO, format, args);
-        va_end(args);
-        return;
+        level = LOG_LEVEL_ERROR;
     }
+    if (level > LOG_LEVEL_DEBUG)
+    {
+        level = LOG_LEVEL_DEBUG;
+    }
+    current_log_level = level;
+}
 
-    /* Write timestamp and info prefix */
-    fprintf(log_fp, "[%s] INFO: ", time_str);
+/**
+ * Get the runtime log level
+ * @return Current LOG_LEVEL_* value
+ */
+int get_log_level(void)
+{
+    return current_log_level;
+}
 
-    /* Write the formatted message */
-    va_start(args, format);
-    vfprintf(log_fp, format, args);
-    va_end(args);
+/**
+ * Parse a log level name ("error", "warn", "info", "debug") or number
+ * @param name Level name
+ * @return LOG_LEVEL_* value, or -1 if the name is not recognised
+ */
+int parse_log_level(const char *name)
+{
+    int i;
 
-    /* Add newline if not present */
-    if (format[strlen(format) - 1] != '\n')
+    if (name == NULL || name[0] == '\0')
     {
-        fprintf(log_fp, "\n");
+        return -1;
     }
 
-    /* Close the log file */
-    fclose(log_fp);
+    if (name[0] >= '0' && name[0] <= '9' && name[1] == '\0')
+    {
+        i = name[0] - '0';
+        return (i <= LOG_LEVEL_DEBUG) ? i : -1;
+    }
 
-    /* Also log to syslog */
-    va_start(args, format);
-    vsyslog(LOG_INFO, format, args);
-    va_end(args);
+    for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if (strcasecmp(name, level_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    /* Accept the long form as well */
+    if (strcasecmp(name, "warning") == 0)
+    {
+        return LOG_LEVEL_WARN;
+    }
+
+    return -1;
+}
+
+/**
+ * Write any pending "last message repeated N times" summary that has
+ * been held back for longer than LOG_REPEAT_FLUSH seconds
+ */
+void log_flush_repeats(void)
+{
+    pthread_mutex_lock(&log_lock);
+    if (repeat_count > 0 && time(NULL) - repeat_since >= LOG_REPEAT_FLUSH)
+    {
+        flush_repeat_summary();
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * Move the calling thread to the idle I/O scheduling class, so its disk
+ * I/O only runs when nothing else needs the device
+ * @return SUCCESS on success, FAILURE on error
+ */
+int set_idle_io_priority(void)
+{
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+    {
+        log_error("Failed to set idle I/O priority: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    return SUCCESS;
 }
 
 /**
@@ -119,10 +403,10 @@ void log_operation(const char *format, ...)
  */
 char *get_timestamp_string(time_t timestamp, char *buffer, size_t buffer_size)
 {
-    struct tm *tm_info;
+    struct tm tm_info;
 
-    tm_info = localtime(&timestamp);
-    strftime(buffer, buffer_size, "%Y-%m-%d %H:%M:%S", tm_info);
+    localtime_r(&timestamp, &tm_info);
+    strftime(buffer, buffer_size, "%Y-%m-%d %H:%M:%S", &tm_info);
 
     return buffer;
 }
@@ -0,0 +1,85 @@
+/**
+ * @file test_paths.c
+ * @brief Checks of the path layout resolved by init_paths()
+ *
+ * Usage: test_paths
+ * Prints one line per failed check and exits 1 if any failed.
+ */
+
+#include "paths.h"
+#include "ipc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static int failures = 0;
+
+/**
+ * Record one check
+ */
+static void check(int ok, const char *what)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/**
+ * Check that an instance name is refused and leaves the paths alone
+ */
+static void check_rejected(const char *instance)
+{
+    char message[128];
+    char before[MAX_ROOT_PATH_LENGTH];
+
+    strcpy(before, get_daemon_paths()->company_root);
+    errno = 0;
+    snprintf(message, sizeof(message), "instance \"%s\" is rejected with EINVAL", instance);
+    check(init_paths("/srv/unit1", instance) == FAILURE && errno == EINVAL, message);
+    snprintf(message, sizeof(message), "instance \"%s\" leaves the paths unchanged", instance);
+    check(strcmp(get_daemon_paths()->company_root, before) == 0, message);
+}
+
+int main(void)
+{
+    const DaemonPaths *paths;
+
+    /* Defaults are the historical paths */
+    check(init_paths(NULL, NULL) == SUCCESS, "default paths resolve");
+    paths = get_daemon_paths();
+    check(strcmp(paths->company_root, "/var/company") == 0, "default company root");
+    check(strcmp(paths->backup_dir, "/var/company/backup") == 0, "default backup directory");
+    check(strcmp(paths->pid_file, "/var/run/company_daemon.pid") == 0, "default PID file");
+
+    /* A named instance gets its own tree and run files */
+    check(init_paths("/srv/unit1/", "sales") == SUCCESS, "named instance resolves");
+    check(strcmp(paths->company_root, "/srv/unit1/var/company/sales") == 0, "instance company root");
+    check(strcmp(paths->upload_dir, "/srv/unit1/var/company/sales/upload") == 0, "instance upload directory");
+    check(strcmp(paths->control_socket_path, "/srv/unit1/var/run/company_daemon-sales.sock") == 0,
+          "instance control socket");
+
+    /* Names of the default instance's trees would nest one instance in another */
+    check_rejected(UPLOAD_TREE);
+    check_rejected(DASHBOARD_TREE);
+    check_rejected(BACKUP_TREE);
+
+    /* Malformed names */
+    check_rejected(".hidden");
+    check_rejected("a/b");
+    check_rejected("../escape");
+    check_rejected("this-instance-name-is-longer-than-32");
+
+    /* Names that only resemble a tree are fine */
+    check(init_paths(NULL, "backups") == SUCCESS, "instance \"backups\" is accepted");
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d path checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All path checks passed\n");
+    return EXIT_SUCCESS;
+}